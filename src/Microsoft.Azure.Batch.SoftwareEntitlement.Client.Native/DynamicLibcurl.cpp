@@ -0,0 +1,101 @@
+#include "SoftwareEntitlementClient.h"
+#include "DynamicLibcurl.h"
+#include <cstdlib>
+#include <string>
+#include <dlfcn.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Internal {
+namespace {
+
+//
+// The soname of the libcurl ABI the library is built against.
+//
+const char* const DefaultLibcurl = "libcurl.so.4";
+
+template <typename Function>
+void Resolve(void* library, const char* name, Function& function)
+{
+    void* symbol = dlsym(library, name);
+    if (symbol == nullptr)
+    {
+        throw Exception(std::string("Unable to find ") + name + " in libcurl");
+    }
+
+    function = reinterpret_cast<Function>(symbol);
+}
+
+//
+// As Resolve, but leaves function null if libcurl does not have it.
+//
+template <typename Function>
+void ResolveOptional(void* library, const char* name, Function& function)
+{
+    function = reinterpret_cast<Function>(dlsym(library, name));
+}
+
+LibcurlFunctions Load()
+{
+    const char* path = std::getenv("AZ_BATCH_SES_LIBCURL");
+    if (path == nullptr || *path == '\0')
+    {
+        path = DefaultLibcurl;
+    }
+
+    //
+    // Never unloaded: libcurl registers atexit handlers in some builds, and
+    // OpenSSL must outlive every connection.
+    //
+    void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (library == nullptr)
+    {
+        const char* error = dlerror();
+        throw Exception(std::string("Unable to load ") + path + ": " + (error != nullptr ? error : "unknown error"));
+    }
+
+    LibcurlFunctions functions;
+    Resolve(library, "curl_global_init", functions.global_init);
+    Resolve(library, "curl_global_cleanup", functions.global_cleanup);
+    Resolve(library, "curl_easy_init", functions.easy_init);
+    Resolve(library, "curl_easy_setopt", functions.easy_setopt);
+    Resolve(library, "curl_easy_getinfo", functions.easy_getinfo);
+    Resolve(library, "curl_easy_perform", functions.easy_perform);
+    Resolve(library, "curl_easy_cleanup", functions.easy_cleanup);
+    Resolve(library, "curl_slist_append", functions.slist_append);
+    Resolve(library, "curl_slist_free_all", functions.slist_free_all);
+    Resolve(library, "curl_multi_init", functions.multi_init);
+    Resolve(library, "curl_multi_cleanup", functions.multi_cleanup);
+    Resolve(library, "curl_multi_add_handle", functions.multi_add_handle);
+    Resolve(library, "curl_multi_remove_handle", functions.multi_remove_handle);
+    Resolve(library, "curl_multi_setopt", functions.multi_setopt);
+    Resolve(library, "curl_multi_perform", functions.multi_perform);
+    Resolve(library, "curl_multi_socket_action", functions.multi_socket_action);
+    Resolve(library, "curl_multi_wait", functions.multi_wait);
+    ResolveOptional(library, "curl_multi_poll", functions.multi_poll);
+    ResolveOptional(library, "curl_multi_wakeup", functions.multi_wakeup);
+    Resolve(library, "curl_multi_info_read", functions.multi_info_read);
+    Resolve(library, "curl_multi_strerror", functions.multi_strerror);
+    Resolve(library, "curl_version_info", functions.version_info);
+    return functions;
+}
+
+}   // anonymous namespace
+
+
+const LibcurlFunctions& Libcurl()
+{
+    //
+    // If loading throws, the next call tries again.
+    //
+    static const LibcurlFunctions functions = Load();
+    return functions;
+}
+
+}
+}
+}
+}
+}
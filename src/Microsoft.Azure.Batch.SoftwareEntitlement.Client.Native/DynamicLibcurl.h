@@ -0,0 +1,89 @@
+#pragma once
+//
+// When built with SES_DLOPEN_LIBCURL, the library does not link libcurl but
+// loads it with dlopen the first time it is needed, so that applications
+// which never check an entitlement do not pay at start-up for loading and
+// relocating libcurl and the many libraries it depends on.
+//
+// Included after <curl/curl.h>, this header redirects the libcurl functions
+// the library uses to those loaded.  It is only for POSIX platforms.
+//
+#include <curl/curl.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Internal {
+
+struct LibcurlFunctions
+{
+    CURLcode (*global_init)(long flags);
+    void (*global_cleanup)();
+    CURL* (*easy_init)();
+    CURLcode (*easy_setopt)(CURL* curl, CURLoption option, ...);
+    CURLcode (*easy_getinfo)(CURL* curl, CURLINFO info, ...);
+    CURLcode (*easy_perform)(CURL* curl);
+    void (*easy_cleanup)(CURL* curl);
+    curl_slist* (*slist_append)(curl_slist* list, const char* value);
+    void (*slist_free_all)(curl_slist* list);
+    CURLM* (*multi_init)();
+    CURLMcode (*multi_cleanup)(CURLM* multi);
+    CURLMcode (*multi_add_handle)(CURLM* multi, CURL* curl);
+    CURLMcode (*multi_remove_handle)(CURLM* multi, CURL* curl);
+    CURLMcode (*multi_setopt)(CURLM* multi, CURLMoption option, ...);
+    CURLMcode (*multi_perform)(CURLM* multi, int* running);
+    CURLMcode (*multi_socket_action)(CURLM* multi, curl_socket_t socket, int events, int* running);
+    CURLMcode (*multi_wait)(CURLM* multi, curl_waitfd* fds, unsigned count, int timeout_ms, int* ready);
+
+    //
+    // Null if the libcurl loaded is older than 7.66.0 and 7.68.0, which
+    // added them, however new the headers the library was built with.
+    //
+    CURLMcode (*multi_poll)(CURLM* multi, curl_waitfd* fds, unsigned count, int timeout_ms, int* ready);
+    CURLMcode (*multi_wakeup)(CURLM* multi);
+
+    CURLMsg* (*multi_info_read)(CURLM* multi, int* queued);
+    const char* (*multi_strerror)(CURLMcode code);
+    curl_version_info_data* (*version_info)(CURLversion version);
+};
+
+//
+// Loads libcurl on the first call; throws an Exception if it cannot be
+// loaded.  The library loaded is libcurl.so.4, or the path given by the
+// AZ_BATCH_SES_LIBCURL environment variable.
+//
+const LibcurlFunctions& Libcurl();
+
+}
+}
+}
+}
+}
+
+#undef curl_easy_setopt
+#undef curl_easy_getinfo
+#undef curl_multi_setopt
+
+#define curl_global_init ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().global_init
+#define curl_global_cleanup ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().global_cleanup
+#define curl_easy_init ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().easy_init
+#define curl_easy_setopt ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().easy_setopt
+#define curl_easy_getinfo ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().easy_getinfo
+#define curl_easy_perform ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().easy_perform
+#define curl_easy_cleanup ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().easy_cleanup
+#define curl_slist_append ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().slist_append
+#define curl_slist_free_all ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().slist_free_all
+#define curl_multi_init ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_init
+#define curl_multi_cleanup ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_cleanup
+#define curl_multi_add_handle ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_add_handle
+#define curl_multi_remove_handle ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_remove_handle
+#define curl_multi_setopt ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_setopt
+#define curl_multi_perform ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_perform
+#define curl_multi_socket_action ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_socket_action
+#define curl_multi_wait ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_wait
+#define curl_multi_poll ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_poll
+#define curl_multi_wakeup ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_wakeup
+#define curl_multi_info_read ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_info_read
+#define curl_multi_strerror ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().multi_strerror
+#define curl_version_info ::Microsoft::Azure::Batch::SoftwareEntitlement::Internal::Libcurl().version_info
@@ -4,22 +4,45 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 #include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <map>
 #include <mutex>
 #include <thread>
+#include <tuple>
 #include <chrono>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
+#ifdef SES_DLOPEN_LIBCURL
+#include "DynamicLibcurl.h"
+#endif
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509.h>
+#include <openssl/x509v3.h>
 
 //
 // Work around non-standard/incomplete C++ support in VC11/VC12
@@ -44,212 +67,267 @@
 #ifdef _WIN32
 #include <Wincrypt.h>
 #include <winhttp.h>
+#else
+#include <unistd.h>
 #endif
 
 
-namespace Microsoft {
-namespace Azure {
-namespace Batch {
-namespace SoftwareEntitlement {
+//
+// Certificate chain accessors.  These are defined outside the SoftwareEntitlement
+// namespace, where X509 names the wrapper class rather than OpenSSL's type.
+//
 namespace {
 
-std::mutex s_lock;
-
-typedef std::array<std::uint8_t, 20> SHA256Thumbprint;
-struct CertInfo
+STACK_OF(X509)* GetVerifiedChain(X509_STORE_CTX* ctx)
 {
-    SHA256Thumbprint thumbprint;
-    std::string common_name;
-    std::string allowed_dns_namespace;
-};
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    return X509_STORE_CTX_get0_chain(ctx);
+#else
+    return X509_STORE_CTX_get_chain(ctx);
+#endif
+}
 
 //
-// Published Microsoft Intermediate Certificates from https://www.microsoft.com/pki/mscorp/cps/
+// Returns cert, with a new reference taken to it.
 //
-CertInfo s_Microsoft_IT_SSL_SHA2 = {
-    {{ 0x97,0xef,0xf3,0x02,0x86,0x77,0x89,0x4b,0xdd,0x4f,0x9a,0xc5,0x3f,0x78,0x9b,0xee,0x5d,0xf4,0xad,0x86 }} ,
-    "Microsoft IT SSL SHA2"
-};
-
-CertInfo s_Microsoft_IT_SSL_SHA2_2 = {
-    {{ 0x94,0x8e,0x16,0x52,0x58,0x62,0x40,0xd4,0x53,0x28,0x7a,0xb6,0x9c,0xae,0xb8,0xf2,0xf4,0xf0,0x21,0x17 }},
-    "Microsoft IT SSL SHA2"
-};
-
-CertInfo s_Microsoft_IT_TLS_CA_1 = {
-    {{ 0x41,0x7e,0x22,0x50,0x37,0xfb,0xfa,0xa4,0xf9,0x57,0x61,0xd5,0xae,0x72,0x9e,0x1a,0xea,0x7e,0x3a,0x42 }},
-    "Microsoft IT TLS CA 1"
-};
+X509* AddReference(X509* cert)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    X509_up_ref(cert);
+#else
+    CRYPTO_add(&cert->references, 1, CRYPTO_LOCK_X509);
+#endif
+    return cert;
+}
 
-CertInfo s_Microsoft_IT_TLS_CA_2 = {
-    {{ 0x54,0xd9,0xd2,0x02,0x39,0x08,0x0c,0x32,0x31,0x6e,0xd9,0xff,0x98,0x0a,0x48,0x98,0x8f,0x4a,0xdf,0x2d }},
-    "Microsoft IT TLS CA 2"
-};
+//
+// Returns a new reference to the certificate at index in chain.
+//
+X509* GetChainCertificate(STACK_OF(X509)* chain, int index)
+{
+    return AddReference(sk_X509_value(chain, index));
+}
 
-CertInfo s_Microsoft_IT_TLS_CA_4 = {
-    {{ 0x8a,0x38,0x75,0x5d,0x09,0x96,0x82,0x3f,0xe8,0xfa,0x31,0x16,0xa2,0x77,0xce,0x44,0x6e,0xac,0x4e,0x99 }},
-    "Microsoft IT TLS CA 4"
-};
+//
+// True if the last certificate of chain is self-signed, as a root is.
+//
+bool EndsAtRoot(STACK_OF(X509)* chain)
+{
+    int count = sk_X509_num(chain);
+    if (count == 0)
+    {
+        return false;
+    }
+    X509* last = sk_X509_value(chain, count - 1);
+    return X509_check_issued(last, last) == X509_V_OK;
+}
 
-CertInfo s_Microsoft_IT_TLS_CA_5 = {
-    {{ 0xad,0x89,0x8a,0xc7,0x3d,0xf3,0x33,0xeb,0x60,0xac,0x1f,0x5f,0xc6,0xc4,0xb2,0x21,0x9d,0xdb,0x79,0xb7 }},
-    "Microsoft IT TLS CA 5"
+struct ChainDeleter
+{
+    void operator()(STACK_OF(X509)* chain)
+    {
+        sk_X509_pop_free(chain, X509_free);
+    }
 };
 
-CertInfo s_Batch_USGov_CloudAPI_CA = {
-    {{ 0x1f,0xb8,0x6b,0x11,0x68,0xec,0x74,0x31,0x54,0x06,0x2e,0x8c,0x9c,0xc5,0xb1,0x71,0xa4,0xb7,0xcc,0xb4 }},
-    "DigiCert SHA2 Secure Server CA",
-    ".batch.usgovcloudapi.net"
-};
+//
+// Returns a new chain holding new references to certs.
+//
+STACK_OF(X509)* CopyChain(const std::vector<X509*>& certs)
+{
+    std::unique_ptr<STACK_OF(X509), ChainDeleter> chain(sk_X509_new_null());
+    if (chain == nullptr)
+    {
+        return nullptr;
+    }
 
-CertInfo s_Batch_China_CloudAPI_CA = {
-	{ { 0x1f,0xb8,0x6b,0x11,0x68,0xec,0x74,0x31,0x54,0x06,0x2e,0x8c,0x9c,0xc5,0xb1,0x71,0xa4,0xb7,0xcc,0xb4 } },
-	"DigiCert SHA2 Secure Server CA",
-	".batch.chinacloudapi.cn"
-};
+    for (X509* cert : certs)
+    {
+        if (sk_X509_push(chain.get(), AddReference(cert)) == 0)
+        {
+            X509_free(cert);
+            return nullptr;
+        }
+    }
+    return chain.release();
+}
 
-CertInfo s_Batch_Germany_CloudAPI_CA = {
-    {{ 0x2f,0xc5,0xde,0x65,0x28,0xcd,0xbe,0x50,0xa1,0x4c,0x38,0x2f,0xc1,0xde,0x52,0x4f,0xaa,0xbf,0x95,0xfc }},
-    "D-TRUST SSL Class 3 CA 1 2009",
-     ".batch.microsoftazure.de" 
-};
+}   // anonymous namespace
 
-std::array<CertInfo, 9> s_microsoftIntermediateCerts = {{
-    s_Microsoft_IT_SSL_SHA2,
-    s_Microsoft_IT_SSL_SHA2_2,
-    s_Microsoft_IT_TLS_CA_1,
-    s_Microsoft_IT_TLS_CA_2,
-    s_Microsoft_IT_TLS_CA_4,
-    s_Microsoft_IT_TLS_CA_5,
-    s_Batch_USGov_CloudAPI_CA,
-    s_Batch_China_CloudAPI_CA,
-    s_Batch_Germany_CloudAPI_CA
-}};
 
-std::vector<CertInfo> s_sslCerts;
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Internal {
 
-std::string ExtractValue(const std::string& response, const std::string& key)
+X509::X509(::x509_st*&& ptr)
+    : _cert(ptr)
 {
-    nlohmann::json j = nlohmann::json::parse(response.c_str());
-
-    return j.at(key);
 }
 
+X509::X509(X509&& rhs)
+{
+    _cert.swap(rhs._cert);
+}
 
-template <class T, typename R, R(*F)(T* ptr)> struct OpenSSLDeleter
+bool X509::MatchesThumbprint(const SHA256Thumbprint& thumb) const
 {
-    void operator() (T* ptr)
+    if (_cert == nullptr)
     {
-        F(ptr);
+        return false;
     }
-};
-
 
-extern "C" int cout_cb(const char* val, size_t /*len*/, void* u)
-{
-    std::ostringstream& str = *static_cast<std::ostringstream*>(u);
-    str << val << std::endl;
-    return 1;
+    return Thumbprint() == thumb;
 }
 
-
-#ifdef _WIN32
-void ThrowIfOpenSSLError(bool error)
+std::string X509::CommonName() const
 {
-    if (error)
-    {
-        std::ostringstream str;
-        ERR_print_errors_cb(cout_cb, &str);
+    X509_name_st* subj = X509_get_subject_name(_cert.get());
 
-        throw Exception(str.str());
+    int lastpos = X509_NAME_get_index_by_NID(subj, NID_commonName, -1);
+    if (lastpos == -1)
+    {
+        throw Exception("Certificate does not have a common name");
     }
-}
 
+    X509_NAME_ENTRY* nameEntry = X509_NAME_get_entry(subj, lastpos);
+    ASN1_STRING* asn1String = X509_NAME_ENTRY_get_data(nameEntry);
+    return reinterpret_cast<char*>(ASN1_STRING_data(asn1String));
+}
 
-void ThrowIfWin32Error(bool error)
+SHA256Thumbprint X509::Thumbprint() const
 {
-    if (!error)
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int cbDigest = EVP_MAX_MD_SIZE;
+    SHA256Thumbprint thumb;
+    if (X509_digest(_cert.get(), EVP_sha1(), digest, &cbDigest) != 1 || cbDigest != thumb.size())
     {
-        return;
+        throw Exception("Failed to calculate thumbprint for certificate " + CommonName());
     }
 
-    DWORD lastErr = GetLastError();
-    throw std::system_error(std::error_code(lastErr, std::system_category()));
+    std::memcpy(thumb.data(), digest, thumb.size());
+    return thumb;
 }
-#endif // _WIN32
 
 
-class X509
-{
-    std::unique_ptr<::x509_st, OpenSSLDeleter<::x509_st, void, &X509_free>> _cert;
+namespace {
 
-public:
-    X509(::x509_st*&& ptr)
-        : _cert(ptr)
+//
+// Returns the value of a hexadecimal digit, or -1 if c is not one.
+//
+int HexDigitValue(char c)
+{
+    if (c >= '0' && c <= '9')
     {
+        return c - '0';
     }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
 
-    X509(X509&& rhs)
+//
+// Returns the value of a base64url digit, or -1 if c is not one.
+//
+int Base64UrlDigitValue(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0' + 52;
+    }
+    if (c == '-')
+    {
+        return 62;
+    }
+    if (c == '_')
     {
-        _cert.swap(rhs._cert);
+        return 63;
     }
+    return -1;
+}
+
+//
+// Decodes base64url without padding, as the parts of a JWS are encoded.
+// Returns false if text is not so encoded.
+//
+bool DecodeBase64Url(const char* text, size_t length, std::string& decoded)
+{
+    decoded.clear();
+    decoded.reserve(length * 3 / 4);
 
-    bool MatchesThumbprint(const SHA256Thumbprint& thumb) const
+    unsigned int bits = 0;
+    int pending = 0;
+    for (size_t i = 0; i < length; ++i)
     {
-        if (_cert == nullptr)
+        int value = Base64UrlDigitValue(text[i]);
+        if (value < 0)
         {
             return false;
         }
 
-        auto myThumb = Thumbprint();
-        if (myThumb.size() != thumb.size())
+        bits = ((bits << 6) | static_cast<unsigned int>(value)) & 0xFFFF;
+        pending += 6;
+        if (pending >= 8)
         {
-            return false;
+            pending -= 8;
+            decoded += static_cast<char>((bits >> pending) & 0xFF);
         }
-
-        return std::memcmp(thumb.data(), myThumb.data(), thumb.size()) == 0;
     }
 
-    std::string CommonName() const
-    {
-        X509_name_st* subj = X509_get_subject_name(_cert.get());
-
-        int lastpos = X509_NAME_get_index_by_NID(subj, NID_commonName, -1);
-        if (lastpos == -1)
-        {
-            throw Exception("Certificate does not have a common name");
-        }
+    //
+    // A lone digit left over cannot encode a whole byte.
+    //
+    return pending < 6;
+}
 
-        X509_NAME_ENTRY* nameEntry = X509_NAME_get_entry(subj, lastpos);
-        ASN1_STRING* asn1String = X509_NAME_ENTRY_get_data(nameEntry);
-        return reinterpret_cast<char*>(ASN1_STRING_data(asn1String));
-    }
+//
+// How far the server allows the lifetime of a token to be missed, in seconds
+// (the ClockSkew of JwtPropertyParser).
+//
+const long long ServerClockSkew = 60;
 
-    std::vector<std::uint8_t> Thumbprint() const
-    {
-        std::vector<std::uint8_t> thumb;
+//
+// Formats seconds since the Unix epoch as the server formats the lifetime of
+// a token in its errors.
+//
+std::string FormatNumericDate(long long seconds)
+{
+    std::time_t time = static_cast<std::time_t>(seconds);
+    std::tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &time);
+#else
+    gmtime_r(&time, &utc);
+#endif
 
-        //
-        // Resize so we can use data() below to fill in.
-        //
-        thumb.resize(EVP_MAX_MD_SIZE);
-        unsigned int cbDigest = EVP_MAX_MD_SIZE;
-        if (X509_digest(_cert.get(), EVP_sha1(), thumb.data(), &cbDigest) != 1)
-        {
-            throw Exception("Failed to calculate thumbprint for certificate " + CommonName());
-        }
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M", &utc);
+    return text;
+}
 
-        thumb.resize(cbDigest);
-        return thumb;
-    }
-};
+}   // anonymous namespace
 
 
 std::string StripNonHexThumbprintDigits(const std::string& input)
 {
     std::string output = input;
     output.erase(
-        std::remove_if(output.begin(), output.end(), [](const char x) { return !isxdigit(x); }),
+        std::remove_if(output.begin(), output.end(), [](const char x) { return HexDigitValue(x) < 0; }),
         output.end());
 
     return output;
@@ -258,581 +336,6133 @@ std::string StripNonHexThumbprintDigits(const std::string& input)
 
 SHA256Thumbprint ThumbprintToBinary(const std::string& thumbprint)
 {
-    std::string digits = StripNonHexThumbprintDigits(thumbprint);
+    //
+    // Convert to binary representation of thumbprint in place, skipping
+    // separators, so that only a malformed thumbprint allocates.
+    //
     SHA256Thumbprint sha256Thumb;
-    if (digits.size() != sha256Thumb.size() * 2)
+    size_t digits = 0;
+    for (char c : thumbprint)
     {
-        throw Exception("Malformed thumbprint: '" + digits + "'");
+        int value = HexDigitValue(c);
+        if (value < 0)
+        {
+            continue;
+        }
+
+        if (digits < sha256Thumb.size() * 2)
+        {
+            std::uint8_t& byte = sha256Thumb[digits / 2];
+            byte = static_cast<std::uint8_t>(digits % 2 == 0 ? value << 4 : byte | value);
+        }
+        ++digits;
     }
 
-    //
-    // Convert to binary representation of thumbprint.
-    //
-    for (size_t digit = 0; digit < sha256Thumb.size(); digit++)
+    if (digits != sha256Thumb.size() * 2)
     {
-        sha256Thumb[digit] = static_cast<std::uint8_t>(std::stoul(digits.substr(digit * 2, 2), 0, 16));
+        throw Exception("Malformed thumbprint: '" + StripNonHexThumbprintDigits(thumbprint) + "'");
     }
 
     return sha256Thumb;
 }
 
 
-class Curl
+std::string ExtractValue(const std::string& response, const std::string& key)
 {
-    struct CurlDeleter
+    nlohmann::json j = nlohmann::json::parse(response.c_str());
+
+    return j.at(key);
+}
+
+
+std::string GetDetailedErrorMessage(const std::string& response)
+{
+    try
     {
-        void operator ()(CURL* curl)
+        nlohmann::json j = nlohmann::json::parse(response.c_str());
+
+        try
         {
-            curl_easy_cleanup(curl);
+            return j.at("message").at("value");
         }
-    };
-    std::unique_ptr<CURL, CurlDeleter> _curl;
+        catch (const nlohmann::detail::exception&)
+        {
+            return j.at("code");
+        }
+    }
+    catch (const nlohmann::detail::exception&)
+    {
+        return "Unknown error: HTTP Status 400 missing expected output";
+    }
+}
 
-    char _errbuf[CURL_ERROR_SIZE];
-    std::string _response;
 
-public:
-    class CurlException : public Exception
-    {
-        CURLcode _code;
+std::string BuildRequestBody(
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement)
+{
+    nlohmann::json j;
+    j["token"] = entitlement_token;
+    j["applicationId"] = requested_entitlement;
 
-    public:
-        CurlException(CURLcode code, const std::string& message)
-            : Exception(message)
-            , _code(code)
-        {}
+    return j.dump();
+}
 
-        CurlException(CURLcode code, const char *message)
-            : Exception(message)
-            , _code(code)
-        {}
 
-        CURLcode GetCode() const
-        {
-            return _code;
-        }
-    };
+TokenClaims::TokenClaims()
+    : decoded(false)
+    , expires(0)
+    , not_before(0)
+    , has_applications(false)
+{
+}
 
-private:
-    void ThrowIfCurlError(CURLcode res)
-    {
-        if (res == CURLE_OK)
-        {
-            return;
-        }
 
-        std::ostringstream what;
-        what << "libcurl_error " << res << ": " << _errbuf;
-        throw CurlException(res, what.str());
-    }
+TokenClaims ReadTokenClaims(const std::string& entitlement_token)
+{
+    TokenClaims claims;
 
-    static size_t WriteCallback(char* ptr, size_t size, size_t nmemb, void* context)
+#if defined _MSC_VER && _MSC_VER < 1900
+    //
+    // The JSON parser of VC11/VC12 reads neither numbers nor arrays.
+    //
+    (void)entitlement_token;
+#else
+    //
+    // header.payload.signature; a JWE has five parts.
+    //
+    size_t payload = entitlement_token.find('.');
+    size_t signature = payload == std::string::npos ? std::string::npos : entitlement_token.find('.', payload + 1);
+    if (signature == std::string::npos || entitlement_token.find('.', signature + 1) != std::string::npos)
     {
-        Curl* self = static_cast<Curl*>(context);
-        try
-        {
-            size_t nbytes = size * nmemb;
-            self->_response.append(ptr, nbytes);
-            return nbytes;
-        }
-        catch (const std::exception&)
-        {
-            return 0;
-        }
+        return claims;
     }
 
-    std::string GetDetailedErrorMessage()
+    std::string json;
+    if (!DecodeBase64Url(entitlement_token.data() + payload + 1, signature - payload - 1, json))
     {
-        try
-        {
-            nlohmann::json j = nlohmann::json::parse(_response.c_str());
-
-            try
-            {
-                return j.at("message").at("value");
-            }
-            catch (const nlohmann::detail::exception&)
-            {
-                return j.at("code");
-            }
-        }
-        catch (const nlohmann::detail::exception&)
-        {
-            return "Unknown error: HTTP Status 400 missing expected output";
-        }
+        return claims;
     }
 
-    std::string GetErrorMessage(long code)
+    try
     {
-        switch (code)
+        nlohmann::json j = nlohmann::json::parse(json.c_str());
+        if (!j.is_object())
         {
-        case 400:
-        case 403:
-            return GetDetailedErrorMessage();
-
-        default:
-            return "Unexpected error: HTTP status " + std::to_string(code);
+            return claims;
         }
-    }
 
-#ifdef _WIN32
-    static CURLcode OpenSSLContextCallback(CURL* /*curl*/, void* ssl_ctx, void* /*userptr*/)
-    {
-        struct CertCloseStoreDeleter
+        //
+        // Clamped well within the range of the clocks, so that absurd dates
+        // compare as very early or very late rather than overflow.
+        //
+        auto numericDate = [&j](const char* name) -> long long
         {
-            void operator ()(HCERTSTORE hStore)
+            auto claim = j.find(name);
+            if (claim == j.end() || !claim->is_number())
             {
-                CertCloseStore(hStore, 0);
+                return 0;
             }
+            double seconds = claim->get<double>();
+            return static_cast<long long>(std::max(-1e12, std::min(1e12, seconds)));
         };
+        claims.expires = numericDate("exp");
+        claims.not_before = numericDate("nbf");
 
-        try
+        auto app = j.find("app");
+        if (app != j.end() && app->is_string())
         {
-            //
-            // Populate the OpenSSL certificate store with the system root certificates.
-            //
-            std::unique_ptr<void, CertCloseStoreDeleter> hStore(CertOpenSystemStoreW(0, L"ROOT"));
-            ThrowIfWin32Error(hStore == nullptr);
-
-            X509_STORE* sslStore = SSL_CTX_get_cert_store(static_cast<SSL_CTX*>(ssl_ctx));
-            ThrowIfOpenSSLError(sslStore == nullptr);
-
-            PCCERT_CONTEXT pCertContext = CertEnumCertificatesInStore(hStore.get(), nullptr);
-            while (pCertContext != nullptr)
+            claims.has_applications = true;
+            claims.applications.push_back(app->get<std::string>());
+        }
+        else if (app != j.end() && app->is_array())
+        {
+            claims.has_applications = true;
+            for (const auto& application : *app)
             {
-                const BYTE* cert = pCertContext->pbCertEncoded;
-                ::X509* x509 = d2i_X509(nullptr, &cert, pCertContext->cbCertEncoded);
-                if (x509 != nullptr)
+                if (application.is_string())
                 {
-                    //
-                    // Ignore failures - missing certs will manifest in cert chain validation failures.
-                    //
-                    X509_STORE_add_cert(sslStore, x509);
-                    X509_free(x509);
+                    claims.applications.push_back(application.get<std::string>());
                 }
-                pCertContext = CertEnumCertificatesInStore(hStore.get(), pCertContext);
             }
         }
-        catch (const Exception&)
+    }
+    catch (const nlohmann::detail::exception&)
+    {
+        return TokenClaims();
+    }
+
+    claims.decoded = true;
+#endif
+    return claims;
+}
+
+
+std::string UnusableTokenReason(
+    const TokenClaims& claims,
+    const std::string& requested_entitlement,
+    std::chrono::system_clock::time_point now)
+{
+    if (!claims.decoded)
+    {
+        return std::string();
+    }
+
+    long long seconds = static_cast<long long>(std::chrono::system_clock::to_time_t(now));
+    if (claims.expires == 0)
+    {
+        return "Missing token expiration";
+    }
+    if (claims.expires < seconds - ServerClockSkew)
+    {
+        return "Token expired at " + FormatNumericDate(claims.expires);
+    }
+    if (claims.not_before > seconds + ServerClockSkew)
+    {
+        return "Token will not be valid until " + FormatNumericDate(claims.not_before);
+    }
+
+    //
+    // The server compares applications without regard to case.
+    //
+    if (claims.has_applications)
+    {
+        auto sameApplication = [&requested_entitlement](const std::string& application)
+        {
+            return application.size() == requested_entitlement.size()
+                && std::equal(application.begin(), application.end(), requested_entitlement.begin(), [](char a, char b)
+                {
+                    return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+                });
+        };
+        if (std::none_of(claims.applications.begin(), claims.applications.end(), sameApplication))
         {
-            return CURLE_OUT_OF_MEMORY;
+            return "Token does not grant entitlement for " + requested_entitlement;
         }
+    }
 
-        return CURLE_OK;
+    return std::string();
+}
+
+
+//
+// The state shared by the copies of a CancellationToken.  Whatever a check
+// waits for, it registers a Wakeup for Cancel to call, which ends the wait.
+// Wakeups are called with the lock held, so that none is called once
+// unregistered: register before taking any lock a wakeup itself takes.
+//
+class Cancellation
+{
+    typedef std::list<std::function<void()>> Wakeups;
+
+    std::atomic<bool> _cancelled;
+    std::mutex _lock;
+    std::condition_variable _signal;
+    Wakeups _wakeups;
+
+public:
+    Cancellation()
+        : _cancelled(false)
+    {
+    }
+
+    static Cancellation* Of(const CancellationToken& token)
+    {
+        return token.m_state.get();
+    }
+
+    bool IsCancelled() const
+    {
+        return _cancelled;
+    }
+
+    void Cancel()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _cancelled = true;
+        _signal.notify_all();
+        for (const auto& wakeup : _wakeups)
+        {
+            wakeup();
+        }
+    }
+
+    //
+    // Sleeps for duration unless cancelled first; returns false if cancelled.
+    //
+    bool Sleep(std::chrono::milliseconds duration)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        return !_signal.wait_for(lock, duration, [this]() { return IsCancelled(); });
     }
-#endif  // _WIN32
 
-    X509 GetCertificate(const curl_slist* certinfo)
+    //
+    // Calls wakeup if the check is cancelled while this is in scope.  Does
+    // nothing for a check that cannot be cancelled.
+    //
+    class Wakeup
     {
-        for (;
-            certinfo != nullptr;
-            certinfo = certinfo->next)
+        Cancellation* _cancellation;
+        Wakeups::iterator _position;
+
+        Wakeup(const Wakeup&);
+        Wakeup& operator=(const Wakeup&);
+
+    public:
+        Wakeup(Cancellation* cancellation, std::function<void()> wakeup)
+            : _cancellation(cancellation)
         {
-            std::string data(certinfo->data);
-            size_t pos = data.rfind("Cert:", 0);
-            if (pos == std::string::npos)
+            if (_cancellation != nullptr)
             {
-                continue;
+                std::lock_guard<std::mutex> lock(_cancellation->_lock);
+                _position = _cancellation->_wakeups.insert(_cancellation->_wakeups.end(), std::move(wakeup));
             }
+        }
 
-            std::unique_ptr<BIO, OpenSSLDeleter<BIO, int, &BIO_free>>bio(BIO_new(BIO_s_mem()));
-            BIO_puts(bio.get(), data.substr(5).c_str());
-            return X509(PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr));
+        ~Wakeup()
+        {
+            if (_cancellation != nullptr)
+            {
+                std::lock_guard<std::mutex> lock(_cancellation->_lock);
+                _cancellation->_wakeups.erase(_position);
+            }
         }
+    };
+};
 
-        return nullptr;
+
+}   // namespace Internal
+
+
+using namespace Internal;
+
+namespace {
+
+bool IsCancelled(const Cancellation* cancellation)
+{
+    return cancellation != nullptr && cancellation->IsCancelled();
+}
+
+//
+// Sleeps for duration unless cancelled first; returns false if cancelled.
+//
+bool Sleep(Cancellation* cancellation, std::chrono::milliseconds duration)
+{
+    if (cancellation == nullptr)
+    {
+        std::this_thread::sleep_for(duration);
+        return true;
     }
+    return cancellation->Sleep(duration);
+}
 
+const char* const CancelledMessage = "Entitlement check cancelled.";
+
+//
+// Adapts how many checks each server may have in flight at once (see
+// SetMaxConcurrency), increasing a server's limit additively while it copes
+// and cutting it multiplicatively when it shows signs of overload.  Checks
+// over the limit wait: in Acquire, or in the queue of an AsyncClient, which
+// each release wakes through its waiter.
+//
+class ConcurrencyLimiter
+{
 public:
-    Curl()
-        : _curl(curl_easy_init())
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // What a finished check says about the load on its server.
+    //
+    enum class Load
     {
-        memset(_errbuf, 0, sizeof(_errbuf));
+        // The server answered; its latency tells how promptly.
+        Answered,
+        // The server timed out, failed to respond, or asked for less.
+        Overloaded,
+        // Nothing: the check was cancelled, or failed for its own reasons.
+        Unknown
+    };
 
-        if (_curl == nullptr)
+    typedef std::list<std::function<void()>>::iterator Waiter;
+
+private:
+    struct Server
+    {
+        Server()
+            : limit(InitialLimit())
+            , inFlight(0)
+            , waiting(0)
+            , slowStart(true)
+            , latency(0)
+            , baseline(0)
+            , backoffs(0)
         {
-            throw Exception("curl_easy_init failed.");
         }
 
-        curl_easy_setopt(_curl.get(), CURLOPT_ERRORBUFFER, _errbuf);
+        double limit;
+        unsigned int inFlight;
+        unsigned int waiting;
 
         //
-        // Require TLSv1_2 always.
-        //
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_USE_SSL, CURLUSESSL_ALL));
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2));
-        //
-        // During testing, if the certificate chain leaves something to be
-        // desired, disable the following two options by setting them to 0.
-        //
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_VERIFYHOST, 2));
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_VERIFYPEER, 1));
-        //
-        // Collect certificate info to allow for common name and thumbprint checking.
+        // When a check last took or waited for a place, for choosing which
+        // server to forget.
         //
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CERTINFO, 1));
+        Clock::time_point lastUsed;
 
         //
-        // Set context for write callback.
+        // Until the first backoff, the limit grows by one for every check
+        // answered, doubling each round trip, rather than by one a round
+        // trip.
         //
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_WRITEDATA, this));
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback));
+        bool slowStart;
 
         //
-        // On Windows, set the OpenSSL SSL_CTX callback in order to populate the
-        // OpenSSL certificate store with the system root certificates.
+        // In microseconds: the moving average of latency, and the lowest
+        // seen lately, which drifts up towards the average so that a server
+        // that has become slower for good is not held to an old low.
         //
-#ifdef _WIN32
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_CTX_FUNCTION, OpenSSLContextCallback));
-#endif // _WIN32
+        double latency;
+        double baseline;
 
-        // Allow overriding the default connection timeout of 300 seconds.
-        const char* env = std::getenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT");
-        long timeout = 0;
-        if (env != nullptr)
+        std::uint64_t backoffs;
+        Clock::time_point lastBackoff;
+    };
+
+    static double InitialLimit()
+    {
+        return 16;
+    }
+
+    static unsigned int DefaultMaximum()
+    {
+        return 1000;
+    }
+
+    //
+    // Servers remembered at most, beyond those with checks in flight or
+    // waiting: a server forgotten starts again from InitialLimit.
+    //
+    static size_t MaxServers()
+    {
+        return 256;
+    }
+
+    //
+    // The limit is multiplied by these on overload, and on rising latency.
+    //
+    static double OverloadBackoff()
+    {
+        return 0.5;
+    }
+
+    static double LatencyBackoff()
+    {
+        return 0.9;
+    }
+
+    //
+    // Latency averaging more than this times the baseline, and more than a
+    // millisecond over it, counts as the server queueing requests; below a
+    // millisecond, the rise is as likely the jitter of a nearby server.
+    //
+    static double LatencyTolerance()
+    {
+        return 2;
+    }
+
+    static double MinimumLatencyRise()
+    {
+        return 1000;
+    }
+
+    //
+    // Weight of the latest check in the moving average of latency, and of
+    // the average in each step of the baseline's drift.
+    //
+    static double Smoothing()
+    {
+        return 0.2;
+    }
+
+    static double BaselineDrift()
+    {
+        return 0.01;
+    }
+
+    std::mutex _lock;
+    std::condition_variable _released;
+    std::map<std::string, Server> _servers;
+    std::list<std::function<void()>> _waiters;
+    unsigned int _maximum;
+
+    //
+    // The server's limit, within the maximum; lowering the maximum leaves
+    // what has been learnt of the server for when it is raised again.
+    //
+    unsigned int Limit(const Server& server) const
+    {
+        unsigned int limit = static_cast<unsigned int>(server.limit);
+        return _maximum != 0 ? std::min(limit, _maximum) : limit;
+    }
+
+    //
+    // The server at url, remembering it if it is new and forgetting the one
+    // unused the longest, if idle, to keep within MaxServers.
+    //
+    Server& Find(const std::string& url)
+    {
+        auto found = _servers.find(url);
+        if (found == _servers.end())
         {
-            timeout = std::strtol(env, nullptr, 10);
+            if (_servers.size() >= MaxServers())
+            {
+                auto oldest = _servers.end();
+                for (auto server = _servers.begin(); server != _servers.end(); ++server)
+                {
+                    if (server->second.inFlight == 0
+                        && server->second.waiting == 0
+                        && (oldest == _servers.end() || server->second.lastUsed < oldest->second.lastUsed))
+                    {
+                        oldest = server;
+                    }
+                }
+                if (oldest != _servers.end())
+                {
+                    _servers.erase(oldest);
+                }
+            }
+            found = _servers.insert(std::make_pair(url, Server())).first;
         }
-        if (timeout <= 0 || timeout == LONG_MAX)
+        found->second.lastUsed = Clock::now();
+        return found->second;
+    }
+
+    bool Admits(const Server& server) const
+    {
+        return _maximum == 0 || server.inFlight < Limit(server);
+    }
+
+    //
+    // Cuts the limit, unless the check started before the last cut: it then
+    // saw the load that caused that cut, and the cut answered for it.
+    //
+    void Backoff(Server& server, Clock::time_point started, double factor)
+    {
+        if (started < server.lastBackoff)
         {
-            timeout = 300L;
+            return;
         }
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CONNECTTIMEOUT, timeout));
+
+        server.limit = std::max(1.0, server.limit * factor);
+        server.slowStart = false;
+        server.lastBackoff = Clock::now();
+        ++server.backoffs;
     }
 
-    void Post(
-        const std::string& url,
-        const std::string& entitlement_token,
-        const std::string& requested_entitlement)
+    void Answered(Server& server, Clock::time_point started, unsigned int inFlight, std::int64_t latency_us)
     {
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_URL, url.c_str()));
+        double sample = static_cast<double>(latency_us);
+        if (server.baseline == 0)
+        {
+            server.latency = sample;
+            server.baseline = sample;
+        }
+        else
+        {
+            server.latency += Smoothing() * (sample - server.latency);
+            server.baseline = std::min(sample, server.baseline + BaselineDrift() * (server.latency - server.baseline));
+        }
 
-        //
-        // We don't use std::unique_ptr here because curl_slist_append does not free
-        // the previous structure, and could change in the future to be implemented
-        // as a stack rather than a list (so that insertions don't walk the list).
-        //
-        struct headers_guard
+        if (server.latency > LatencyTolerance() * server.baseline
+            && server.latency > server.baseline + MinimumLatencyRise())
+        {
+            Backoff(server, started, LatencyBackoff());
+        }
+        else if (2 * inFlight >= server.limit)
+        {
+            //
+            // Only a limit in use is known to be safe to raise.
+            //
+            server.limit += server.slowStart ? 1 : 1 / server.limit;
+            server.limit = std::min(server.limit, static_cast<double>(_maximum != 0 ? _maximum : DefaultMaximum()));
+        }
+    }
+
+public:
+    ConcurrencyLimiter()
+        : _maximum(DefaultMaximum())
+    {
+    }
+
+    //
+    // Takes a place among the checks url may have in flight, if there is
+    // one free.
+    //
+    bool TryAcquire(const std::string& url)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Server& server = Find(url);
+        if (!Admits(server))
         {
-            curl_slist *value;
+            return false;
+        }
+        ++server.inFlight;
+        return true;
+    }
 
-            headers_guard()
-                :value(nullptr)
-            {}
+    //
+    // Waits for a place among the checks url may have in flight.  Returns
+    // false, without one, if cancelled first.
+    //
+    bool Acquire(const std::string& url, Cancellation* cancellation)
+    {
+        Cancellation::Wakeup wakeup(cancellation, [this]()
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _released.notify_all();
+        });
 
-            ~headers_guard()
+        std::unique_lock<std::mutex> lock(_lock);
+        Server& server = Find(url);
+        if (!Admits(server))
+        {
+            ++server.waiting;
+            _released.wait(lock, [this, &server, cancellation]() { return Admits(server) || IsCancelled(cancellation); });
+            --server.waiting;
+            if (!Admits(server))
             {
-                if (value != nullptr)
-                {
-                    curl_slist_free_all(value);
-                }
+                return false;
             }
-        } headers;
+        }
+        ++server.inFlight;
+        return true;
+    }
+
+    //
+    // Gives up a place taken at started, adapting url's limit to how the
+    // check went, and wakes the checks waiting.
+    //
+    void Release(const std::string& url, Clock::time_point started, Load load, std::int64_t latency_us)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Server& server = Find(url);
+        unsigned int inFlight = server.inFlight--;
+        if (load == Load::Overloaded)
+        {
+            Backoff(server, started, OverloadBackoff());
+        }
+        else if (load == Load::Answered && latency_us > 0)
+        {
+            Answered(server, started, inFlight, latency_us);
+        }
+
+        _released.notify_all();
+        for (const auto& waiter : _waiters)
+        {
+            waiter();
+        }
+    }
+
+    //
+    // Counts checks an AsyncClient holds back for url.
+    //
+    void Waiting(const std::string& url, int change)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Find(url).waiting += change;
+    }
+
+    //
+    // Registers wakeup to be called, with the limiter's lock held, whenever a
+    // check gives up its place.
+    //
+    Waiter AddWaiter(std::function<void()> wakeup)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _waiters.insert(_waiters.end(), std::move(wakeup));
+    }
+
+    void RemoveWaiter(Waiter waiter)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _waiters.erase(waiter);
+    }
+
+    void SetMaximum(unsigned int maximum)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _maximum = maximum;
+        _released.notify_all();
+        for (const auto& waiter : _waiters)
+        {
+            waiter();
+        }
+    }
+
+    std::vector<ConcurrencyLimit> Limits()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        std::vector<ConcurrencyLimit> limits;
+        for (const auto& server : _servers)
+        {
+            ConcurrencyLimit limit;
+            limit.endpoint = server.first;
+            limit.limit = Limit(server.second);
+            limit.in_flight = server.second.inFlight;
+            limit.waiting = server.second.waiting;
+            limit.backoffs = server.second.backoffs;
+            limit.latency_us = static_cast<std::int64_t>(server.second.latency);
+            limit.baseline_latency_us = static_cast<std::int64_t>(server.second.baseline);
+            limits.push_back(limit);
+        }
+        return limits;
+    }
+};
+
+ConcurrencyLimiter s_limiter;
+
+//
+// What the outcome of a check says about the load on its server.
+//
+ConcurrencyLimiter::Load LoadOf(const EntitlementResult& result)
+{
+    switch (result.category)
+    {
+    case ErrorCategory::None:
+    case ErrorCategory::Denied:
+    case ErrorCategory::BadRequest:
+        return ConcurrencyLimiter::Load::Answered;
+
+    case ErrorCategory::Timeout:
+        return ConcurrencyLimiter::Load::Overloaded;
+
+    case ErrorCategory::Transport:
+        //
+        // A name that does not resolve says nothing of the server.
+        //
+        return result.curl_code == CURLE_COULDNT_RESOLVE_HOST || result.curl_code == CURLE_COULDNT_RESOLVE_PROXY
+            ? ConcurrencyLimiter::Load::Unknown
+            : ConcurrencyLimiter::Load::Overloaded;
+
+    case ErrorCategory::UnexpectedResponse:
+        return result.http_status == 429 || result.http_status >= 500
+            ? ConcurrencyLimiter::Load::Overloaded
+            : ConcurrencyLimiter::Load::Unknown;
+
+    default:
+        return ConcurrencyLimiter::Load::Unknown;
+    }
+}
+
+//
+// A check's place among those its server may have in flight, given up
+// without telling the limiter anything if the check does not finish.
+//
+class ConcurrencySlot
+{
+    std::string _url;
+    ConcurrencyLimiter::Clock::time_point _started;
+    bool _held;
+
+    ConcurrencySlot(const ConcurrencySlot&);
+    ConcurrencySlot& operator=(const ConcurrencySlot&);
+
+public:
+    ConcurrencySlot()
+        : _held(false)
+    {
+    }
+
+    ~ConcurrencySlot()
+    {
+        Release(ConcurrencyLimiter::Load::Unknown, 0);
+    }
+
+    bool TryAcquire(const std::string& url)
+    {
+        _held = s_limiter.TryAcquire(url);
+        if (_held)
+        {
+            _url = url;
+            _started = ConcurrencyLimiter::Clock::now();
+        }
+        return _held;
+    }
+
+    bool Acquire(const std::string& url, Cancellation* cancellation)
+    {
+        _held = s_limiter.Acquire(url, cancellation);
+        if (_held)
+        {
+            _url = url;
+            _started = ConcurrencyLimiter::Clock::now();
+        }
+        return _held;
+    }
+
+    void Release(ConcurrencyLimiter::Load load, std::int64_t latency_us)
+    {
+        if (_held)
+        {
+            _held = false;
+            s_limiter.Release(_url, _started, load, latency_us);
+        }
+    }
+};
+
+//
+// The identity of the node, for its share of the start-up window.
+//
+std::string NodeIdentity()
+{
+    const char* node = std::getenv("AZ_BATCH_NODE_ID");
+    if (node != nullptr && *node != '\0')
+    {
+        return node;
+    }
+
+#ifdef _WIN32
+    const char* computer = std::getenv("COMPUTERNAME");
+    return computer != nullptr ? computer : "";
+#else
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+    return host;
+#endif
+}
+
+//
+// Reads the pacing from the environment, for a process that has not called
+// SetAdmissionControl.  Values that do not parse leave pacing off.
+//
+AdmissionControl AdmissionFromEnvironment()
+{
+    AdmissionControl control;
+    const char* rate = std::getenv("AZ_BATCH_SES_ADMISSION_RATE");
+    if (rate != nullptr)
+    {
+        control.rate = std::max(0.0, std::strtod(rate, nullptr));
+    }
+    const char* burst = std::getenv("AZ_BATCH_SES_ADMISSION_BURST");
+    if (burst != nullptr)
+    {
+        control.burst = static_cast<unsigned int>(std::strtoul(burst, nullptr, 10));
+    }
+    const char* window = std::getenv("AZ_BATCH_SES_STARTUP_WINDOW_MS");
+    if (window != nullptr)
+    {
+        control.startup_window = std::chrono::milliseconds(std::strtoul(window, nullptr, 10));
+    }
+    return control;
+}
+
+//
+// Set on the threads whose checks are interactive (see SetInteractive).
+//
+#if defined _MSC_VER && _MSC_VER < 1900
+__declspec(thread) bool s_interactive = false;
+#else
+thread_local bool s_interactive = false;
+#endif
+
+//
+// Paces the requests sent to entitlement servers (see SetAdmissionControl)
+// with a token bucket, refilled at the rate up to the burst, which no
+// request may draw on before the node's share of the start-up window has
+// passed.  A request finding the bucket empty takes it into debt, reserving
+// its turn, so that requests waiting are sent in the order they asked.
+//
+class AdmissionController
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    std::mutex _lock;
+    bool _configured;
+    double _rate;
+    double _burst;
+
+    //
+    // The tokens in the bucket as of _updated, which is never earlier than
+    // the end of the node's share of the start-up window.
+    //
+    double _tokens;
+    Clock::time_point _updated;
+
+    AdmissionStats _stats;
+
+    void Configure(const AdmissionControl& control, Clock::time_point now)
+    {
+        if (!(control.rate >= 0))
+        {
+            throw Exception("The rate of requests must not be negative.");
+        }
+
+        //
+        // The first 8 bytes of the identity's SHA-256 hash, as a fraction.
+        //
+        TokenDigest digest = DigestToken(control.identity.empty() ? NodeIdentity() : control.identity);
+        double fraction = 0;
+        for (std::uint8_t byte : digest)
+        {
+            fraction = (fraction + byte) / 256;
+        }
+        auto delay = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(control.startup_window.count() * fraction));
+
+        _configured = true;
+        _rate = control.rate;
+        _burst = std::max(1u, control.burst);
+        _tokens = _burst;
+        _updated = now + delay;
+        _stats.startup_delay_us = std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+    }
+
+    //
+    // Returns how long a request made now must wait for its turn, taking
+    // its token.
+    //
+    Clock::duration Reserve(Clock::time_point now)
+    {
+        if (!_configured)
+        {
+            Configure(AdmissionFromEnvironment(), now);
+        }
+
+        if (now > _updated)
+        {
+            if (_rate > 0)
+            {
+                _tokens = std::min(_burst, _tokens + _rate * std::chrono::duration<double>(now - _updated).count());
+            }
+            _updated = now;
+        }
+
+        Clock::duration wait = _updated - now;
+        if (_rate > 0)
+        {
+            _tokens -= 1;
+            if (_tokens < 0)
+            {
+                wait += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-_tokens / _rate));
+            }
+        }
+        return wait;
+    }
+
+    void RefundLocked()
+    {
+        if (_rate > 0)
+        {
+            _tokens = std::min(_burst, _tokens + 1);
+        }
+    }
+
+    void RecordWaitLocked(Clock::duration wait)
+    {
+        std::int64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+        ++_stats.delayed;
+        _stats.total_wait_us += wait_us;
+        _stats.max_wait_us = std::max(_stats.max_wait_us, wait_us);
+    }
+
+public:
+    AdmissionController()
+        : _configured(false)
+        , _rate(0)
+        , _burst(1)
+        , _tokens(1)
+    {
+    }
+
+    void Set(const AdmissionControl& control)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Configure(control, Clock::now());
+    }
+
+    void SetInteractive(bool interactive)
+    {
+        s_interactive = interactive;
+    }
+
+    //
+    // True if the calling thread makes interactive checks.
+    //
+    bool IsInteractive() const
+    {
+        return s_interactive;
+    }
+
+    //
+    // Waits for the turn of a request from the calling thread.  Returns
+    // false, giving the turn up, if cancelled first.
+    //
+    bool Admit(Cancellation* cancellation)
+    {
+        Clock::duration wait;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (s_interactive)
+            {
+                ++_stats.bypassed;
+                return true;
+            }
+            wait = Reserve(Clock::now());
+        }
+
+        if (wait > Clock::duration::zero())
+        {
+            auto started = Clock::now();
+            bool slept = Sleep(
+                cancellation,
+                std::chrono::duration_cast<std::chrono::milliseconds>(wait + std::chrono::milliseconds(1) - Clock::duration(1)));
+
+            std::lock_guard<std::mutex> lock(_lock);
+            if (!slept)
+            {
+                RefundLocked();
+                return false;
+            }
+            RecordWaitLocked(Clock::now() - started);
+        }
+
+        std::lock_guard<std::mutex> lock(_lock);
+        ++_stats.admitted;
+        return true;
+    }
+
+    //
+    // The turn of a request that could not be sent at once: like a caller
+    // of Admit, it keeps the token it took, and its place, until it is due.
+    //
+    struct Reservation
+    {
+        Reservation()
+            : held(false)
+        {
+        }
+
+        bool held;
+        Clock::time_point due;
+    };
+
+    //
+    // Takes the turn of a request, if it has come; otherwise reserves it,
+    // if not already reserved, and sets wait to how long until it comes.
+    //
+    bool TryAdmit(bool interactive, Reservation& reservation, Clock::duration& wait)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (interactive)
+        {
+            ++_stats.bypassed;
+            return true;
+        }
+
+        auto now = Clock::now();
+        if (!reservation.held)
+        {
+            reservation.due = now + Reserve(now);
+            reservation.held = true;
+        }
+        if (reservation.due > now)
+        {
+            wait = reservation.due - now;
+            return false;
+        }
+
+        reservation.held = false;
+        ++_stats.admitted;
+        return true;
+    }
+
+    //
+    // Gives back a turn taken by TryAdmit, the request not having been sent;
+    // it stays reserved for the request, which may be sent at once.
+    //
+    void Unadmit(bool interactive, Reservation& reservation)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (interactive)
+        {
+            --_stats.bypassed;
+            return;
+        }
+        reservation.held = true;
+        reservation.due = Clock::now();
+        --_stats.admitted;
+    }
+
+    //
+    // Gives up a turn reserved by TryAdmit for a request that will not be
+    // sent.
+    //
+    void Release(Reservation& reservation)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (reservation.held)
+        {
+            RefundLocked();
+            reservation.held = false;
+        }
+    }
+
+    //
+    // Counts the wait of a request that was not sent at once.
+    //
+    void RecordWait(Clock::duration wait)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        RecordWaitLocked(wait);
+    }
+
+    AdmissionStats Stats()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _stats;
+    }
+};
+
+AdmissionController s_admission;
+
+struct CertInfo
+{
+    SHA256Thumbprint thumbprint;
+    std::string common_name;
+    std::string allowed_dns_namespace;
+};
+
+//
+// A certificate pinned by the library itself.  Plain data, so that the table
+// of them is initialized when the library is loaded, without running any code.
+//
+struct BuiltInCertInfo
+{
+    std::uint8_t thumbprint[20];
+    const char* common_name;
+
+    //
+    // Empty if the certificate may be presented by any server.
+    //
+    const char* allowed_dns_namespace;
+};
+
+//
+// Published Microsoft Intermediate Certificates from https://www.microsoft.com/pki/mscorp/cps/,
+// sorted by thumbprint for FindBuiltInCertificates.  Keep them sorted when
+// adding to them.
+//
+const BuiltInCertInfo s_microsoftIntermediateCerts[] = {
+    // Batch US Government cloud
+    { { 0x1f,0xb8,0x6b,0x11,0x68,0xec,0x74,0x31,0x54,0x06,0x2e,0x8c,0x9c,0xc5,0xb1,0x71,0xa4,0xb7,0xcc,0xb4 },
+        "DigiCert SHA2 Secure Server CA", ".batch.usgovcloudapi.net" },
+    // Batch China cloud
+    { { 0x1f,0xb8,0x6b,0x11,0x68,0xec,0x74,0x31,0x54,0x06,0x2e,0x8c,0x9c,0xc5,0xb1,0x71,0xa4,0xb7,0xcc,0xb4 },
+        "DigiCert SHA2 Secure Server CA", ".batch.chinacloudapi.cn" },
+    // Batch Germany cloud
+    { { 0x2f,0xc5,0xde,0x65,0x28,0xcd,0xbe,0x50,0xa1,0x4c,0x38,0x2f,0xc1,0xde,0x52,0x4f,0xaa,0xbf,0x95,0xfc },
+        "D-TRUST SSL Class 3 CA 1 2009", ".batch.microsoftazure.de" },
+    { { 0x41,0x7e,0x22,0x50,0x37,0xfb,0xfa,0xa4,0xf9,0x57,0x61,0xd5,0xae,0x72,0x9e,0x1a,0xea,0x7e,0x3a,0x42 },
+        "Microsoft IT TLS CA 1", "" },
+    { { 0x54,0xd9,0xd2,0x02,0x39,0x08,0x0c,0x32,0x31,0x6e,0xd9,0xff,0x98,0x0a,0x48,0x98,0x8f,0x4a,0xdf,0x2d },
+        "Microsoft IT TLS CA 2", "" },
+    { { 0x8a,0x38,0x75,0x5d,0x09,0x96,0x82,0x3f,0xe8,0xfa,0x31,0x16,0xa2,0x77,0xce,0x44,0x6e,0xac,0x4e,0x99 },
+        "Microsoft IT TLS CA 4", "" },
+    { { 0x94,0x8e,0x16,0x52,0x58,0x62,0x40,0xd4,0x53,0x28,0x7a,0xb6,0x9c,0xae,0xb8,0xf2,0xf4,0xf0,0x21,0x17 },
+        "Microsoft IT SSL SHA2", "" },
+    { { 0x97,0xef,0xf3,0x02,0x86,0x77,0x89,0x4b,0xdd,0x4f,0x9a,0xc5,0x3f,0x78,0x9b,0xee,0x5d,0xf4,0xad,0x86 },
+        "Microsoft IT SSL SHA2", "" },
+    { { 0xad,0x89,0x8a,0xc7,0x3d,0xf3,0x33,0xeb,0x60,0xac,0x1f,0x5f,0xc6,0xc4,0xb2,0x21,0x9d,0xdb,0x79,0xb7 },
+        "Microsoft IT TLS CA 5", "" },
+};
+
+//
+// Orders built-in certificates and thumbprints by thumbprint.
+//
+struct ThumbprintOrder
+{
+    bool operator()(const BuiltInCertInfo& lhs, const SHA256Thumbprint& rhs) const
+    {
+        return std::memcmp(lhs.thumbprint, rhs.data(), rhs.size()) < 0;
+    }
+
+    bool operator()(const SHA256Thumbprint& lhs, const BuiltInCertInfo& rhs) const
+    {
+        return std::memcmp(lhs.data(), rhs.thumbprint, lhs.size()) < 0;
+    }
+
+    bool operator()(const BuiltInCertInfo& lhs, const BuiltInCertInfo& rhs) const
+    {
+        return std::memcmp(lhs.thumbprint, rhs.thumbprint, sizeof(lhs.thumbprint)) < 0;
+    }
+};
+
+//
+// Returns the built-in certificates with the given thumbprint.
+//
+std::pair<const BuiltInCertInfo*, const BuiltInCertInfo*> FindBuiltInCertificates(const SHA256Thumbprint& thumbprint)
+{
+    return std::equal_range(
+        std::begin(s_microsoftIntermediateCerts),
+        std::end(s_microsoftIntermediateCerts),
+        thumbprint,
+        ThumbprintOrder());
+}
+
+typedef std::vector<CertInfo> CertSet;
+
+//
+// The certificates accepted with AddSslCertificate, in addition to the
+// built-in ones, read during TLS handshakes on any thread.  Never
+// modified once published: readers take the current set with an atomic load,
+// without a lock, and writers publish a modified copy in its place.
+//
+std::shared_ptr<const CertSet> s_sslCerts(std::make_shared<CertSet>());
+
+//
+// Serializes changes to s_sslCerts, so that none is lost; readers never take
+// it.
+//
+std::mutex s_certLock;
+
+//
+// Publishes the accepted certificates with [first, last) added.  Must be
+// called with s_certLock held.
+//
+template<typename Iterator>
+void PublishCertificates(Iterator first, Iterator last)
+{
+    std::shared_ptr<CertSet> certs = std::make_shared<CertSet>(*std::atomic_load(&s_sslCerts));
+    certs->insert(certs->end(), first, last);
+    std::atomic_store(&s_sslCerts, std::shared_ptr<const CertSet>(std::move(certs)));
+}
+
+//
+// Guards initialization of libcurl.
+//
+std::mutex s_initLock;
+
+//
+// Number of calls to Init not yet matched by Cleanup.
+//
+unsigned s_initCount = 0;
+
+//
+// Whether libcurl is initialized, read without the lock on every check.
+//
+std::atomic<bool> s_curlInitialized(false);
+
+}   // anonymous namespace
+
+
+namespace Internal {
+
+//
+// Returns true if a pinned certificate whose thumbprint matches cert's
+// accepts the server at url; throws if the common names differ.
+//
+bool AcceptsServer(
+    const X509& cert,
+    const char* common_name,
+    const char* allowed_dns_namespace,
+    const std::string& url)
+{
+    auto certName = cert.CommonName();
+    if (certName != common_name)
+    {
+        //
+        // Thumbprint match, but common name mismatch.
+        //
+        throw Exception(
+            "Certificate common name does not match, expected '" +
+            std::string(common_name) +
+            "' but got '" +
+            certName +
+            "'");
+    }
+
+    return *allowed_dns_namespace == '\0' || url.find(allowed_dns_namespace) != std::string::npos;
+}
+
+//
+// Perform additional certificate checks:
+// - Find any one of the built-in certificates, or those in the current
+//   s_sslCerts, by thumbprint.
+// - Verify that such cetificate has the matching common name.
+//
+void VerifyCertificateChain(STACK_OF(X509)* chain, const std::string& url)
+{
+    std::shared_ptr<const CertSet> certs = std::atomic_load(&s_sslCerts);
+
+    //
+    // Root certificates cannot be pinned, so a self-signed anchor from the
+    // local store is skipped.  A chain verified with X509_V_FLAG_PARTIAL_CHAIN
+    // may instead end at a pinned intermediate trusted in the store, which
+    // is checked like the rest.
+    //
+    int count = sk_X509_num(chain);
+    if (EndsAtRoot(chain))
+    {
+        --count;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        X509 cert(GetChainCertificate(chain, i));
+        auto thumbprint = cert.Thumbprint();
+
+        auto builtIn = FindBuiltInCertificates(thumbprint);
+        for (auto validCert = builtIn.first; validCert != builtIn.second; ++validCert)
+        {
+            if (AcceptsServer(cert, validCert->common_name, validCert->allowed_dns_namespace, url))
+            {
+                return;
+            }
+        }
+
+        for (const auto& validCert : *certs)
+        {
+            if (thumbprint != validCert.thumbprint)
+            {
+                continue;
+            }
+
+            if (AcceptsServer(cert, validCert.common_name.c_str(), validCert.allowed_dns_namespace.c_str(), url))
+            {
+                return;
+            }
+        }
+    }
+
+    throw Exception("None of the candidate certificates were found in certificate chain.");
+}
+
+}   // namespace Internal
+
+
+namespace {
+
+extern "C" int cout_cb(const char* val, size_t /*len*/, void* u)
+{
+    std::ostringstream& str = *static_cast<std::ostringstream*>(u);
+    str << val << std::endl;
+    return 1;
+}
+
+
+void ThrowIfOpenSSLError(bool error)
+{
+    if (error)
+    {
+        std::ostringstream str;
+        ERR_print_errors_cb(cout_cb, &str);
+
+        throw Exception(str.str());
+    }
+}
+
+
+#ifdef _WIN32
+void ThrowIfWin32Error(bool error)
+{
+    if (!error)
+    {
+        return;
+    }
+
+    DWORD lastErr = GetLastError();
+    throw std::system_error(std::error_code(lastErr, std::system_category()));
+}
+#endif // _WIN32
+
+
+//
+// The CA certificates trusted when validating the server's chain.  libcurl
+// would otherwise parse them from disk into the store of every new connection
+// (and, on Windows, OpenSSLContextCallback copy the system ROOT store into it
+// too); instead they are loaded once into a store that every connection
+// shares, and reloaded only when their source changes.
+//
+// Guarded by s_trustStoreLock.
+//
+std::mutex s_trustStoreLock;
+X509_STORE* s_trustStore = nullptr;
+std::string s_trustStoreFile;
+std::string s_trustStorePath;
+
+//
+// Identifies a version of a file, so that a change can be detected without
+// reading it.
+//
+struct FileVersion
+{
+    long long size;
+    long long modified;
+};
+
+FileVersion s_trustStoreVersion = { -1, -1 };
+
+
+FileVersion GetFileVersion(const std::string& path)
+{
+    FileVersion version = { -1, -1 };
+    if (path.empty())
+    {
+        return version;
+    }
+
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(path.c_str(), &info) == 0)
+    {
+        version.size = info.st_size;
+        version.modified = info.st_mtime;
+    }
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0)
+    {
+        version.size = info.st_size;
+#ifdef __linux__
+        version.modified = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#else
+        version.modified = info.st_mtime;
+#endif
+    }
+#endif
+
+    return version;
+}
+
+
+X509_STORE* ShareTrustStore(X509_STORE* store)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    X509_STORE_up_ref(store);
+#else
+    CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+#endif
+    return store;
+}
+
+
+#ifdef _WIN32
+//
+// The system ROOT store, kept open to be notified when it changes (for
+// example when Windows downloads a root certificate on demand), and its
+// certificates, parsed once for each change.
+//
+HCERTSTORE s_rootStore = nullptr;
+HANDLE s_rootStoreChanged = nullptr;
+std::vector<::X509*> s_rootCertificates;
+
+
+void FreeRootCertificates()
+{
+    for (auto cert : s_rootCertificates)
+    {
+        X509_free(cert);
+    }
+    s_rootCertificates.clear();
+}
+
+
+//
+// Reads the ROOT store if it has changed since it was last read, returning
+// true if it has.  The caller holds s_trustStoreLock.
+//
+bool RefreshRootCertificates()
+{
+    if (s_rootStore == nullptr)
+    {
+        HCERTSTORE store = CertOpenSystemStoreW(0, L"ROOT");
+        ThrowIfWin32Error(store == nullptr);
+
+        HANDLE changed = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (changed == nullptr
+            || !CertControlStore(store, 0, CERT_STORE_CTRL_NOTIFY_CHANGE, &changed))
+        {
+            DWORD lastErr = GetLastError();
+            if (changed != nullptr)
+            {
+                CloseHandle(changed);
+            }
+            CertCloseStore(store, 0);
+            throw std::system_error(std::error_code(lastErr, std::system_category()));
+        }
+
+        s_rootStore = store;
+        s_rootStoreChanged = changed;
+    }
+    else if (WaitForSingleObject(s_rootStoreChanged, 0) == WAIT_OBJECT_0)
+    {
+        //
+        // Brings the open store up to date and rearms the notification.
+        //
+        CertControlStore(s_rootStore, 0, CERT_STORE_CTRL_RESYNC, &s_rootStoreChanged);
+        FreeRootCertificates();
+    }
+    else if (!s_rootCertificates.empty())
+    {
+        return false;
+    }
+
+    PCCERT_CONTEXT pCertContext = CertEnumCertificatesInStore(s_rootStore, nullptr);
+    while (pCertContext != nullptr)
+    {
+        const BYTE* cert = pCertContext->pbCertEncoded;
+        ::X509* x509 = d2i_X509(nullptr, &cert, pCertContext->cbCertEncoded);
+        if (x509 != nullptr)
+        {
+            s_rootCertificates.push_back(x509);
+        }
+        pCertContext = CertEnumCertificatesInStore(s_rootStore, pCertContext);
+    }
+
+    return true;
+}
+
+
+//
+// Adds the ROOT certificates to store.  The caller holds s_trustStoreLock.
+//
+void CopyRootCertificates(X509_STORE* store)
+{
+    for (auto cert : s_rootCertificates)
+    {
+        //
+        // Ignore failures - missing certs will manifest in cert chain validation failures.
+        //
+        X509_STORE_add_cert(store, cert);
+    }
+}
+
+
+//
+// Populates the store of a connection that does not use the shared store
+// with the system root certificates.
+//
+void AddRootCertificates(X509_STORE* store)
+{
+    std::lock_guard<std::mutex> lock(s_trustStoreLock);
+
+    RefreshRootCertificates();
+    CopyRootCertificates(store);
+}
+#endif  // _WIN32
+
+
+//
+// The version of the libcurl the library runs with, which may be older than
+// the headers it was built with when libcurl is loaded at run time.
+//
+unsigned int LibcurlVersion()
+{
+    return curl_version_info(CURLVERSION_NOW)->version_num;
+}
+
+
+X509_STORE* LoadTrustStore(const std::string& caFile, const std::string& caPath)
+{
+    std::unique_ptr<X509_STORE, OpenSSLDeleter<X509_STORE, void, &X509_STORE_free>> store(X509_STORE_new());
+    ThrowIfOpenSSLError(store == nullptr);
+
+    if (!caFile.empty() && X509_STORE_load_locations(store.get(), caFile.c_str(), nullptr) != 1)
+    {
+        ERR_clear_error();
+        throw Exception("Unable to load CA certificates from " + caFile);
+    }
+
+    if (!caPath.empty() && X509_STORE_load_locations(store.get(), nullptr, caPath.c_str()) != 1)
+    {
+        ERR_clear_error();
+        throw Exception("Unable to use CA certificate directory " + caPath);
+    }
+
+    //
+    // libcurl built with --with-ca-fallback has no locations of its own and
+    // leaves OpenSSL to use its defaults; do the same rather than trust
+    // nothing.
+    //
+    if (caFile.empty() && caPath.empty())
+    {
+        ThrowIfOpenSSLError(X509_STORE_set_default_paths(store.get()) != 1);
+    }
+
+#ifdef _WIN32
+    CopyRootCertificates(store.get());
+#endif
+
+    //
+    // libcurl sets these on the store of every connection; setting them here
+    // first means its writes to the shared store change nothing.
+    //
+    unsigned long flags = X509_V_FLAG_TRUSTED_FIRST;
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+    if (LibcurlVersion() >= 0x074400)
+    {
+        flags |= X509_V_FLAG_PARTIAL_CHAIN;
+    }
+#endif
+    X509_STORE_set_flags(store.get(), flags);
+
+    return store.release();
+}
+
+
+//
+// Frees the shared store and the certificates it was loaded from; called by
+// the last Cleanup.  Connections still open keep their own references.
+//
+void ReleaseTrustStore()
+{
+    std::lock_guard<std::mutex> lock(s_trustStoreLock);
+
+    if (s_trustStore != nullptr)
+    {
+        X509_STORE_free(s_trustStore);
+        s_trustStore = nullptr;
+    }
+
+#ifdef _WIN32
+    FreeRootCertificates();
+    if (s_rootStore != nullptr)
+    {
+        CloseHandle(s_rootStoreChanged);
+        CertCloseStore(s_rootStore, 0);
+        s_rootStore = nullptr;
+        s_rootStoreChanged = nullptr;
+    }
+#endif
+}
+
+}   // anonymous namespace
+
+
+namespace Internal {
+
+X509_STORE* AcquireTrustStore(const std::string& caFile, const std::string& caPath)
+{
+    std::lock_guard<std::mutex> lock(s_trustStoreLock);
+
+    FileVersion version = GetFileVersion(caFile);
+    bool changed = s_trustStore == nullptr
+        || caFile != s_trustStoreFile
+        || caPath != s_trustStorePath
+        || version.size != s_trustStoreVersion.size
+        || version.modified != s_trustStoreVersion.modified;
+#ifdef _WIN32
+    changed = RefreshRootCertificates() || changed;
+#endif
+
+    if (changed)
+    {
+        X509_STORE* store = LoadTrustStore(caFile, caPath);
+        if (s_trustStore != nullptr)
+        {
+            X509_STORE_free(s_trustStore);
+        }
+        s_trustStore = store;
+        s_trustStoreFile = caFile;
+        s_trustStorePath = caPath;
+        s_trustStoreVersion = version;
+    }
+
+    return ShareTrustStore(s_trustStore);
+}
+
+}   // namespace Internal
+
+
+namespace {
+
+
+//
+// Initializes libcurl (loading it first, if built to do so) unless Init
+// already has.  Called before every use of libcurl.
+//
+void EnsureInitialized()
+{
+    if (s_curlInitialized)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(s_initLock);
+
+    if (!s_curlInitialized)
+    {
+        CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (res != CURLE_OK)
+        {
+            throw Exception("curl_global_init failed with error " + std::to_string(res));
+        }
+        s_curlInitialized = true;
+    }
+}
+
+
+CURL* NewEasyHandle()
+{
+    EnsureInitialized();
+    return curl_easy_init();
+}
+
+
+CURLM* NewMultiHandle()
+{
+    EnsureInitialized();
+    return curl_multi_init();
+}
+
+
+struct MultiDeleter
+{
+    void operator ()(CURLM* multi)
+    {
+        curl_multi_cleanup(multi);
+    }
+};
+
+
+void ThrowIfMultiError(CURLMcode res)
+{
+    if (res == CURLM_OK)
+    {
+        return;
+    }
+
+    std::ostringstream what;
+    what << "libcurl_multi_error " << res << ": " << curl_multi_strerror(res);
+    throw Exception(what.str());
+}
+
+
+//
+// True if the libcurl the library runs with has curl_multi_poll and
+// curl_multi_wakeup (7.68.0), so that a wait on a multi handle can be cut
+// short from another thread.
+//
+bool CanWakeMultiHandles()
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+    return LibcurlVersion() >= 0x074400;
+#else
+    return false;
+#endif
+}
+
+
+//
+// Waits up to timeout_ms for activity on the transfers of multi: with
+// curl_multi_poll where the libcurl the library runs with has it (7.66.0),
+// which curl_multi_wakeup can cut short, and otherwise with curl_multi_wait.
+//
+void WaitForTransfers(CURLM* multi, int timeout_ms)
+{
+#if LIBCURL_VERSION_NUM >= 0x074200
+    if (LibcurlVersion() >= 0x074200)
+    {
+        ThrowIfMultiError(curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr));
+        return;
+    }
+#endif
+    ThrowIfMultiError(curl_multi_wait(multi, nullptr, 0, timeout_ms, nullptr));
+}
+
+
+//
+// Set by Cleanup to abandon warm-ups still in progress.
+//
+std::atomic<bool> s_abandonWarmups(false);
+
+
+//
+// Why a check failed, kept as received so that the message is only built if
+// it is asked for.
+//
+struct Failure
+{
+    enum Detail
+    {
+        // detail is the message itself.
+        Message,
+        // detail is the body of an error response.
+        ResponseBody,
+        // detail is libcurl's error buffer.
+        ErrorBuffer,
+        // Only the HTTP status is known.
+        Status
+    };
+
+    Detail kind;
+    long status;
+    CURLcode code;
+    std::string detail;
+};
+
+std::string Describe(const Failure& failure)
+{
+    switch (failure.kind)
+    {
+    case Failure::ResponseBody:
+        return GetDetailedErrorMessage(failure.detail);
+
+    case Failure::ErrorBuffer:
+    {
+        std::ostringstream what;
+        what << "libcurl_error " << failure.code << ": " << failure.detail;
+        return what.str();
+    }
+
+    case Failure::Status:
+        return "Unexpected error: HTTP status " + std::to_string(failure.status);
+
+    default:
+        return failure.detail;
+    }
+}
+
+EntitlementResult Failed(
+    ErrorCategory category,
+    Failure::Detail kind,
+    long status,
+    CURLcode code,
+    std::string detail)
+{
+    std::shared_ptr<Failure> failure = std::make_shared<Failure>();
+    failure->kind = kind;
+    failure->status = status;
+    failure->code = code;
+    failure->detail = std::move(detail);
+
+    EntitlementResult result;
+    result.category = category;
+    result.http_status = status;
+    result.curl_code = code;
+    result.describe = [failure]() { return Describe(*failure); };
+    return result;
+}
+
+EntitlementResult Failed(ErrorCategory category, const std::string& message)
+{
+    return Failed(category, Failure::Message, 0, CURLE_OK, message);
+}
+
+EntitlementResult Cancelled(CURLcode code = CURLE_OK)
+{
+    return Failed(ErrorCategory::Cancelled, Failure::Message, 0, code, CancelledMessage);
+}
+
+EntitlementResult Granted(std::unique_ptr<Entitlement> entitlement)
+{
+    EntitlementResult result;
+    result.entitlement = std::move(entitlement);
+    result.http_status = 200;
+    return result;
+}
+
+//
+// Returns the entitlement granted, or throws the Exception describing why
+// none was.
+//
+std::unique_ptr<Entitlement> TakeEntitlement(EntitlementResult& result)
+{
+    switch (result.category)
+    {
+    case ErrorCategory::None:
+        return std::move(result.entitlement);
+
+    case ErrorCategory::Denied:
+        throw EntitlementDeniedException(result.Message(), result.cached);
+
+    case ErrorCategory::Cancelled:
+        throw CheckCancelledException();
+
+    default:
+        throw Exception(result.Message());
+    }
+}
+
+
+//
+// The last Capacity requests made, kept for RecentRequests without locks.
+// Each slot is a seqlock: its sequence is odd while a writer fills it, and
+// 2 * (index + 1) once it holds the index'th request recorded, so that a
+// reader can tell a complete entry from one being overwritten.  Entries are
+// copied in and out as atomic words, which keeps the copies free of data
+// races.  Should more than Capacity requests finish at once, a writer that
+// finds its slot busy drops its record rather than wait.
+//
+class FlightRecorder
+{
+public:
+    static const size_t Capacity = 64;
+
+    //
+    // Trivially copyable, so that it can be stored as words.
+    //
+    struct Entry
+    {
+        std::int64_t started_us;
+        std::int64_t name_lookup_us;
+        std::int64_t connect_us;
+        std::int64_t tls_handshake_us;
+        std::int64_t first_byte_us;
+        std::int64_t total_us;
+        std::int64_t server_us;
+        std::int64_t network_us;
+        std::int32_t curl_code;
+        std::int32_t http_status;
+        std::uint32_t attempt;
+        std::uint8_t category;
+        std::uint8_t pin_check;
+        TokenDigest digest;
+        char endpoint[128];
+        char application[64];
+        char client_request_id[40];
+        char request_id[64];
+    };
+
+    void Record(const Entry& entry)
+    {
+        std::uint64_t index = _next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = _slots[index % Capacity];
+
+        //
+        // Claim the slot, unless another writer is filling it or has filled
+        // it with a later request.
+        //
+        std::uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        do
+        {
+            if ((sequence & 1) != 0 || sequence > 2 * index)
+            {
+                return;
+            }
+        } while (!slot.sequence.compare_exchange_weak(sequence, 2 * index + 1, std::memory_order_relaxed));
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::uint64_t words[Words];
+        words[Words - 1] = 0;
+        std::memcpy(words, &entry, sizeof(entry));
+        for (size_t i = 0; i < Words; ++i)
+        {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        slot.sequence.store(2 * index + 2, std::memory_order_release);
+    }
+
+    //
+    // Returns the complete entries yet to be overwritten, oldest first.
+    //
+    std::vector<Entry> Entries() const
+    {
+        std::vector<Entry> entries;
+        std::uint64_t next = _next.load(std::memory_order_acquire);
+        std::uint64_t index = next > Capacity ? next - Capacity : 0;
+        entries.reserve(static_cast<size_t>(next - index));
+
+        for (; index < next; ++index)
+        {
+            const Slot& slot = _slots[index % Capacity];
+            std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * index + 2)
+            {
+                continue;
+            }
+
+            std::uint64_t words[Words];
+            for (size_t i = 0; i < Words; ++i)
+            {
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+            {
+                continue;
+            }
+
+            Entry entry;
+            std::memcpy(&entry, words, sizeof(entry));
+            entries.push_back(entry);
+        }
+
+        return entries;
+    }
+
+private:
+    static const size_t Words = (sizeof(Entry) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+    struct Slot
+    {
+        std::atomic<std::uint64_t> sequence;
+        std::atomic<std::uint64_t> words[Words];
+    };
+
+    std::atomic<std::uint64_t> _next;
+    Slot _slots[Capacity];
+};
+
+//
+// Zero-initialized, so that recording needs no set-up.
+//
+FlightRecorder s_flightRecorder;
+
+
+//
+// Returns a new random (version 4) UUID, in lower case, to identify one
+// attempt at a request in the client-request-id header.
+//
+std::string NewClientRequestId()
+{
+    unsigned char bytes[16];
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+    {
+        throw Exception("Failed to generate a client request id");
+    }
+    bytes[6] = static_cast<unsigned char>((bytes[6] & 0x0f) | 0x40);
+    bytes[8] = static_cast<unsigned char>((bytes[8] & 0x3f) | 0x80);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string id;
+    id.reserve(36);
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+        {
+            id += '-';
+        }
+        id += digits[bytes[i] >> 4];
+        id += digits[bytes[i] & 0xf];
+    }
+    return id;
+}
+
+//
+// If the header line (as passed to a libcurl header callback, with its line
+// break) is named name, which must be in lower case, sets value to its
+// value, trimmed, and returns true.
+//
+bool MatchHeader(const char* line, size_t length, const char* name, std::string& value)
+{
+    size_t nameLength = std::strlen(name);
+    if (length <= nameLength || line[nameLength] != ':')
+    {
+        return false;
+    }
+    for (size_t i = 0; i < nameLength; ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(line[i])) != name[i])
+        {
+            return false;
+        }
+    }
+
+    const char* begin = line + nameLength + 1;
+    const char* end = line + length;
+    while (begin < end && (*begin == ' ' || *begin == '\t'))
+    {
+        ++begin;
+    }
+    while (end > begin && std::isspace(static_cast<unsigned char>(end[-1])))
+    {
+        --end;
+    }
+    value.assign(begin, end);
+    return true;
+}
+
+//
+// Returns, in microseconds, how long a Server-Timing header says the server
+// spent on the request: the duration of its metric named "total", if it has
+// one, or else its longest; -1 if it gives no duration.  Metrics are listed
+// as in 'db;dur=12.5, app;desc="render";dur=40'.
+//
+std::int64_t ServerDuration(const std::string& serverTiming)
+{
+    double total = -1;
+    double longest = -1;
+
+    size_t start = 0;
+    while (start < serverTiming.size())
+    {
+        size_t end = serverTiming.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = serverTiming.size();
+        }
+        std::string metric = serverTiming.substr(start, end - start);
+        start = end + 1;
+
+        //
+        // The name, then parameters, each after a semicolon.
+        //
+        std::vector<std::string> parts;
+        std::istringstream fields(metric);
+        std::string field;
+        while (std::getline(fields, field, ';'))
+        {
+            field.erase(0, field.find_first_not_of(" \t"));
+            field.erase(field.find_last_not_of(" \t") + 1);
+            parts.push_back(field);
+        }
+        if (parts.empty())
+        {
+            continue;
+        }
+
+        double milliseconds = -1;
+        for (size_t i = 1; i < parts.size(); ++i)
+        {
+            if (parts[i].compare(0, 4, "dur=") == 0)
+            {
+                char* parsed = nullptr;
+                const char* value = parts[i].c_str() + 4;
+                double duration = std::strtod(value, &parsed);
+                if (parsed != value && duration >= 0)
+                {
+                    milliseconds = duration;
+                }
+            }
+        }
+        if (milliseconds < 0)
+        {
+            continue;
+        }
+
+        const std::string& name = parts[0];
+
+        if (name == "total")
+        {
+            total = milliseconds;
+        }
+        longest = std::max(longest, milliseconds);
+    }
+
+    double milliseconds = total >= 0 ? total : longest;
+    return milliseconds >= 0 ? static_cast<std::int64_t>(milliseconds * 1000 + 0.5) : -1;
+}
+
+
+class Curl
+{
+    struct CurlDeleter
+    {
+        void operator ()(CURL* curl)
+        {
+            curl_easy_cleanup(curl);
+        }
+    };
+    std::unique_ptr<CURL, CurlDeleter> _curl;
+
+    //
+    // We don't use std::unique_ptr here because curl_slist_append does not free
+    // the previous structure, and could change in the future to be implemented
+    // as a stack rather than a list (so that insertions don't walk the list).
+    //
+    struct headers_guard
+    {
+        curl_slist *value;
+
+        headers_guard()
+            :value(nullptr)
+        {}
+
+        ~headers_guard()
+        {
+            if (value != nullptr)
+            {
+                curl_slist_free_all(value);
+            }
+        }
+    } _headers;
+
+    char _errbuf[CURL_ERROR_SIZE];
+    std::string _url;
+    std::string _body;
+    std::string _response;
+    std::string _handshakeError;
+    bool _shareTrustStore;
+
+    //
+    // Whether the request last configured had the pinned certificates
+    // checked, and what its response's headers say of it.
+    //
+    PinCheck _pinCheck;
+    std::string _requestId;
+    std::string _serverTiming;
+
+    std::string _caFile;
+    std::string _caPath;
+
+    //
+    // Performs the transfers of Warm and GetEntitlement, and keeps their
+    // connection; created by the first.
+    //
+    std::unique_ptr<CURLM, MultiDeleter> _multi;
+
+public:
+    class CurlException : public Exception
+    {
+        CURLcode _code;
+
+    public:
+        CurlException(CURLcode code, const std::string& message)
+            : Exception(message)
+            , _code(code)
+        {}
+
+        CurlException(CURLcode code, const char *message)
+            : Exception(message)
+            , _code(code)
+        {}
+
+        CURLcode GetCode() const
+        {
+            return _code;
+        }
+    };
+
+private:
+    void ThrowIfCurlError(CURLcode res)
+    {
+        if (res == CURLE_OK)
+        {
+            return;
+        }
+
+        std::ostringstream what;
+        what << "libcurl_error " << res << ": " << _errbuf;
+        throw CurlException(res, what.str());
+    }
+
+    static int WarmupProgressCallback(void* /*context*/, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+    {
+        return s_abandonWarmups ? 1 : 0;
+    }
+
+    static int CancellationProgressCallback(void* context, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+    {
+        return static_cast<Cancellation*>(context)->IsCancelled() ? 1 : 0;
+    }
+
+    static size_t WriteCallback(char* ptr, size_t size, size_t nmemb, void* context)
+    {
+        Curl* self = static_cast<Curl*>(context);
+        try
+        {
+            size_t nbytes = size * nmemb;
+            self->_response.append(ptr, nbytes);
+            return nbytes;
+        }
+        catch (const std::exception&)
+        {
+            return 0;
+        }
+    }
+
+    //
+    // Keeps the headers of the response that attribute its latency.  Those
+    // of an interim response, such as 100 Continue, are dropped at the status
+    // line of the next.
+    //
+    static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* context)
+    {
+        Curl* self = static_cast<Curl*>(context);
+        size_t nbytes = size * nitems;
+        try
+        {
+            std::string value;
+            if (nbytes > 5 && std::strncmp(buffer, "HTTP/", 5) == 0)
+            {
+                self->_requestId.clear();
+                self->_serverTiming.clear();
+            }
+            else if (MatchHeader(buffer, nbytes, "request-id", value))
+            {
+                self->_requestId = std::move(value);
+            }
+            else if (MatchHeader(buffer, nbytes, "server-timing", value))
+            {
+                //
+                // The header may be repeated, as one list.
+                //
+                if (!self->_serverTiming.empty())
+                {
+                    self->_serverTiming += ", ";
+                }
+                self->_serverTiming += value;
+            }
+        }
+        catch (const std::exception&)
+        {
+            //
+            // Attributing latency is not worth failing the transfer for.
+            //
+        }
+        return nbytes;
+    }
+
+    //
+    // Runs OpenSSL's chain validation, then the pinned certificate checks, as
+    // part of the TLS handshake.  Checking here rather than after the transfer
+    // means the token is never sent to a server that fails the checks, and
+    // that connections reused by later transfers (for which libcurl reports no
+    // certificate information) were pinned when they were established.
+    //
+    static int VerifyCallback(X509_STORE_CTX* ctx, void* arg)
+    {
+        Curl* self = static_cast<Curl*>(arg);
+
+        if (X509_verify_cert(ctx) != 1)
+        {
+            //
+            // libcurl reports the chain validation error.
+            //
+            return 0;
+        }
+
+        try
+        {
+            VerifyCertificateChain(::GetVerifiedChain(ctx), self->_url);
+        }
+        catch (const std::exception& e)
+        {
+            self->_handshakeError = e.what();
+            self->_pinCheck = PinCheck::Failed;
+            X509_STORE_CTX_set_error(ctx, X509_V_ERR_APPLICATION_VERIFICATION);
+            return 0;
+        }
+
+        self->_pinCheck = PinCheck::Passed;
+        return 1;
+    }
+
+    static CURLcode OpenSSLContextCallback(CURL* /*curl*/, void* ssl_ctx, void* userptr)
+    {
+        SSL_CTX* ctx = static_cast<SSL_CTX*>(ssl_ctx);
+        Curl* self = static_cast<Curl*>(userptr);
+
+        try
+        {
+            if (self->_shareTrustStore)
+            {
+                //
+                // The context takes the reference acquired, and frees the
+                // store libcurl would have populated.
+                //
+                SSL_CTX_set_cert_store(ctx, AcquireTrustStore(self->_caFile, self->_caPath));
+            }
+#ifdef _WIN32
+            else
+            {
+                //
+                // Populate the OpenSSL certificate store with the system root certificates.
+                //
+                AddRootCertificates(SSL_CTX_get_cert_store(ctx));
+            }
+#endif  // _WIN32
+        }
+        catch (const std::exception& e)
+        {
+            self->_handshakeError = e.what();
+            return CURLE_SSL_CACERT_BADFILE;
+        }
+
+        SSL_CTX_set_cert_verify_callback(ctx, VerifyCallback, userptr);
+
+        //
+        // The verify callback refers to the transfer that opened the
+        // connection, so never verify a second chain on the same connection.
+        //
+#ifdef SSL_OP_NO_RENEGOTIATION
+        SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#endif
+
+        return CURLE_OK;
+    }
+
+    //
+    // The handle may be kept for a later check, which must not refer to
+    // cancellation.
+    //
+    void ForgetCancellation(Cancellation* cancellation)
+    {
+        if (cancellation != nullptr)
+        {
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOPROGRESS, 1L));
+        }
+    }
+
+public:
+    Curl()
+        : _curl(NewEasyHandle())
+        , _shareTrustStore(false)
+        , _pinCheck(PinCheck::NotMade)
+    {
+        memset(_errbuf, 0, sizeof(_errbuf));
+
+        if (_curl == nullptr)
+        {
+            throw Exception("curl_easy_init failed.");
+        }
+
+        curl_easy_setopt(_curl.get(), CURLOPT_ERRORBUFFER, _errbuf);
+
+        //
+        // Require TLSv1_2 always.
+        //
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_USE_SSL, CURLUSESSL_ALL));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2));
+        //
+        // During testing, if the certificate chain leaves something to be
+        // desired, disable the following two options by setting them to 0.
+        //
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_VERIFYHOST, 2));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_VERIFYPEER, 1));
+
+        //
+        // Set context for write callback.
+        //
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_WRITEDATA, this));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_HEADERDATA, this));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_HEADERFUNCTION, HeaderCallback));
+
+        //
+        // Set the OpenSSL SSL_CTX callback in order to check the pinned
+        // certificates during the handshake and to give the connection the
+        // shared store of CA certificates (which, on Windows, includes the
+        // system root certificates).
+        //
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_CTX_FUNCTION, OpenSSLContextCallback));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_SSL_CTX_DATA, this));
+
+        // Allow overriding the default connection timeout of 300 seconds.
+        const char* env = std::getenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT");
+        long timeout = 0;
+        if (env != nullptr)
+        {
+            timeout = std::strtol(env, nullptr, 10);
+        }
+        if (timeout <= 0 || timeout == LONG_MAX)
+        {
+            timeout = 300L;
+        }
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CONNECTTIMEOUT, timeout));
+
+        //
+        // Allow overriding the CA bundle used to validate the server's
+        // certificate chain, so that test servers using a private root
+        // certificate can be reached.
+        //
+        const char* caInfo = std::getenv("AZ_BATCH_SES_CURLOPT_CAINFO");
+        if (caInfo != nullptr && *caInfo != '\0')
+        {
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CAINFO, caInfo));
+        }
+
+#if LIBCURL_VERSION_NUM >= 0x075400
+        //
+        // Share one store of the CA certificates between all connections
+        // rather than have libcurl load them into each.  This needs libcurl
+        // to say where its own defaults are, which it does from 7.84.0; the
+        // libcurl loaded at run time may be older than the headers.
+        //
+        if (LibcurlVersion() >= 0x075400)
+        {
+            char* defaultCaFile = nullptr;
+            char* defaultCaPath = nullptr;
+            ThrowIfCurlError(curl_easy_getinfo(_curl.get(), CURLINFO_CAINFO, &defaultCaFile));
+            ThrowIfCurlError(curl_easy_getinfo(_curl.get(), CURLINFO_CAPATH, &defaultCaPath));
+
+            if (caInfo != nullptr && *caInfo != '\0')
+            {
+                _caFile = caInfo;
+            }
+            else if (defaultCaFile != nullptr)
+            {
+                _caFile = defaultCaFile;
+            }
+
+            if (defaultCaPath != nullptr)
+            {
+                _caPath = defaultCaPath;
+            }
+
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CAINFO, nullptr));
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CAPATH, nullptr));
+            _shareTrustStore = true;
+        }
+#endif
+    }
+
+    CURL* Handle() const
+    {
+        return _curl.get();
+    }
+
+    //
+    // Configures the handle to send request, which must be for a server
+    // whose URL has already been validated: over HTTPS or, given socketPath,
+    // as plain HTTP over that Unix domain socket.  The request is sent by
+    // Perform or by adding the handle to a multi handle.
+    //
+    void Configure(const TransportRequest& request, const std::string& socketPath)
+    {
+        //
+        // The handle may have been used before, to warm up its connection or
+        // for an earlier request.
+        //
+        _errbuf[0] = '\0';
+        _response.clear();
+        _handshakeError.clear();
+        _requestId.clear();
+        _serverTiming.clear();
+        _pinCheck = PinCheck::NotMade;
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOBODY, 0L));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOPROGRESS, 1L));
+
+        _url = request.url;
+        std::string requestUrl = socketPath.empty()
+            ? request.url + request.path
+            : "http://" + request.url.substr(std::strlen("https://")) + request.path;
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_URL, requestUrl.c_str()));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_CUSTOMREQUEST, request.method));
+#if LIBCURL_VERSION_NUM >= 0x072800
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_UNIX_SOCKET_PATH, socketPath.empty() ? nullptr : socketPath.c_str()));
+#else
+        if (!socketPath.empty())
+        {
+            throw Exception("Unix domain sockets need libcurl 7.40.0 or later.");
+        }
+#endif
+
+        if (_headers.value != nullptr)
+        {
+            curl_slist_free_all(_headers.value);
+            _headers.value = nullptr;
+        }
+
+        for (const std::string& header : request.headers)
+        {
+            curl_slist* headers = curl_slist_append(_headers.value, header.c_str());
+            if (headers == nullptr)
+            {
+                throw Exception("Failed to allocate request header");
+            }
+            _headers.value = headers;
+        }
+
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_HTTPHEADER, _headers.value));
+
+        //
+        // We need to ensure the payload remains resident for the duration of
+        // the transfer.  We store it in a member here rather than have
+        // libcurl buffer it for us (by using CURLOPT_COPYPOSTFIELDS).
+        //
+        _body = request.body;
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_POSTFIELDS, _body.c_str()));
+    }
+
+    //
+    // Limits how long the transfer may take in all; zero for no limit.
+    //
+    void SetTimeout(std::chrono::milliseconds timeout)
+    {
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count())));
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x073D00
+    //
+    // Returns one of the durations libcurl measures of the last transfer, or
+    // zero if it has none.
+    //
+    std::int64_t Microseconds(CURLINFO info)
+    {
+        curl_off_t value = 0;
+        if (curl_easy_getinfo(_curl.get(), info, &value) != CURLE_OK)
+        {
+            return 0;
+        }
+        return value;
+    }
+#endif
+
+    //
+    // Returns how long, in microseconds, the server took to start responding
+    // once the last request was sent, or zero if that is not known.
+    //
+    std::int64_t ServerLatency()
+    {
+#if LIBCURL_VERSION_NUM >= 0x073D00
+        return Microseconds(CURLINFO_STARTTRANSFER_TIME_T) - Microseconds(CURLINFO_PRETRANSFER_TIME_T);
+#else
+        double firstByte = 0;
+        double sent = 0;
+        if (curl_easy_getinfo(_curl.get(), CURLINFO_STARTTRANSFER_TIME, &firstByte) != CURLE_OK
+            || curl_easy_getinfo(_curl.get(), CURLINFO_PRETRANSFER_TIME, &sent) != CURLE_OK)
+        {
+            return 0;
+        }
+        return static_cast<std::int64_t>((firstByte - sent) * 1000000);
+#endif
+    }
+
+    //
+    // Fills in response with the outcome of the transfer last performed,
+    // without throwing: a failure to get a response, or the response, whose
+    // body the handle no longer needs.
+    //
+    void Complete(CURLcode result, Cancellation* cancellation, TransportResponse& response)
+    {
+        response.curl_code = result;
+        response.pin_check = _pinCheck;
+        response.request_id.swap(_requestId);
+        response.server_timing.swap(_serverTiming);
+#if LIBCURL_VERSION_NUM >= 0x073D00
+        response.name_lookup_us = Microseconds(CURLINFO_NAMELOOKUP_TIME_T);
+        response.connect_us = Microseconds(CURLINFO_CONNECT_TIME_T);
+        response.tls_handshake_us = Microseconds(CURLINFO_APPCONNECT_TIME_T);
+        response.first_byte_us = Microseconds(CURLINFO_STARTTRANSFER_TIME_T);
+        response.total_us = Microseconds(CURLINFO_TOTAL_TIME_T);
+#endif
+        response.server_latency_us = ServerLatency();
+
+        if (result != CURLE_OK && IsCancelled(cancellation))
+        {
+            response.category = ErrorCategory::Cancelled;
+            return;
+        }
+
+        if (!_handshakeError.empty())
+        {
+            //
+            // Set either by the pinned certificate checks or, with
+            // CURLE_SSL_CACERT_BADFILE, if the trusted CA certificates could
+            // not be loaded.
+            //
+            response.category = result == CURLE_SSL_CACERT_BADFILE ? ErrorCategory::Transport : ErrorCategory::PinFailure;
+            response.error = _handshakeError;
+            return;
+        }
+
+        if (result == CURLE_OK)
+        {
+            result = curl_easy_getinfo(_curl.get(), CURLINFO_RESPONSE_CODE, &response.http_status);
+            response.curl_code = result;
+        }
+
+        if (result != CURLE_OK)
+        {
+            response.category = result == CURLE_OPERATION_TIMEDOUT ? ErrorCategory::Timeout : ErrorCategory::Transport;
+            response.http_status = 0;
+
+            std::ostringstream what;
+            what << "libcurl_error " << result << ": " << _errbuf;
+            response.error = what.str();
+            return;
+        }
+
+        response.body.swap(_response);
+    }
+
+    //
+    // Connects to the server at url, which must already have been validated,
+    // completing the TLS handshake (and so the pinned certificate checks)
+    // with a HEAD request that sends no token.  The connection is left open
+    // for a later Configure and transfer on the same handle to reuse.
+    //
+    CURLcode Warm(const std::string& url)
+    {
+        _url = url;
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_URL, url.c_str()));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOBODY, 1L));
+#if LIBCURL_VERSION_NUM >= 0x072000
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_XFERINFOFUNCTION, WarmupProgressCallback));
+        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOPROGRESS, 0L));
+#endif
+
+        CURLcode result = Perform(nullptr);
+        if (result == CURLE_OK && !_handshakeError.empty())
+        {
+            result = CURLE_PEER_FAILED_VERIFICATION;
+        }
+        return result;
+    }
+
+    //
+    // Performs the transfer the handle is set up for, as curl_easy_perform
+    // does; aborts it with CURLE_ABORTED_BY_CALLBACK if cancelled.  If the
+    // libcurl the library runs with is 7.68.0 or later, the transfer is made
+    // through a multi handle of the Curl's own, whose wait for the server a
+    // cancellation cuts short at once; otherwise, a cancellation takes effect
+    // the next time libcurl calls the progress callback, at least once a
+    // second.
+    //
+    CURLcode Perform(Cancellation* cancellation)
+    {
+        if (cancellation != nullptr)
+        {
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_XFERINFOFUNCTION, CancellationProgressCallback));
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_XFERINFODATA, cancellation));
+            ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_NOPROGRESS, 0L));
+        }
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+        if (!CanWakeMultiHandles())
+        {
+            CURLcode result = curl_easy_perform(_curl.get());
+            ForgetCancellation(cancellation);
+            return result;
+        }
+
+        if (_multi == nullptr)
+        {
+            _multi.reset(NewMultiHandle());
+            if (_multi == nullptr)
+            {
+                throw Exception("curl_multi_init failed.");
+            }
+        }
+
+        ThrowIfMultiError(curl_multi_add_handle(_multi.get(), _curl.get()));
+
+        CURLcode result = CURLE_OK;
+        try
+        {
+            Cancellation::Wakeup wakeup(cancellation, [this]() { curl_multi_wakeup(_multi.get()); });
+
+            bool done = false;
+            while (!done)
+            {
+                int running;
+                ThrowIfMultiError(curl_multi_perform(_multi.get(), &running));
+
+                int queued;
+                CURLMsg* msg;
+                while ((msg = curl_multi_info_read(_multi.get(), &queued)) != nullptr)
+                {
+                    if (msg->msg == CURLMSG_DONE)
+                    {
+                        result = msg->data.result;
+                        done = true;
+                    }
+                }
+
+                if (!done)
+                {
+                    if (IsCancelled(cancellation))
+                    {
+                        //
+                        // Removing the handle abandons the transfer.
+                        //
+                        result = CURLE_ABORTED_BY_CALLBACK;
+                        break;
+                    }
+                    WaitForTransfers(_multi.get(), 1000);
+                }
+            }
+        }
+        catch (...)
+        {
+            curl_multi_remove_handle(_multi.get(), _curl.get());
+            throw;
+        }
+        curl_multi_remove_handle(_multi.get(), _curl.get());
+#else
+        CURLcode result = curl_easy_perform(_curl.get());
+#endif
+
+        ForgetCancellation(cancellation);
+        return result;
+    }
+};
+
+
+//
+// A request as built for a transport, with what the flight recorder keeps of
+// it.
+//
+struct RequestContext
+{
+    TransportRequest request;
+    std::string application;
+    TokenDigest digest;
+    std::string clientRequestId;
+    std::chrono::system_clock::time_point started;
+};
+
+//
+// Builds a request for path on the server at url, which must already have
+// been validated: a POST of body, unless method names another.  application
+// and digest describe the request to the flight recorder.
+//
+RequestContext NewRequest(
+    const std::string& url,
+    const std::string& path,
+    const char* method,
+    std::string body,
+    const std::string& application,
+    const TokenDigest& digest)
+{
+    RequestContext context;
+    context.request.url = url;
+    context.request.path = path;
+    context.request.method = method;
+    context.request.body = std::move(body);
+
+    //
+    // A new id for every attempt, so that each can be found in the server's
+    // logs; the Batch service echoes it back when asked to.
+    //
+    context.clientRequestId = NewClientRequestId();
+    context.request.headers.reserve(3);
+    context.request.headers.push_back("Content-Type: application/json; odata=minimalmetadata");
+    context.request.headers.push_back("client-request-id: " + context.clientRequestId);
+    context.request.headers.push_back("return-client-request-id: true");
+
+    context.application = application;
+    context.digest = digest;
+    return context;
+}
+
+//
+// The api-version of checks, which every version of the service supports.
+//
+const char* const CheckApiVersion = "api-version=2017-05-01.5.0";
+
+//
+// Builds a request for an entitlement from the server at url, which must
+// already have been validated.
+//
+RequestContext CheckRequest(
+    const std::string& url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement)
+{
+    return NewRequest(
+        url,
+        std::string("softwareEntitlements?") + CheckApiVersion,
+        nullptr,
+        BuildRequestBody(entitlement_token, requested_entitlement),
+        requested_entitlement,
+        DigestToken(entitlement_token));
+}
+
+//
+// True if the response is a 403 saying the application was denied, as
+// opposed to the token being rejected.
+//
+bool IsDenial(long code, const std::string& response)
+{
+    if (code != 403)
+    {
+        return false;
+    }
+
+    try
+    {
+        return ExtractValue(response, "code") == "EntitlementDenied";
+    }
+    catch (const nlohmann::detail::exception&)
+    {
+        return false;
+    }
+}
+
+//
+// The outcome of an error response whose body says why the server refused
+// the request.
+//
+EntitlementResult Rejected(TransportResponse& response)
+{
+    ErrorCategory category = IsDenial(response.http_status, response.body) ? ErrorCategory::Denied : ErrorCategory::BadRequest;
+    return Failed(category, Failure::ResponseBody, response.http_status, CURLE_OK, std::move(response.body));
+}
+
+//
+// The outcome of a response to a request for an entitlement.
+//
+EntitlementResult Approval(TransportResponse& response)
+{
+    long code = response.http_status;
+    switch (code)
+    {
+    case 200:
+        try
+        {
+            return Granted(std::unique_ptr<Entitlement>(new Entitlement(response.body)));
+        }
+        catch (const nlohmann::detail::exception& e)
+        {
+            return Failed(ErrorCategory::UnexpectedResponse, Failure::Message, code, CURLE_OK, std::string("Unreadable entitlement: ") + e.what());
+        }
+
+    case 400:
+    case 403:
+        return Rejected(response);
+
+    default:
+        return Failed(ErrorCategory::UnexpectedResponse, Failure::Status, code, CURLE_OK, std::string());
+    }
+}
+
+//
+// Returns the outcome of a request, without throwing: a failure to get a
+// response, or what interpret makes of the response.
+//
+template <typename Interpret>
+EntitlementResult Outcome(TransportResponse& response, Interpret interpret)
+{
+    CURLcode code = static_cast<CURLcode>(response.curl_code);
+    switch (response.category)
+    {
+    case ErrorCategory::None:
+        return interpret(response);
+
+    case ErrorCategory::Cancelled:
+        return Cancelled(code);
+
+    default:
+        return Failed(response.category, Failure::Message, 0, code, response.error);
+    }
+}
+
+//
+// Adds a request, with the outcome of its exchange, to the flight recorder.
+//
+void Record(
+    const RequestContext& context,
+    unsigned int attempt,
+    const TransportResponse& response,
+    const EntitlementResult& result)
+{
+    RequestRecord record;
+    record.started_us = std::chrono::duration_cast<std::chrono::microseconds>(context.started.time_since_epoch()).count();
+    record.attempt = attempt;
+    record.category = result.category;
+    record.curl_code = result.curl_code;
+    record.http_status = result.http_status;
+    record.pin_check = response.pin_check;
+    record.name_lookup_us = response.name_lookup_us;
+    record.connect_us = response.connect_us;
+    record.tls_handshake_us = response.tls_handshake_us;
+    record.first_byte_us = response.first_byte_us;
+    record.total_us = response.total_us;
+    record.client_request_id = context.clientRequestId;
+    record.request_id = response.request_id;
+
+    std::int64_t server = ServerDuration(response.server_timing);
+    if (server >= 0)
+    {
+        record.server_us = server;
+        record.network_us = std::max<std::int64_t>(response.server_latency_us - server, 0);
+    }
+    RecordRequest(context.request.url, context.application, context.digest, record);
+}
+
+#ifdef _WIN32
+struct WinHttpDeleter
+{
+    void operator()(HINTERNET h)
+    {
+        WinHttpCloseHandle(h);
+    }
+};
+
+typedef std::unique_ptr<void, WinHttpDeleter> WinHttpHandle;
+
+//
+// OpenSSL does not hook into the Windows Automatic Root Certificates Update process.
+// This results in certificate validation failures, so we perform a dummy connection
+// using WinHTTP which will setup the root cert store correctly.
+//
+void EnsureRootCertsArePopulated(const std::string& url)
+{
+    std::string prefix("https://");
+    size_t start = url.rfind(prefix, 0);
+    if (start == std::string::npos)
+    {
+        throw Exception("Malformed URL: " + url);
+    }
+
+    start += prefix.length();
+    size_t end = url.find("/", start);
+    std::string temp;
+    if (end == std::string::npos)
+    {
+        temp = url.substr(start);
+    }
+    else
+    {
+        temp = url.substr(start, end - start);
+    }
+
+    std::wstring hostname(temp.cbegin(), temp.cend());
+
+    WinHttpHandle hSession(
+        WinHttpOpen(
+            L"Azure Batch Software Entitlement Service client",
+            WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY,
+            WINHTTP_NO_PROXY_NAME,
+            WINHTTP_NO_PROXY_BYPASS,
+            0)
+    );
+    ThrowIfWin32Error(hSession == nullptr);
+
+    WinHttpHandle hConn(
+        WinHttpConnect(hSession.get(), hostname.c_str(), INTERNET_DEFAULT_HTTPS_PORT, 0)
+    );
+    ThrowIfWin32Error(hConn == nullptr);
+
+    WinHttpHandle hRequest(
+        WinHttpOpenRequest(
+            hConn.get(),
+            nullptr,
+            nullptr,
+            nullptr,
+            WINHTTP_NO_REFERER,
+            WINHTTP_DEFAULT_ACCEPT_TYPES,
+            WINHTTP_FLAG_SECURE)
+    );
+    ThrowIfWin32Error(hRequest == nullptr);
+
+    ThrowIfWin32Error(TRUE != WinHttpSendRequest(
+        hRequest.get(),
+        WINHTTP_NO_ADDITIONAL_HEADERS,
+        0,
+        WINHTTP_NO_REQUEST_DATA,
+        0,
+        0,
+        0)
+    );
+}
+#endif
+
+
+//
+// Validates the URL of an entitlement server, returning it with a trailing
+// slash so that the entitlement route can be appended.
+//
+std::string NormalizeUrl(std::string url)
+{
+    if (url.rfind("https://", 0) == std::string::npos)
+    {
+        throw Exception("Invalid input URL: must start with \"https://\"");
+    }
+
+    if (url.find('?') != std::string::npos)
+    {
+        throw Exception("Invalid input URL: must not contain any query params");
+    }
+
+    size_t pos = url.find('/', 8);
+    if (pos < url.length() - 1)
+    {
+        pos = url.find('/', pos + 1);
+        if (pos < url.length() - 1)
+        {
+            throw Exception("Invalid input URL: should not include more than one slash after the hostname (excluding trailing slash).");
+        }
+    }
+
+    if (pos == std::string::npos)
+    {
+        url += '/';
+    }
+
+    return url;
+}
+
+
+//
+// libcurl closes connections idle for longer than this (CURLOPT_MAXAGE_CONN)
+// rather than reuse them.
+//
+const std::chrono::seconds MaxIdleConnectionAge(118);
+
+
+//
+// Handles kept after a check, or opened by Warmup, so that the next check
+// against the same server reuses their connection; at most one per URL.  A
+// handle is only ever used by one thread at a time: it is taken out of the
+// pool for each check.
+//
+class ConnectionPool
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct IdleConnection
+    {
+        std::unique_ptr<Curl> curl;
+        Clock::time_point lastUsed;
+    };
+
+    std::mutex _lock;
+    std::condition_variable _warmupFinished;
+    std::map<std::string, IdleConnection> _idle;
+    std::vector<std::string> _warming;
+
+    bool IsWarming(const std::string& url) const
+    {
+        return std::find(_warming.cbegin(), _warming.cend(), url) != _warming.cend();
+    }
+
+    void Park(const std::string& url, std::unique_ptr<Curl>& curl)
+    {
+        IdleConnection& idle = _idle[url];
+        idle.curl.swap(curl);
+        idle.lastUsed = Clock::now();
+    }
+
+    void WarmUp(std::string url)
+    {
+        std::unique_ptr<Curl> curl;
+        try
+        {
+            curl.reset(new Curl());
+            CURLcode result = curl->Warm(url);
+#ifdef _WIN32
+            if (result == CURLE_SSL_CACERT && !s_abandonWarmups)
+            {
+                EnsureRootCertsArePopulated(url);
+                result = curl->Warm(url);
+            }
+#endif
+            if (result != CURLE_OK)
+            {
+                curl.reset();
+            }
+        }
+        catch (const std::exception&)
+        {
+            curl.reset();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (curl && !s_abandonWarmups)
+            {
+                //
+                // Any handle replaced is closed below, outside the lock.
+                //
+                Park(url, curl);
+            }
+        }
+
+        //
+        // Closed before the warm-up is seen to finish, so that Cleanup does
+        // not release libcurl while it is still in use.
+        //
+        curl.reset();
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _warming.erase(std::find(_warming.begin(), _warming.end(), url));
+        _warmupFinished.notify_all();
+    }
+
+public:
+    //
+    // Returns the handle kept for url, if any, first waiting for a warm-up
+    // of url in progress to finish unless cancelled.
+    //
+    std::unique_ptr<Curl> Take(const std::string& url, Cancellation* cancellation)
+    {
+        std::unique_ptr<Curl> curl;
+
+        Cancellation::Wakeup wakeup(cancellation, [this]()
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _warmupFinished.notify_all();
+        });
+
+        std::unique_lock<std::mutex> lock(_lock);
+        _warmupFinished.wait(lock, [this, &url, cancellation]() { return !IsWarming(url) || IsCancelled(cancellation); });
+        if (IsWarming(url))
+        {
+            return curl;
+        }
+
+        auto idle = _idle.find(url);
+        if (idle != _idle.end())
+        {
+            curl.swap(idle->second.curl);
+            _idle.erase(idle);
+        }
+        return curl;
+    }
+
+    //
+    // Keeps a handle whose last transfer left its connection usable.
+    //
+    void Return(const std::string& url, std::unique_ptr<Curl> curl)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Park(url, curl);
+    }
+
+    void Warmup(const std::string& url)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        if (IsWarming(url))
+        {
+            return;
+        }
+
+        auto idle = _idle.find(url);
+        if (idle != _idle.end() && Clock::now() - idle->second.lastUsed < MaxIdleConnectionAge)
+        {
+            return;
+        }
+
+        _warming.push_back(url);
+        try
+        {
+            std::thread(&ConnectionPool::WarmUp, this, url).detach();
+        }
+        catch (const std::system_error&)
+        {
+            //
+            // Warming up is only ever an optimization.
+            //
+            _warming.pop_back();
+        }
+    }
+
+    //
+    // Abandons warm-ups in progress, waits for them to finish and closes
+    // every connection kept.
+    //
+    void Close()
+    {
+        std::map<std::string, IdleConnection> idle;
+        {
+            s_abandonWarmups = true;
+
+            std::unique_lock<std::mutex> lock(_lock);
+            _warmupFinished.wait(lock, [this]() { return _warming.empty(); });
+            idle.swap(_idle);
+
+            s_abandonWarmups = false;
+        }
+    }
+};
+
+//
+// Never destroyed, so that connections are not closed by static destructors
+// after OpenSSL may have been cleaned up; Cleanup closes them.
+//
+ConnectionPool* const s_connections = new ConnectionPool();
+
+
+//
+// Sends a request through libcurl: over HTTPS, on the connection kept for
+// its server if there is one or, given socketPath, as plain HTTP over that
+// Unix domain socket.
+//
+void SendOverCurl(
+    const TransportRequest& request,
+    TransportResponse& response,
+    Cancellation* cancellation,
+    const std::string& socketPath)
+{
+    std::string socketKey;
+    if (!socketPath.empty())
+    {
+        socketKey = "unix:" + socketPath + " " + request.url;
+    }
+    const std::string& key = socketPath.empty() ? request.url : socketKey;
+
+    std::unique_ptr<Curl> curl = s_connections->Take(key, cancellation);
+    if (IsCancelled(cancellation))
+    {
+        if (curl)
+        {
+            s_connections->Return(key, std::move(curl));
+        }
+        response.category = ErrorCategory::Cancelled;
+        return;
+    }
+
+    if (!curl)
+    {
+        curl.reset(new Curl());
+    }
+
+    curl->Configure(request, socketPath);
+    CURLcode code = curl->Perform(cancellation);
+    curl->Complete(code, cancellation, response);
+
+    //
+    // A response, even a denial, leaves the connection open for the next
+    // request.
+    //
+    if (code == CURLE_OK && response.category != ErrorCategory::PinFailure)
+    {
+        s_connections->Return(key, std::move(curl));
+    }
+}
+
+
+//
+// Transports set by SetTransport, by server URL.  Only looked up once one
+// has been set, so that requests over libcurl take no lock for them.
+//
+std::mutex s_transportLock;
+std::map<std::string, std::shared_ptr<const Transport>> s_transports;
+std::atomic<bool> s_transportsSet(false);
+
+std::shared_ptr<const Transport> FindTransport(const std::string& url)
+{
+    std::shared_ptr<const Transport> transport;
+    if (!s_transportsSet)
+    {
+        return transport;
+    }
+
+    std::lock_guard<std::mutex> lock(s_transportLock);
+    auto found = s_transports.find(url);
+    if (found != s_transports.end())
+    {
+        transport = found->second;
+    }
+    return transport;
+}
+
+//
+// Sends a request through the transport set for its server, or libcurl over
+// HTTPS, records it, and returns what interpret makes of the response.
+//
+template <typename Interpret>
+EntitlementResult Exchange(
+    RequestContext& context,
+    unsigned int attempt,
+    Cancellation* cancellation,
+    TransportResponse& response,
+    Interpret interpret)
+{
+    context.started = std::chrono::system_clock::now();
+
+    std::shared_ptr<const Transport> transport = FindTransport(context.request.url);
+    if (transport)
+    {
+        (*transport)(context.request, response, cancellation);
+    }
+    else
+    {
+        SendOverCurl(context.request, response, cancellation, std::string());
+    }
+
+    EntitlementResult result = Outcome(response, interpret);
+    Record(context, attempt, response, result);
+    return result;
+}
+
+//
+// Requests an entitlement from the server at url, which must already have
+// been validated, once the check is admitted and has a slot.
+//
+EntitlementResult RequestEntitlement(
+    const std::string& url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int attempt,
+    Cancellation* cancellation)
+{
+    ConcurrencySlot slot;
+    if (!s_admission.Admit(cancellation) || !slot.Acquire(url, cancellation))
+    {
+        return Cancelled();
+    }
+
+    RequestContext context = CheckRequest(url, entitlement_token, requested_entitlement);
+    TransportResponse response;
+    EntitlementResult result = Exchange(context, attempt, cancellation, response, Approval);
+    slot.Release(LoadOf(result), response.server_latency_us);
+    return result;
+}
+
+//
+// Sends a request built as by NewRequest and returns what interpret makes of
+// the response.
+//
+template <typename Interpret>
+EntitlementResult Send(
+    const std::string& url,
+    const std::string& path,
+    const char* method,
+    std::string body,
+    const std::string& application,
+    const TokenDigest& digest,
+    Cancellation* cancellation,
+    Interpret interpret)
+{
+    RequestContext context = NewRequest(url, path, method, std::move(body), application, digest);
+    TransportResponse response;
+    return Exchange(context, 1, cancellation, response, interpret);
+}
+
+
+//
+// How long the entitlements granted to Prefetch are kept.
+//
+const std::chrono::minutes PrefetchLifetime(5);
+
+//
+// How long denials are kept, in seconds; see SetDenialLifetime.
+//
+std::atomic<long long> s_denialLifetime(0);
+
+//
+// The most outcomes kept at once.
+//
+const size_t MaxResults = 4096;
+
+
+//
+// Server URL, token and application of an entitlement check.
+//
+typedef std::tuple<std::string, std::string, std::string> CheckKey;
+
+
+//
+// Returns a copy of a result, for a second caller to take.
+//
+EntitlementResult Copy(const EntitlementResult& result)
+{
+    EntitlementResult copy;
+    if (result.entitlement)
+    {
+        copy.entitlement.reset(new Entitlement(*result.entitlement));
+    }
+    copy.category = result.category;
+    copy.http_status = result.http_status;
+    copy.curl_code = result.curl_code;
+    copy.cached = result.cached;
+    copy.describe = result.describe;
+    return copy;
+}
+
+
+//
+// Entitlements already granted, and applications recently denied, for
+// GetEntitlement to answer without contacting the server again.  At most
+// MaxResults are kept; when full, the one due to expire soonest makes way.
+//
+class ResultCache
+{
+    typedef std::chrono::steady_clock Clock;
+    typedef std::multimap<Clock::time_point, CheckKey> Expiries;
+
+    //
+    // entitlement is set for an entitlement granted; describe for a denial.
+    // expiry is the entry's place in _expiries.
+    //
+    struct Entry
+    {
+        std::shared_ptr<Entitlement> entitlement;
+        std::function<std::string()> describe;
+        long status;
+        Clock::time_point expires;
+        Expiries::iterator expiry;
+    };
+
+    std::mutex _lock;
+    std::map<CheckKey, Entry> _entries;
+
+    //
+    // The keys of _entries in the order they expire.
+    //
+    Expiries _expiries;
+
+    void Remove(std::map<CheckKey, Entry>::iterator entry)
+    {
+        _expiries.erase(entry->second.expiry);
+        _entries.erase(entry);
+    }
+
+    void RemoveExpired(Clock::time_point now)
+    {
+        while (!_expiries.empty() && _expiries.begin()->first <= now)
+        {
+            Remove(_entries.find(_expiries.begin()->second));
+        }
+    }
+
+    void Add(const CheckKey& key, Entry entry)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto now = Clock::now();
+        RemoveExpired(now);
+        if (entry.expires <= now)
+        {
+            return;
+        }
+
+        auto existing = _entries.find(key);
+        if (existing != _entries.end())
+        {
+            Remove(existing);
+        }
+        else if (_entries.size() >= MaxResults)
+        {
+            Remove(_entries.find(_expiries.begin()->second));
+        }
+
+        entry.expiry = _expiries.insert(Expiries::value_type(entry.expires, key));
+        _entries.insert(std::make_pair(key, entry));
+    }
+
+    //
+    // When an outcome kept for lifetime from now expires: no later than the
+    // exp claim of the token, if it can be read.
+    //
+    static Clock::time_point Expires(const std::string& entitlement_token, Clock::duration lifetime)
+    {
+        auto now = Clock::now();
+        TokenClaims claims = ReadTokenClaims(entitlement_token);
+        if (claims.decoded && claims.expires != 0)
+        {
+            long long remaining = claims.expires - static_cast<long long>(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+            if (remaining < std::chrono::duration_cast<std::chrono::seconds>(lifetime).count())
+            {
+                lifetime = std::chrono::seconds(std::max(remaining, 0LL));
+            }
+        }
+        return now + lifetime;
+    }
+
+public:
+    void Add(
+        const std::string& url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        const Entitlement& entitlement,
+        Clock::duration lifetime)
+    {
+        Entry entry;
+        entry.entitlement = std::make_shared<Entitlement>(entitlement);
+        entry.status = 200;
+        entry.expires = Expires(entitlement_token, lifetime);
+        Add(CheckKey(url, entitlement_token, requested_entitlement), entry);
+    }
+
+    //
+    // Keeps a denial for the lifetime set by SetDenialLifetime, if any;
+    // describe builds its message.  Neither outcome is kept beyond the
+    // token's expiry.
+    //
+    void AddDenial(
+        const std::string& url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        const std::function<std::string()>& describe)
+    {
+        std::chrono::seconds lifetime(s_denialLifetime.load());
+        if (lifetime <= std::chrono::seconds::zero())
+        {
+            return;
+        }
+
+        Entry entry;
+        entry.describe = describe;
+        entry.status = 403;
+        entry.expires = Expires(entitlement_token, lifetime);
+        Add(CheckKey(url, entitlement_token, requested_entitlement), entry);
+    }
+
+    //
+    // Sets result to a copy of the outcome kept, if there is one; returns
+    // false otherwise.
+    //
+    bool Find(
+        const std::string& url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        EntitlementResult& result)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        auto entry = _entries.find(CheckKey(url, entitlement_token, requested_entitlement));
+        if (entry == _entries.end())
+        {
+            return false;
+        }
+
+        if (entry->second.expires <= Clock::now())
+        {
+            Remove(entry);
+            return false;
+        }
+
+        if (entry->second.entitlement)
+        {
+            result.entitlement.reset(new Entitlement(*entry->second.entitlement));
+            result.category = ErrorCategory::None;
+        }
+        else
+        {
+            result.category = ErrorCategory::Denied;
+            result.describe = entry->second.describe;
+        }
+        result.http_status = entry->second.status;
+        result.cached = true;
+        return true;
+    }
+
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _entries.clear();
+        _expiries.clear();
+    }
+};
+
+ResultCache s_results;
+
+
+//
+// Checks in progress, so that GetEntitlement calls made at the same time for
+// the same URL, token and application share one request to the server.
+//
+class InFlightChecks
+{
+    struct Flight
+    {
+        Flight() : finished(false), waiters(0)
+        {
+        }
+
+        std::condition_variable done;
+        bool finished;
+        size_t waiters;
+        EntitlementResult result;
+        std::exception_ptr error;
+    };
+
+    std::mutex _lock;
+    std::map<CheckKey, std::shared_ptr<Flight>> _flights;
+
+public:
+    //
+    // Calls check, or if a call for the same key is already in progress,
+    // waits for that one instead.  Either way, returns the result it
+    // returned or rethrows the exception it threw.  A call cancelled while
+    // waiting returns at once; if instead the call waited for is cancelled,
+    // this one starts over.  checked is set if this call made the check
+    // itself.
+    //
+    template <typename Check>
+    EntitlementResult Join(const CheckKey& key, Check check, Cancellation* cancellation, bool& checked)
+    {
+        checked = false;
+        std::shared_ptr<Flight> waitingFor;
+        Cancellation::Wakeup wakeup(cancellation, [this, &waitingFor]()
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (waitingFor)
+            {
+                waitingFor->done.notify_all();
+            }
+        });
+
+        std::unique_lock<std::mutex> lock(_lock);
+
+        auto existing = _flights.find(key);
+        while (existing != _flights.end())
+        {
+            std::shared_ptr<Flight> flight = existing->second;
+            waitingFor = flight;
+            ++flight->waiters;
+            flight->done.wait(lock, [&flight, cancellation]() { return flight->finished || IsCancelled(cancellation); });
+            --flight->waiters;
+            waitingFor.reset();
+
+            if (!flight->finished)
+            {
+                return Cancelled();
+            }
+
+            if (flight->error)
+            {
+                lock.unlock();
+                std::rethrow_exception(flight->error);
+            }
+            if (flight->result.category != ErrorCategory::Cancelled)
+            {
+                lock.unlock();
+                return Copy(flight->result);
+            }
+
+            existing = _flights.find(key);
+        }
+
+        std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+        _flights[key] = flight;
+        lock.unlock();
+        checked = true;
+
+        EntitlementResult result;
+        std::exception_ptr error;
+        try
+        {
+            result = check();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        //
+        // No caller can join once the flight is removed, so only those
+        // already waiting need a copy of the result.
+        //
+        lock.lock();
+        _flights.erase(key);
+        if (flight->waiters != 0)
+        {
+            flight->result = Copy(result);
+            flight->error = error;
+        }
+        flight->finished = true;
+        flight->done.notify_all();
+        lock.unlock();
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        return result;
+    }
+};
+
+InFlightChecks s_inFlight;
+
+
+//
+// The servers a check may be sent to: a single URL, or the endpoints of an
+// EndpointSet.  key names them in the caches.
+//
+struct Servers
+{
+    std::string key;
+    std::vector<std::string> urls;
+    std::vector<double> weights;
+};
+
+
+//
+// Tracks the latency and error rate of each endpoint checked through an
+// EndpointSet, as moving averages, to choose where to send the next check.
+//
+class EndpointHealth
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stats
+    {
+        Stats() : latency(-1), errors(0)
+        {
+        }
+
+        //
+        // Of responses, in seconds; negative until the first response.
+        //
+        double latency;
+
+        //
+        // Between 0 and 1.
+        //
+        double errors;
+
+        Clock::time_point lastAttempt;
+    };
+
+    //
+    // Weight of the latest check in each moving average.
+    //
+    static double Smoothing()
+    {
+        return 0.3;
+    }
+
+    //
+    // An endpoint whose error rate is at or above this is avoided: a single
+    // failure reaches it, and a single success brings it back below.
+    //
+    static double Unhealthy()
+    {
+        return 0.25;
+    }
+
+    //
+    // How long an avoided endpoint waits before being tried again.
+    //
+    static Clock::duration ProbeInterval()
+    {
+        return std::chrono::seconds(30);
+    }
+
+    std::mutex _lock;
+    std::map<std::string, Stats> _stats;
+
+public:
+    void Record(const std::string& url, Clock::duration elapsed, bool failed)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        Stats& stats = _stats[url];
+        stats.lastAttempt = Clock::now();
+        stats.errors += Smoothing() * ((failed ? 1.0 : 0.0) - stats.errors);
+        if (!failed)
+        {
+            double seconds = std::chrono::duration<double>(elapsed).count();
+            stats.latency = stats.latency < 0 ? seconds : stats.latency + Smoothing() * (seconds - stats.latency);
+        }
+    }
+
+    //
+    // Returns the index of the endpoint to check next: of those not already
+    // failed during this check, the healthy one with the lowest latency
+    // divided by its weight, preferring those listed first.  Endpoints yet
+    // to respond count as the fastest, so that each is measured.  If none is
+    // healthy, returns the one failing least often.
+    //
+    size_t Choose(const Servers& servers, const std::vector<bool>& failed)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        Clock::time_point now = Clock::now();
+
+        size_t best = servers.urls.size();
+        double bestCost = 0;
+        size_t leastFailing = servers.urls.size();
+        double leastErrors = 0;
+        for (size_t i = 0; i < servers.urls.size(); ++i)
+        {
+            if (failed[i])
+            {
+                continue;
+            }
+
+            Stats stats;
+            auto found = _stats.find(servers.urls[i]);
+            if (found != _stats.end())
+            {
+                stats = found->second;
+            }
+
+            if (leastFailing == servers.urls.size() || stats.errors < leastErrors)
+            {
+                leastFailing = i;
+                leastErrors = stats.errors;
+            }
+
+            bool healthy = stats.errors < Unhealthy() || now - stats.lastAttempt >= ProbeInterval();
+            if (!healthy)
+            {
+                continue;
+            }
+
+            double cost = stats.latency < 0 ? 0 : stats.latency / servers.weights[i];
+            if (best == servers.urls.size() || cost < bestCost)
+            {
+                best = i;
+                bestCost = cost;
+            }
+        }
+
+        return best != servers.urls.size() ? best : leastFailing;
+    }
+};
+
+EndpointHealth s_health;
+
+
+//
+// True if another endpoint might answer a check that failed this way.
+//
+bool CanFailOver(ErrorCategory category)
+{
+    return category == ErrorCategory::Transport
+        || category == ErrorCategory::Timeout
+        || category == ErrorCategory::UnexpectedResponse
+        || category == ErrorCategory::PinFailure;
+}
+
+
+//
+// Keeps the dumps of checks failing at the same time apart.
+//
+std::mutex s_dumpLock;
+
+//
+// Appends the flight recorder's requests to the file named by
+// AZ_BATCH_SES_FLIGHT_RECORDER, or to standard error, if it is set.
+//
+void DumpFlightRecorder()
+{
+    const char* path = std::getenv("AZ_BATCH_SES_FLIGHT_RECORDER");
+    if (path == nullptr || *path == '\0')
+    {
+        return;
+    }
+
+    std::string dump = "Entitlement check failed; recent requests:\n" + DescribeRecentRequests() + "\n";
+
+    std::lock_guard<std::mutex> lock(s_dumpLock);
+    if (std::strcmp(path, "stderr") == 0)
+    {
+        std::fwrite(dump.data(), 1, dump.size(), stderr);
+        std::fflush(stderr);
+    }
+    else
+    {
+        std::ofstream file(path, std::ios::app | std::ios::binary);
+        file << dump;
+    }
+}
+
+
+//
+// Checks an entitlement with one of the servers, recording how it went if
+// there is a choice of servers.
+//
+EntitlementResult CheckEndpoint(
+    const Servers& servers,
+    size_t endpoint,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int attempt,
+    Cancellation* cancellation)
+{
+    const std::string& url = servers.urls[endpoint];
+    if (servers.urls.size() == 1)
+    {
+        return RequestEntitlement(url, entitlement_token, requested_entitlement, attempt, cancellation);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EntitlementResult result = RequestEntitlement(url, entitlement_token, requested_entitlement, attempt, cancellation);
+    if (result.category != ErrorCategory::Cancelled)
+    {
+        s_health.Record(url, std::chrono::steady_clock::now() - start, CanFailOver(result.category));
+    }
+    return result;
+}
+
+
+//
+// Checks an entitlement with the servers, retrying timeouts.  With a choice
+// of servers, a check that fails on one moves straight on to the next, each
+// attempt counting against the same retries; once every server has failed,
+// timeouts are retried as for a single server.
+//
+EntitlementResult CheckEntitlement(
+    const Servers& servers,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries,
+    Cancellation* cancellation)
+{
+    std::vector<bool> failed(servers.urls.size(), false);
+    size_t endpoint = servers.urls.size() == 1 ? 0 : s_health.Choose(servers, failed);
+    EntitlementResult result = CheckEndpoint(servers, endpoint, entitlement_token, requested_entitlement, 1, cancellation);
+    for (unsigned int retry = 1; retry <= retries; ++retry)
+    {
+        //
+        // Move on at once to a server that has yet to fail.
+        //
+        bool failOver = false;
+        if (servers.urls.size() > 1 && CanFailOver(result.category))
+        {
+            failed[endpoint] = true;
+            failOver = std::find(failed.begin(), failed.end(), false) != failed.end();
+        }
+
+        if (!failOver)
+        {
+            if (result.category == ErrorCategory::Timeout)
+            {
+                if (!Sleep(cancellation, std::chrono::seconds(retry)))
+                {
+                    result = Cancelled();
+                    break;
+                }
+            }
+#ifdef _WIN32
+            else if (result.curl_code == CURLE_SSL_CACERT)
+            {
+                EnsureRootCertsArePopulated(servers.urls[endpoint]);
+            }
+#endif
+            else
+            {
+                break;
+            }
+
+            std::fill(failed.begin(), failed.end(), false);
+        }
+
+        if (servers.urls.size() > 1)
+        {
+            endpoint = s_health.Choose(servers, failed);
+        }
+        result = CheckEndpoint(servers, endpoint, entitlement_token, requested_entitlement, retry + 1, cancellation);
+    }
+
+    if (result.category == ErrorCategory::Denied)
+    {
+        s_results.AddDenial(servers.key, entitlement_token, requested_entitlement, result.describe);
+    }
+    return result;
+}
+
+
+//
+// Answers a check from a check already in progress, or from the servers.
+// Dumps the flight recorder if a check this call made fails.
+//
+EntitlementResult JoinOrCheckEntitlement(
+    const Servers& servers,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries,
+    Cancellation* cancellation)
+{
+    if (IsCancelled(cancellation))
+    {
+        return Cancelled();
+    }
+
+    bool checked;
+    EntitlementResult result = s_inFlight.Join(
+        CheckKey(servers.key, entitlement_token, requested_entitlement),
+        [&]() { return CheckEntitlement(servers, entitlement_token, requested_entitlement, retries, cancellation); },
+        cancellation,
+        checked);
+
+    //
+    // Only once the check is no longer in flight, so that the calls that
+    // joined it do not wait for the dump to be written.
+    //
+    if (checked
+        && result.category != ErrorCategory::None
+        && result.category != ErrorCategory::Denied
+        && result.category != ErrorCategory::Cancelled)
+    {
+        DumpFlightRecorder();
+    }
+    return result;
+}
+
+
+//
+// Whether checks first refuse tokens the server would; see SetTokenPreCheck.
+//
+std::atomic<bool> s_tokenPreCheck(false);
+
+//
+// With the token pre-check on, sets result to ErrorCategory::UnusableToken if
+// the token's claims show that the server would refuse it.  Returns false if
+// the check is to go ahead.
+//
+bool RefuseUnusableToken(
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    EntitlementResult& result)
+{
+    if (!s_tokenPreCheck.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    std::string reason = UnusableTokenReason(ReadTokenClaims(entitlement_token), requested_entitlement, std::chrono::system_clock::now());
+    if (reason.empty())
+    {
+        return false;
+    }
+
+    result = Failed(ErrorCategory::UnusableToken, reason);
+    return true;
+}
+
+
+//
+// Answers a check from the token alone, from the cache, from a check already
+// in progress, or from the server.  Throws if the check cannot be made at
+// all.
+//
+EntitlementResult FindOrCheckEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries,
+    Cancellation* cancellation)
+{
+    url = NormalizeUrl(url);
+
+    EntitlementResult cached;
+    if (RefuseUnusableToken(entitlement_token, requested_entitlement, cached)
+        || s_results.Find(url, entitlement_token, requested_entitlement, cached))
+    {
+        return cached;
+    }
+
+    Servers servers;
+    servers.key = url;
+    servers.urls.push_back(url);
+    servers.weights.push_back(1);
+    return JoinOrCheckEntitlement(servers, entitlement_token, requested_entitlement, retries, cancellation);
+}
+
+
+//
+// As FindOrCheckEntitlement, for the endpoints of an EndpointSet.  The caches
+// treat the set as a whole as one server.
+//
+EntitlementResult FindOrCheckEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries,
+    Cancellation* cancellation)
+{
+    if (endpoints.Urls().empty())
+    {
+        throw Exception("No entitlement server endpoints given.");
+    }
+
+    Servers servers;
+    for (const auto& url : endpoints.Urls())
+    {
+        servers.key += url;
+        servers.key += '\n';
+    }
+
+    EntitlementResult cached;
+    if (RefuseUnusableToken(entitlement_token, requested_entitlement, cached)
+        || s_results.Find(servers.key, entitlement_token, requested_entitlement, cached))
+    {
+        return cached;
+    }
+
+    servers.urls = endpoints.Urls();
+    servers.weights = endpoints.Weights();
+    return JoinOrCheckEntitlement(servers, entitlement_token, requested_entitlement, retries, cancellation);
+}
+
+
+//
+// A lease duration as the server expects it: ISO 8601, in seconds.
+//
+std::string LeaseDuration(std::chrono::seconds duration)
+{
+    if (duration.count() <= 0)
+    {
+        throw Exception("A lease must last at least a second.");
+    }
+    return "PT" + std::to_string(duration.count()) + "S";
+}
+
+//
+// segment as one segment of a URL's path: every byte but the unreserved
+// characters of RFC 3986 is percent-encoded, so that a '/', '?' or '#' in
+// an identifier the server chose cannot change the resource addressed.
+//
+std::string EscapePathSegment(const std::string& segment)
+{
+    static const char* const hex = "0123456789ABCDEF";
+
+    std::string escaped;
+    escaped.reserve(segment.size());
+    for (size_t i = 0; i < segment.size(); ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(segment[i]);
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '.' || c == '_' || c == '~')
+        {
+            escaped += static_cast<char>(c);
+        }
+        else
+        {
+            escaped += '%';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 0xF];
+        }
+    }
+    return escaped;
+}
+
+//
+// Reads property key of a response to a lease request, reporting a
+// malformed response as the server's failure rather than throwing.
+//
+EntitlementResult LeaseProperty(TransportResponse& response, const char* key, std::string& value)
+{
+    try
+    {
+        value = ExtractValue(response.body, key);
+        return Granted(std::unique_ptr<Entitlement>());
+    }
+    catch (const std::exception&)
+    {
+        return Failed(
+            ErrorCategory::UnexpectedResponse,
+            "Malformed response to a lease request: no '" + std::string(key) + "' in '" + response.body + "'");
+    }
+}
+
+}   // anonymous namespace
+
+
+Exception::Exception(const std::string& message)
+    : std::runtime_error(message)
+{
+}
+
+Exception::Exception(const char *message)
+    : std::runtime_error(message)
+{
+}
+
+
+EntitlementDeniedException::EntitlementDeniedException(const std::string& message, bool cached)
+    : Exception(message)
+    , m_cached(cached)
+{
+}
+
+bool EntitlementDeniedException::Cached() const
+{
+    return m_cached;
+}
+
+
+CheckCancelledException::CheckCancelledException()
+    : Exception(CancelledMessage)
+{
+}
+
+
+LeaseLostException::LeaseLostException(const std::string& message)
+    : Exception(message)
+{
+}
+
+
+CancellationToken::CancellationToken()
+    : m_state(std::make_shared<Cancellation>())
+{
+}
+
+void CancellationToken::Cancel() const
+{
+    m_state->Cancel();
+}
+
+bool CancellationToken::IsCancelled() const
+{
+    return m_state->IsCancelled();
+}
+
+
+Entitlement::Entitlement(const std::string& response)
+    : m_id(ExtractValue(response, "id"))
+    , m_vmid(ExtractValue(response, "vmid"))
+{
+}
+
+Entitlement::~Entitlement()
+{
+}
+
+const std::string& Entitlement::Id() const
+{
+    return m_id;
+}
+
+const std::string& Entitlement::VmId() const
+{
+    return m_vmid;
+}
+
+
+int Init(InitMode mode)
+{
+    std::lock_guard<std::mutex> lock(s_initLock);
+
+    if (mode == InitMode::Eager && !s_curlInitialized)
+    {
+        //
+        // CURL_GLOBAL_DEFAULT initializes SSL (and, on Windows, Winsock),
+        // which is all HTTPS needs.
+        //
+        CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (res != CURLE_OK)
+        {
+            return res;
+        }
+        s_curlInitialized = true;
+    }
+
+    ++s_initCount;
+    return 0;
+}
+
+
+void Cleanup()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_initLock);
+
+        if (s_initCount > 0)
+        {
+            --s_initCount;
+        }
+
+        if (s_initCount != 0)
+        {
+            return;
+        }
+    }
+
+    //
+    // Outside the lock, as warm-ups in progress may be initializing libcurl.
+    //
+    s_connections->Close();
+
+    std::lock_guard<std::mutex> lock(s_initLock);
+
+    if (s_initCount != 0)
+    {
+        return;
+    }
+
+    s_results.Clear();
+    ReleaseTrustStore();
+
+    //
+    // Never load libcurl just to clean it up.
+    //
+    if (s_curlInitialized)
+    {
+        curl_global_cleanup();
+        s_curlInitialized = false;
+    }
+}
+
+
+//
+// Returns an Entitlement object, throws an EntitlementException
+// providing details of entitlement validation failure.
+//
+std::unique_ptr<Entitlement> GetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries)
+{
+    EntitlementResult result = FindOrCheckEntitlement(url, entitlement_token, requested_entitlement, retries, nullptr);
+    return TakeEntitlement(result);
+}
+
+
+std::unique_ptr<Entitlement> GetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries)
+{
+    EntitlementResult result = FindOrCheckEntitlement(url, entitlement_token, requested_entitlement, retries, Cancellation::Of(cancellation));
+    return TakeEntitlement(result);
+}
+
+
+std::unique_ptr<Entitlement> GetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries)
+{
+    EntitlementResult result = FindOrCheckEntitlement(endpoints, entitlement_token, requested_entitlement, retries, nullptr);
+    return TakeEntitlement(result);
+}
+
+
+std::unique_ptr<Entitlement> GetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries)
+{
+    EntitlementResult result = FindOrCheckEntitlement(endpoints, entitlement_token, requested_entitlement, retries, Cancellation::Of(cancellation));
+    return TakeEntitlement(result);
+}
+
+
+void EndpointSet::Add(const std::string& url, double weight)
+{
+    if (!(weight > 0))
+    {
+        throw Exception("Invalid endpoint weight: must be greater than zero");
+    }
+
+    std::string normalized = NormalizeUrl(url);
+    if (std::find(m_urls.begin(), m_urls.end(), normalized) != m_urls.end())
+    {
+        throw Exception("Duplicate endpoint: " + normalized);
+    }
+
+    m_urls.push_back(normalized);
+    m_weights.push_back(weight);
+}
+
+const std::vector<std::string>& EndpointSet::Urls() const
+{
+    return m_urls;
+}
+
+const std::vector<double>& EndpointSet::Weights() const
+{
+    return m_weights;
+}
+
+
+EntitlementResult::EntitlementResult()
+    : category(ErrorCategory::None)
+    , http_status(0)
+    , curl_code(0)
+    , cached(false)
+    , _described(false)
+{
+}
+
+EntitlementResult::EntitlementResult(EntitlementResult&& rhs)
+    : entitlement(std::move(rhs.entitlement))
+    , category(rhs.category)
+    , http_status(rhs.http_status)
+    , curl_code(rhs.curl_code)
+    , cached(rhs.cached)
+    , describe(std::move(rhs.describe))
+    , _message(std::move(rhs._message))
+    , _described(rhs._described)
+{
+}
+
+EntitlementResult& EntitlementResult::operator=(EntitlementResult&& rhs)
+{
+    entitlement = std::move(rhs.entitlement);
+    category = rhs.category;
+    http_status = rhs.http_status;
+    curl_code = rhs.curl_code;
+    cached = rhs.cached;
+    describe = std::move(rhs.describe);
+    _message = std::move(rhs._message);
+    _described = rhs._described;
+    return *this;
+}
+
+const std::string& EntitlementResult::Message() const
+{
+    if (!_described)
+    {
+        if (describe)
+        {
+            _message = describe();
+        }
+        _described = true;
+    }
+    return _message;
+}
+
+
+namespace {
+
+//
+// Checks an entitlement against a URL or an EndpointSet, reporting every
+// failure in the result.
+//
+template <typename Servers>
+EntitlementResult TryFindOrCheckEntitlement(
+    const Servers& servers,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries,
+    Cancellation* cancellation)
+{
+    try
+    {
+        return FindOrCheckEntitlement(servers, entitlement_token, requested_entitlement, retries, cancellation);
+    }
+    catch (const std::bad_alloc&)
+    {
+        throw;
+    }
+    catch (const std::exception& e)
+    {
+        return Failed(ErrorCategory::Internal, e.what());
+    }
+}
+
+}   // anonymous namespace
+
+
+EntitlementResult TryGetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries)
+{
+    return TryFindOrCheckEntitlement(url, entitlement_token, requested_entitlement, retries, nullptr);
+}
+
+
+EntitlementResult TryGetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries)
+{
+    return TryFindOrCheckEntitlement(url, entitlement_token, requested_entitlement, retries, Cancellation::Of(cancellation));
+}
+
+
+EntitlementResult TryGetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries)
+{
+    return TryFindOrCheckEntitlement(endpoints, entitlement_token, requested_entitlement, retries, nullptr);
+}
+
+
+EntitlementResult TryGetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries)
+{
+    return TryFindOrCheckEntitlement(endpoints, entitlement_token, requested_entitlement, retries, Cancellation::Of(cancellation));
+}
+
+
+void Warmup(const std::string& url)
+{
+    std::string normalized = NormalizeUrl(url);
+    if (!FindTransport(normalized))
+    {
+        s_connections->Warmup(normalized);
+    }
+}
+
+
+void SetDenialLifetime(std::chrono::seconds lifetime)
+{
+    s_denialLifetime = lifetime.count();
+}
+
+
+void SetTokenPreCheck(bool enabled)
+{
+    s_tokenPreCheck = enabled;
+}
+
+
+void AddSslCertificate(
+    const std::string& ssl_cert_thumbprint,
+    const std::string& ssl_cert_common_name)
+{
+    CertInfo info = { ThumbprintToBinary(ssl_cert_thumbprint), ssl_cert_common_name, {} };
+
+    std::lock_guard<std::mutex> lock(s_certLock);
+    PublishCertificates(&info, &info + 1);
+}
+
+
+CheckResult::CheckResult()
+    : http_status(0)
+    , curl_code(0)
+{
+}
+
+CheckResult::CheckResult(CheckResult&& rhs)
+    : entitlement(std::move(rhs.entitlement))
+    , error(std::move(rhs.error))
+    , http_status(rhs.http_status)
+    , curl_code(rhs.curl_code)
+{
+}
+
+CheckResult& CheckResult::operator=(CheckResult&& rhs)
+{
+    entitlement = std::move(rhs.entitlement);
+    error = std::move(rhs.error);
+    http_status = rhs.http_status;
+    curl_code = rhs.curl_code;
+    return *this;
+}
+
+
+class AsyncClient::Impl
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Transfer
+    {
+        Transfer()
+            : interactive(false)
+            , paced(false)
+        {
+        }
+
+        std::string url;
+        RequestContext context;
+        Curl curl;
+        Callback callback;
+        CheckId id;
+        ConcurrencySlot slot;
+
+        //
+        // Whether the check bypasses the pacing (see SetInteractive), the
+        // turn reserved for it, and whether, and since when, it has waited
+        // for its turn.
+        //
+        bool interactive;
+        AdmissionController::Reservation reservation;
+        bool paced;
+        Clock::time_point pacedSince;
+    };
+
+    std::string _url;
+    std::unique_ptr<CURLM, MultiDeleter> _multi;
+    std::unordered_map<CURL*, std::unique_ptr<Transfer>> _transfers;
+
+    //
+    // Checks waiting, in the order made, for their server to have fewer
+    // checks in flight (see SetMaxConcurrency), or for their turn (see
+    // SetAdmissionControl).  While there are any, the client's waiter on the
+    // limiter wakes it whenever a check anywhere in the process finishes.
+    //
+    std::deque<std::unique_ptr<Transfer>> _queued;
+    std::atomic<bool> _queueing;
+    ConcurrencyLimiter::Waiter _waiter;
+
+    //
+    // When the next queued check held back by the pacing has its turn.
+    //
+    bool _pacing;
+    Clock::time_point _pacedUntil;
+
+    //
+    // With an event loop, the one timer is shared: between libcurl's, as
+    // last set through TimerCallback, and the client's own, for when queued
+    // checks may next start.
+    //
+    bool _curlTimerSet;
+    Clock::time_point _curlTimerDue;
+    bool _queueTimerSet;
+    Clock::time_point _queueTimerDue;
+
+    CheckId _nextId;
+    std::chrono::milliseconds _timeout;
+
+    //
+    // The most checks in flight at once so far.  libcurl keeps up to four
+    // idle connections per transfer, but counts only the transfers still
+    // running: finishing checks one at a time, as an event loop does, would
+    // close the connections the next batch of checks could have reused.
+    //
+    size_t _peakTransfers;
+
+    //
+    // Set by UseEventLoop; while it is, libcurl is driven through
+    // curl_multi_socket_action rather than curl_multi_perform.
+    //
+    std::unique_ptr<EventLoop> _loop;
+
+    //
+    // Checks to cancel, added to from any thread by Cancel and taken by
+    // Perform.
+    //
+    std::mutex _cancelLock;
+    std::vector<CheckId> _cancelled;
+
+    //
+    // The first exception a callback has thrown since Perform, SocketReady
+    // or TimerExpired was called, rethrown once the callbacks of every other
+    // check that finished meanwhile have been invoked.
+    //
+    std::exception_ptr _callbackError;
+
+    //
+    // How often an event loop with no wakeup function checks whether queued
+    // checks can start.
+    //
+    static std::chrono::milliseconds QueuePollInterval()
+    {
+        return std::chrono::milliseconds(10);
+    }
+
+    //
+    // Milliseconds from now until due, rounded up.
+    //
+    static long MillisecondsUntil(Clock::time_point due)
+    {
+        auto remaining = std::max(due - Clock::now(), Clock::duration::zero());
+        return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            remaining + std::chrono::milliseconds(1) - Clock::duration(1)).count());
+    }
+
+    //
+    // Gives transfer its turn and a place among its server's checks in
+    // flight, or neither.  Notes when it is the pacing that holds it back.
+    //
+    bool TakeTurn(Transfer& transfer)
+    {
+        Clock::duration wait;
+        if (!s_admission.TryAdmit(transfer.interactive, transfer.reservation, wait))
+        {
+            auto now = Clock::now();
+            if (!transfer.paced)
+            {
+                transfer.paced = true;
+                transfer.pacedSince = now;
+            }
+            if (!_pacing || now + wait < _pacedUntil)
+            {
+                _pacing = true;
+                _pacedUntil = now + wait;
+            }
+            return false;
+        }
+
+        if (!transfer.slot.TryAcquire(transfer.url))
+        {
+            s_admission.Unadmit(transfer.interactive, transfer.reservation);
+            return false;
+        }
+
+        if (transfer.paced)
+        {
+            s_admission.RecordWait(Clock::now() - transfer.pacedSince);
+        }
+        return true;
+    }
+
+    //
+    // Sets the event loop's timer for the earlier of libcurl's and the
+    // client's own.
+    //
+    void ArmTimer()
+    {
+        if (!_curlTimerSet && !_queueTimerSet)
+        {
+            _loop->setTimer(-1);
+            return;
+        }
+
+        Clock::time_point due = !_queueTimerSet || (_curlTimerSet && _curlTimerDue < _queueTimerDue)
+            ? _curlTimerDue
+            : _queueTimerDue;
+        _loop->setTimer(MillisecondsUntil(due));
+    }
+
+    //
+    // Hands a check to libcurl; on failure, throws and leaves it with the
+    // caller.
+    //
+    void Start(std::unique_ptr<Transfer>& transfer)
+    {
+        CURL* handle = transfer->curl.Handle();
+        auto started = _transfers.emplace(handle, std::move(transfer)).first;
+
+        CURLMcode res = curl_multi_add_handle(_multi.get(), handle);
+        if (res != CURLM_OK)
+        {
+            transfer = std::move(started->second);
+            _transfers.erase(started);
+            ThrowIfMultiError(res);
+        }
+
+        if (_transfers.size() > _peakTransfers)
+        {
+            _peakTransfers = _transfers.size();
+            curl_multi_setopt(_multi.get(), CURLMOPT_MAXCONNECTS, static_cast<long>(4 * _peakTransfers));
+        }
+    }
+
+    //
+    // Invokes the callback of a check, keeping any exception it throws for
+    // RethrowCallbackError, so that the other checks' callbacks still run.
+    //
+    void Invoke(Transfer& transfer, CheckResult result)
+    {
+        try
+        {
+            transfer.callback(std::move(result));
+        }
+        catch (...)
+        {
+            if (!_callbackError)
+            {
+                _callbackError = std::current_exception();
+            }
+        }
+    }
+
+    void RethrowCallbackError()
+    {
+        if (_callbackError)
+        {
+            std::exception_ptr error;
+            std::swap(error, _callbackError);
+            std::rethrow_exception(error);
+        }
+    }
+
+    //
+    // Starts the queued checks whose servers now have room for them, and
+    // invokes the callbacks of any that cannot be started.
+    //
+    void StartQueued()
+    {
+        _pacing = false;
+        if (_queued.empty())
+        {
+            return;
+        }
+
+        std::vector<std::pair<std::unique_ptr<Transfer>, std::exception_ptr>> failed;
+        for (auto it = _queued.begin(); it != _queued.end();)
+        {
+            if (!TakeTurn(**it))
+            {
+                ++it;
+                continue;
+            }
+
+            std::unique_ptr<Transfer> transfer(std::move(*it));
+            it = _queued.erase(it);
+            s_limiter.Waiting(transfer->url, -1);
+            try
+            {
+                Start(transfer);
+            }
+            catch (...)
+            {
+                transfer->slot.Release(ConcurrencyLimiter::Load::Unknown, 0);
+                failed.emplace_back(std::move(transfer), std::current_exception());
+            }
+        }
+        _queueing = !_queued.empty();
+
+        for (auto& failure : failed)
+        {
+            CheckResult result;
+            result.error = failure.second;
+            Invoke(*failure.first, std::move(result));
+        }
+    }
+
+    //
+    // Has the event loop call back when queued checks may start: when the
+    // next has its turn, or, without a wakeup function to hear of room among
+    // a server's checks in flight, every QueuePollInterval.
+    //
+    void PollQueued()
+    {
+        if (!_loop)
+        {
+            return;
+        }
+
+        bool set = false;
+        Clock::time_point due;
+        if (!_queued.empty() && !_loop->wakeup)
+        {
+            set = true;
+            due = Clock::now() + QueuePollInterval();
+        }
+        if (_pacing && (!set || _pacedUntil < due))
+        {
+            set = true;
+            due = _pacedUntil;
+        }
+
+        if (set != _queueTimerSet || (set && due != _queueTimerDue))
+        {
+            _queueTimerSet = set;
+            _queueTimerDue = due;
+            ArmTimer();
+        }
+    }
+
+    //
+    // How long Perform may wait for network activity before a queued check
+    // has its turn.
+    //
+    int PollTimeout(int timeout_ms) const
+    {
+        if (!_pacing)
+        {
+            return timeout_ms;
+        }
+        return static_cast<int>(std::min<long>(timeout_ms, MillisecondsUntil(_pacedUntil)));
+    }
+
+    //
+    // Invokes the callbacks of finished transfers; returns the number of
+    // callbacks invoked.
+    //
+    size_t DispatchCompleted()
+    {
+        size_t completed = 0;
+        int queued;
+        CURLMsg* msg;
+        while ((msg = curl_multi_info_read(_multi.get(), &queued)) != nullptr)
+        {
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            CURL* handle = msg->easy_handle;
+            CURLcode code = msg->data.result;
+
+            auto it = _transfers.find(handle);
+            std::unique_ptr<Transfer> transfer(std::move(it->second));
+            _transfers.erase(it);
+            curl_multi_remove_handle(_multi.get(), handle);
+
+            CheckResult result;
+            result.curl_code = code;
+            try
+            {
+                TransportResponse response;
+                transfer->curl.Complete(code, nullptr, response);
+                result.http_status = response.http_status;
+                EntitlementResult outcome = Outcome(response, Approval);
+                Record(transfer->context, 1, response, outcome);
+                transfer->slot.Release(LoadOf(outcome), response.server_latency_us);
+                result.entitlement = TakeEntitlement(outcome);
+            }
+            catch (...)
+            {
+                result.error = std::current_exception();
+            }
+
+            transfer->slot.Release(ConcurrencyLimiter::Load::Unknown, 0);
+            ++completed;
+            Invoke(*transfer, std::move(result));
+        }
+
+        return completed;
+    }
+
+    //
+    // Removes the checks cancelled since the last call, whether in flight or
+    // queued, and invokes their callbacks; returns the number of callbacks
+    // invoked.
+    //
+    size_t DispatchCancelled()
+    {
+        std::vector<CheckId> cancelled;
+        {
+            std::lock_guard<std::mutex> lock(_cancelLock);
+            cancelled.swap(_cancelled);
+        }
+
+        size_t dispatched = 0;
+        for (CheckId id : cancelled)
+        {
+            std::unique_ptr<Transfer> transfer;
+            auto queued = std::find_if(
+                _queued.begin(),
+                _queued.end(),
+                [id](const std::unique_ptr<Transfer>& transfer) { return transfer->id == id; });
+            if (queued != _queued.end())
+            {
+                transfer = std::move(*queued);
+                _queued.erase(queued);
+                _queueing = !_queued.empty();
+                s_limiter.Waiting(transfer->url, -1);
+                s_admission.Release(transfer->reservation);
+            }
+            else
+            {
+                auto it = std::find_if(
+                    _transfers.begin(),
+                    _transfers.end(),
+                    [id](const std::pair<CURL* const, std::unique_ptr<Transfer>>& transfer) { return transfer.second->id == id; });
+                if (it == _transfers.end())
+                {
+                    // Finished before it could be cancelled.
+                    continue;
+                }
+
+                transfer = std::move(it->second);
+                _transfers.erase(it);
+                curl_multi_remove_handle(_multi.get(), transfer->curl.Handle());
+                transfer->slot.Release(ConcurrencyLimiter::Load::Unknown, 0);
+            }
+
+            CheckResult result;
+            result.error = std::make_exception_ptr(CheckCancelledException());
+            ++dispatched;
+            Invoke(*transfer, std::move(result));
+        }
+
+        return dispatched;
+    }
+
+    static int SocketCallback(CURL* /*easy*/, curl_socket_t socket, int what, void* userp, void* /*socketp*/)
+    {
+        int events = 0;
+        if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+        {
+            events |= Readable;
+        }
+        if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+        {
+            events |= Writable;
+        }
+
+        try
+        {
+            static_cast<Impl*>(userp)->_loop->watchSocket(socket, events);
+            return 0;
+        }
+        catch (...)
+        {
+            return -1;
+        }
+    }
+
+    static int TimerCallback(CURLM* /*multi*/, long timeout_ms, void* userp)
+    {
+        try
+        {
+            Impl* impl = static_cast<Impl*>(userp);
+            impl->_curlTimerSet = timeout_ms >= 0;
+            impl->_curlTimerDue = Clock::now() + std::chrono::milliseconds(timeout_ms);
+            impl->ArmTimer();
+            return 0;
+        }
+        catch (...)
+        {
+            return -1;
+        }
+    }
+
+    void SocketAction(curl_socket_t socket, int events)
+    {
+        int running;
+        ThrowIfMultiError(curl_multi_socket_action(_multi.get(), socket, events, &running));
+        DispatchCompleted();
+        DispatchCancelled();
+        StartQueued();
+        PollQueued();
+    }
+
+public:
+    explicit Impl(const std::string& url)
+        : _url(NormalizeUrl(url))
+        , _multi(NewMultiHandle())
+        , _queueing(false)
+        , _pacing(false)
+        , _curlTimerSet(false)
+        , _queueTimerSet(false)
+        , _nextId(0)
+        , _timeout(0)
+        , _peakTransfers(0)
+    {
+        if (_multi == nullptr)
+        {
+            throw Exception("curl_multi_init failed.");
+        }
+
+        _waiter = s_limiter.AddWaiter([this]()
+        {
+            if (_queueing)
+            {
+                Wakeup();
+            }
+        });
+    }
+
+    ~Impl()
+    {
+        s_limiter.RemoveWaiter(_waiter);
+        for (const auto& transfer : _queued)
+        {
+            s_limiter.Waiting(transfer->url, -1);
+            s_admission.Release(transfer->reservation);
+        }
+        for (const auto& transfer : _transfers)
+        {
+            curl_multi_remove_handle(_multi.get(), transfer.first);
+        }
+    }
+
+    CheckId Check(
+        const std::string& url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        Callback callback)
+    {
+        std::unique_ptr<Transfer> transfer(new Transfer());
+        transfer->url = url;
+        transfer->context = CheckRequest(url, entitlement_token, requested_entitlement);
+        transfer->context.started = std::chrono::system_clock::now();
+        transfer->curl.Configure(transfer->context.request, std::string());
+        transfer->curl.SetTimeout(_timeout);
+        transfer->callback = std::move(callback);
+        transfer->id = ++_nextId;
+
+        transfer->interactive = s_admission.IsInteractive();
+
+        CheckId id = transfer->id;
+        if (_queued.empty() && TakeTurn(*transfer))
+        {
+            Start(transfer);
+            return id;
+        }
+
+        //
+        // Behind any already queued, even for another server, so that checks
+        // start in the order made.
+        //
+        s_limiter.Waiting(url, 1);
+        _queued.push_back(std::move(transfer));
+        _queueing = true;
+        PollQueued();
+        return id;
+    }
+
+    const std::string& Url() const
+    {
+        return _url;
+    }
+
+    size_t Perform(int timeout_ms)
+    {
+        if (_loop)
+        {
+            throw Exception("Perform cannot be used once an event loop drives the checks.");
+        }
+
+        size_t cancelled = DispatchCancelled();
+        StartQueued();
+        if (_transfers.empty())
+        {
+            timeout_ms = PollTimeout(timeout_ms);
+            if (timeout_ms > 0 && cancelled == 0)
+            {
+                if (CanWakeMultiHandles())
+                {
+                    // Unlike sleeping, this can be cut short by Wakeup, as
+                    // when a queued check's server has room for it.
+                    WaitForTransfers(_multi.get(), timeout_ms);
+                }
+                else
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+                }
+            }
+            RethrowCallbackError();
+            return _queued.size();
+        }
+
+        int running;
+        ThrowIfMultiError(curl_multi_perform(_multi.get(), &running));
+        if (DispatchCompleted() == 0 && cancelled == 0 && !_transfers.empty())
+        {
+            WaitForTransfers(_multi.get(), PollTimeout(timeout_ms));
+            ThrowIfMultiError(curl_multi_perform(_multi.get(), &running));
+            DispatchCompleted();
+        }
+
+        StartQueued();
+        RethrowCallbackError();
+        return Pending();
+    }
+
+    size_t Pending() const
+    {
+        return _transfers.size() + _queued.size();
+    }
+
+    void Wakeup()
+    {
+        if (_loop)
+        {
+            if (_loop->wakeup)
+            {
+                _loop->wakeup();
+            }
+            return;
+        }
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+        if (CanWakeMultiHandles())
+        {
+            curl_multi_wakeup(_multi.get());
+        }
+#endif
+    }
+
+    void Cancel(CheckId check)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_cancelLock);
+            _cancelled.push_back(check);
+        }
+        Wakeup();
+    }
+
+    void SetTimeout(std::chrono::milliseconds timeout)
+    {
+        _timeout = timeout;
+    }
+
+    void UseEventLoop(EventLoop loop)
+    {
+        if (!loop.watchSocket || !loop.setTimer)
+        {
+            throw Exception("An event loop must watch sockets and set timers.");
+        }
+        if (!_transfers.empty() || !_queued.empty() || _loop)
+        {
+            throw Exception("An event loop must be set before the first check, and only once.");
+        }
+
+        _loop.reset(new EventLoop(std::move(loop)));
+        ThrowIfMultiError(curl_multi_setopt(_multi.get(), CURLMOPT_SOCKETFUNCTION, SocketCallback));
+        ThrowIfMultiError(curl_multi_setopt(_multi.get(), CURLMOPT_SOCKETDATA, this));
+        ThrowIfMultiError(curl_multi_setopt(_multi.get(), CURLMOPT_TIMERFUNCTION, TimerCallback));
+        ThrowIfMultiError(curl_multi_setopt(_multi.get(), CURLMOPT_TIMERDATA, this));
+    }
+
+    void SocketReady(Socket socket, int events)
+    {
+        int action = 0;
+        if (events & Readable)
+        {
+            action |= CURL_CSELECT_IN;
+        }
+        if (events & Writable)
+        {
+            action |= CURL_CSELECT_OUT;
+        }
+        if (events & SocketError)
+        {
+            action |= CURL_CSELECT_ERR;
+        }
+        SocketAction(static_cast<curl_socket_t>(socket), action);
+        RethrowCallbackError();
+    }
+
+    void TimerExpired()
+    {
+        //
+        // The timer has fired, whichever's it was; libcurl sets its own again
+        // if it still needs one, and PollQueued the client's.
+        //
+        _curlTimerSet = _curlTimerSet && _curlTimerDue > Clock::now();
+        _queueTimerSet = false;
+        SocketAction(CURL_SOCKET_TIMEOUT, 0);
+        if (_curlTimerSet && !_queueTimerSet)
+        {
+            ArmTimer();
+        }
+        RethrowCallbackError();
+    }
+};
+
+
+AsyncClient::AsyncClient(const std::string& url)
+    : _impl(new Impl(url))
+{
+}
+
+AsyncClient::~AsyncClient()
+{
+}
+
+AsyncClient::CheckId AsyncClient::Check(
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    Callback callback)
+{
+    return _impl->Check(_impl->Url(), entitlement_token, requested_entitlement, std::move(callback));
+}
+
+AsyncClient::CheckId AsyncClient::Check(
+    const std::string& url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    Callback callback)
+{
+    return _impl->Check(NormalizeUrl(url), entitlement_token, requested_entitlement, std::move(callback));
+}
+
+size_t AsyncClient::Perform(int timeout_ms)
+{
+    return _impl->Perform(timeout_ms);
+}
+
+size_t AsyncClient::Pending() const
+{
+    return _impl->Pending();
+}
+
+void AsyncClient::Wakeup()
+{
+    _impl->Wakeup();
+}
+
+void AsyncClient::Cancel(CheckId check)
+{
+    _impl->Cancel(check);
+}
+
+void AsyncClient::SetTimeout(std::chrono::milliseconds timeout)
+{
+    _impl->SetTimeout(timeout);
+}
+
+void AsyncClient::UseEventLoop(EventLoop loop)
+{
+    _impl->UseEventLoop(std::move(loop));
+}
+
+void AsyncClient::SocketReady(Socket socket, int events)
+{
+    _impl->SocketReady(socket, events);
+}
+
+void AsyncClient::TimerExpired()
+{
+    _impl->TimerExpired();
+}
+
+
+std::vector<CheckResult> Prefetch(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::vector<std::string>& requested_entitlements)
+{
+    url = NormalizeUrl(url);
+
+    std::vector<CheckResult> results(requested_entitlements.size());
+    std::vector<bool> checked(requested_entitlements.size(), false);
+    std::unique_ptr<AsyncClient> client;
+    for (size_t i = 0; i < requested_entitlements.size(); ++i)
+    {
+        EntitlementResult answered;
+        if (RefuseUnusableToken(entitlement_token, requested_entitlements[i], answered)
+            || s_results.Find(url, entitlement_token, requested_entitlements[i], answered))
+        {
+            results[i].http_status = answered.http_status;
+            try
+            {
+                results[i].entitlement = TakeEntitlement(answered);
+            }
+            catch (const Exception&)
+            {
+                results[i].error = std::current_exception();
+            }
+            continue;
+        }
+
+        if (!client)
+        {
+            client.reset(new AsyncClient(url));
+        }
+
+        checked[i] = true;
+        CheckResult* result = &results[i];
+        client->Check(entitlement_token, requested_entitlements[i], [result](CheckResult completed)
+        {
+            *result = std::move(completed);
+        });
+    }
+
+    while (client && client->Pending() > 0)
+    {
+        client->Perform(1000);
+    }
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        if (!checked[i])
+        {
+            continue;
+        }
+
+        if (results[i].entitlement)
+        {
+            s_results.Add(url, entitlement_token, requested_entitlements[i], *results[i].entitlement, PrefetchLifetime);
+            continue;
+        }
+
+        try
+        {
+            std::rethrow_exception(results[i].error);
+        }
+        catch (const EntitlementDeniedException& e)
+        {
+            std::string message = e.what();
+            s_results.AddDenial(url, entitlement_token, requested_entitlements[i], [message]() { return message; });
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+
+    return results;
+}
+
+
+class Lease::Impl
+{
+    std::string _url;
+    std::string _apiVersion;
+    std::string _application;
+    TokenDigest _digest;
+    std::string _id;
+    std::string _expiry;
+    bool _released;
+
+    std::string Path() const
+    {
+        return "softwareEntitlements/" + EscapePathSegment(_id) + "?" + _apiVersion;
+    }
+
+public:
+    Impl(
+        std::string url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        std::chrono::seconds duration,
+        const std::string& api_version)
+        : _url(NormalizeUrl(std::move(url)))
+        , _apiVersion("api-version=" + EscapePathSegment(api_version))
+        , _application(requested_entitlement)
+        , _digest(DigestToken(entitlement_token))
+        , _released(false)
+    {
+        if (api_version.empty())
+        {
+            throw Exception("A lease needs the api-version of the server's lease operations.");
+        }
+
+        nlohmann::json body;
+        body["token"] = entitlement_token;
+        body["applicationId"] = requested_entitlement;
+        body["duration"] = LeaseDuration(duration);
+
+        std::string& id = _id;
+        std::string& expiry = _expiry;
+        EntitlementResult result = Send(
+            _url,
+            "softwareEntitlements?" + _apiVersion,
+            nullptr,
+            body.dump(),
+            _application,
+            _digest,
+            nullptr,
+            [&id, &expiry](TransportResponse& response) -> EntitlementResult
+            {
+                long code = response.http_status;
+                switch (code)
+                {
+                case 200:
+                {
+                    EntitlementResult granted = Granted(std::unique_ptr<Entitlement>());
+                    try
+                    {
+                        id = ExtractValue(response.body, "entitlementId");
+                        expiry = ExtractValue(response.body, "initialExpiryTime");
+                    }
+                    catch (const std::exception&)
+                    {
+                        granted = Failed(
+                            ErrorCategory::UnexpectedResponse,
+                            "Malformed response to a lease request: '" + response.body + "'");
+                    }
+                    return granted;
+                }
+
+                case 400:
+                case 403:
+                    return Rejected(response);
+
+                default:
+                    return Failed(ErrorCategory::UnexpectedResponse, Failure::Status, code, CURLE_OK, std::string());
+                }
+            });
+        TakeEntitlement(result);
+    }
+
+    const std::string& Id() const
+    {
+        return _id;
+    }
+
+    const std::string& Expiry() const
+    {
+        return _expiry;
+    }
+
+    void Renew(std::chrono::seconds duration, Cancellation* cancellation)
+    {
+        if (_released)
+        {
+            throw LeaseLostException("Lease " + _id + " has been released.");
+        }
+
+        nlohmann::json body;
+        body["duration"] = LeaseDuration(duration);
+
+        bool lost = false;
+        std::string& expiry = _expiry;
+        EntitlementResult result = Send(
+            _url,
+            Path(),
+            nullptr,
+            body.dump(),
+            _application,
+            _digest,
+            cancellation,
+            [&lost, &expiry](TransportResponse& response) -> EntitlementResult
+            {
+                long code = response.http_status;
+                switch (code)
+                {
+                case 200:
+                    return LeaseProperty(response, "expiryTime", expiry);
+
+                case 404:
+                case 409:
+                    lost = true;
+                    return Failed(ErrorCategory::UnexpectedResponse, Failure::ResponseBody, code, CURLE_OK, std::move(response.body));
+
+                case 400:
+                case 403:
+                    return Rejected(response);
+
+                default:
+                    return Failed(ErrorCategory::UnexpectedResponse, Failure::Status, code, CURLE_OK, std::string());
+                }
+            });
+
+        if (lost)
+        {
+            _released = true;
+            throw LeaseLostException(result.Message());
+        }
+        TakeEntitlement(result);
+    }
+
+    void Release()
+    {
+        if (_released)
+        {
+            return;
+        }
+
+        EntitlementResult result = Send(
+            _url,
+            Path(),
+            "DELETE",
+            std::string(),
+            _application,
+            _digest,
+            nullptr,
+            [](TransportResponse& response) -> EntitlementResult
+            {
+                //
+                // A lease the server does not know is as good as released.
+                //
+                long code = response.http_status;
+                return code == 204 || code == 404
+                    ? Granted(std::unique_ptr<Entitlement>())
+                    : Failed(ErrorCategory::UnexpectedResponse, Failure::Status, code, CURLE_OK, std::string());
+            });
+        TakeEntitlement(result);
+        _released = true;
+    }
+};
+
+
+Lease::Lease(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    std::chrono::seconds duration,
+    const std::string& api_version)
+    : _impl(new Impl(std::move(url), entitlement_token, requested_entitlement, duration, api_version))
+{
+}
+
+Lease::~Lease()
+{
+    try
+    {
+        _impl->Release();
+    }
+    catch (const std::exception&)
+    {
+    }
+}
+
+const std::string& Lease::Id() const
+{
+    return _impl->Id();
+}
+
+const std::string& Lease::Expiry() const
+{
+    return _impl->Expiry();
+}
+
+void Lease::Renew(std::chrono::seconds duration)
+{
+    _impl->Renew(duration, nullptr);
+}
+
+void Lease::Renew(std::chrono::seconds duration, const CancellationToken& cancellation)
+{
+    _impl->Renew(duration, Cancellation::Of(cancellation));
+}
+
+void Lease::Release()
+{
+    _impl->Release();
+}
+
+
+namespace Internal {
+
+TokenDigest DigestToken(const std::string& entitlement_token)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    TokenDigest digest = {};
+    if (EVP_Digest(entitlement_token.data(), entitlement_token.size(), hash, &size, EVP_sha256(), nullptr) == 1)
+    {
+        std::memcpy(digest.data(), hash, digest.size());
+    }
+    return digest;
+}
+
+void RecordRequest(
+    const std::string& endpoint,
+    const std::string& application,
+    const TokenDigest& digest,
+    const RequestRecord& record)
+{
+    FlightRecorder::Entry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.started_us = record.started_us;
+    entry.name_lookup_us = record.name_lookup_us;
+    entry.connect_us = record.connect_us;
+    entry.tls_handshake_us = record.tls_handshake_us;
+    entry.first_byte_us = record.first_byte_us;
+    entry.total_us = record.total_us;
+    entry.server_us = record.server_us;
+    entry.network_us = record.network_us;
+    entry.curl_code = record.curl_code;
+    entry.http_status = static_cast<std::int32_t>(record.http_status);
+    entry.attempt = record.attempt;
+    entry.category = static_cast<std::uint8_t>(record.category);
+    entry.pin_check = static_cast<std::uint8_t>(record.pin_check);
+    entry.digest = digest;
+    endpoint.copy(entry.endpoint, sizeof(entry.endpoint) - 1);
+    application.copy(entry.application, sizeof(entry.application) - 1);
+    record.client_request_id.copy(entry.client_request_id, sizeof(entry.client_request_id) - 1);
+    record.request_id.copy(entry.request_id, sizeof(entry.request_id) - 1);
+
+    s_flightRecorder.Record(entry);
+}
 
-        headers.value = curl_slist_append(nullptr, "Content-Type: application/json; odata=minimalmetadata");
+}   // namespace Internal
 
-        if (headers.value == nullptr)
-        {
-            throw Exception("Failed to allocate Content-Type header");
-        }
 
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_HTTPHEADER, headers.value));
+namespace {
 
-        nlohmann::json j;
-        j["token"] = entitlement_token;
-        j["applicationId"] = requested_entitlement;
+//
+// The service, as LoopbackTransport serves it.
+//
+class Loopback
+{
+    std::vector<std::string> _applications;
+    std::unique_ptr<STACK_OF(X509), ::ChainDeleter> _chain;
+    std::atomic<unsigned long long> _requests;
 
-        //
-        // We need to ensure the payload remains resident for the duration of
-        // the transfer.  We store it in a temporary here rather than have
-        // libcurl buffer it for us (by using CURLOPT_COPYPOSTFIELDS).
-        //
-        std::string body = j.dump();
-        ThrowIfCurlError(curl_easy_setopt(_curl.get(), CURLOPT_POSTFIELDS, body.c_str()));
+    bool Grants(const std::string& application) const
+    {
+        for (const std::string& granted : _applications)
+        {
+            if (granted == "*" || granted == application)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 
-        ThrowIfCurlError(curl_easy_perform(_curl.get()));
+    static void Respond(TransportResponse& response, long status, std::string body)
+    {
+        response.http_status = status;
+        response.body = std::move(body);
     }
 
     //
-    // Perform additional certificate checks:
-    // - Find any one of the certificates in the s_sslCerts vector by thumbprint.
-    // - Verify that such cetificate has the matching common name.
+    // Answers a request for an entitlement or a lease of the application it
+    // names, with body if the application is granted.
     //
-    void VerifyIntermediateCertificate(const std::string& url)
+    void Decide(const TransportRequest& request, TransportResponse& response, const std::string& body) const
     {
-        curl_certinfo* info;
-        ThrowIfCurlError(curl_easy_getinfo(_curl.get(), CURLINFO_CERTINFO, &info));
-
-        for (int i = 0; i < info->num_of_certs; i++)
+        std::string application;
+        try
         {
-            X509 cert = GetCertificate(info->certinfo[i]);
-
-            for (const auto& validCert : s_sslCerts)
-            {
-                if (!cert.MatchesThumbprint(validCert.thumbprint))
-                {
-                    continue;
-                }
+            application = ExtractValue(request.body, "applicationId");
+        }
+        catch (const std::exception&)
+        {
+            Respond(response, 400, "{\"code\":\"InvalidRequestBody\"}");
+            return;
+        }
 
-                auto certName = cert.CommonName();
-                if (certName != validCert.common_name)
-                {
-                    //
-                    // Thumbprint match, but common name mismatch.
-                    //
-                    throw Exception(
-                        "Certificate common name does not match, expected '" +
-                        validCert.common_name +
-                        "' but got '" +
-                        certName +
-                        "'");
-                }
+        if (Grants(application))
+        {
+            Respond(response, 200, body);
+            return;
+        }
 
-                if (validCert.allowed_dns_namespace.empty())
-                {
-                    return;
-                }
+        nlohmann::json denial;
+        denial["code"] = "EntitlementDenied";
+        denial["message"]["lang"] = "en-us";
+        denial["message"]["value"] = "Application " + application + " is not entitled.";
+        Respond(response, 403, denial.dump());
+    }
 
-                if (url.find(validCert.allowed_dns_namespace) != std::string::npos)
-                {
-                    return;
-                }
+public:
+    Loopback(const std::vector<std::string>& applications, const std::vector<::x509_st*>& chain)
+        : _applications(applications)
+        , _requests(0)
+    {
+        if (!chain.empty())
+        {
+            _chain.reset(::CopyChain(chain));
+            if (_chain == nullptr)
+            {
+                throw Exception("Failed to copy the loopback certificate chain");
             }
         }
-
-        throw Exception("None of the candidate certificates were found in certificate chain.");
     }
 
-    std::unique_ptr<Entitlement> GetEntitlement()
+    void Serve(const TransportRequest& request, TransportResponse& response, Cancellation* cancellation)
     {
-        long code;
-        ThrowIfCurlError(curl_easy_getinfo(_curl.get(), CURLINFO_RESPONSE_CODE, &code));
-
-        if (code == 200)
+        if (IsCancelled(cancellation))
         {
-            return std::unique_ptr<Entitlement>(new Entitlement(_response));
+            response.category = ErrorCategory::Cancelled;
+            return;
         }
 
-        throw Exception(GetErrorMessage(code));
-    }
+        std::string n = std::to_string(++_requests);
+        response.request_id = "loopback-" + n;
+        response.server_timing = "loopback;dur=0";
 
-    static std::unique_ptr<Entitlement> GetEntitlement(
-        const std::string& url,
-        const std::string& entitlement_token,
-        const std::string& requested_entitlement)
-    {
-        Curl curl;
-        curl.Post(url + "softwareEntitlements?api-version=2017-05-01.5.0", entitlement_token, requested_entitlement);
+        if (_chain)
+        {
+            try
+            {
+                VerifyCertificateChain(_chain.get(), request.url);
+            }
+            catch (const std::exception& e)
+            {
+                response.pin_check = PinCheck::Failed;
+                response.category = ErrorCategory::PinFailure;
+                response.error = e.what();
+                return;
+            }
+            response.pin_check = PinCheck::Passed;
+        }
 
-        curl.VerifyIntermediateCertificate(url);
+        const std::string collection("softwareEntitlements");
+        std::string resource = request.path.substr(0, request.path.find('?'));
+        bool post = request.method == nullptr;
+        bool lease = request.path.find(CheckApiVersion) == std::string::npos;
 
-        return curl.GetEntitlement();
+        if (post && resource == collection)
+        {
+            Decide(
+                request,
+                response,
+                lease
+                    ? "{\"entitlementId\":\"lease-" + n + "\",\"initialExpiryTime\":\"9999-12-31T23:59:59Z\"}"
+                    : "{\"id\":\"entitlement-" + n + "\",\"vmid\":\"loopback\"}");
+        }
+        else if (lease && resource.compare(0, collection.size() + 1, collection + "/") == 0)
+        {
+            if (post)
+            {
+                Respond(response, 200, "{\"expiryTime\":\"9999-12-31T23:59:59Z\"}");
+            }
+            else
+            {
+                Respond(response, std::strcmp(request.method, "DELETE") == 0 ? 204 : 405, std::string());
+            }
+        }
+        else
+        {
+            Respond(response, 404, std::string());
+        }
     }
+
+private:
+    Loopback(const Loopback&);
+    Loopback& operator=(const Loopback&);
 };
 
-#ifdef _WIN32
-struct WinHttpDeleter
+}   // anonymous namespace
+
+
+namespace Internal {
+
+TransportRequest::TransportRequest()
+    : method(nullptr)
 {
-    void operator()(HINTERNET h)
+}
+
+TransportResponse::TransportResponse()
+    : category(ErrorCategory::None)
+    , curl_code(0)
+    , http_status(0)
+    , pin_check(PinCheck::NotMade)
+    , name_lookup_us(0)
+    , connect_us(0)
+    , tls_handshake_us(0)
+    , first_byte_us(0)
+    , total_us(0)
+    , server_latency_us(0)
+{
+}
+
+Transport HttpsTransport()
+{
+    return [](const TransportRequest& request, TransportResponse& response, Cancellation* cancellation)
     {
-        WinHttpCloseHandle(h);
+        SendOverCurl(request, response, cancellation, std::string());
+    };
+}
+
+Transport UnixSocketTransport(const std::string& path)
+{
+    if (path.empty())
+    {
+        throw Exception("A Unix domain socket path is required.");
     }
-};
 
-typedef std::unique_ptr<void, WinHttpDeleter> WinHttpHandle;
+    return [path](const TransportRequest& request, TransportResponse& response, Cancellation* cancellation)
+    {
+        SendOverCurl(request, response, cancellation, path);
+    };
+}
 
-//
-// OpenSSL does not hook into the Windows Automatic Root Certificates Update process.
-// This results in certificate validation failures, so we perform a dummy connection
-// using WinHTTP which will setup the root cert store correctly.
-//
-void EnsureRootCertsArePopulated(const std::string& url)
+Transport LoopbackTransport(
+    const std::vector<std::string>& applications,
+    const std::vector<::x509_st*>& chain)
 {
-    std::string prefix("https://");
-    size_t start = url.rfind(prefix, 0);
-    if (start == std::string::npos)
+    std::shared_ptr<Loopback> loopback = std::make_shared<Loopback>(applications, chain);
+    return [loopback](const TransportRequest& request, TransportResponse& response, Cancellation* cancellation)
     {
-        throw Exception("Malformed URL: " + url);
-    }
+        loopback->Serve(request, response, cancellation);
+    };
+}
 
-    start += prefix.length();
-    size_t end = url.find("/", start);
-    std::string temp;
-    if (end == std::string::npos)
+void SetTransport(const std::string& url, Transport transport)
+{
+    std::string normalized = NormalizeUrl(url);
+
+    std::lock_guard<std::mutex> lock(s_transportLock);
+    if (transport)
     {
-        temp = url.substr(start);
+        s_transports[normalized] = std::make_shared<const Transport>(std::move(transport));
     }
     else
     {
-        temp = url.substr(start, end - start);
+        s_transports.erase(normalized);
     }
+    s_transportsSet = !s_transports.empty();
+}
 
-    std::wstring hostname(temp.cbegin(), temp.cend());
+}   // namespace Internal
 
-    WinHttpHandle hSession(
-        WinHttpOpen(
-            L"Azure Batch Software Entitlement Service client",
-            WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY,
-            WINHTTP_NO_PROXY_NAME,
-            WINHTTP_NO_PROXY_BYPASS,
-            0)
-    );
-    ThrowIfWin32Error(hSession == nullptr);
 
-    WinHttpHandle hConn(
-        WinHttpConnect(hSession.get(), hostname.c_str(), INTERNET_DEFAULT_HTTPS_PORT, 0)
-    );
-    ThrowIfWin32Error(hConn == nullptr);
+namespace {
 
-    WinHttpHandle hRequest(
-        WinHttpOpenRequest(
-            hConn.get(),
-            nullptr,
-            nullptr,
-            nullptr,
-            WINHTTP_NO_REFERER,
-            WINHTTP_DEFAULT_ACCEPT_TYPES,
-            WINHTTP_FLAG_SECURE)
-    );
-    ThrowIfWin32Error(hRequest == nullptr);
+const char* CategoryName(ErrorCategory category)
+{
+    switch (category)
+    {
+    case ErrorCategory::None:
+        return "None";
+    case ErrorCategory::Denied:
+        return "Denied";
+    case ErrorCategory::BadRequest:
+        return "BadRequest";
+    case ErrorCategory::Transport:
+        return "Transport";
+    case ErrorCategory::PinFailure:
+        return "PinFailure";
+    case ErrorCategory::Timeout:
+        return "Timeout";
+    case ErrorCategory::UnexpectedResponse:
+        return "UnexpectedResponse";
+    case ErrorCategory::Internal:
+        return "Internal";
+    case ErrorCategory::Cancelled:
+        return "Cancelled";
+    case ErrorCategory::UnusableToken:
+        return "UnusableToken";
+    default:
+        return "Unknown";
+    }
+}
 
-    ThrowIfWin32Error(TRUE != WinHttpSendRequest(
-        hRequest.get(),
-        WINHTTP_NO_ADDITIONAL_HEADERS,
-        0,
-        WINHTTP_NO_REQUEST_DATA,
-        0,
-        0,
-        0)
-    );
+const char* PinCheckName(PinCheck check)
+{
+    switch (check)
+    {
+    case PinCheck::Passed:
+        return "Passed";
+    case PinCheck::Failed:
+        return "Failed";
+    default:
+        return "NotMade";
+    }
 }
+
+//
+// Formats microseconds since the Unix epoch as an ISO 8601 UTC time.
+//
+std::string FormatTime(std::int64_t microseconds)
+{
+    std::time_t seconds = static_cast<std::time_t>(microseconds / 1000000);
+    std::tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
 #endif
 
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    std::ostringstream time;
+    time << text << '.' << std::setw(6) << std::setfill('0') << microseconds % 1000000 << 'Z';
+    return time.str();
+}
+
 }   // anonymous namespace
 
 
-Exception::Exception(const std::string& message)
-    : std::runtime_error(message)
+RequestRecord::RequestRecord()
+    : started_us(0)
+    , attempt(0)
+    , category(ErrorCategory::None)
+    , curl_code(0)
+    , http_status(0)
+    , pin_check(PinCheck::NotMade)
+    , name_lookup_us(0)
+    , connect_us(0)
+    , tls_handshake_us(0)
+    , first_byte_us(0)
+    , total_us(0)
+    , server_us(0)
+    , network_us(0)
 {
 }
 
-Exception::Exception(const char *message)
-    : std::runtime_error(message)
+
+std::vector<RequestRecord> RecentRequests()
 {
+    std::vector<FlightRecorder::Entry> entries = s_flightRecorder.Entries();
+
+    std::vector<RequestRecord> records(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const FlightRecorder::Entry& entry = entries[i];
+        RequestRecord& record = records[i];
+        record.started_us = entry.started_us;
+        record.endpoint = entry.endpoint;
+        record.application = entry.application;
+
+        static const char digits[] = "0123456789abcdef";
+        for (std::uint8_t byte : entry.digest)
+        {
+            record.token_digest += digits[byte >> 4];
+            record.token_digest += digits[byte & 0xf];
+        }
+
+        record.attempt = entry.attempt;
+        record.category = static_cast<ErrorCategory>(entry.category);
+        record.curl_code = entry.curl_code;
+        record.http_status = entry.http_status;
+        record.pin_check = static_cast<PinCheck>(entry.pin_check);
+        record.name_lookup_us = entry.name_lookup_us;
+        record.connect_us = entry.connect_us;
+        record.tls_handshake_us = entry.tls_handshake_us;
+        record.first_byte_us = entry.first_byte_us;
+        record.total_us = entry.total_us;
+        record.client_request_id = entry.client_request_id;
+        record.request_id = entry.request_id;
+        record.server_us = entry.server_us;
+        record.network_us = entry.network_us;
+    }
+    return records;
 }
 
 
-Entitlement::Entitlement(const std::string& response)
-    : m_id(ExtractValue(response, "id"))
-    , m_vmid(ExtractValue(response, "vmid"))
+std::string DescribeRecentRequests()
 {
+    std::ostringstream description;
+    for (const RequestRecord& record : RecentRequests())
+    {
+        description
+            << FormatTime(record.started_us)
+            << " endpoint=" << record.endpoint
+            << " application=" << record.application
+            << " token=" << record.token_digest
+            << " client_request_id=" << record.client_request_id
+            << " request_id=" << record.request_id
+            << " attempt=" << record.attempt
+            << " category=" << CategoryName(record.category)
+            << " http_status=" << record.http_status
+            << " curl_code=" << record.curl_code
+            << " pin_check=" << PinCheckName(record.pin_check)
+            << " name_lookup_us=" << record.name_lookup_us
+            << " connect_us=" << record.connect_us
+            << " tls_handshake_us=" << record.tls_handshake_us
+            << " first_byte_us=" << record.first_byte_us
+            << " total_us=" << record.total_us
+            << " server_us=" << record.server_us
+            << " network_us=" << record.network_us
+            << '\n';
+    }
+    return description.str();
 }
 
-Entitlement::~Entitlement()
+
+ConcurrencyLimit::ConcurrencyLimit()
+    : limit(0)
+    , in_flight(0)
+    , waiting(0)
+    , backoffs(0)
+    , latency_us(0)
+    , baseline_latency_us(0)
 {
 }
 
-const std::string& Entitlement::Id() const
+
+void SetMaxConcurrency(unsigned int maximum)
 {
-    return m_id;
+    s_limiter.SetMaximum(maximum);
 }
 
-const std::string& Entitlement::VmId() const
+
+std::vector<ConcurrencyLimit> ConcurrencyLimits()
 {
-    return m_vmid;
+    return s_limiter.Limits();
 }
 
 
-int Init()
+std::string DescribeConcurrencyLimits()
 {
-    s_sslCerts.insert(s_sslCerts.end(), s_microsoftIntermediateCerts.cbegin(), s_microsoftIntermediateCerts.cend());
-    return curl_global_init(CURL_GLOBAL_ALL);
+    std::ostringstream description;
+    for (const ConcurrencyLimit& limit : ConcurrencyLimits())
+    {
+        description
+            << "endpoint=" << limit.endpoint
+            << " limit=" << limit.limit
+            << " in_flight=" << limit.in_flight
+            << " waiting=" << limit.waiting
+            << " backoffs=" << limit.backoffs
+            << " latency_us=" << limit.latency_us
+            << " baseline_latency_us=" << limit.baseline_latency_us
+            << '\n';
+    }
+    return description.str();
 }
 
 
-void Cleanup()
+AdmissionControl::AdmissionControl()
+    : rate(0)
+    , burst(1)
+    , startup_window(0)
 {
-    curl_global_cleanup();
 }
 
 
-//
-// Returns an Entitlement object, throws an EntitlementException
-// providing details of entitlement validation failure.
-//
-std::unique_ptr<Entitlement> GetEntitlement(
-    std::string url,
-    const std::string& entitlement_token,
-    const std::string& requested_entitlement,
-    unsigned int retries)
+void SetAdmissionControl(const AdmissionControl& control)
 {
-    std::lock_guard<std::mutex> lock(s_lock);
+    s_admission.Set(control);
+}
 
-    if (url.rfind("https://", 0) == std::string::npos)
-    {
-        throw Exception("Invalid input URL: must start with \"https://\"");
-    }
 
-    if (url.find('?') != std::string::npos)
-    {
-        throw Exception("Invalid input URL: must not contain any query params");
-    }
+void SetInteractive(bool interactive)
+{
+    s_admission.SetInteractive(interactive);
+}
 
-    size_t pos = url.find('/', 8);
-    if (pos < url.length() - 1)
-    {
-        pos = url.find('/', pos + 1);
-        if (pos < url.length() - 1)
-        {
-            throw Exception("Invalid input URL: should not include more than one slash after the hostname (excluding trailing slash).");
-        }
-    }
 
-    if (pos == std::string::npos)
-    {
-        url += '/';
-    }
+AdmissionStats::AdmissionStats()
+    : admitted(0)
+    , delayed(0)
+    , bypassed(0)
+    , total_wait_us(0)
+    , max_wait_us(0)
+    , startup_delay_us(0)
+{
+}
 
-    for (unsigned int retry = 1; retry <= retries; ++retry)
-    {
-        try
-        {
-            return Curl::GetEntitlement(url, entitlement_token, requested_entitlement);
-        }
-        catch (const Curl::CurlException& e)
-        {
-            if (e.GetCode() == CURLE_OPERATION_TIMEDOUT)
-            {
-                std::this_thread::sleep_for(std::chrono::seconds(retry));
-            }
-#ifdef _WIN32
-            else if (e.GetCode() == CURLE_SSL_CACERT)
-            {
-                EnsureRootCertsArePopulated(url);
-            }
-#endif
-            else
-            {
-                throw e;
-            }
-        }
-    }
 
-    return Curl::GetEntitlement(url, entitlement_token, requested_entitlement);
+AdmissionStats AdmissionStatistics()
+{
+    return s_admission.Stats();
 }
 
 
-void AddSslCertificate(
-    const std::string& ssl_cert_thumbprint,
-    const std::string& ssl_cert_common_name)
+std::string DescribeAdmission()
 {
-    std::lock_guard<std::mutex> lock(s_lock);
-
-    CertInfo info = { ThumbprintToBinary(ssl_cert_thumbprint), ssl_cert_common_name, {} };
-    s_sslCerts.push_back(info);
+    AdmissionStats stats = AdmissionStatistics();
+    std::ostringstream description;
+    description
+        << "admitted=" << stats.admitted
+        << " delayed=" << stats.delayed
+        << " bypassed=" << stats.bypassed
+        << " total_wait_us=" << stats.total_wait_us
+        << " max_wait_us=" << stats.max_wait_us
+        << " startup_delay_us=" << stats.startup_delay_us
+        << '\n';
+    return description.str();
 }
 
-
 }
 }
 }
@@ -1,22 +1,53 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <exception>
+#include <stdexcept>
 #include <memory>
+#include <functional>
+#include <vector>
 
 namespace Microsoft {
 namespace Azure {
 namespace Batch {
 namespace SoftwareEntitlement {
 
+namespace Internal {
+class Cancellation;
+}
+
+//
+// When the library initializes libcurl and OpenSSL.
+//
+enum class InitMode
+{
+    //
+    // During Init, which must then be invoked from the program's entry
+    // function (e.g. 'main'), as libcurl older than 7.84.0 has an absurd
+    // requirement that no other threads exist in the application when it is
+    // initialized.  See https://curl.haxx.se/libcurl/c/curl_global_init.html.
+    //
+    Eager,
+
+    //
+    // On the first entitlement check, from whichever thread makes it, so
+    // that runs which never check an entitlement do not pay for it.  The
+    // library serializes its own initialization, so this is safe unless
+    // other code in the application initializes libcurl concurrently.
+    // Checks made without calling Init at all behave the same way.
+    //
+    OnFirstUse
+};
+
 //
-// The following initialization function must be invoked from the program's
-// entry function (e.g. 'main'), as this library uses libcurl which has an
-// absurd requirement that no other threads exist in the application when it
-// is initialized.  See https://curl.haxx.se/libcurl/c/curl_global_init.html.
+// Initializes the library.  Init may be called more than once; each call
+// should be matched by a call to Cleanup, and only the last Cleanup releases
+// libcurl.
 //
 // Returns 0 if successful.
 //
-int Init();
+int Init(InitMode mode = InitMode::Eager);
 
 void Cleanup();
 
@@ -30,6 +61,79 @@ public:
 };
 
 
+//
+// Thrown when the server denies the requested entitlement (HTTP 403
+// EntitlementDenied), as opposed to rejecting the token or failing to
+// respond.
+//
+class EntitlementDeniedException : public Exception
+{
+private:
+    bool m_cached;
+
+public:
+    EntitlementDeniedException(const std::string& message, bool cached);
+
+    //
+    // True if the denial was remembered from an earlier check rather than
+    // received from the server for this one (see SetDenialLifetime).
+    //
+    bool Cached() const;
+};
+
+
+//
+// The outcome of a check cancelled before it finished (see CancellationToken
+// and AsyncClient::Cancel).
+//
+class CheckCancelledException : public Exception
+{
+public:
+    CheckCancelledException();
+};
+
+
+//
+// Thrown by Lease::Renew when the server no longer holds the lease: it has
+// been released, or the server does not know it.
+//
+class LeaseLostException : public Exception
+{
+public:
+    explicit LeaseLostException(const std::string& message);
+};
+
+
+//
+// Cancels GetEntitlement and TryGetEntitlement calls from another thread,
+// such as when a task is being terminated or the application is shutting
+// down.  Copies share their state: cancelling one cancels the checks given
+// any of them, those in progress and those yet to start.
+//
+// A cancelled check returns within milliseconds, whether it was waiting for
+// the server (even to connect), to retry, or for another call's check of the
+// same entitlement; GetEntitlement throws a CheckCancelledException, and
+// TryGetEntitlement reports ErrorCategory::Cancelled.  Other calls waiting
+// for a cancelled call's check make their own.
+//
+class CancellationToken
+{
+private:
+    friend class Internal::Cancellation;
+    std::shared_ptr<Internal::Cancellation> m_state;
+
+public:
+    CancellationToken();
+
+    //
+    // May be called from any thread, and more than once.
+    //
+    void Cancel() const;
+
+    bool IsCancelled() const;
+};
+
+
 class Entitlement
 {
 private:
@@ -49,7 +153,13 @@ public:
 
 //
 // Returns an Entitlement object, throws an Exception providing details of
-// entitlement validation failure.
+// entitlement validation failure.  A denial is thrown as an
+// EntitlementDeniedException, and may be remembered for a short time (see
+// SetDenialLifetime).
+//
+// Calls made while another for the same url, token and application is in
+// progress wait for it rather than repeating the request, and return the
+// same entitlement or throw the same Exception; they share its retries.
 //
 std::unique_ptr<Entitlement> GetEntitlement(
     std::string url,
@@ -58,12 +168,849 @@ std::unique_ptr<Entitlement> GetEntitlement(
     unsigned int retries = 5
 );
 
+//
+// As GetEntitlement, but cancelled through cancellation.
+//
+std::unique_ptr<Entitlement> GetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries = 5
+);
+
+
+//
+// Why an entitlement check failed.
+//
+enum class ErrorCategory
+{
+    //
+    // The entitlement was granted.
+    //
+    None,
+
+    //
+    // The server denied the requested entitlement (HTTP 403
+    // EntitlementDenied).
+    //
+    Denied,
+
+    //
+    // The server rejected the request, for example because the token is
+    // invalid or has expired (HTTP 400, or any other 403).
+    //
+    BadRequest,
+
+    //
+    // The server could not be reached, or the connection failed; curl_code
+    // says how.
+    //
+    Transport,
+
+    //
+    // The server's certificate chain failed the pinned certificate checks
+    // (see AddSslCertificate), so the token was not sent.
+    //
+    PinFailure,
+
+    //
+    // The request timed out, after any retries.
+    //
+    Timeout,
+
+    //
+    // The server responded with any other status, or with a body that could
+    // not be read.
+    //
+    UnexpectedResponse,
+
+    //
+    // The check could not be made: the URL is invalid, or libcurl could not
+    // be loaded or initialized.
+    //
+    Internal,
+
+    //
+    // The check was cancelled through its CancellationToken.
+    //
+    Cancelled,
+
+    //
+    // The token's own claims show that the server would refuse it: it has
+    // expired, is not yet valid, or does not list the application.  Only
+    // reported with SetTokenPreCheck on, without contacting the server.
+    //
+    UnusableToken
+};
+
+
+//
+// The outcome of TryGetEntitlement.  entitlement is set if, and only if,
+// category is ErrorCategory::None.
+//
+struct EntitlementResult
+{
+    std::unique_ptr<Entitlement> entitlement;
+    ErrorCategory category;
+
+    //
+    // HTTP status of the response, or 0 if none was received.
+    //
+    long http_status;
+
+    //
+    // CURLcode of the transfer; 0 if it completed.
+    //
+    int curl_code;
+
+    //
+    // True if the outcome was remembered from an earlier check rather than
+    // received from the server for this one.
+    //
+    bool cached;
+
+    //
+    // Builds the message; set by the library for failed checks.
+    //
+    std::function<std::string()> describe;
 
+    EntitlementResult();
+
+    EntitlementResult(EntitlementResult&& rhs);
+
+    EntitlementResult& operator=(EntitlementResult&& rhs);
+
+    //
+    // The message of the Exception GetEntitlement would have thrown, or an
+    // empty string if the entitlement was granted.  Built on the first call,
+    // so that callers which only look at category do not pay for it.
+    //
+    const std::string& Message() const;
+
+private:
+    mutable std::string _message;
+    mutable bool _described;
+};
+
+
+//
+// As GetEntitlement, but reports every failure in the result rather than
+// throwing, for callers to which denials and other failures are routine.
+// Only fails to return if memory runs out.
+//
+EntitlementResult TryGetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries = 5
+);
+
+EntitlementResult TryGetEntitlement(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries = 5
+);
+
+
+//
+// Entitlement servers that can answer the same checks, such as the
+// endpoints of several regions, for GetEntitlement to choose between.
+//
+// The library tracks, across all sets, a moving average of the latency and
+// error rate of each endpoint, and sends each check to the fastest healthy
+// endpoint.  An endpoint that fails a check (without a response, or with an
+// unexpected status) is avoided for 30 seconds unless every endpoint is
+// failing; the check moves on at once to the next endpoint, the attempt
+// counting against its retries.  Pinned certificates that only apply to a
+// DNS namespace, such as those of the sovereign clouds, are checked against
+// each endpoint's own URL.
+//
+class EndpointSet
+{
+private:
+    std::vector<std::string> m_urls;
+    std::vector<double> m_weights;
+
+public:
+    //
+    // Adds an endpoint.  Of endpoints equally fast, the one added first is
+    // used.  An endpoint of weight 2 is preferred to one of weight 1 unless
+    // it is more than twice as slow, and so on.
+    //
+    // Throws an Exception if url is not a valid entitlement server URL, is
+    // already in the set, or if weight is not positive.
+    //
+    void Add(const std::string& url, double weight = 1.0);
+
+    const std::vector<std::string>& Urls() const;
+
+    const std::vector<double>& Weights() const;
+};
+
+
+//
+// As GetEntitlement and TryGetEntitlement, against any of endpoints.  The
+// outcome is remembered, and checks in progress are shared, for the set as a
+// whole.  An empty set is an Exception, or ErrorCategory::Internal.
+//
+std::unique_ptr<Entitlement> GetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries = 5
+);
+
+EntitlementResult TryGetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    unsigned int retries = 5
+);
+
+std::unique_ptr<Entitlement> GetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries = 5
+);
+
+EntitlementResult TryGetEntitlement(
+    const EndpointSet& endpoints,
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement,
+    const CancellationToken& cancellation,
+    unsigned int retries = 5
+);
+
+
+//
+// Starts opening a connection to the server at url in the background,
+// completing the TLS handshake and the pinned certificate checks, for the
+// next GetEntitlement against url to use; returns without waiting.  Does
+// nothing if a connection to url is already open or being opened.
+//
+// GetEntitlement keeps its connection open for the next check against the
+// same server in the same way.  Cleanup abandons warm-ups in progress and
+// closes the connections kept.
+//
+// Throws an Exception if url is not a valid entitlement server URL.
+//
+void Warmup(const std::string& url);
+
+
+//
+// Sets how long GetEntitlement and Prefetch remember that the server denied
+// an entitlement, rethrowing the denial for the same URL, token and
+// application without contacting the server; zero or less, the default,
+// stops denials being remembered.  Only denials are remembered: failures to
+// reach the server, and other errors, are never.  Denials already
+// remembered keep their lifetime.  At most 4096 outcomes, entitlements and
+// denials together, are remembered at once; when full, the one due to be
+// forgotten soonest makes way.
+//
+void SetDenialLifetime(std::chrono::seconds lifetime);
+
+
+//
+// Sets whether GetEntitlement, TryGetEntitlement and Prefetch first read the
+// claims of the token, when it is a signed but unencrypted JWT, and fail a
+// check at once with ErrorCategory::UnusableToken if they show that the
+// server would refuse it: exp has passed, nbf has yet to, exp is missing, or
+// the app claim does not list the application.  The signature is not
+// checked, so a token that passes may still be refused by the server; the
+// server's 60 seconds of clock skew are allowed.  Off by default.
+//
+// Whether or not it is on, entitlements and denials are never remembered
+// beyond the exp claim of such a token.
+//
+void SetTokenPreCheck(bool enabled);
+
+
+//
+// Accepts servers whose certificate chain includes the certificate with this
+// thumbprint and common name.  May be called at any time, from any thread;
+// checks already past the TLS handshake are unaffected, and checks never wait
+// for it.
+//
 void AddSslCertificate(
     const std::string& ssl_cert_thumbprint,
     const std::string& ssl_cert_common_name
 );
 
+
+//
+// The outcome of an entitlement check made through AsyncClient.  Exactly one
+// of entitlement and error is set; error holds the Exception GetEntitlement
+// would have thrown.
+//
+struct CheckResult
+{
+    std::unique_ptr<Entitlement> entitlement;
+    std::exception_ptr error;
+
+    //
+    // HTTP status of the response, or 0 if none was received.
+    //
+    long http_status;
+
+    //
+    // CURLcode of the transfer; 0 if it completed.
+    //
+    int curl_code;
+
+    CheckResult();
+
+    CheckResult(CheckResult&& rhs);
+
+    CheckResult& operator=(CheckResult&& rhs);
+};
+
+
+//
+// Makes many entitlement checks against one server concurrently from a
+// single thread, reusing connections between checks.  Checks are made once,
+// without the retries of GetEntitlement.
+//
+// An AsyncClient must only be used by one thread at a time, except for
+// Wakeup; separate instances may be used concurrently, and alongside
+// GetEntitlement.
+//
+class AsyncClient
+{
+public:
+    typedef std::function<void(CheckResult)> Callback;
+
+    //
+    // Identifies a check started by this client, for Cancel.
+    //
+    typedef std::uint64_t CheckId;
+
+#ifdef _WIN32
+    typedef std::uintptr_t Socket;
+#else
+    typedef int Socket;
+#endif
+
+    //
+    // Ways in which a socket can be ready, combined in the events passed to
+    // EventLoop::watchSocket and SocketReady.
+    //
+    enum SocketEvents
+    {
+        Readable = 1,
+        Writable = 2,
+        SocketError = 4
+    };
+
+    //
+    // The application's event loop (epoll, libuv and the like), for
+    // UseEventLoop.  None of the functions may throw.
+    //
+    struct EventLoop
+    {
+        //
+        // Starts watching socket for events (Readable, Writable or both),
+        // replacing any watched before; stops watching it if events is zero.
+        //
+        std::function<void(Socket socket, int events)> watchSocket;
+
+        //
+        // Arranges for TimerExpired to be called in timeout_ms, replacing
+        // any timer set before; -1 cancels the timer.  Zero asks for a call
+        // as soon as possible, from the loop rather than from within
+        // setTimer.
+        //
+        std::function<void(long timeout_ms)> setTimer;
+
+        //
+        // Optional.  Called from any thread by Wakeup and Cancel, and when a
+        // queued check may start (see SetMaxConcurrency), to have the loop
+        // call TimerExpired soon, such as by writing to an eventfd it
+        // watches.  Without it, queued checks are started as the client's
+        // own checks finish, or polled for every 10ms when it has none.
+        //
+        std::function<void()> wakeup;
+    };
+
+    //
+    // Throws an Exception if url is not a valid entitlement server URL.
+    //
+    explicit AsyncClient(const std::string& url);
+
+    ~AsyncClient();
+
+    //
+    // Starts a check, or queues it while its server has as many checks in
+    // flight as it may (see SetMaxConcurrency); callback is invoked from a
+    // later call to Perform once the check finishes.
+    //
+    CheckId Check(
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        Callback callback
+    );
+
+    //
+    // Starts a check against another server, sharing this client's
+    // connections.  Throws an Exception if url is not a valid entitlement
+    // server URL.
+    //
+    CheckId Check(
+        const std::string& url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        Callback callback
+    );
+
+    //
+    // Makes progress on checks in flight, waiting up to timeout_ms for
+    // network activity, and invokes the callbacks of those that finish.
+    // Returns the number of checks still in flight or queued.
+    //
+    // Should a callback throw, the callbacks of the other checks that
+    // finished are still invoked, and Perform then rethrows the first
+    // exception thrown; the checks still pending are unaffected.  The same
+    // goes for SocketReady and TimerExpired.
+    //
+    size_t Perform(int timeout_ms);
+
+    //
+    // Returns the number of checks in flight or queued.
+    //
+    size_t Pending() const;
+
+    //
+    // May be called from any thread to make a Perform that is waiting return
+    // early, such as when there are new checks to start.  With libcurl older
+    // than 7.68.0 this does nothing, and Perform waits out its timeout.
+    //
+    void Wakeup();
+
+    //
+    // Stops a check: unless it has already finished, its callback is invoked
+    // from the next call to Perform with a CheckCancelledException.  May be
+    // called from any thread, and wakes a Perform that is waiting, as Wakeup
+    // does.
+    //
+    void Cancel(CheckId check);
+
+    //
+    // Limits how long each check started afterwards may take, failing it as
+    // a timeout once exceeded.  Zero, the default, leaves only the
+    // connection timeout.
+    //
+    void SetTimeout(std::chrono::milliseconds timeout);
+
+    //
+    // Has checks driven by the application's event loop rather than by
+    // Perform, so that they need no thread of their own: the client asks
+    // the loop to watch sockets and set a timer, and the loop calls
+    // SocketReady and TimerExpired, which make progress and invoke the
+    // callbacks of the checks that finish.  Must be called before the first
+    // check; Perform may not be used afterwards.  With an event loop, a
+    // cancellation takes effect at the next call to SocketReady or
+    // TimerExpired.
+    //
+    void UseEventLoop(EventLoop loop);
+
+    //
+    // Called by the event loop when socket is ready; events combines
+    // Readable, Writable and SocketError, or is zero if not known.
+    //
+    void SocketReady(Socket socket, int events);
+
+    //
+    // Called by the event loop when the timer set through setTimer expires.
+    //
+    void TimerExpired();
+
+private:
+    AsyncClient(const AsyncClient&);
+    AsyncClient& operator=(const AsyncClient&);
+
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+//
+// Checks entitlement_token for each of requested_entitlements concurrently,
+// returning once every check has finished, so that it takes about as long as
+// the slowest check rather than all of them together.  Returns a result for
+// each requested entitlement, in order; checks are made once, without the
+// retries of GetEntitlement.
+//
+// The entitlements granted are kept for five minutes, for GetEntitlement to
+// return at once when asked for them with the same URL and token; denials
+// are kept as GetEntitlement keeps them, and are not checked again while
+// kept.
+//
+// Throws an Exception if url is not a valid entitlement server URL.
+//
+std::vector<CheckResult> Prefetch(
+    std::string url,
+    const std::string& entitlement_token,
+    const std::vector<std::string>& requested_entitlements
+);
+
+
+//
+// An entitlement leased from the server for a limited time, for applications
+// that hold an entitlement while they run rather than check it once.  The
+// lease is acquired on construction, must be renewed before it expires, and
+// is released on destruction if not before.  Requests reuse the connections
+// kept by GetEntitlement, and pass the same pinned certificate checks; they
+// are made once, without retries.  Only one thread at a time may use a
+// Lease.
+//
+// Leases need a server supporting the acquire, renew and release operations,
+// and the api-version it offers them under; no released version of the
+// service has them yet, and 'sestest server' offers them under
+// "9999-09-09.99.99".
+//
+class Lease
+{
+public:
+    //
+    // Acquires a lease of requested_entitlement for duration, with requests
+    // made under api_version.  Throws an EntitlementDeniedException if the
+    // server denies it, or an Exception if it cannot be acquired or
+    // api_version is empty.
+    //
+    Lease(
+        std::string url,
+        const std::string& entitlement_token,
+        const std::string& requested_entitlement,
+        std::chrono::seconds duration,
+        const std::string& api_version);
+
+    //
+    // Releases the lease unless already released, ignoring failures.
+    //
+    ~Lease();
+
+    //
+    // The identifier given to the lease by the server.
+    //
+    const std::string& Id() const;
+
+    //
+    // When the lease expires unless renewed, in ISO 8601 as reported by the
+    // server.
+    //
+    const std::string& Expiry() const;
+
+    //
+    // Extends the lease to duration from now.  Throws a LeaseLostException if
+    // the server no longer holds it, or an Exception if the server could not
+    // be reached or failed, in which case the lease stands until it expires
+    // and the renewal may be retried; a cancelled renewal throws a
+    // CheckCancelledException.
+    //
+    void Renew(std::chrono::seconds duration);
+
+    void Renew(std::chrono::seconds duration, const CancellationToken& cancellation);
+
+    //
+    // Releases the lease, throwing an Exception if the server could not be
+    // told.  Does nothing if already released.
+    //
+    void Release();
+
+private:
+    Lease(const Lease&);
+    Lease& operator=(const Lease&);
+
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+//
+// How the pinned certificate checks (see AddSslCertificate) went for the
+// connection a request was sent over.
+//
+enum class PinCheck
+{
+    //
+    // The request reused a connection, or resumed a TLS session, checked
+    // when it was first opened, or it failed before the server presented its
+    // certificates.
+    //
+    NotMade,
+
+    Passed,
+
+    Failed
+};
+
+
+//
+// A request made to an entitlement server, as kept by the flight recorder
+// (see RecentRequests).  Durations are in microseconds from the start of the
+// request, and zero for stages it did not reach or that a reused connection
+// skipped; libcurl reports them from 7.61.0.
+//
+struct RequestRecord
+{
+    //
+    // When the request started, in microseconds since the Unix epoch.
+    //
+    std::int64_t started_us;
+
+    //
+    // The server's URL, up to 127 characters.
+    //
+    std::string endpoint;
+
+    //
+    // The requested application, up to 63 characters.
+    //
+    std::string application;
+
+    //
+    // The first 8 bytes of the SHA-256 hash of the token, in hexadecimal,
+    // to tell tokens apart; the token itself is never recorded.
+    //
+    std::string token_digest;
+
+    //
+    // The client-request-id header sent with the request, a new UUID for
+    // every attempt, and the request-id header of the response, up to 63
+    // characters and empty if there was none; to find the request in the
+    // server's logs.
+    //
+    std::string client_request_id;
+    std::string request_id;
+
+    //
+    // 1 for the first attempt of a check, 2 for the first retry, and so on.
+    //
+    unsigned int attempt;
+
+    ErrorCategory category;
+    int curl_code;
+    long http_status;
+    PinCheck pin_check;
+
+    std::int64_t name_lookup_us;
+    std::int64_t connect_us;
+    std::int64_t tls_handshake_us;
+    std::int64_t first_byte_us;
+    std::int64_t total_us;
+
+    //
+    // Of the time between sending the request and the first byte of its
+    // response: how long the server says it spent on the request, in its
+    // Server-Timing header (the metric named "total", or else the longest),
+    // and the rest, taken by the network.  Both zero if the response had no
+    // Server-Timing.
+    //
+    std::int64_t server_us;
+    std::int64_t network_us;
+
+    RequestRecord();
+};
+
+
+//
+// Returns the last 64 requests made to entitlement servers, oldest first,
+// from a flight recorder the library keeps in memory for diagnosing checks
+// after the fact.  Checks answered from the library's cache, or joined to
+// another thread's check, make no request of their own.
+//
+// Each attempt sends a client-request-id header with a new UUID, and asks
+// the server to echo it back; the response's request-id and Server-Timing
+// headers are recorded, the latter to split the wait for the response into
+// time spent by the server and time spent on the network.
+//
+// Recording takes no locks and allocates nothing, so it never slows checks
+// down; a request recorded while this copies the same entry is left out.
+//
+// When the environment variable AZ_BATCH_SES_FLIGHT_RECORDER names a file
+// (or is "stderr"), the library appends DescribeRecentRequests to it each
+// time a check fails for any reason other than a denial or cancellation.
+// Calls that joined the failed check have its result before the dump is
+// written; the call that made it returns after.
+//
+std::vector<RequestRecord> RecentRequests();
+
+//
+// Describes RecentRequests, one line per request.
+//
+std::string DescribeRecentRequests();
+
+
+//
+// How many checks the library lets one entitlement server have in flight
+// at once (see ConcurrencyLimits).
+//
+struct ConcurrencyLimit
+{
+    //
+    // The server's URL.
+    //
+    std::string endpoint;
+
+    //
+    // The checks currently allowed in flight; never less than 1.
+    //
+    unsigned int limit;
+
+    unsigned int in_flight;
+
+    //
+    // Checks waiting to be sent: for one of those in flight to finish, or
+    // for their turn (see SetAdmissionControl).
+    //
+    unsigned int waiting;
+
+    //
+    // Times the limit has been cut, for overload or for rising latency.
+    //
+    std::uint64_t backoffs;
+
+    //
+    // The server's latency, from sending a request to its first byte of
+    // response: a moving average, and the lowest seen lately, against which
+    // the average is compared.  Zero until the first response.
+    //
+    std::int64_t latency_us;
+    std::int64_t baseline_latency_us;
+
+    ConcurrencyLimit();
+};
+
+//
+// Sets the most checks the library lets one server have in flight at once,
+// by default 1000; 0 turns the limits off.
+//
+// Every check, from GetEntitlement, TryGetEntitlement, AsyncClient and
+// Prefetch alike, counts against the limit of its server, which starts at
+// 16 and adapts to how the server copes.  While the server answers promptly
+// and the limit is in use, it grows: doubling each round trip until the
+// first sign of trouble, then by one a round trip.  A timeout, a failed
+// connection, a 429 or a 5xx halves it, and a moving average of latency
+// twice its recent low (and a millisecond over it) cuts it by a tenth, each
+// at most once a round trip.
+//
+// Checks over the limit wait for those in flight to finish: GetEntitlement
+// and TryGetEntitlement block (until cancelled), and AsyncClient starts the
+// checks it is given in turn as others finish.
+//
+void SetMaxConcurrency(unsigned int maximum);
+
+//
+// Returns the current limit of each server checked so far.  Beyond 256
+// servers, the one unused the longest is forgotten, unless it has checks in
+// flight or waiting, and starts again from 16 if checked again.
+//
+std::vector<ConcurrencyLimit> ConcurrencyLimits();
+
+//
+// Describes ConcurrencyLimits, one line per server.
+//
+std::string DescribeConcurrencyLimits();
+
+
+//
+// Paces the requests the process sends entitlement servers, so that the
+// nodes of a pool starting together do not all check at once (see
+// SetAdmissionControl).
+//
+struct AdmissionControl
+{
+    //
+    // Requests per second, on average, the process may send; 0 for no limit.
+    //
+    double rate;
+
+    //
+    // Requests that may be sent at once, after a quiet spell; at least 1.
+    //
+    unsigned int burst;
+
+    //
+    // The first request waits for a fraction of this window, the same
+    // fraction every time for the same identity and a different one for
+    // each, so that nodes starting together spread their first requests
+    // over it.
+    //
+    std::chrono::milliseconds startup_window;
+
+    //
+    // The identity of the node, seeding the fraction of the window; empty
+    // for the AZ_BATCH_NODE_ID environment variable, or the host name.
+    //
+    std::string identity;
+
+    AdmissionControl();
+};
+
+//
+// Sets how requests are paced: requests beyond the rate wait for their turn,
+// and none is sent until the node's share of the start-up window, counted
+// from this call, has passed.  Every request counts, from GetEntitlement,
+// TryGetEntitlement, AsyncClient and Prefetch alike, each retry included,
+// but not those of interactive checks (see SetInteractive).  Calls waiting
+// can be cancelled.  The default AdmissionControl turns pacing off.
+//
+// Until this is first called, the AZ_BATCH_SES_ADMISSION_RATE,
+// AZ_BATCH_SES_ADMISSION_BURST and AZ_BATCH_SES_STARTUP_WINDOW_MS
+// environment variables set rate, burst and startup_window, counted from
+// the first check.
+//
+void SetAdmissionControl(const AdmissionControl& control);
+
+//
+// Marks the checks made from the calling thread from now on as interactive,
+// or not: they are sent at once, whatever the pacing, for a user who is
+// waiting on them, and do not wait behind other threads' checks waiting for
+// their turn.  A check of another thread's that an interactive one joins is
+// still paced.  The mark is the thread's own, and ends with it.
+//
+void SetInteractive(bool interactive);
+
+//
+// Time spent waiting to be admitted, for tuning the pacing against the
+// capacity of the servers (see AdmissionStatistics).
+//
+struct AdmissionStats
+{
+    //
+    // Requests admitted by the pacing, those of them that waited first, and
+    // requests of interactive checks, which bypass it.
+    //
+    std::uint64_t admitted;
+    std::uint64_t delayed;
+    std::uint64_t bypassed;
+
+    //
+    // Time spent waiting, in microseconds: in all, and by the request that
+    // waited longest.
+    //
+    std::int64_t total_wait_us;
+    std::int64_t max_wait_us;
+
+    //
+    // This node's share of the start-up window, in microseconds.
+    //
+    std::int64_t startup_delay_us;
+
+    AdmissionStats();
+};
+
+AdmissionStats AdmissionStatistics();
+
+//
+// Describes AdmissionStatistics on one line.
+//
+std::string DescribeAdmission();
+
 }
 }
 }
@@ -0,0 +1,249 @@
+#include "SoftwareEntitlementClientC.h"
+#include "SoftwareEntitlementClient.h"
+#include <new>
+#include <string>
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+
+static_assert(static_cast<int>(SES::ErrorCategory::None) == SES_OK
+    && static_cast<int>(SES::ErrorCategory::Denied) == SES_DENIED
+    && static_cast<int>(SES::ErrorCategory::BadRequest) == SES_BAD_REQUEST
+    && static_cast<int>(SES::ErrorCategory::Transport) == SES_TRANSPORT
+    && static_cast<int>(SES::ErrorCategory::PinFailure) == SES_PIN_FAILURE
+    && static_cast<int>(SES::ErrorCategory::Timeout) == SES_TIMEOUT
+    && static_cast<int>(SES::ErrorCategory::UnexpectedResponse) == SES_UNEXPECTED_RESPONSE
+    && static_cast<int>(SES::ErrorCategory::Internal) == SES_INTERNAL
+    && static_cast<int>(SES::ErrorCategory::Cancelled) == SES_CANCELLED
+    && static_cast<int>(SES::ErrorCategory::UnusableToken) == SES_UNUSABLE_TOKEN,
+    "ses_error_category must match ErrorCategory");
+
+struct ses_result
+{
+    SES::EntitlementResult result;
+};
+
+struct ses_cancellation
+{
+    SES::CancellationToken token;
+};
+
+namespace {
+
+//
+// Copies a description to buffer, as ses_describe_recent_requests does.
+//
+size_t CopyDescription(std::string (*describe)(), char* buffer, size_t size)
+{
+    try
+    {
+        std::string description = describe();
+        if (size != 0)
+        {
+            size_t length = description.copy(buffer, size - 1);
+            buffer[length] = '\0';
+        }
+        return description.size();
+    }
+    catch (const std::exception&)
+    {
+        return 0;
+    }
+}
+
+}
+
+
+int ses_init(int on_first_use)
+{
+    return SES::Init(on_first_use != 0 ? SES::InitMode::OnFirstUse : SES::InitMode::Eager);
+}
+
+void ses_cleanup(void)
+{
+    SES::Cleanup();
+}
+
+ses_error_category ses_add_ssl_certificate(
+    const char* ssl_cert_thumbprint,
+    const char* ssl_cert_common_name)
+{
+    if (ssl_cert_thumbprint == nullptr || ssl_cert_common_name == nullptr)
+    {
+        return SES_INTERNAL;
+    }
+
+    try
+    {
+        SES::AddSslCertificate(ssl_cert_thumbprint, ssl_cert_common_name);
+        return SES_OK;
+    }
+    catch (const std::exception&)
+    {
+        return SES_INTERNAL;
+    }
+}
+
+void ses_set_denial_lifetime(long long seconds)
+{
+    SES::SetDenialLifetime(std::chrono::seconds(seconds));
+}
+
+void ses_set_token_pre_check(int enabled)
+{
+    SES::SetTokenPreCheck(enabled != 0);
+}
+
+ses_result* ses_get_entitlement(
+    const char* url,
+    const char* entitlement_token,
+    const char* requested_entitlement,
+    unsigned int retries)
+{
+    return ses_get_entitlement_cancellable(url, entitlement_token, requested_entitlement, retries, nullptr);
+}
+
+ses_result* ses_get_entitlement_cancellable(
+    const char* url,
+    const char* entitlement_token,
+    const char* requested_entitlement,
+    unsigned int retries,
+    const ses_cancellation* cancellation)
+{
+    ses_result* result = new (std::nothrow) ses_result();
+    if (result == nullptr)
+    {
+        return nullptr;
+    }
+
+    try
+    {
+        std::string checkUrl = url != nullptr ? url : "";
+        std::string token = entitlement_token != nullptr ? entitlement_token : "";
+        std::string application = requested_entitlement != nullptr ? requested_entitlement : "";
+        result->result = cancellation != nullptr
+            ? SES::TryGetEntitlement(checkUrl, token, application, cancellation->token, retries)
+            : SES::TryGetEntitlement(checkUrl, token, application, retries);
+    }
+    catch (const std::exception&)
+    {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
+ses_cancellation* ses_cancellation_new(void)
+{
+    try
+    {
+        return new ses_cancellation();
+    }
+    catch (const std::exception&)
+    {
+        return nullptr;
+    }
+}
+
+void ses_cancel(ses_cancellation* cancellation)
+{
+    cancellation->token.Cancel();
+}
+
+void ses_cancellation_free(ses_cancellation* cancellation)
+{
+    delete cancellation;
+}
+
+void ses_result_free(ses_result* result)
+{
+    delete result;
+}
+
+ses_error_category ses_result_category(const ses_result* result)
+{
+    return static_cast<ses_error_category>(result->result.category);
+}
+
+long ses_result_http_status(const ses_result* result)
+{
+    return result->result.http_status;
+}
+
+int ses_result_curl_code(const ses_result* result)
+{
+    return result->result.curl_code;
+}
+
+int ses_result_cached(const ses_result* result)
+{
+    return result->result.cached ? 1 : 0;
+}
+
+const char* ses_result_entitlement_id(const ses_result* result)
+{
+    return result->result.entitlement ? result->result.entitlement->Id().c_str() : nullptr;
+}
+
+const char* ses_result_vm_id(const ses_result* result)
+{
+    return result->result.entitlement ? result->result.entitlement->VmId().c_str() : nullptr;
+}
+
+const char* ses_result_message(const ses_result* result)
+{
+    try
+    {
+        return result->result.Message().c_str();
+    }
+    catch (const std::exception&)
+    {
+        return nullptr;
+    }
+}
+
+size_t ses_describe_recent_requests(char* buffer, size_t size)
+{
+    return CopyDescription(SES::DescribeRecentRequests, buffer, size);
+}
+
+void ses_set_max_concurrency(unsigned int maximum)
+{
+    SES::SetMaxConcurrency(maximum);
+}
+
+size_t ses_describe_concurrency_limits(char* buffer, size_t size)
+{
+    return CopyDescription(SES::DescribeConcurrencyLimits, buffer, size);
+}
+
+ses_error_category ses_set_admission_control(
+    double rate,
+    unsigned int burst,
+    unsigned int startup_window_ms,
+    const char* identity)
+{
+    try
+    {
+        SES::AdmissionControl control;
+        control.rate = rate;
+        control.burst = burst;
+        control.startup_window = std::chrono::milliseconds(startup_window_ms);
+        control.identity = identity != nullptr ? identity : "";
+        SES::SetAdmissionControl(control);
+        return SES_OK;
+    }
+    catch (const std::exception&)
+    {
+        return SES_INTERNAL;
+    }
+}
+
+void ses_set_interactive(int interactive)
+{
+    SES::SetInteractive(interactive != 0);
+}
+
+size_t ses_describe_admission(char* buffer, size_t size)
+{
+    return CopyDescription(SES::DescribeAdmission, buffer, size);
+}
@@ -0,0 +1,181 @@
+#pragma once
+//
+// A C interface to the software entitlement client, for hosts that cannot
+// call C++.  No function throws; failures are reported in the results.
+//
+// The library must be initialized with ses_init before the first check (or
+// with on_first_use set, see InitMode::OnFirstUse), and released with
+// ses_cleanup.
+//
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Why an entitlement check failed; see ErrorCategory.
+//
+typedef enum ses_error_category
+{
+    SES_OK = 0,
+    SES_DENIED = 1,
+    SES_BAD_REQUEST = 2,
+    SES_TRANSPORT = 3,
+    SES_PIN_FAILURE = 4,
+    SES_TIMEOUT = 5,
+    SES_UNEXPECTED_RESPONSE = 6,
+    SES_INTERNAL = 7,
+    SES_CANCELLED = 8,
+    SES_UNUSABLE_TOKEN = 9
+} ses_error_category;
+
+//
+// The outcome of a check, owned by the caller until passed to
+// ses_result_free.
+//
+typedef struct ses_result ses_result;
+
+//
+// Cancels checks from another thread; see CancellationToken.  Owned by the
+// caller until passed to ses_cancellation_free.
+//
+typedef struct ses_cancellation ses_cancellation;
+
+//
+// Returns 0 if successful.  Each call must be matched by a call to
+// ses_cleanup.
+//
+int ses_init(int on_first_use);
+
+void ses_cleanup(void);
+
+//
+// Returns SES_OK, or SES_INTERNAL if the thumbprint is not valid.
+//
+ses_error_category ses_add_ssl_certificate(
+    const char* ssl_cert_thumbprint,
+    const char* ssl_cert_common_name);
+
+//
+// Sets how long denials are remembered, in seconds; see SetDenialLifetime.
+//
+void ses_set_denial_lifetime(long long seconds);
+
+//
+// Turns the token pre-check on if enabled is non-zero; see SetTokenPreCheck.
+//
+void ses_set_token_pre_check(int enabled);
+
+//
+// Checks an entitlement as GetEntitlement does.  Returns null only if memory
+// runs out.
+//
+ses_result* ses_get_entitlement(
+    const char* url,
+    const char* entitlement_token,
+    const char* requested_entitlement,
+    unsigned int retries);
+
+//
+// As ses_get_entitlement, but cancelled through cancellation, which may be
+// null.  A cancelled check ends in SES_CANCELLED.
+//
+ses_result* ses_get_entitlement_cancellable(
+    const char* url,
+    const char* entitlement_token,
+    const char* requested_entitlement,
+    unsigned int retries,
+    const ses_cancellation* cancellation);
+
+//
+// Returns null only if memory runs out.
+//
+ses_cancellation* ses_cancellation_new(void);
+
+//
+// Cancels the checks given cancellation.  May be called from any thread,
+// and more than once.
+//
+void ses_cancel(ses_cancellation* cancellation);
+
+void ses_cancellation_free(ses_cancellation* cancellation);
+
+void ses_result_free(ses_result* result);
+
+ses_error_category ses_result_category(const ses_result* result);
+
+//
+// HTTP status of the response, or 0 if none was received.
+//
+long ses_result_http_status(const ses_result* result);
+
+//
+// CURLcode of the transfer; 0 if it completed.
+//
+int ses_result_curl_code(const ses_result* result);
+
+//
+// Non-zero if the outcome was remembered from an earlier check.
+//
+int ses_result_cached(const ses_result* result);
+
+//
+// The identifiers of the entitlement granted, or null if none was.  Valid
+// until the result is freed.
+//
+const char* ses_result_entitlement_id(const ses_result* result);
+
+const char* ses_result_vm_id(const ses_result* result);
+
+//
+// Why the check failed, or an empty string if the entitlement was granted.
+// Built on the first call; valid until the result is freed.  Returns null
+// only if memory runs out.
+//
+const char* ses_result_message(const ses_result* result);
+
+//
+// Writes DescribeRecentRequests to buffer, truncated to size - 1 characters
+// and null terminated if size is not 0.  Returns the length of the whole
+// description, or 0 if memory runs out.
+//
+size_t ses_describe_recent_requests(char* buffer, size_t size);
+
+//
+// Sets the most checks in flight at once to a server; see SetMaxConcurrency.
+//
+void ses_set_max_concurrency(unsigned int maximum);
+
+//
+// Writes DescribeConcurrencyLimits to buffer, as ses_describe_recent_requests
+// does.
+//
+size_t ses_describe_concurrency_limits(char* buffer, size_t size);
+
+//
+// Sets how requests are paced; see SetAdmissionControl.  identity may be
+// null.  Returns SES_OK, or SES_INTERNAL if rate is negative or memory runs
+// out.
+//
+ses_error_category ses_set_admission_control(
+    double rate,
+    unsigned int burst,
+    unsigned int startup_window_ms,
+    const char* identity);
+
+//
+// Marks the checks of the calling thread as interactive if interactive is
+// non-zero; see SetInteractive.
+//
+void ses_set_interactive(int interactive);
+
+//
+// Writes DescribeAdmission to buffer, as ses_describe_recent_requests does.
+//
+size_t ses_describe_admission(char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
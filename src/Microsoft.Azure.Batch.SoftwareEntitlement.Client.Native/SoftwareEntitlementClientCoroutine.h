@@ -0,0 +1,186 @@
+#pragma once
+//
+// A C++20 coroutine interface to AsyncClient, for applications that check
+// entitlements from coroutines.  Header only, so that the library itself
+// still builds as C++11: include it only from code built as C++20.
+//
+#include "SoftwareEntitlementClient.h"
+#include <coroutine>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <utility>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+
+//
+// Checks entitlements with co_await, through an AsyncClient:
+//
+//     CheckResult result = co_await client.Check(entitlement_token, "contosoapp");
+//
+// Nothing here runs on threads of its own, nor assumes an executor: checks
+// make progress in whichever thread calls Perform, and the coroutines
+// awaiting them are resumed by the resumer given to the constructor once
+// they finish.  The default resumer resumes them at once, from Perform; an
+// application with its own scheduler passes one that posts them to it.
+//
+// As with AsyncClient, only one thread at a time may use a CoroutineClient,
+// but a check may be cancelled from any thread through its stop_token.  The
+// client must outlive the checks it has started.
+//
+class CoroutineClient
+{
+public:
+    typedef std::function<void(std::coroutine_handle<>)> Resumer;
+
+    class CheckAwaitable
+    {
+    public:
+        CheckAwaitable(
+            CoroutineClient& client,
+            std::string entitlement_token,
+            std::string requested_entitlement,
+            std::stop_token stop)
+            : _client(client)
+            , _token(std::move(entitlement_token))
+            , _application(std::move(requested_entitlement))
+            , _stop(std::move(stop))
+        {
+        }
+
+        CheckAwaitable(const CheckAwaitable&) = delete;
+        CheckAwaitable& operator=(const CheckAwaitable&) = delete;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        //
+        // Starts the check.  Throws, resuming the awaiting coroutine with
+        // the Exception, if it cannot be started.
+        //
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            AsyncClient::CheckId check = _client._client.Check(
+                _token,
+                _application,
+                [this, awaiting](CheckResult result)
+                {
+                    //
+                    // Waits for a cancellation running on another thread to
+                    // finish, so that none reaches the check after this.
+                    //
+                    _onStop.reset();
+                    _result = std::move(result);
+                    _client.Resume(awaiting);
+                });
+
+            if (_stop.stop_possible())
+            {
+                _onStop.emplace(_stop, Canceller { &_client._client, check });
+            }
+        }
+
+        //
+        // The outcome of the check; error holds a CheckCancelledException if
+        // it was cancelled.
+        //
+        CheckResult await_resume()
+        {
+            return std::move(_result);
+        }
+
+    private:
+        struct Canceller
+        {
+            AsyncClient* client;
+            AsyncClient::CheckId check;
+
+            void operator()() const
+            {
+                client->Cancel(check);
+            }
+        };
+
+        CoroutineClient& _client;
+        std::string _token;
+        std::string _application;
+        std::stop_token _stop;
+        std::optional<std::stop_callback<Canceller>> _onStop;
+        CheckResult _result;
+    };
+
+    //
+    // Throws an Exception if url is not a valid entitlement server URL.
+    //
+    explicit CoroutineClient(const std::string& url, Resumer resumer = Resumer())
+        : _client(url)
+        , _resumer(std::move(resumer))
+    {
+    }
+
+    CoroutineClient(const CoroutineClient&) = delete;
+    CoroutineClient& operator=(const CoroutineClient&) = delete;
+
+    //
+    // Returns an awaitable that checks the entitlement when awaited.  A stop
+    // requested through stop cancels the check, which then completes with a
+    // CheckCancelledException; time limits are set with SetTimeout.
+    //
+    CheckAwaitable Check(
+        std::string entitlement_token,
+        std::string requested_entitlement,
+        std::stop_token stop = std::stop_token())
+    {
+        return CheckAwaitable(*this, std::move(entitlement_token), std::move(requested_entitlement), std::move(stop));
+    }
+
+    //
+    // As AsyncClient::Perform, resuming the coroutines whose checks finish.
+    //
+    size_t Perform(int timeout_ms)
+    {
+        return _client.Perform(timeout_ms);
+    }
+
+    size_t Pending() const
+    {
+        return _client.Pending();
+    }
+
+    void Wakeup()
+    {
+        _client.Wakeup();
+    }
+
+    void SetTimeout(std::chrono::milliseconds timeout)
+    {
+        _client.SetTimeout(timeout);
+    }
+
+private:
+    void Resume(std::coroutine_handle<> awaiting)
+    {
+        if (_resumer)
+        {
+            _resumer(awaiting);
+        }
+        else
+        {
+            awaiting.resume();
+        }
+    }
+
+    AsyncClient _client;
+    Resumer _resumer;
+};
+
+}
+}
+}
+}
@@ -0,0 +1,277 @@
+#pragma once
+//
+// Implementation details of the software entitlement client, exposed for
+// benchmarks and tests.  Applications should include SoftwareEntitlementClient.h
+// only; nothing here is part of the supported interface.
+//
+#include "SoftwareEntitlementClient.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <openssl/x509.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Internal {
+
+typedef std::array<std::uint8_t, 20> SHA256Thumbprint;
+
+
+template <class T, typename R, R(*F)(T* ptr)> struct OpenSSLDeleter
+{
+    void operator() (T* ptr)
+    {
+        F(ptr);
+    }
+};
+
+
+class X509
+{
+    std::unique_ptr<::x509_st, OpenSSLDeleter<::x509_st, void, &X509_free>> _cert;
+
+public:
+    X509(::x509_st*&& ptr);
+
+    X509(X509&& rhs);
+
+    bool MatchesThumbprint(const SHA256Thumbprint& thumb) const;
+
+    std::string CommonName() const;
+
+    SHA256Thumbprint Thumbprint() const;
+};
+
+
+std::string StripNonHexThumbprintDigits(const std::string& input);
+
+//
+// Parses a hexadecimal thumbprint, ignoring any separators between digits.
+// Throws an Exception if it does not have 40 digits.
+//
+SHA256Thumbprint ThumbprintToBinary(const std::string& thumbprint);
+
+//
+// Returns the string value of a top level property of a JSON response.
+//
+std::string ExtractValue(const std::string& response, const std::string& key);
+
+//
+// Returns the most specific message available from the JSON body of an error
+// response: message.value, then code.
+//
+std::string GetDetailedErrorMessage(const std::string& response);
+
+//
+// Returns the JSON body of an entitlement request.
+//
+std::string BuildRequestBody(
+    const std::string& entitlement_token,
+    const std::string& requested_entitlement);
+
+//
+// The claims of an entitlement token that can be read without the server.
+// Only a compact JWS has them: a JWE keeps its claims encrypted.  They are
+// as the token states them, since its signature is not checked.
+//
+struct TokenClaims
+{
+    TokenClaims();
+
+    //
+    // False if the token is not a JWS whose payload is a JSON object; the
+    // other members are then unset.
+    //
+    bool decoded;
+
+    //
+    // The exp and nbf claims, in seconds since the Unix epoch; 0 if absent.
+    //
+    long long expires;
+    long long not_before;
+
+    //
+    // The app claim, a string or an array of them; has_applications is
+    // false if it is absent.
+    //
+    bool has_applications;
+    std::vector<std::string> applications;
+};
+
+//
+// Reads the claims of a token, without checking its signature.  Does not
+// throw for a malformed token, which is left for the server to reject.
+//
+TokenClaims ReadTokenClaims(const std::string& entitlement_token);
+
+//
+// Returns why the server would refuse a token with claims for the requested
+// application at time now, allowing the server's clock skew; an empty
+// string if the claims give no reason to.
+//
+std::string UnusableTokenReason(
+    const TokenClaims& claims,
+    const std::string& requested_entitlement,
+    std::chrono::system_clock::time_point now);
+
+//
+// Checks a chain verified by OpenSSL against the pinned certificates, throwing
+// an Exception if none of them is found.  url is the address of the server
+// that presented the chain.  A self-signed last certificate, the root the
+// chain was verified against, is not checked; any other is.
+//
+void VerifyCertificateChain(STACK_OF(X509)* chain, const std::string& url);
+
+//
+// Returns a new reference to the CA certificates trusted by every connection,
+// to be released with X509_STORE_free.  They are loaded from caFile and caPath
+// (either may be empty, and if both are, from OpenSSL's default locations)
+// and, on Windows, the system ROOT store on the first call, and reloaded only
+// when one of those sources changes.
+//
+X509_STORE* AcquireTrustStore(const std::string& caFile, const std::string& caPath);
+
+typedef std::array<std::uint8_t, 8> TokenDigest;
+
+//
+// Returns the first 8 bytes of the SHA-256 hash of a token, which the flight
+// recorder keeps in its place.
+//
+TokenDigest DigestToken(const std::string& entitlement_token);
+
+//
+// Adds a request to the flight recorder, in place of the oldest once it is
+// full, without locking or allocating.  The strings of record are ignored in
+// favour of the other arguments.
+//
+void RecordRequest(
+    const std::string& endpoint,
+    const std::string& application,
+    const TokenDigest& digest,
+    const RequestRecord& record);
+
+//
+// A request to the service, as handed to a Transport.
+//
+struct TransportRequest
+{
+    TransportRequest();
+
+    //
+    // The server's URL, as normalized by the client (https://host/), and
+    // the path and query of the request on it.
+    //
+    std::string url;
+    std::string path;
+
+    //
+    // nullptr for a POST of body; otherwise the method to use instead.
+    //
+    const char* method;
+
+    //
+    // Each in the form "Name: value".
+    //
+    std::vector<std::string> headers;
+
+    std::string body;
+};
+
+//
+// What a Transport made of a request.  If category is ErrorCategory::None,
+// a response was received, with http_status and body; otherwise no response
+// was, and error says why.
+//
+struct TransportResponse
+{
+    TransportResponse();
+
+    ErrorCategory category;
+    std::string error;
+    int curl_code;
+
+    long http_status;
+    std::string body;
+
+    //
+    // The response's request-id and Server-Timing headers, if any.
+    //
+    std::string request_id;
+    std::string server_timing;
+
+    //
+    // As for RequestRecord; zero where the transport does not measure them.
+    //
+    PinCheck pin_check;
+    std::int64_t name_lookup_us;
+    std::int64_t connect_us;
+    std::int64_t tls_handshake_us;
+    std::int64_t first_byte_us;
+    std::int64_t total_us;
+
+    //
+    // How long the server took to start responding once the request was
+    // sent, which feeds the adaptive concurrency limit (see
+    // SetMaxConcurrency).
+    //
+    std::int64_t server_latency_us;
+};
+
+//
+// Sends a request and fills in the response, without throwing for anything
+// the server or the network does; may be cancelled through the Cancellation,
+// which is nullptr if the request cannot be.  Called from any thread, and by
+// several at once.
+//
+// Requests are built, and responses interpreted, cached and recorded, the
+// same whatever the transport, so that benchmarks can isolate the client's
+// own work from the network's.
+//
+typedef std::function<void(const TransportRequest&, TransportResponse&, Cancellation*)> Transport;
+
+//
+// The transport used unless another is set: libcurl, over HTTPS, reusing
+// connections and checking the pinned certificates during the handshake.
+//
+Transport HttpsTransport();
+
+//
+// Sends requests as plain HTTP, through libcurl, over the Unix domain socket
+// at path, to a server such as sesserver.native --unix-socket.  Without TLS
+// there is no handshake, so no pinned certificate checks are made.  Needs
+// libcurl 7.40.0 or later.
+//
+Transport UnixSocketTransport(const std::string& path);
+
+//
+// Answers requests from memory, as the service would: entitlements and
+// leases of applications are granted, and those of any other application
+// denied; "*" grants every application.  Requests under any api-version but
+// that of checks are taken to be for leases.  If chain is not empty, it is
+// the certificate chain the server presents, leaf first, and is checked
+// against the pinned certificates for every request, as a handshake would
+// be.  The transport takes its own references to the certificates.
+//
+Transport LoopbackTransport(
+    const std::vector<std::string>& applications,
+    const std::vector<::x509_st*>& chain);
+
+//
+// Sends the requests of synchronous checks and leases to the server at url
+// through transport, in place of libcurl over HTTPS; an empty transport
+// restores libcurl.  Warmup skips servers with a transport of their own.
+// AsyncClient drives libcurl directly, and always uses HTTPS.
+//
+void SetTransport(const std::string& url, Transport transport);
+
+}
+}
+}
+}
+}
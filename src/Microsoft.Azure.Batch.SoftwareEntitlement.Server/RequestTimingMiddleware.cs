@@ -0,0 +1,59 @@
+using System;
+using System.Diagnostics;
+using System.Globalization;
+using System.Threading.Tasks;
+using Microsoft.AspNetCore.Http;
+
+namespace Microsoft.Azure.Batch.SoftwareEntitlement.Server
+{
+    /// <summary>
+    /// Identifies each response and says how long the server took over it, as the Batch service
+    /// does, so that a client can tell time spent by the server from time spent on the network.
+    /// </summary>
+    public class RequestTimingMiddleware
+    {
+        private readonly RequestDelegate _next;
+
+        /// <summary>
+        /// Initializes a new instance of the <see cref="RequestTimingMiddleware"/> class
+        /// </summary>
+        /// <param name="next">The rest of the pipeline.</param>
+        public RequestTimingMiddleware(RequestDelegate next)
+        {
+            _next = next;
+        }
+
+        /// <summary>
+        /// Handles a request, adding <c>request-id</c> and <c>Server-Timing</c> headers to its
+        /// response, and echoing the client's <c>client-request-id</c> if it asked for it with
+        /// <c>return-client-request-id</c>.
+        /// </summary>
+        /// <param name="context">The request and its response.</param>
+        public Task Invoke(HttpContext context)
+        {
+            var stopwatch = Stopwatch.StartNew();
+            var requestId = Guid.NewGuid().ToString();
+
+            context.Response.OnStarting(() =>
+            {
+                var requestHeaders = context.Request.Headers;
+                var responseHeaders = context.Response.Headers;
+
+                responseHeaders["request-id"] = requestId;
+                if (string.Equals(requestHeaders["return-client-request-id"], "true", StringComparison.OrdinalIgnoreCase)
+                    && requestHeaders.ContainsKey("client-request-id"))
+                {
+                    responseHeaders["client-request-id"] = requestHeaders["client-request-id"];
+                }
+
+                responseHeaders["Server-Timing"] = string.Format(
+                    CultureInfo.InvariantCulture,
+                    "ses;dur={0:0.###}",
+                    stopwatch.Elapsed.TotalMilliseconds);
+                return Task.CompletedTask;
+            });
+
+            return _next(context);
+        }
+    }
+}
@@ -58,6 +58,7 @@ namespace Microsoft.Azure.Batch.SoftwareEntitlement.Server
             loggerFactory.AddProvider(_provider);
             app.UseDefaultFiles();
             app.UseStaticFiles();
+            app.UseMiddleware<RequestTimingMiddleware>();
             app.UseMvc();
         }
     }
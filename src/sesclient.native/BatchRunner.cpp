@@ -0,0 +1,339 @@
+#include "BatchRunner.h"
+#include <SoftwareEntitlementClient.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "json.hpp"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // Upper bound on each wait for network activity, for libcurl too old to
+    // be woken when new requests arrive.
+    //
+    const int MaxWaitMilliseconds = 50;
+
+    //
+    // Lines read from the input by a separate thread, so that requests can
+    // keep arriving while checks are in flight.  The queue is bounded so that
+    // a large input file is not read into memory all at once.
+    //
+    class LineQueue
+    {
+        std::mutex _lock;
+        std::condition_variable _changed;
+        std::deque<std::string> _lines;
+        size_t _capacity;
+        bool _finished;
+        bool _abandoned;
+        SES::AsyncClient* _client;
+
+    public:
+        explicit LineQueue(size_t capacity)
+            : _capacity(capacity)
+            , _finished(false)
+            , _abandoned(false)
+            , _client(nullptr)
+        {
+        }
+
+        //
+        // Waits for space, then adds a line.  Returns false if the consumer
+        // has given up.
+        //
+        bool Push(std::string line)
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _changed.wait(lock, [this]() { return _lines.size() < _capacity || _abandoned; });
+            if (_abandoned)
+            {
+                return false;
+            }
+
+            _lines.push_back(std::move(line));
+            _changed.notify_all();
+            if (_client != nullptr)
+            {
+                _client->Wakeup();
+            }
+            return true;
+        }
+
+        void Finish()
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _finished = true;
+            _changed.notify_all();
+            if (_client != nullptr)
+            {
+                _client->Wakeup();
+            }
+        }
+
+        void Abandon()
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _abandoned = true;
+            _client = nullptr;
+            _changed.notify_all();
+        }
+
+        //
+        // Sets the client to wake when lines arrive; null to stop.
+        //
+        void SetClient(SES::AsyncClient* client)
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _client = client;
+        }
+
+        bool TryPop(std::string& line)
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (_lines.empty())
+            {
+                return false;
+            }
+
+            line = std::move(_lines.front());
+            _lines.pop_front();
+            _changed.notify_all();
+            return true;
+        }
+
+        //
+        // Waits until a line is available; returns false at the end of the
+        // input instead.
+        //
+        bool Wait()
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _changed.wait(lock, [this]() { return !_lines.empty() || _finished; });
+            return !_lines.empty();
+        }
+    };
+
+    void ReadLines(std::istream& input, std::shared_ptr<LineQueue> queue)
+    {
+        std::string line;
+        while (std::getline(input, line))
+        {
+            if (!queue->Push(std::move(line)))
+            {
+                return;
+            }
+        }
+
+        queue->Finish();
+    }
+
+    std::string ErrorMessage(const std::exception_ptr& error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception& e)
+        {
+            return e.what();
+        }
+        catch (...)
+        {
+            return "Unknown error";
+        }
+    }
+
+    class Batch
+    {
+        std::ostream& _output;
+        const BatchOptions& _options;
+        LineQueue& _queue;
+        std::unique_ptr<SES::AsyncClient> _client;
+        std::uint64_t _lines;
+        BatchSummary _summary;
+
+        size_t Pending() const
+        {
+            return _client ? _client->Pending() : 0;
+        }
+
+        void Write(const nlohmann::json& result)
+        {
+            // Flushed line by line for callers reading results as they come.
+            _output << result.dump() << '\n' << std::flush;
+        }
+
+        void WriteError(nlohmann::json result, const std::string& message)
+        {
+            result["approved"] = false;
+            result["error"] = message;
+            Write(result);
+        }
+
+        void Start(const std::string& line)
+        {
+            std::uint64_t number = ++_lines;
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+            {
+                return;
+            }
+
+            ++_summary.requests;
+
+            nlohmann::json result;
+            result["line"] = number;
+
+            nlohmann::json request;
+            try
+            {
+                request = nlohmann::json::parse(line);
+            }
+            catch (const std::exception&)
+            {
+            }
+
+            if (!request.is_object())
+            {
+                WriteError(result, "Invalid request: expected a JSON object");
+                return;
+            }
+
+            if (request.find("id") != request.end())
+            {
+                result["id"] = request["id"];
+            }
+
+            std::string url;
+            std::string token;
+            std::string application;
+            try
+            {
+                url = request.value("url", _options.url);
+                token = request.value("token", std::string());
+                application = request.value("application", std::string());
+            }
+            catch (const std::exception&)
+            {
+                WriteError(result, "Invalid request: url, token and application must be strings");
+                return;
+            }
+
+            result["application"] = application;
+            if (url.empty() || token.empty() || application.empty())
+            {
+                WriteError(result, "Invalid request: url, token and application are required");
+                return;
+            }
+
+            auto start = Clock::now();
+            auto completed = [this, result, start](SES::CheckResult check) mutable
+            {
+                result["elapsedMs"] = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                result["httpStatus"] = check.http_status;
+                if (check.entitlement)
+                {
+                    ++_summary.approved;
+                    result["approved"] = true;
+                    result["entitlementId"] = check.entitlement->Id();
+                    Write(result);
+                }
+                else
+                {
+                    result["curlCode"] = check.curl_code;
+                    WriteError(result, ErrorMessage(check.error));
+                }
+            };
+
+            try
+            {
+                if (!_client)
+                {
+                    _client.reset(new SES::AsyncClient(url));
+                    _queue.SetClient(_client.get());
+                }
+                _client->Check(url, token, application, completed);
+            }
+            catch (const SES::Exception& e)
+            {
+                WriteError(result, e.what());
+            }
+        }
+
+    public:
+        Batch(std::ostream& output, const BatchOptions& options, LineQueue& queue)
+            : _output(output)
+            , _options(options)
+            , _queue(queue)
+            , _lines(0)
+        {
+            _summary.requests = 0;
+            _summary.approved = 0;
+        }
+
+        ~Batch()
+        {
+            _queue.SetClient(nullptr);
+        }
+
+        void Run()
+        {
+            for (;;)
+            {
+                std::string line;
+                while (Pending() < _options.concurrency && _queue.TryPop(line))
+                {
+                    Start(line);
+                }
+
+                if (Pending() == 0)
+                {
+                    if (!_queue.Wait())
+                    {
+                        return;
+                    }
+                    continue;
+                }
+
+                _client->Perform(MaxWaitMilliseconds);
+            }
+        }
+
+        const BatchSummary& Summary() const
+        {
+            return _summary;
+        }
+    };
+}
+
+BatchSummary RunBatch(std::istream& input, std::ostream& output, const BatchOptions& options)
+{
+    auto queue = std::make_shared<LineQueue>(std::max<size_t>(64, 4 * static_cast<size_t>(options.concurrency)));
+    std::thread reader(ReadLines, std::ref(input), queue);
+
+    BatchSummary summary;
+    try
+    {
+        Batch batch(output, options, *queue);
+        batch.Run();
+        summary = batch.Summary();
+    }
+    catch (...)
+    {
+        // The reader may be blocked on input that will never come.
+        queue->Abandon();
+        reader.detach();
+        throw;
+    }
+
+    reader.join();
+    return summary;
+}
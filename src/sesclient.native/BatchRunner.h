@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+struct BatchOptions
+{
+    //
+    // Server for requests that do not name one; may be empty.
+    //
+    std::string url;
+
+    //
+    // Most checks in flight at once.
+    //
+    unsigned concurrency;
+};
+
+struct BatchSummary
+{
+    std::uint64_t requests;
+    std::uint64_t approved;
+};
+
+//
+// Reads newline-delimited JSON requests such as
+//
+//     {"id": 7, "url": "https://...", "token": "...", "application": "contosoapp"}
+//
+// from input, checks them concurrently over shared connections, and writes
+// one JSON result per line to output as each completes, in completion order.
+// Each result carries the request's line number and (if given) its id.
+//
+// Requests are read as they arrive, so the caller may keep input open and
+// use the process as a co-process.  Returns once input is exhausted and all
+// checks are complete.
+//
+BatchSummary RunBatch(std::istream& input, std::ostream& output, const BatchOptions& options);
@@ -0,0 +1,111 @@
+#include "LatencyHistogram.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    //
+    // 2048 is the smallest power of two above 2 * 10^3, giving three
+    // significant digits throughout the range.
+    //
+    const unsigned SubBucketBits = 11;
+    const std::uint64_t SubBucketCount = 1 << SubBucketBits;
+    const std::uint64_t SubBucketHalfCount = SubBucketCount / 2;
+
+    //
+    // Values above 2^36 microseconds (about 19 hours) are recorded as 2^36.
+    //
+    const unsigned MaxValueBits = 36;
+    const std::uint64_t MaxValue = (std::uint64_t(1) << MaxValueBits) - 1;
+
+    unsigned HighestBit(std::uint64_t value)
+    {
+        unsigned bit = 0;
+        while (value >>= 1)
+        {
+            ++bit;
+        }
+        return bit;
+    }
+
+    size_t BucketIndex(std::uint64_t value)
+    {
+        if (value < SubBucketCount)
+        {
+            return static_cast<size_t>(value);
+        }
+
+        unsigned shift = HighestBit(value) - (SubBucketBits - 1);
+        return static_cast<size_t>(shift * SubBucketHalfCount + (value >> shift));
+    }
+
+    std::uint64_t HighestEquivalentValue(size_t index)
+    {
+        if (index < SubBucketCount)
+        {
+            return index;
+        }
+
+        std::uint64_t shift = index / SubBucketHalfCount - 1;
+        std::uint64_t subBucket = index - shift * SubBucketHalfCount;
+        return ((subBucket + 1) << shift) - 1;
+    }
+}
+
+LatencyHistogram::LatencyHistogram()
+    : _counts(BucketIndex(MaxValue) + 1)
+    , _count(0)
+    , _max(0)
+{
+}
+
+void LatencyHistogram::Record(std::uint64_t microseconds)
+{
+    microseconds = std::min(microseconds, MaxValue);
+    ++_counts[BucketIndex(microseconds)];
+    ++_count;
+    _max = std::max(_max, microseconds);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (size_t i = 0; i < _counts.size(); i++)
+    {
+        _counts[i] += other._counts[i];
+    }
+    _count += other._count;
+    _max = std::max(_max, other._max);
+}
+
+std::uint64_t LatencyHistogram::Count() const
+{
+    return _count;
+}
+
+std::uint64_t LatencyHistogram::Max() const
+{
+    return _max;
+}
+
+std::uint64_t LatencyHistogram::ValueAtPercentile(double percentile) const
+{
+    if (_count == 0)
+    {
+        return 0;
+    }
+
+    double rank = std::ceil(std::min(percentile, 100.0) / 100.0 * _count);
+    std::uint64_t target = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(rank));
+
+    std::uint64_t seen = 0;
+    for (size_t i = 0; i < _counts.size(); i++)
+    {
+        seen += _counts[i];
+        if (seen >= target)
+        {
+            return std::min(HighestEquivalentValue(i), _max);
+        }
+    }
+
+    return _max;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+//
+// Records latencies in microseconds to three significant digits, in the
+// manner of HdrHistogram: values below 2048 are recorded exactly, and above
+// that each power of two is split into 1024 equal buckets.  Recording is
+// constant time and memory use does not grow with the number of samples.
+//
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void Record(std::uint64_t microseconds);
+
+    void Merge(const LatencyHistogram& other);
+
+    std::uint64_t Count() const;
+
+    std::uint64_t Max() const;
+
+    //
+    // Returns the smallest value that percentile percent of the recorded
+    // values are at or below, rounded up to the end of its bucket.
+    //
+    std::uint64_t ValueAtPercentile(double percentile) const;
+
+private:
+    std::vector<std::uint64_t> _counts;
+    std::uint64_t _count;
+    std::uint64_t _max;
+};
@@ -0,0 +1,391 @@
+#include "LeasedExec.h"
+#include <SoftwareEntitlementClient.h>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // Shortest wait before retrying a failed renewal; otherwise a tenth of
+    // the lease.
+    //
+    const std::chrono::seconds MinRetryInterval(1);
+
+    //
+    // Decides when the lease is next to be renewed, renews it, and tells
+    // whether it has been lost.  Expiry is tracked from before each request,
+    // so that it is never later than the server's.
+    //
+    class Renewer
+    {
+        SES::Lease& _lease;
+        std::chrono::seconds _duration;
+        Clock::time_point _expiry;
+        Clock::time_point _due;
+        bool _lost;
+
+    public:
+        Renewer(SES::Lease& lease, std::chrono::seconds duration, Clock::time_point acquired)
+            : _lease(lease)
+            , _duration(duration)
+            , _expiry(acquired + duration)
+            , _due(acquired + std::chrono::duration_cast<Clock::duration>(duration) / 2)
+            , _lost(false)
+        {
+        }
+
+        //
+        // How long until the next renewal is due; an hour once the lease is
+        // lost, as there is nothing left to do but wait for the child.
+        //
+        Clock::duration UntilDue() const
+        {
+            if (_lost)
+            {
+                return std::chrono::hours(1);
+            }
+            return std::max(_due - Clock::now(), Clock::duration::zero());
+        }
+
+        //
+        // Renews the lease if a renewal is due.  Returns false once the lease
+        // has been lost.
+        //
+        bool RenewIfDue()
+        {
+            if (_lost)
+            {
+                return false;
+            }
+
+            auto now = Clock::now();
+            if (now < _due)
+            {
+                return true;
+            }
+
+            try
+            {
+                _lease.Renew(_duration);
+                _expiry = now + _duration;
+                _due = now + std::chrono::duration_cast<Clock::duration>(_duration) / 2;
+                return true;
+            }
+            catch (const SES::LeaseLostException& e)
+            {
+                std::cerr << "Lease " << _lease.Id() << " lost: " << e.what() << std::endl;
+                _lost = true;
+                return false;
+            }
+            catch (const std::exception& e)
+            {
+                Clock::duration retry = std::max<Clock::duration>(MinRetryInterval, _duration / 10);
+                auto failed = Clock::now();
+                if (failed + retry >= _expiry)
+                {
+                    std::cerr << "Unable to renew lease " << _lease.Id() << " before it expires: " << e.what() << std::endl;
+                    _lost = true;
+                    return false;
+                }
+
+                std::cerr << "Unable to renew lease " << _lease.Id() << ", will retry: " << e.what() << std::endl;
+                _due = failed + retry;
+                return true;
+            }
+        }
+    };
+
+    //
+    // Releases the lease once the child has exited, reporting rather than
+    // throwing a failure, so that the child's exit code is still returned.
+    //
+    void ReleaseLease(SES::Lease& lease)
+    {
+        try
+        {
+            lease.Release();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Unable to release lease " << lease.Id() << ": " << e.what() << std::endl;
+        }
+    }
+
+#ifdef _WIN32
+
+    //
+    // Control events reach the child too, which decides whether to exit;
+    // ignoring them here keeps the lease held until it does.
+    //
+    BOOL WINAPI IgnoreControlEvent(DWORD)
+    {
+        return TRUE;
+    }
+
+    //
+    // Quotes an argument so that the child's runtime parses it back as is
+    // (see CommandLineToArgvW).
+    //
+    std::string QuoteArgument(const std::string& argument)
+    {
+        if (!argument.empty() && argument.find_first_of(" \t\n\v\"") == std::string::npos)
+        {
+            return argument;
+        }
+
+        std::string quoted(1, '"');
+        size_t backslashes = 0;
+        for (char c : argument)
+        {
+            if (c == '\\')
+            {
+                ++backslashes;
+                continue;
+            }
+
+            //
+            // Backslashes are literal unless they precede a quote.
+            //
+            quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+            backslashes = 0;
+            quoted += c;
+        }
+        quoted.append(backslashes * 2, '\\');
+        quoted += '"';
+        return quoted;
+    }
+
+    DWORD WaitMilliseconds(Clock::duration duration)
+    {
+        return static_cast<DWORD>(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() + 1);
+    }
+
+#else
+
+    const int ForwardedSignals[] = { SIGINT, SIGTERM, SIGHUP };
+
+    //
+    // Blocks the signals passed on to the child, and SIGCHLD, for the life
+    // of the wrapper, so that they are taken by sigtimedwait between
+    // renewals rather than handled asynchronously.  Blocked before the lease
+    // is acquired, so that any thread libcurl starts inherits the mask.
+    //
+    class BlockedSignals
+    {
+        sigset_t _blocked;
+        sigset_t _previous;
+
+    public:
+        BlockedSignals()
+        {
+            //
+            // An ignored SIGCHLD would have the child reaped unseen.
+            //
+            signal(SIGCHLD, SIG_DFL);
+
+            sigemptyset(&_blocked);
+            for (int forwarded : ForwardedSignals)
+            {
+                sigaddset(&_blocked, forwarded);
+            }
+            sigaddset(&_blocked, SIGCHLD);
+            pthread_sigmask(SIG_BLOCK, &_blocked, &_previous);
+        }
+
+        ~BlockedSignals()
+        {
+            pthread_sigmask(SIG_SETMASK, &_previous, nullptr);
+        }
+
+        const sigset_t& Blocked() const
+        {
+            return _blocked;
+        }
+
+        //
+        // The mask to start the child with.
+        //
+        const sigset_t& Previous() const
+        {
+            return _previous;
+        }
+
+    private:
+        BlockedSignals(const BlockedSignals&);
+        BlockedSignals& operator=(const BlockedSignals&);
+    };
+
+    //
+    // Starts the command, found on the PATH, with the signal mask the
+    // wrapper was started with.  Returns -1 if it could not be started.
+    //
+    pid_t Spawn(const std::vector<std::string>& command, const sigset_t& mask)
+    {
+        std::vector<char*> argv;
+        for (const auto& argument : command)
+        {
+            argv.push_back(const_cast<char*>(argument.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigmask(&attributes, &mask);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+        pid_t pid = -1;
+        int error = posix_spawnp(&pid, argv[0], nullptr, &attributes, argv.data(), environ);
+        posix_spawnattr_destroy(&attributes);
+        if (error != 0)
+        {
+            std::cerr << "Unable to run " << command[0] << ": " << std::strerror(error) << std::endl;
+            return -1;
+        }
+
+        return pid;
+    }
+
+    timespec ToTimespec(Clock::duration duration)
+    {
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        timespec result;
+        result.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+        result.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+        return result;
+    }
+
+#endif
+}
+
+#ifdef _WIN32
+
+int RunLeased(const ExecOptions& options)
+{
+    auto acquired = Clock::now();
+    SES::Lease lease(options.url, options.token, options.application, options.lease, options.apiVersion);
+
+    std::string commandLine;
+    for (const auto& argument : options.command)
+    {
+        if (!commandLine.empty())
+        {
+            commandLine += ' ';
+        }
+        commandLine += QuoteArgument(argument);
+    }
+    std::vector<char> line(commandLine.begin(), commandLine.end());
+    line.push_back('\0');
+
+    SetConsoleCtrlHandler(IgnoreControlEvent, TRUE);
+
+    STARTUPINFOA startup = {};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION process = {};
+    if (!CreateProcessA(nullptr, line.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process))
+    {
+        std::cerr << "Unable to run " << options.command[0] << ": error " << GetLastError() << std::endl;
+        SetConsoleCtrlHandler(IgnoreControlEvent, FALSE);
+        ReleaseLease(lease);
+        return 127;
+    }
+    CloseHandle(process.hThread);
+
+    Renewer renewer(lease, options.lease, acquired);
+    bool terminated = false;
+    while (WaitForSingleObject(process.hProcess, WaitMilliseconds(renewer.UntilDue())) == WAIT_TIMEOUT)
+    {
+        if (!renewer.RenewIfDue() && !terminated)
+        {
+            TerminateProcess(process.hProcess, 1);
+            terminated = true;
+        }
+    }
+
+    DWORD code = 1;
+    GetExitCodeProcess(process.hProcess, &code);
+    CloseHandle(process.hProcess);
+    SetConsoleCtrlHandler(IgnoreControlEvent, FALSE);
+
+    ReleaseLease(lease);
+    return static_cast<int>(code);
+}
+
+#else
+
+int RunLeased(const ExecOptions& options)
+{
+    BlockedSignals signals;
+
+    auto acquired = Clock::now();
+    SES::Lease lease(options.url, options.token, options.application, options.lease, options.apiVersion);
+
+    pid_t child = Spawn(options.command, signals.Previous());
+    if (child < 0)
+    {
+        ReleaseLease(lease);
+        return 127;
+    }
+
+    //
+    // Only this thread signals and reaps the child, so its pid cannot be
+    // reused by another process while signals are still passed on to it.
+    //
+    Renewer renewer(lease, options.lease, acquired);
+    bool terminated = false;
+    int status = 0;
+    for (;;)
+    {
+        pid_t reaped = waitpid(child, &status, WNOHANG);
+        if (reaped == child)
+        {
+            break;
+        }
+        if (reaped < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("Unable to wait for the child: ") + std::strerror(errno));
+        }
+
+        if (!renewer.RenewIfDue() && !terminated)
+        {
+            kill(child, SIGTERM);
+            terminated = true;
+        }
+
+        timespec timeout = ToTimespec(renewer.UntilDue());
+        int received = sigtimedwait(&signals.Blocked(), nullptr, &timeout);
+        if (received > 0 && received != SIGCHLD)
+        {
+            kill(child, received);
+        }
+    }
+
+    ReleaseLease(lease);
+
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct ExecOptions
+{
+    std::string url;
+    std::string token;
+    std::string application;
+
+    //
+    // The api-version the server offers leases under.
+    //
+    std::string apiVersion;
+
+    //
+    // How long each acquisition or renewal of the lease lasts.
+    //
+    std::chrono::seconds lease;
+
+    //
+    // The program to run and its arguments; the program is found on the
+    // PATH.
+    //
+    std::vector<std::string> command;
+};
+
+//
+// Acquires a lease of the application, runs command as a child process, and
+// holds the lease for as long as the child runs: it is renewed at half its
+// duration, from this thread, which otherwise sleeps until the child exits
+// or a renewal is due.  The lease is released once the child exits.
+//
+// Interrupt, termination and hangup signals are passed on to the child
+// rather than ending this process, so that the lease is still released.
+// Should the lease be lost, or be about to expire without a successful
+// renewal, the child is terminated.
+//
+// Returns the child's exit code, or 128 plus the number of the signal that
+// ended it, as a shell would; 127 if it could not be started.  Throws if the
+// lease cannot be acquired, in which case the child is never started.
+//
+int RunLeased(const ExecOptions& options);
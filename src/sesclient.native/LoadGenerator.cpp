@@ -0,0 +1,352 @@
+#include "LoadGenerator.h"
+#include <SoftwareEntitlementClient.h>
+#include <algorithm>
+#include <exception>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // How long to wait for checks in flight to finish once the run is over.
+    //
+    const std::chrono::seconds DrainTimeout(30);
+
+    //
+    // Upper bound on each wait for network activity, so that the schedule is
+    // never far behind.
+    //
+    const int MaxWaitMilliseconds = 100;
+
+    std::string FailureCause(const Microsoft::Azure::Batch::SoftwareEntitlement::CheckResult& result)
+    {
+        std::ostringstream cause;
+        if (result.curl_code != 0)
+        {
+            cause << "libcurl error " << result.curl_code;
+        }
+        else if (result.http_status != 200)
+        {
+            cause << "HTTP " << result.http_status;
+        }
+        else
+        {
+            cause << "Invalid response";
+        }
+        return cause.str();
+    }
+
+    int MillisecondsUntil(Clock::time_point now, Clock::time_point deadline)
+    {
+        if (deadline <= now)
+        {
+            return 0;
+        }
+
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now + std::chrono::milliseconds(1) - Clock::duration(1));
+        return static_cast<int>(std::min<long long>(wait.count(), MaxWaitMilliseconds));
+    }
+
+    //
+    // Runs one thread's share of the load on its own AsyncClient.
+    //
+    class Worker
+    {
+        const LoadOptions& _options;
+        const Clock::time_point _start;
+        const Clock::time_point _end;
+        size_t _limit;
+        Clock::duration _interval;
+        Clock::time_point _next;
+        size_t _entry;
+        Clock::time_point _lastCompletion;
+        LoadReport _report;
+        Microsoft::Azure::Batch::SoftwareEntitlement::AsyncClient _client;
+
+        void Send(Clock::time_point intended)
+        {
+            const CorpusEntry& entry = _options.corpus[_entry++ % _options.corpus.size()];
+            _client.Check(
+                entry.token,
+                entry.application,
+                [this, intended](Microsoft::Azure::Batch::SoftwareEntitlement::CheckResult result)
+                {
+                    Record(intended, result);
+                });
+            ++_report.sent;
+        }
+
+        void Record(Clock::time_point intended, const Microsoft::Azure::Batch::SoftwareEntitlement::CheckResult& result)
+        {
+            _lastCompletion = Clock::now();
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(_lastCompletion - intended);
+            _report.latency.Record(static_cast<std::uint64_t>(latency.count()));
+
+            if (result.entitlement)
+            {
+                ++_report.approved;
+            }
+            else
+            {
+                ++_report.failures[FailureCause(result)];
+            }
+        }
+
+    public:
+        Worker(const LoadOptions& options, unsigned index, Clock::time_point start)
+            : _options(options)
+            , _start(start)
+            , _end(start + options.duration)
+            , _limit(std::numeric_limits<size_t>::max())
+            , _interval(Clock::duration::zero())
+            , _next(start)
+            , _entry(index)
+            , _lastCompletion(start)
+            , _client(options.url)
+        {
+            if (options.concurrency != 0)
+            {
+                //
+                // Spread the limit over the threads, giving the remainder
+                // to the first few.
+                //
+                _limit = options.concurrency / options.threads + (index < options.concurrency % options.threads ? 1 : 0);
+                _limit = std::max<size_t>(_limit, 1);
+            }
+
+            if (options.rate > 0)
+            {
+                //
+                // Each thread sends at its share of the rate, offset from the
+                // others so that the combined schedule is evenly spaced.
+                //
+                _interval = std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(options.threads / options.rate));
+                _next = start + _interval * index / options.threads;
+            }
+        }
+
+        LoadReport Run()
+        {
+            bool openLoop = _options.rate > 0;
+            for (;;)
+            {
+                auto now = Clock::now();
+                if (now < _end)
+                {
+                    if (openLoop)
+                    {
+                        while (_next <= now && _client.Pending() < _limit)
+                        {
+                            Send(_next);
+                            _next += _interval;
+                        }
+                    }
+                    else
+                    {
+                        while (_client.Pending() < _limit)
+                        {
+                            Send(now);
+                        }
+                    }
+                }
+                else if (_client.Pending() == 0)
+                {
+                    break;
+                }
+                else if (now >= _end + DrainTimeout)
+                {
+                    _report.incomplete = _client.Pending();
+                    break;
+                }
+
+                int timeout = MaxWaitMilliseconds;
+                if (now < _end && openLoop && _client.Pending() < _limit)
+                {
+                    timeout = MillisecondsUntil(now, std::min(_next, _end));
+                }
+
+                _client.Perform(timeout);
+            }
+
+            if (openLoop && _next < _end)
+            {
+                _report.notSent = static_cast<std::uint64_t>((_end - _next) / _interval) + 1;
+            }
+
+            _report.elapsed = _lastCompletion - _start;
+            return _report;
+        }
+    };
+}
+
+
+std::vector<CorpusEntry> ReadCorpus(std::istream& input)
+{
+    std::vector<CorpusEntry> corpus;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(input, line))
+    {
+        ++lineNumber;
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+
+        std::istringstream fields(line);
+        CorpusEntry entry;
+        if (!(fields >> entry.application) || entry.application[0] == '#')
+        {
+            continue;
+        }
+
+        std::string extra;
+        if (!(fields >> entry.token) || (fields >> extra))
+        {
+            throw std::runtime_error(
+                "Corpus line " + std::to_string(lineNumber) + " must contain an application and a token");
+        }
+
+        corpus.push_back(entry);
+    }
+
+    if (corpus.empty())
+    {
+        throw std::runtime_error("Corpus contains no entries");
+    }
+
+    return corpus;
+}
+
+
+LoadReport::LoadReport()
+    : elapsed(Clock::duration::zero())
+    , sent(0)
+    , approved(0)
+    , notSent(0)
+    , incomplete(0)
+{
+}
+
+void LoadReport::Merge(const LoadReport& other)
+{
+    latency.Merge(other.latency);
+    elapsed = std::max(elapsed, other.elapsed);
+    sent += other.sent;
+    approved += other.approved;
+    notSent += other.notSent;
+    incomplete += other.incomplete;
+    for (const auto& failure : other.failures)
+    {
+        failures[failure.first] += failure.second;
+    }
+}
+
+
+LoadReport RunLoad(const LoadOptions& options)
+{
+    //
+    // The load is the experiment: the library's own limit on checks in
+    // flight would hold it back, and hide how the server copes.
+    //
+    Microsoft::Azure::Batch::SoftwareEntitlement::SetMaxConcurrency(0);
+
+    std::mutex lock;
+    LoadReport total;
+    std::exception_ptr error;
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned index = 0; index < options.threads; index++)
+    {
+        threads.emplace_back([&, index]()
+        {
+            try
+            {
+                Worker worker(options, index, start);
+                LoadReport report = worker.Run();
+
+                std::lock_guard<std::mutex> guard(lock);
+                total.Merge(report);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                error = std::current_exception();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    return total;
+}
+
+
+void PrintReport(std::ostream& out, const LoadOptions& options, const LoadReport& report)
+{
+    double seconds = std::chrono::duration<double>(report.elapsed).count();
+    std::uint64_t completed = report.latency.Count();
+
+    out << std::fixed << std::setprecision(1);
+    out << "Load:       " << std::chrono::duration<double>(options.duration).count() << " s, ";
+    if (options.rate > 0)
+    {
+        out << options.rate << " checks/s (open loop)";
+        if (options.concurrency != 0)
+        {
+            out << ", at most " << options.concurrency << " in flight";
+        }
+    }
+    else
+    {
+        out << options.concurrency << " concurrent clients (closed loop)";
+    }
+    out << ", " << options.threads << " thread(s)" << std::endl;
+
+    out << "Sent:       " << report.sent << std::endl;
+    out << "Completed:  " << completed << std::endl;
+    out << "Throughput: " << (seconds > 0 ? completed / seconds : 0) << " checks/s" << std::endl;
+    out << "Approved:   " << report.approved << std::endl;
+    out << "Failed:     " << completed - report.approved << std::endl;
+    for (const auto& failure : report.failures)
+    {
+        out << "    " << std::left << std::setw(24) << failure.first << std::right << failure.second << std::endl;
+    }
+    if (report.notSent != 0)
+    {
+        out << "Not sent:   " << report.notSent << " (concurrency limit reached)" << std::endl;
+    }
+    if (report.incomplete != 0)
+    {
+        out << "Incomplete: " << report.incomplete << " (still in flight after " << DrainTimeout.count() << " s)" << std::endl;
+    }
+
+    out << std::endl << "Latency (ms) from scheduled start:" << std::endl;
+    out << std::setprecision(3);
+    const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+    for (double percentile : percentiles)
+    {
+        std::ostringstream label;
+        label << "p" << percentile;
+        out << "    " << std::left << std::setw(8) << label.str() << std::right << std::setw(12)
+            << report.latency.ValueAtPercentile(percentile) / 1000.0 << std::endl;
+    }
+    out << "    " << std::left << std::setw(8) << "max" << std::right << std::setw(12)
+        << report.latency.Max() / 1000.0 << std::endl;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "LatencyHistogram.h"
+#include <chrono>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//
+// An application and token to check, as read from a corpus file.
+//
+struct CorpusEntry
+{
+    std::string application;
+    std::string token;
+};
+
+//
+// Reads a corpus: one '<application> <token>' pair per line.  Blank lines and
+// lines starting with '#' are ignored.
+//
+std::vector<CorpusEntry> ReadCorpus(std::istream& input);
+
+struct LoadOptions
+{
+    std::string url;
+    std::chrono::milliseconds duration;
+
+    //
+    // Checks per second to start, across all threads, regardless of how
+    // quickly the server responds (open loop).  If 0, each of concurrency
+    // virtual clients starts its next check as soon as its last one finishes
+    // (closed loop).
+    //
+    double rate;
+
+    //
+    // Maximum checks in flight across all threads; 0 for no limit (open loop
+    // only).
+    //
+    unsigned concurrency;
+
+    unsigned threads;
+
+    std::vector<CorpusEntry> corpus;
+};
+
+struct LoadReport
+{
+    //
+    // Time from when each check should have started, per the schedule, to
+    // when it finished, so that a stalled server delays the measurement of
+    // every check scheduled behind it rather than hiding them.
+    //
+    LatencyHistogram latency;
+
+    std::chrono::steady_clock::duration elapsed;
+
+    std::uint64_t sent;
+    std::uint64_t approved;
+
+    //
+    // Checks the schedule called for but that were never started because
+    // the concurrency limit was reached.
+    //
+    std::uint64_t notSent;
+
+    //
+    // Checks still in flight when the run was abandoned.
+    //
+    std::uint64_t incomplete;
+
+    //
+    // Count of checks that were not approved, by cause.
+    //
+    std::map<std::string, std::uint64_t> failures;
+
+    LoadReport();
+
+    void Merge(const LoadReport& other);
+};
+
+LoadReport RunLoad(const LoadOptions& options);
+
+void PrintReport(std::ostream& out, const LoadOptions& options, const LoadReport& report);
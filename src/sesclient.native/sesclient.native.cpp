@@ -1,4 +1,7 @@
 #include "stdafx.h"
+#include "BatchRunner.h"
+#include "LeasedExec.h"
+#include "LoadGenerator.h"
 
 namespace
 {
@@ -15,20 +18,102 @@ namespace
             << std::endl
             << "Optional parameters:" << std::endl
             << "    --thumbprint <thumbprint of a certificate expected in the server's SSL certificate chain>" << std::endl
-            << "    --common-name <common name of the certificate with the specified thumbprint>" << std::endl;
+            << "    --common-name <common name of the certificate with the specified thumbprint>" << std::endl
+            << std::endl
+            << "Load generation (replaces the mandatory --token and --application):" << std::endl
+            << "    --load <number of seconds to generate load for>" << std::endl
+            << "    --rate <checks to start per second, however quickly the server responds>" << std::endl
+            << "    --concurrency <checks in flight; with --rate, the most allowed in flight>" << std::endl
+            << "    --threads <number of threads to generate load from, default 1>" << std::endl
+            << "    --corpus <file of '<application> <token>' lines to check in turn>" << std::endl
+            << "    --token and --application may be used instead of --corpus." << std::endl
+            << std::endl
+            << "Batch mode (replaces the mandatory --url, --token and --application):" << std::endl
+            << "    --batch <file of JSON requests, one per line, or - for stdin>" << std::endl
+            << "    --concurrency <checks in flight, default 16>" << std::endl
+            << "    --url <server for requests that do not specify one>" << std::endl
+            << "    Requests look like {\"id\": 1, \"url\": \"...\", \"token\": \"...\", \"application\": \"...\"};" << std::endl
+            << "    a JSON result is written to stdout, one per line, as each check completes." << std::endl
+            << std::endl
+            << "Prefetch (replaces the mandatory --application):" << std::endl
+            << "    --prefetch <comma-separated applications to check concurrently, then in turn>" << std::endl
+            << std::endl
+            << "Leased execution (follows the mandatory parameters):" << std::endl
+            << "    --exec -- <command> [<arguments>...]" << std::endl
+            << "    --lease-api-version <api-version the server offers leases under; 9999-09-09.99.99 for sestest server>" << std::endl
+            << "    --lease <seconds each acquisition or renewal of the lease lasts, default 300>" << std::endl
+            << "    The lease is held while the command runs, and its exit code is returned." << std::endl
+            << "    No released version of the service offers leases yet." << std::endl;
     }
 
-    static const std::array<std::string, 3> mandatoryParameterNames = {
+    static const std::vector<std::string> mandatoryParameterNames = {
         "--url",
         "--token",
         "--application"
     };
 
-    static const std::array<std::string, 2> optionalParameterNames = {
+    static const std::vector<std::string> optionalParameterNames = {
+        "--thumbprint",
+        "--common-name"
+    };
+
+    static const std::vector<std::string> loadMandatoryParameterNames = {
+        "--url",
+        "--load"
+    };
+
+    static const std::vector<std::string> loadOptionalParameterNames = {
+        "--token",
+        "--application",
+        "--corpus",
+        "--rate",
+        "--concurrency",
+        "--threads",
+        "--thumbprint",
+        "--common-name"
+    };
+
+    static const std::vector<std::string> batchMandatoryParameterNames = {
+        "--batch"
+    };
+
+    static const std::vector<std::string> batchOptionalParameterNames = {
+        "--url",
+        "--concurrency",
+        "--thumbprint",
+        "--common-name"
+    };
+
+    static const std::vector<std::string> prefetchMandatoryParameterNames = {
+        "--url",
+        "--token",
+        "--prefetch"
+    };
+
+    static const std::vector<std::string> execMandatoryParameterNames = {
+        "--url",
+        "--token",
+        "--application",
+        "--lease-api-version"
+    };
+
+    static const std::vector<std::string> execOptionalParameterNames = {
+        "--lease",
         "--thumbprint",
         "--common-name"
     };
 
+    //
+    // Checks in flight in batch mode unless --concurrency is given.
+    //
+    const unsigned DefaultBatchConcurrency = 16;
+
+    //
+    // Seconds each acquisition or renewal of a lease lasts unless --lease is
+    // given.
+    //
+    const unsigned DefaultLeaseSeconds = 300;
+
     struct Initializer
     {
         Initializer()
@@ -53,7 +138,7 @@ namespace
     {
     public:
 
-        bool parse(int argc, char** argv)
+        bool parse(int argc, char** argv, bool exec)
         {
             if ((argc % 2) == 1)
             {
@@ -72,8 +157,31 @@ namespace
                 return true;
             }
 
-            checkForMandatoryParameters(_parameters);
-            checkForExtraParameters(_parameters);
+            if (exec)
+            {
+                checkForMandatoryParameters(_parameters, execMandatoryParameterNames);
+                checkForExtraParameters(_parameters, execMandatoryParameterNames, execOptionalParameterNames);
+            }
+            else if (contains("--batch"))
+            {
+                checkForMandatoryParameters(_parameters, batchMandatoryParameterNames);
+                checkForExtraParameters(_parameters, batchMandatoryParameterNames, batchOptionalParameterNames);
+            }
+            else if (contains("--prefetch"))
+            {
+                checkForMandatoryParameters(_parameters, prefetchMandatoryParameterNames);
+                checkForExtraParameters(_parameters, prefetchMandatoryParameterNames, optionalParameterNames);
+            }
+            else if (contains("--load"))
+            {
+                checkForMandatoryParameters(_parameters, loadMandatoryParameterNames);
+                checkForExtraParameters(_parameters, loadMandatoryParameterNames, loadOptionalParameterNames);
+            }
+            else
+            {
+                checkForMandatoryParameters(_parameters, mandatoryParameterNames);
+                checkForExtraParameters(_parameters, mandatoryParameterNames, optionalParameterNames);
+            }
 
             return false;
         }
@@ -97,9 +205,11 @@ namespace
         bool _hasConfigurationError = false;
         std::unordered_map<std::string, std::string> _parameters;
 
-        void checkForMandatoryParameters(const std::unordered_map<std::string, std::string>& parameters)
+        void checkForMandatoryParameters(
+            const std::unordered_map<std::string, std::string>& parameters,
+            const std::vector<std::string>& mandatory)
         {
-            for (const auto& param : mandatoryParameterNames)
+            for (const auto& param : mandatory)
             {
                 if (parameters.find(param) == parameters.end())
                 {
@@ -109,15 +219,18 @@ namespace
             }
         }
 
-        void checkForExtraParameters(const std::unordered_map<std::string, std::string>& parameters)
+        void checkForExtraParameters(
+            const std::unordered_map<std::string, std::string>& parameters,
+            const std::vector<std::string>& mandatory,
+            const std::vector<std::string>& optional)
         {
             for (const auto& parameter : parameters)
             {
-                if (std::find(mandatoryParameterNames.begin(), mandatoryParameterNames.end(), parameter.first) != mandatoryParameterNames.end()) {
+                if (std::find(mandatory.begin(), mandatory.end(), parameter.first) != mandatory.end()) {
                     continue;
                 }
 
-                if (std::find(optionalParameterNames.begin(), optionalParameterNames.end(), parameter.first) != optionalParameterNames.end()) {
+                if (std::find(optional.begin(), optional.end(), parameter.first) != optional.end()) {
                     continue;
                 }
 
@@ -169,6 +282,223 @@ namespace
 
         return token;
     }
+
+    //
+    // Reads a positive number from the named parameter, reporting an error if
+    // it is missing or malformed.
+    //
+    bool readPositiveNumber(const ParameterParser& parameters, const std::string& name, double& value)
+    {
+        auto text = parameters.find(name);
+        char* end = nullptr;
+        value = std::strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || !(value > 0))
+        {
+            std::cerr << name << " must be a positive number" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    //
+    // Prefetches the entitlements of a comma-separated list of applications,
+    // then checks each in turn, as an application would, printing its
+    // entitlement identifier or the reason it was denied.
+    //
+    int runPrefetch(ParameterParser& parameters)
+    {
+        std::vector<std::string> applications;
+        std::istringstream list(parameters.find("--prefetch"));
+        std::string application;
+        while (std::getline(list, application, ','))
+        {
+            if (!application.empty())
+            {
+                applications.push_back(application);
+            }
+        }
+
+        if (applications.empty())
+        {
+            std::cerr << "--prefetch must list at least one application" << std::endl;
+            return -EINVAL;
+        }
+
+        auto url = parameters.find("--url");
+        auto token = readToken(parameters);
+
+        typedef std::chrono::steady_clock Clock;
+        auto start = Clock::now();
+        Microsoft::Azure::Batch::SoftwareEntitlement::Prefetch(url, token, applications);
+        auto prefetched = Clock::now();
+
+        int result = 0;
+        for (const auto& requested : applications)
+        {
+            try
+            {
+                auto entitlement = Microsoft::Azure::Batch::SoftwareEntitlement::GetEntitlement(url, token, requested);
+                std::cout << requested << ": " << entitlement->Id() << std::endl;
+            }
+            catch (const Microsoft::Azure::Batch::SoftwareEntitlement::Exception& e)
+            {
+                std::cout << requested << ": " << e.what() << std::endl;
+                result = -1;
+            }
+        }
+        auto checked = Clock::now();
+
+        std::cerr
+            << "Prefetched " << applications.size() << " entitlements in "
+            << std::chrono::duration<double, std::milli>(prefetched - start).count() << " ms, then checked them in "
+            << std::chrono::duration<double, std::milli>(checked - prefetched).count() << " ms" << std::endl;
+        return result;
+    }
+
+    bool readLoadOptions(ParameterParser& parameters, LoadOptions& options)
+    {
+        options.url = parameters.find("--url");
+        options.rate = 0;
+        options.concurrency = 0;
+        options.threads = 1;
+
+        double value;
+        if (!readPositiveNumber(parameters, "--load", value))
+        {
+            return false;
+        }
+        options.duration = std::chrono::milliseconds(static_cast<long long>(value * 1000));
+
+        if (parameters.contains("--rate"))
+        {
+            if (!readPositiveNumber(parameters, "--rate", options.rate))
+            {
+                return false;
+            }
+        }
+
+        if (parameters.contains("--concurrency"))
+        {
+            if (!readPositiveNumber(parameters, "--concurrency", value))
+            {
+                return false;
+            }
+            options.concurrency = static_cast<unsigned>(value);
+        }
+
+        if (options.rate == 0 && options.concurrency == 0)
+        {
+            std::cerr << "--rate or --concurrency must be used with --load" << std::endl;
+            return false;
+        }
+
+        if (parameters.contains("--threads"))
+        {
+            if (!readPositiveNumber(parameters, "--threads", value))
+            {
+                return false;
+            }
+            options.threads = static_cast<unsigned>(value);
+        }
+
+        if (parameters.contains("--corpus"))
+        {
+            if (parameters.contains("--token") || parameters.contains("--application"))
+            {
+                std::cerr << "--token and --application cannot be used with --corpus" << std::endl;
+                return false;
+            }
+
+            std::ifstream corpus(parameters.find("--corpus"));
+            if (!corpus)
+            {
+                std::cerr << "Unable to open corpus " << parameters.find("--corpus") << std::endl;
+                return false;
+            }
+            options.corpus = ReadCorpus(corpus);
+        }
+        else if (parameters.contains("--token") && parameters.contains("--application"))
+        {
+            CorpusEntry entry = { parameters.find("--application"), readToken(parameters) };
+            options.corpus.push_back(entry);
+        }
+        else
+        {
+            std::cerr << "--corpus, or both --token and --application, must be used with --load" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    //
+    // Splits off the command following '--' and the --exec before it, which
+    // take no part in the pairs of parameters; returns false if only one of
+    // them is given, or the command is empty.
+    //
+    bool splitExecCommand(int& argc, char** argv, bool& exec, std::vector<std::string>& command)
+    {
+        int separator = 1;
+        while (separator < argc && std::string(argv[separator]) != "--")
+        {
+            ++separator;
+        }
+
+        exec = false;
+        for (int i = 1; i < separator; ++i)
+        {
+            if (std::string(argv[i]) == "--exec")
+            {
+                std::copy(argv + i + 1, argv + argc, argv + i);
+                --argc;
+                --separator;
+                exec = true;
+                break;
+            }
+        }
+
+        if (separator == argc && !exec)
+        {
+            return true;
+        }
+
+        command.assign(argv + std::min(separator + 1, argc), argv + argc);
+        argc = separator;
+        if (!exec || command.empty())
+        {
+            std::cerr << "--exec must be followed by -- and the command to run" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool readExecOptions(ParameterParser& parameters, ExecOptions& options)
+    {
+        options.url = parameters.find("--url");
+        options.token = readToken(parameters);
+        options.application = parameters.find("--application");
+        options.apiVersion = parameters.find("--lease-api-version");
+        options.lease = std::chrono::seconds(DefaultLeaseSeconds);
+
+        if (parameters.contains("--lease"))
+        {
+            double value;
+            if (!readPositiveNumber(parameters, "--lease", value))
+            {
+                return false;
+            }
+            if (value < 1)
+            {
+                std::cerr << "--lease must be at least one second" << std::endl;
+                return false;
+            }
+            options.lease = std::chrono::seconds(static_cast<long long>(value));
+        }
+
+        return true;
+    }
 }
 
 int main(int argc, char** argv)
@@ -178,7 +508,14 @@ int main(int argc, char** argv)
         Initializer init;
         ParameterParser parser;
 
-        auto shouldShowUsage = parser.parse(argc, argv);
+        bool exec;
+        ExecOptions execOptions;
+        if (!splitExecCommand(argc, argv, exec, execOptions.command))
+        {
+            return -EINVAL;
+        }
+
+        auto shouldShowUsage = parser.parse(argc, argv, exec);
         if (shouldShowUsage)
         {
             ShowUsage(argv[0]);
@@ -190,7 +527,6 @@ int main(int argc, char** argv)
             return -EINVAL;
         }
 
-        auto token = readToken(parser);
         auto connectionConfigured = configureConnection(parser);
 
         if (!connectionConfigured)
@@ -198,6 +534,72 @@ int main(int argc, char** argv)
             return -EINVAL;
         }
 
+        if (exec)
+        {
+            if (!readExecOptions(parser, execOptions))
+            {
+                return -EINVAL;
+            }
+
+            return RunLeased(execOptions);
+        }
+
+        if (parser.contains("--batch"))
+        {
+            BatchOptions options;
+            options.concurrency = DefaultBatchConcurrency;
+            if (parser.contains("--url"))
+            {
+                options.url = parser.find("--url");
+            }
+
+            if (parser.contains("--concurrency"))
+            {
+                double value;
+                if (!readPositiveNumber(parser, "--concurrency", value))
+                {
+                    return -EINVAL;
+                }
+                options.concurrency = static_cast<unsigned>(value);
+            }
+
+            auto path = parser.find("--batch");
+            if (path == "-")
+            {
+                RunBatch(std::cin, std::cout, options);
+                return 0;
+            }
+
+            std::ifstream input(path);
+            if (!input)
+            {
+                std::cerr << "Unable to open batch " << path << std::endl;
+                return -EINVAL;
+            }
+            RunBatch(input, std::cout, options);
+            return 0;
+        }
+
+        if (parser.contains("--prefetch"))
+        {
+            return runPrefetch(parser);
+        }
+
+        if (parser.contains("--load"))
+        {
+            LoadOptions options;
+            if (!readLoadOptions(parser, options))
+            {
+                return -EINVAL;
+            }
+
+            auto report = RunLoad(options);
+            PrintReport(std::cout, options, report);
+            return 0;
+        }
+
+        auto token = readToken(parser);
+
         auto entitlement = Microsoft::Azure::Batch::SoftwareEntitlement::GetEntitlement(
             parser.find("--url"),
             token,
@@ -0,0 +1,1453 @@
+#include "Server.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include "json.hpp"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//
+// The api-versions understood by the service, grouped by the shape of their
+// responses.
+//
+const char* const ApiVersionsV1[] = { "2017-05-01.5.0", "2017-06-01.5.1" };
+const char* const ApiVersionsV2[] = { "2017-09-01.6.0", "2018-03-01.6.1", "2018-08-01.7.0" };
+const char* const ApiVersionLatest = "9999-09-09.99.99";
+
+//
+// Lifetime reported for entitlements approved through the V2 api-versions.
+//
+const std::chrono::hours ApprovedEntitlementLifetime(24 * 7);
+
+//
+// Interval between the chunks of a slow body.
+//
+const std::chrono::milliseconds SlowBodyInterval(100);
+
+//
+// Largest request head accepted before the connection is dropped.
+//
+const size_t MaximumHeadLength = 64 * 1024;
+
+void ThrowIfError(bool error, const char* operation)
+{
+    if (error)
+    {
+        throw std::runtime_error(std::string(operation) + " failed: " + std::strerror(errno));
+    }
+}
+
+std::string ToLower(std::string value)
+{
+    std::transform(value.begin(), value.end(), value.begin(),
+        [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return value;
+}
+
+//
+// Returns the value of the named header (case-insensitive), or an empty
+// string.  'head' starts with the request line and ends with "\r\n".
+//
+std::string FindHeader(const std::string& head, const std::string& name)
+{
+    std::string lower = ToLower(head);
+    std::string key = "\r\n" + ToLower(name) + ":";
+    size_t pos = lower.find(key);
+    if (pos == std::string::npos)
+    {
+        return std::string();
+    }
+
+    pos += key.length();
+    size_t end = head.find("\r\n", pos);
+    std::string value = head.substr(pos, end - pos);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return value;
+}
+
+bool IsOneOf(const std::string& value, const char* const* begin, const char* const* end)
+{
+    return std::find_if(begin, end, [&value](const char* v) { return value == v; }) != end;
+}
+
+//
+// Returns the value of a query parameter, not URL-decoded; false if absent.
+//
+bool FindQueryParameter(const std::string& query, const std::string& name, std::string& value)
+{
+    size_t start = 0;
+    while (start <= query.size())
+    {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos)
+        {
+            end = query.size();
+        }
+
+        std::string parameter = query.substr(start, end - start);
+        size_t equals = parameter.find('=');
+        if (parameter.substr(0, equals) == name)
+        {
+            value = equals == std::string::npos ? std::string() : parameter.substr(equals + 1);
+            return true;
+        }
+
+        start = end + 1;
+    }
+
+    return false;
+}
+
+//
+// Parses the subset of ISO 8601 durations made of weeks, days, hours,
+// minutes and (fractional) seconds, such as 'PT5M' or 'P1DT12H'.
+//
+bool ParseDuration(const std::string& value, std::chrono::milliseconds& result)
+{
+    if (value.size() < 2 || value[0] != 'P')
+    {
+        return false;
+    }
+
+    double seconds = 0;
+    bool time = false;
+    size_t i = 1;
+    while (i < value.size())
+    {
+        if (value[i] == 'T' && !time)
+        {
+            time = true;
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < value.size() && (std::isdigit(static_cast<unsigned char>(value[i])) || value[i] == '.'))
+        {
+            ++i;
+        }
+
+        if (start == i || i == value.size())
+        {
+            return false;
+        }
+
+        double amount = std::strtod(value.substr(start, i - start).c_str(), nullptr);
+        char unit = value[i++];
+        if (!time && unit == 'W')
+        {
+            seconds += amount * 7 * 86400;
+        }
+        else if (!time && unit == 'D')
+        {
+            seconds += amount * 86400;
+        }
+        else if (time && unit == 'H')
+        {
+            seconds += amount * 3600;
+        }
+        else if (time && unit == 'M')
+        {
+            seconds += amount * 60;
+        }
+        else if (time && unit == 'S')
+        {
+            seconds += amount;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if (value.back() == 'P' || value.back() == 'T')
+    {
+        return false;
+    }
+
+    result = std::chrono::milliseconds(std::llround(seconds * 1000));
+    return true;
+}
+
+//
+// Formats a time as ISO 8601 UTC with seven fractional digits, as .NET
+// does; 'suffix' is "Z" for DateTime and "+00:00" for DateTimeOffset.
+//
+std::string FormatTime(std::chrono::system_clock::time_point time, const char* suffix)
+{
+    auto ticks = std::chrono::duration_cast<std::chrono::duration<long long, std::ratio<1, 10000000>>>(
+        time.time_since_epoch()).count();
+    std::time_t seconds = static_cast<std::time_t>(ticks / 10000000);
+    std::tm utc;
+    gmtime_r(&seconds, &utc);
+
+    char buffer[64];
+    size_t length = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+    std::snprintf(buffer + length, sizeof(buffer) - length, ".%07lld%s", ticks % 10000000, suffix);
+    return buffer;
+}
+
+//
+// A random (version 4) GUID, with or without hyphens.
+//
+std::string NewGuid(Random& random, bool hyphens)
+{
+    std::uint64_t high = (random() & 0xffffffffffff0fffULL) | 0x0000000000004000ULL;
+    std::uint64_t low = (random() & 0x3fffffffffffffffULL) | 0x8000000000000000ULL;
+
+    char buffer[40];
+    std::snprintf(buffer, sizeof(buffer),
+        hyphens ? "%08x-%04x-%04x-%04x-%012llx" : "%08x%04x%04x%04x%012llx",
+        static_cast<unsigned>(high >> 32),
+        static_cast<unsigned>((high >> 16) & 0xffff),
+        static_cast<unsigned>(high & 0xffff),
+        static_cast<unsigned>(low >> 48),
+        static_cast<unsigned long long>(low & 0xffffffffffffULL));
+    return buffer;
+}
+
+const char* ReasonPhrase(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return status < 500 ? "Client Error" : "Server Error";
+    }
+}
+
+std::string FailureBody(const std::string& code, const std::string& message)
+{
+    nlohmann::json j;
+    j["code"] = code;
+    j["message"]["lang"] = "en-us";
+    j["message"]["value"] = message;
+    return j.dump();
+}
+
+//
+// Parses a request body, returning null if it is not valid JSON.
+//
+nlohmann::json ParseBody(const std::string& body)
+{
+    try
+    {
+        return nlohmann::json::parse(body);
+    }
+    catch (const std::exception&)
+    {
+        return nlohmann::json();
+    }
+}
+
+}   // anonymous namespace
+
+
+struct Server::Request
+{
+    std::string method;
+    std::string target;
+    std::string body;
+    bool keepAlive;
+    // The client's id for the request, to echo back if it asks for it.
+    std::string clientRequestId;
+    bool returnClientRequestId;
+};
+
+struct Server::Response
+{
+    int status;
+    std::string body;
+    unsigned retryAfterSeconds;
+
+    Response(int status, const std::string& body)
+        : status(status)
+        , body(body)
+        , retryAfterSeconds(0)
+    {
+    }
+
+    static Response Failure(int status, const std::string& code, const std::string& message)
+    {
+        return Response(status, FailureBody(code, message));
+    }
+};
+
+
+//
+// One event loop thread: a listener sharing the server's port (via
+// SO_REUSEPORT, so the kernel spreads connections across loops) and the
+// connections accepted on it, driven by epoll.  Injected delays are timers
+// on the loop, so a delayed response never blocks other connections.
+//
+class Server::Loop
+{
+public:
+    Loop(Server& server, unsigned short port);
+
+    ~Loop();
+
+    unsigned short Port() const { return _port; }
+
+    void Start();
+
+private:
+    enum class State
+    {
+        HandshakeDelay,
+        Handshake,
+        Reading,
+        Responding,
+        Writing,
+        Dribbling,
+        Reset
+    };
+
+    struct SslDeleter
+    {
+        void operator()(SSL* ssl) { SSL_free(ssl); }
+    };
+
+    struct Connection
+    {
+        int fd;
+        std::uint64_t id;
+        std::unique_ptr<SSL, SslDeleter> ssl;
+        State state;
+        std::uint32_t events;
+        std::string input;
+        bool continueSent;
+        std::string output;
+        size_t written;
+        // Response waiting for its injected latency to elapse.
+        std::string response;
+        size_t headLength;
+        Fault fault;
+        // The part of a slow body not yet released for writing.
+        std::string trickle;
+        bool closeAfterResponse;
+    };
+
+    struct Timer
+    {
+        Clock::time_point due;
+        int fd;
+        std::uint64_t connection;
+
+        bool operator>(const Timer& other) const { return due > other.due; }
+    };
+
+    enum class ParseResult
+    {
+        Incomplete,
+        Complete,
+        Malformed
+    };
+
+    Server& _server;
+    int _epoll;
+    int _listener;
+    int _wake;
+    int _timerFd;
+    unsigned short _port;
+    Clock::time_point _armed;
+    std::unordered_map<int, std::unique_ptr<Connection>> _connections;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> _timers;
+    std::thread _thread;
+
+    void Run();
+
+    void Accept();
+
+    void OnEvent(int fd, std::uint32_t events);
+
+    void OnTimers();
+
+    void Schedule(const Connection& connection, std::chrono::microseconds delay);
+
+    bool Advance(Connection& connection);
+
+    bool Flush(Connection& connection, bool& blocked);
+
+    bool Watch(Connection& connection, std::uint32_t events);
+
+    bool WaitFor(Connection& connection, int result);
+
+    //
+    // As WaitFor, for a connection without TLS: waits for events if the
+    // socket would have blocked.
+    //
+    bool WaitForSocket(Connection& connection, ssize_t result, std::uint32_t events);
+
+    ParseResult Parse(Connection& connection, Request& request);
+
+    void StartResponse(Connection& connection, const Request& request);
+
+    void Respond(Connection& connection);
+
+    //
+    // Closes a connection; with a reset (RST) if that is its injected fault.
+    //
+    void Close(int fd);
+
+    Loop(const Loop&);
+    Loop& operator=(const Loop&);
+};
+
+
+Server::Loop::Loop(Server& server, unsigned short port)
+    : _server(server)
+    , _epoll(-1)
+    , _listener(-1)
+    , _wake(-1)
+    , _timerFd(-1)
+    , _port(port)
+{
+    try
+    {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        ThrowIfError(_epoll == -1, "epoll_create1");
+        _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ThrowIfError(_wake == -1, "eventfd");
+        _timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ThrowIfError(_timerFd == -1, "timerfd_create");
+
+        const std::string& path = _server._options.unixSocket;
+        if (!path.empty())
+        {
+            sockaddr_un addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                throw std::runtime_error("Unix domain socket path is too long: " + path);
+            }
+            path.copy(addr.sun_path, path.size());
+
+            _listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            ThrowIfError(_listener == -1, "socket");
+            unlink(path.c_str());
+            ThrowIfError(bind(_listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0, "bind");
+            ThrowIfError(listen(_listener, SOMAXCONN) != 0, "listen");
+        }
+        else
+        {
+            _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            ThrowIfError(_listener == -1, "socket");
+
+            int enable = 1;
+            setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            ThrowIfError(setsockopt(_listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0, "SO_REUSEPORT");
+
+            sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(port);
+            ThrowIfError(bind(_listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0, "bind");
+            ThrowIfError(listen(_listener, SOMAXCONN) != 0, "listen");
+
+            socklen_t length = sizeof(addr);
+            ThrowIfError(getsockname(_listener, reinterpret_cast<sockaddr*>(&addr), &length) != 0, "getsockname");
+            _port = ntohs(addr.sin_port);
+        }
+
+        const int fds[] = { _listener, _wake, _timerFd };
+        for (int fd : fds)
+        {
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            ThrowIfError(epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) != 0, "epoll_ctl");
+        }
+    }
+    catch (...)
+    {
+        const int fds[] = { _listener, _timerFd, _wake, _epoll };
+        for (int fd : fds)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+        throw;
+    }
+}
+
+Server::Loop::~Loop()
+{
+    if (_thread.joinable())
+    {
+        std::uint64_t one = 1;
+        ssize_t written = write(_wake, &one, sizeof(one));
+        (void)written;
+        _thread.join();
+    }
+
+    while (!_connections.empty())
+    {
+        Close(_connections.begin()->first);
+    }
+
+    close(_listener);
+    close(_timerFd);
+    close(_wake);
+    close(_epoll);
+}
+
+void Server::Loop::Start()
+{
+    _thread = std::thread(&Loop::Run, this);
+}
+
+void Server::Loop::Run()
+{
+    epoll_event events[256];
+    for (;;)
+    {
+        int count = epoll_wait(_epoll, events, 256, -1);
+        if (count == -1 && errno != EINTR)
+        {
+            return;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == _wake)
+            {
+                return;
+            }
+
+            if (fd == _listener)
+            {
+                Accept();
+            }
+            else if (fd == _timerFd)
+            {
+                std::uint64_t expirations;
+                ssize_t length = read(_timerFd, &expirations, sizeof(expirations));
+                (void)length;
+            }
+            else
+            {
+                OnEvent(fd, events[i].events);
+            }
+        }
+
+        OnTimers();
+    }
+}
+
+void Server::Loop::Accept()
+{
+    for (;;)
+    {
+        int fd = accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            // EAGAIN once the backlog is drained; anything else (such as
+            // running out of descriptors) is retried on the next event.
+            return;
+        }
+
+        //
+        // Connections on a Unix domain socket are plain HTTP.
+        //
+        bool plain = !_server._options.unixSocket.empty();
+        if (!plain)
+        {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+
+        std::unique_ptr<Connection> connection(new Connection());
+        connection->fd = fd;
+        connection->id = ++_server._connections;
+        if (!plain)
+        {
+            connection->ssl.reset(SSL_new(_server._context.get()));
+        }
+        connection->events = 0;
+        connection->continueSent = false;
+        connection->written = 0;
+        connection->headLength = 0;
+        connection->closeAfterResponse = false;
+
+        epoll_event event;
+        event.events = 0;
+        event.data.fd = fd;
+        if ((!plain && (connection->ssl == nullptr || SSL_set_fd(connection->ssl.get(), fd) != 1))
+            || epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        Connection& added = *connection;
+        _connections[fd] = std::move(connection);
+
+        if (plain)
+        {
+            added.state = State::Reading;
+            if (!Advance(added))
+            {
+                Close(fd);
+            }
+            continue;
+        }
+
+        SSL_set_accept_state(added.ssl.get());
+
+        //
+        // Connections draw from a stream of their own, distinct from the
+        // request streams, so handshake delays are reproducible too.
+        //
+        Random random(_server._options.seed, ~added.id);
+        auto delay = _server._options.handshakeDelay.Sample(random);
+
+        if (delay.count() > 0)
+        {
+            added.state = State::HandshakeDelay;
+            Schedule(added, delay);
+        }
+        else
+        {
+            added.state = State::Handshake;
+            if (!Advance(added))
+            {
+                Close(fd);
+            }
+        }
+    }
+}
+
+void Server::Loop::OnEvent(int fd, std::uint32_t events)
+{
+    auto found = _connections.find(fd);
+    if (found == _connections.end())
+    {
+        return;
+    }
+
+    //
+    // Hang-ups are reported whatever the interest set, so must be handled
+    // here even for a connection that is only waiting on a timer.
+    //
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0 || !Advance(*found->second))
+    {
+        Close(fd);
+    }
+}
+
+void Server::Loop::OnTimers()
+{
+    auto now = Clock::now();
+    while (!_timers.empty() && _timers.top().due <= now)
+    {
+        Timer timer = _timers.top();
+        _timers.pop();
+
+        auto found = _connections.find(timer.fd);
+        if (found == _connections.end() || found->second->id != timer.connection)
+        {
+            continue;
+        }
+
+        Connection& connection = *found->second;
+        switch (connection.state)
+        {
+        case State::HandshakeDelay:
+            connection.state = State::Handshake;
+            break;
+
+        case State::Responding:
+            Respond(connection);
+            break;
+
+        case State::Dribbling:
+        {
+            size_t chunk = std::max<size_t>(1, _server._options.slowBodyBytesPerSecond / 10);
+            chunk = std::min(chunk, connection.trickle.size());
+            connection.output.append(connection.trickle, 0, chunk);
+            connection.trickle.erase(0, chunk);
+            connection.state = State::Writing;
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        if (!Advance(connection))
+        {
+            Close(timer.fd);
+        }
+    }
+
+    if (!_timers.empty() && _timers.top().due != _armed)
+    {
+        _armed = _timers.top().due;
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(_armed - Clock::now());
+        long long nanoseconds = std::max<long long>(remaining.count(), 1);
+
+        itimerspec spec;
+        std::memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+        timerfd_settime(_timerFd, 0, &spec, nullptr);
+    }
+}
+
+void Server::Loop::Schedule(const Connection& connection, std::chrono::microseconds delay)
+{
+    Timer timer;
+    timer.due = Clock::now() + delay;
+    timer.fd = connection.fd;
+    timer.connection = connection.id;
+    _timers.push(timer);
+}
+
+bool Server::Loop::Watch(Connection& connection, std::uint32_t events)
+{
+    if (connection.events != events)
+    {
+        epoll_event event;
+        event.events = events;
+        event.data.fd = connection.fd;
+        if (epoll_ctl(_epoll, EPOLL_CTL_MOD, connection.fd, &event) != 0)
+        {
+            return false;
+        }
+        connection.events = events;
+    }
+
+    return true;
+}
+
+bool Server::Loop::WaitFor(Connection& connection, int result)
+{
+    switch (SSL_get_error(connection.ssl.get(), result))
+    {
+    case SSL_ERROR_WANT_READ:
+        return Watch(connection, EPOLLIN);
+
+    case SSL_ERROR_WANT_WRITE:
+        return Watch(connection, EPOLLOUT);
+
+    default:
+        return false;
+    }
+}
+
+bool Server::Loop::WaitForSocket(Connection& connection, ssize_t result, std::uint32_t events)
+{
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && Watch(connection, events);
+}
+
+bool Server::Loop::Flush(Connection& connection, bool& blocked)
+{
+    blocked = false;
+    while (connection.written < connection.output.size())
+    {
+        const char* data = connection.output.data() + connection.written;
+        size_t size = connection.output.size() - connection.written;
+        if (!connection.ssl)
+        {
+            ssize_t n = send(connection.fd, data, size, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                blocked = true;
+                return WaitForSocket(connection, n, EPOLLOUT);
+            }
+            connection.written += static_cast<size_t>(n);
+            continue;
+        }
+
+        ERR_clear_error();
+        int n = SSL_write(connection.ssl.get(), data, static_cast<int>(size));
+        if (n <= 0)
+        {
+            blocked = true;
+            return WaitFor(connection, n);
+        }
+        connection.written += static_cast<size_t>(n);
+    }
+
+    connection.output.clear();
+    connection.written = 0;
+    return true;
+}
+
+//
+// Moves a connection through its states until it must wait for the socket
+// or a timer.  Returns false if the connection should be closed.
+//
+bool Server::Loop::Advance(Connection& connection)
+{
+    for (;;)
+    {
+        switch (connection.state)
+        {
+        case State::HandshakeDelay:
+        case State::Responding:
+        case State::Dribbling:
+            return Watch(connection, 0);
+
+        case State::Reset:
+            return false;
+
+        case State::Handshake:
+        {
+            ERR_clear_error();
+            int result = SSL_accept(connection.ssl.get());
+            if (result != 1)
+            {
+                return WaitFor(connection, result);
+            }
+            connection.state = State::Reading;
+            break;
+        }
+
+        case State::Reading:
+        {
+            bool blocked;
+            if (!Flush(connection, blocked))
+            {
+                return false;
+            }
+
+            if (blocked)
+            {
+                return true;
+            }
+
+            Request request;
+            ParseResult parsed = Parse(connection, request);
+            if (parsed == ParseResult::Malformed)
+            {
+                return false;
+            }
+
+            if (parsed == ParseResult::Complete)
+            {
+                StartResponse(connection, request);
+                break;
+            }
+
+            if (!connection.output.empty())
+            {
+                // Just queued "100 Continue".
+                break;
+            }
+
+            char buffer[16 * 1024];
+            if (!connection.ssl)
+            {
+                ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                {
+                    return WaitForSocket(connection, n, EPOLLIN);
+                }
+                connection.input.append(buffer, static_cast<size_t>(n));
+                break;
+            }
+
+            ERR_clear_error();
+            int n = SSL_read(connection.ssl.get(), buffer, sizeof(buffer));
+            if (n <= 0)
+            {
+                return WaitFor(connection, n);
+            }
+            connection.input.append(buffer, static_cast<size_t>(n));
+            break;
+        }
+
+        case State::Writing:
+        {
+            bool blocked;
+            if (!Flush(connection, blocked))
+            {
+                return false;
+            }
+
+            if (blocked)
+            {
+                return true;
+            }
+
+            if (!connection.trickle.empty())
+            {
+                connection.state = State::Dribbling;
+                Schedule(connection, SlowBodyInterval);
+                break;
+            }
+
+            if (connection.closeAfterResponse)
+            {
+                if (connection.ssl)
+                {
+                    SSL_shutdown(connection.ssl.get());
+                }
+                return false;
+            }
+
+            connection.state = State::Reading;
+            break;
+        }
+        }
+    }
+}
+
+Server::Loop::ParseResult Server::Loop::Parse(Connection& connection, Request& request)
+{
+    std::string& input = connection.input;
+    size_t headEnd = input.find("\r\n\r\n");
+    if (headEnd == std::string::npos)
+    {
+        return input.size() > MaximumHeadLength ? ParseResult::Malformed : ParseResult::Incomplete;
+    }
+
+    std::string head = input.substr(0, headEnd + 2);
+    size_t lineEnd = head.find("\r\n");
+    std::string line = head.substr(0, lineEnd);
+    size_t first = line.find(' ');
+    size_t second = line.find(' ', first + 1);
+    if (first == std::string::npos || second == std::string::npos)
+    {
+        return ParseResult::Malformed;
+    }
+
+    if (!FindHeader(head, "Transfer-Encoding").empty())
+    {
+        // Chunked request bodies are never sent by the client.
+        return ParseResult::Malformed;
+    }
+
+    size_t contentLength = std::strtoul(FindHeader(head, "Content-Length").c_str(), nullptr, 10);
+    if (input.size() < headEnd + 4 + contentLength)
+    {
+        if (!connection.continueSent && ToLower(FindHeader(head, "Expect")) == "100-continue")
+        {
+            connection.output += "HTTP/1.1 100 Continue\r\n\r\n";
+            connection.continueSent = true;
+        }
+        return ParseResult::Incomplete;
+    }
+
+    request.method = line.substr(0, first);
+    request.target = line.substr(first + 1, second - first - 1);
+    request.body = input.substr(headEnd + 4, contentLength);
+
+    std::string version = line.substr(second + 1);
+    std::string connectionHeader = ToLower(FindHeader(head, "Connection"));
+    request.keepAlive = version == "HTTP/1.1"
+        ? connectionHeader != "close"
+        : connectionHeader == "keep-alive";
+    request.clientRequestId = FindHeader(head, "client-request-id");
+    request.returnClientRequestId = ToLower(FindHeader(head, "return-client-request-id")) == "true";
+
+    input.erase(0, headEnd + 4 + contentLength);
+    connection.continueSent = false;
+    return ParseResult::Complete;
+}
+
+void Server::Loop::StartResponse(Connection& connection, const Request& request)
+{
+    auto started = Clock::now();
+    std::uint64_t sequence = ++_server._requests;
+    Random random(_server._options.seed, sequence);
+    const ServerOptions& options = _server._options;
+
+    connection.fault = options.FaultFor(sequence, random);
+
+    Response response(0, std::string());
+    if (connection.fault.kind == FaultKind::Status)
+    {
+        int status = connection.fault.status;
+        if (status == 429)
+        {
+            response = Response::Failure(status, "TooManyRequests",
+                "The server is throttling requests; retry after " + std::to_string(options.retryAfterSeconds) + " seconds.");
+        }
+        else if (status == 503)
+        {
+            response = Response::Failure(status, "ServerBusy", "The server is currently unable to handle the request.");
+        }
+        else
+        {
+            response = Response::Failure(status, status >= 500 ? "InternalServerError" : "BadRequest",
+                "Injected failure from the stand-in server.");
+        }
+
+        if (status == 429 || status == 503)
+        {
+            response.retryAfterSeconds = options.retryAfterSeconds;
+        }
+    }
+    else
+    {
+        response = _server.Handle(request, random);
+    }
+
+    connection.closeAfterResponse = !request.keepAlive
+        || options.connectionMode == ServerOptions::ConnectionMode::Close;
+
+    std::string& text = connection.response;
+    text = "HTTP/1.1 " + std::to_string(response.status) + " " + ReasonPhrase(response.status) + "\r\n";
+    if (response.status != 204)
+    {
+        text += "Content-Type: application/json; charset=utf-8\r\n";
+        text += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+    }
+    if (response.retryAfterSeconds != 0)
+    {
+        text += "Retry-After: " + std::to_string(response.retryAfterSeconds) + "\r\n";
+    }
+    if (connection.closeAfterResponse)
+    {
+        text += "Connection: close\r\n";
+    }
+
+    //
+    // As the service does, identify the request, and say how long it took,
+    // including the injected latency, so that clients can tell the server's
+    // time from the network's.
+    //
+    auto delay = options.latency.Sample(random);
+    text += "request-id: " + NewGuid(random, true) + "\r\n";
+    if (request.returnClientRequestId && !request.clientRequestId.empty())
+    {
+        text += "client-request-id: " + request.clientRequestId + "\r\n";
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started) + delay;
+    char timing[64];
+    std::snprintf(timing, sizeof(timing), "Server-Timing: ses;dur=%.3f\r\n", elapsed.count() / 1000.0);
+    text += timing;
+
+    text += "\r\n";
+    connection.headLength = text.size();
+    text += response.body;
+
+    if (delay.count() > 0)
+    {
+        connection.state = State::Responding;
+        Schedule(connection, delay);
+    }
+    else
+    {
+        Respond(connection);
+    }
+}
+
+void Server::Loop::Respond(Connection& connection)
+{
+    switch (connection.fault.kind)
+    {
+    case FaultKind::Reset:
+        connection.state = State::Reset;
+        break;
+
+    case FaultKind::SlowBody:
+        connection.output += connection.response.substr(0, connection.headLength);
+        connection.trickle = connection.response.substr(connection.headLength);
+        connection.state = State::Writing;
+        break;
+
+    default:
+        connection.output += connection.response;
+        connection.state = State::Writing;
+        break;
+    }
+
+    connection.response.clear();
+}
+
+void Server::Loop::Close(int fd)
+{
+    auto found = _connections.find(fd);
+    if (found != _connections.end() && found->second->state == State::Reset)
+    {
+        //
+        // Closing with a zero linger time sends RST instead of FIN.
+        //
+        linger immediate;
+        immediate.l_onoff = 1;
+        immediate.l_linger = 0;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &immediate, sizeof(immediate));
+    }
+
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+    _connections.erase(fd);
+    close(fd);
+}
+
+
+Server::Server(const TestCertificates& certificates, const ServerOptions& options)
+    : _options(options)
+    , _context(SSL_CTX_new(TLS_server_method()))
+    , _port(0)
+    , _requests(0)
+    , _connections(0)
+    , _acquired(0)
+    , _renewed(0)
+    , _released(0)
+{
+    if (_context == nullptr
+        || SSL_CTX_use_certificate(_context.get(), certificates.ServerCertificate()) != 1
+        || SSL_CTX_add1_chain_cert(_context.get(), certificates.IntermediateCertificate()) != 1
+        || SSL_CTX_use_PrivateKey(_context.get(), certificates.ServerKey()) != 1)
+    {
+        throw std::runtime_error("Failed to configure stand-in server certificate chain");
+    }
+
+    Start();
+}
+
+Server::Server(const std::string& certificateChainPath, const std::string& keyPath, const ServerOptions& options)
+    : _options(options)
+    , _context(SSL_CTX_new(TLS_server_method()))
+    , _port(0)
+    , _requests(0)
+    , _connections(0)
+    , _acquired(0)
+    , _renewed(0)
+    , _released(0)
+{
+    if (_context == nullptr
+        || SSL_CTX_use_certificate_chain_file(_context.get(), certificateChainPath.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(_context.get(), keyPath.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(_context.get()) != 1)
+    {
+        throw std::runtime_error("Failed to load certificate chain " + certificateChainPath + " and key " + keyPath);
+    }
+
+    Start();
+}
+
+Server::~Server()
+{
+    _loops.clear();
+
+    if (!_options.unixSocket.empty())
+    {
+        unlink(_options.unixSocket.c_str());
+    }
+}
+
+void Server::Start()
+{
+    _options.Validate();
+
+    SSL_CTX_set_min_proto_version(_context.get(), TLS1_2_VERSION);
+    SSL_CTX_set_mode(_context.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    _port = _options.port;
+    for (unsigned i = 0; i < _options.threads; ++i)
+    {
+        _loops.emplace_back(new Loop(*this, _port));
+        _port = _loops.back()->Port();
+    }
+
+    for (auto& loop : _loops)
+    {
+        loop->Start();
+    }
+}
+
+std::string Server::Url() const
+{
+    if (!_options.unixSocket.empty())
+    {
+        return "http://localhost/";
+    }
+    return "https://localhost:" + std::to_string(_port) + "/";
+}
+
+unsigned short Server::Port() const
+{
+    return _port;
+}
+
+std::uint64_t Server::RequestCount() const
+{
+    return _requests;
+}
+
+std::uint64_t Server::ConnectionCount() const
+{
+    return _connections;
+}
+
+std::uint64_t Server::AcquireCount() const
+{
+    return _acquired;
+}
+
+std::uint64_t Server::RenewCount() const
+{
+    return _renewed;
+}
+
+std::uint64_t Server::ReleaseCount() const
+{
+    return _released;
+}
+
+bool Server::IsApproved(const std::string& application) const
+{
+    return _options.approvedApplications.count("*") != 0
+        || _options.approvedApplications.count(application) != 0;
+}
+
+//
+// Routes a request as the service does: POST to the softwareEntitlements
+// collection approves (or, at the latest api-version, acquires); POST and
+// DELETE on an entitlement renew and release it.  The collection may follow
+// any path, as account URLs may include one.
+//
+Server::Response Server::Handle(const Request& request, Random& random)
+{
+    size_t question = request.target.find('?');
+    std::string path = request.target.substr(0, question);
+    std::string query = question == std::string::npos ? std::string() : request.target.substr(question + 1);
+    while (path.size() > 1 && path.back() == '/')
+    {
+        path.pop_back();
+    }
+
+    std::vector<std::string> segments;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = path.size();
+        }
+        if (end > start)
+        {
+            segments.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+
+    std::string apiVersion;
+    bool hasApiVersion = FindQueryParameter(query, "api-version", apiVersion) && !apiVersion.empty();
+
+    size_t count = segments.size();
+    bool collection = count >= 1 && ToLower(segments[count - 1]) == "softwareentitlements";
+    bool item = count >= 2 && ToLower(segments[count - 2]) == "softwareentitlements";
+
+    if (collection && request.method == "POST")
+    {
+        if (!hasApiVersion)
+        {
+            return Response::Failure(400, "EntitlementDenied", "Missing api-version query parameter; denying entitlement request.");
+        }
+
+        if (apiVersion == ApiVersionLatest)
+        {
+            return Acquire(request, random);
+        }
+
+        if (IsOneOf(apiVersion, std::begin(ApiVersionsV1), std::end(ApiVersionsV1))
+            || IsOneOf(apiVersion, std::begin(ApiVersionsV2), std::end(ApiVersionsV2)))
+        {
+            return Approve(request, apiVersion, random);
+        }
+
+        return Response::Failure(400, "EntitlementDenied",
+            "Specified api-version of " + apiVersion + " is not supported; denying entitlement request.");
+    }
+
+    if (item && hasApiVersion && apiVersion == ApiVersionLatest)
+    {
+        if (request.method == "POST")
+        {
+            return Renew(request, segments[count - 1]);
+        }
+
+        if (request.method == "DELETE")
+        {
+            return Release(segments[count - 1]);
+        }
+    }
+
+    return Response::Failure(404, "NotFound", "No route matches " + request.method + " " + request.target);
+}
+
+Server::Response Server::Approve(const Request& request, const std::string& apiVersion, Random& random)
+{
+    const nlohmann::json body = ParseBody(request.body);
+
+    if (!body.is_object())
+    {
+        return Response::Failure(400, "EntitlementDenied", "Missing request body from software entitlement request.");
+    }
+
+    std::string token = body.value("token", std::string());
+    std::string application = body.value("applicationId", std::string());
+    if (token.empty())
+    {
+        return Response::Failure(400, "EntitlementDenied", "Missing token from software entitlement request.");
+    }
+
+    if (application.empty())
+    {
+        return Response::Failure(400, "EntitlementDenied", "Missing applicationId value from software entitlement request.");
+    }
+
+    if (!IsApproved(application))
+    {
+        return Response::Failure(403, "EntitlementDenied", "Entitlement for " + application + " was denied.");
+    }
+
+    nlohmann::json result;
+    result["id"] = "entitlement-" + NewGuid(random, true);
+    if (IsOneOf(apiVersion, std::begin(ApiVersionsV1), std::end(ApiVersionsV1)))
+    {
+        result["vmid"] = "stand-in-vm";
+    }
+    else
+    {
+        result["expiry"] = FormatTime(std::chrono::system_clock::now() + ApprovedEntitlementLifetime, "+00:00");
+    }
+
+    return Response(200, result.dump());
+}
+
+Server::Response Server::Acquire(const Request& request, Random& random)
+{
+    const nlohmann::json body = ParseBody(request.body);
+
+    std::string duration = body.is_object() ? body.value("duration", std::string()) : std::string();
+    std::chrono::milliseconds lifetime;
+    if (duration.empty())
+    {
+        return Response::Failure(400, "EntitlementDenied", "Value for duration was not specified.");
+    }
+
+    if (!ParseDuration(duration, lifetime))
+    {
+        return Response::Failure(400, "EntitlementDenied",
+            "Unable to parse duration " + duration + ": The string '" + duration + "' is not a valid TimeSpan value.");
+    }
+
+    Response approval = Approve(request, ApiVersionsV2[0], random);
+    if (approval.status != 200)
+    {
+        return approval;
+    }
+
+    std::string id = NewGuid(random, false);
+    {
+        std::lock_guard<std::mutex> lock(_entitlementLock);
+        _entitlements[id] = false;
+    }
+    ++_acquired;
+
+    nlohmann::json result;
+    result["entitlementId"] = id;
+    result["initialExpiryTime"] = FormatTime(std::chrono::system_clock::now() + lifetime, "Z");
+    return Response(200, result.dump());
+}
+
+Server::Response Server::Renew(const Request& request, const std::string& entitlementId)
+{
+    const nlohmann::json body = ParseBody(request.body);
+
+    std::string duration = body.is_object() ? body.value("duration", std::string()) : std::string();
+    std::chrono::milliseconds lifetime;
+    if (duration.empty())
+    {
+        return Response::Failure(400, "EntitlementDenied", "Value for duration was not specified.");
+    }
+
+    if (!ParseDuration(duration, lifetime))
+    {
+        return Response::Failure(400, "EntitlementDenied",
+            "Unable to parse duration " + duration + ": The string '" + duration + "' is not a valid TimeSpan value.");
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_entitlementLock);
+        auto found = _entitlements.find(entitlementId);
+        if (found == _entitlements.end())
+        {
+            return Response::Failure(404, "NotFound", "Entitlement " + entitlementId + " was not found.");
+        }
+
+        if (found->second)
+        {
+            return Response::Failure(409, "AlreadyReleased", "Entitlement " + entitlementId + " is already released");
+        }
+    }
+    ++_renewed;
+
+    nlohmann::json result;
+    result["expiryTime"] = FormatTime(std::chrono::system_clock::now() + lifetime, "Z");
+    return Response(200, result.dump());
+}
+
+Server::Response Server::Release(const std::string& entitlementId)
+{
+    std::lock_guard<std::mutex> lock(_entitlementLock);
+    auto found = _entitlements.find(entitlementId);
+    if (found == _entitlements.end())
+    {
+        return Response::Failure(404, "NotFound", "Entitlement " + entitlementId + " was not found.");
+    }
+
+    if (!found->second)
+    {
+        found->second = true;
+        ++_released;
+    }
+    return Response(204, std::string());
+}
+
+}
+}
+}
+}
+}
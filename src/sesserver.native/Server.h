@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <openssl/ssl.h>
+#include "ServerOptions.h"
+#include "TestCertificates.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+
+//
+// A stand-in for the software entitlement service, for load testing the
+// native client without an Azure Batch account.
+//
+// It answers the same routes, api-versions and error bodies as the service
+// (and 'sestest server'), from a fixed number of event loop threads, each
+// serving many non-blocking TLS connections.  Latency, resets, error
+// statuses, throttling and slow bodies can be injected per request (see
+// ServerOptions) to show how a client behaves when the service misbehaves.
+//
+// The server listens on the loopback interface from construction until
+// destruction.
+//
+class Server
+{
+public:
+    //
+    // Serves with the server certificate and key of a generated hierarchy.
+    //
+    Server(const TestCertificates& certificates, const ServerOptions& options);
+
+    //
+    // Serves with a PEM certificate chain (server certificate first) and
+    // private key read from files.
+    //
+    Server(const std::string& certificateChainPath, const std::string& keyPath, const ServerOptions& options);
+
+    ~Server();
+
+    //
+    // The URL to pass to the client, such as 'https://localhost:5443/'; for
+    // a Unix domain socket, 'http://localhost/'.
+    //
+    std::string Url() const;
+
+    unsigned short Port() const;
+
+    //
+    // Requests received and connections accepted so far.
+    //
+    std::uint64_t RequestCount() const;
+
+    std::uint64_t ConnectionCount() const;
+
+    //
+    // Entitlements acquired, renewals granted, and entitlements released so
+    // far, by the leases of the latest api-version.
+    //
+    std::uint64_t AcquireCount() const;
+
+    std::uint64_t RenewCount() const;
+
+    std::uint64_t ReleaseCount() const;
+
+private:
+    class Loop;
+    struct Request;
+    struct Response;
+
+    struct ContextDeleter
+    {
+        void operator()(SSL_CTX* context) { SSL_CTX_free(context); }
+    };
+
+    //
+    // Entitlements issued by acquire, by identifier; true once released.
+    //
+    std::mutex _entitlementLock;
+    std::map<std::string, bool> _entitlements;
+
+    ServerOptions _options;
+    std::unique_ptr<SSL_CTX, ContextDeleter> _context;
+    unsigned short _port;
+    std::atomic<std::uint64_t> _requests;
+    std::atomic<std::uint64_t> _connections;
+    std::atomic<std::uint64_t> _acquired;
+    std::atomic<std::uint64_t> _renewed;
+    std::atomic<std::uint64_t> _released;
+    std::vector<std::unique_ptr<Loop>> _loops;
+
+    void Start();
+
+    Response Handle(const Request& request, Random& random);
+
+    Response Approve(const Request& request, const std::string& apiVersion, Random& random);
+
+    Response Acquire(const Request& request, Random& random);
+
+    Response Renew(const Request& request, const std::string& entitlementId);
+
+    Response Release(const std::string& entitlementId);
+
+    bool IsApproved(const std::string& application) const;
+
+    Server(const Server&);
+    Server& operator=(const Server&);
+};
+
+}
+}
+}
+}
+}
@@ -0,0 +1,276 @@
+#include "ServerOptions.h"
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+namespace {
+
+std::vector<std::string> Split(const std::string& value, char separator)
+{
+    std::vector<std::string> parts;
+    std::istringstream stream(value);
+    std::string part;
+    while (std::getline(stream, part, separator))
+    {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+double ParseNonNegative(const std::string& value, const std::string& specification)
+{
+    char* end = nullptr;
+    double result = std::strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !(result >= 0))
+    {
+        throw std::invalid_argument("Invalid value '" + value + "' in '" + specification + "'");
+    }
+    return result;
+}
+
+}   // anonymous namespace
+
+
+Random::Random(std::uint64_t seed, std::uint64_t stream)
+    : _state(seed ^ (stream * 0x9e3779b97f4a7c15ULL))
+{
+}
+
+Random::result_type Random::operator()()
+{
+    std::uint64_t z = (_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double Random::NextDouble()
+{
+    return ((*this)() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+LatencyDistribution::LatencyDistribution()
+    : _kind(Kind::None)
+    , _first(0)
+    , _second(0)
+{
+}
+
+LatencyDistribution LatencyDistribution::Parse(const std::string& specification)
+{
+    std::vector<std::string> parts = Split(specification, ':');
+    LatencyDistribution result;
+
+    if (parts.size() == 1)
+    {
+        result._kind = Kind::Fixed;
+        result._first = ParseNonNegative(parts[0], specification);
+    }
+    else if (parts[0] == "fixed" && parts.size() == 2)
+    {
+        result._kind = Kind::Fixed;
+        result._first = ParseNonNegative(parts[1], specification);
+    }
+    else if (parts[0] == "uniform" && parts.size() == 3)
+    {
+        result._kind = Kind::Uniform;
+        result._first = ParseNonNegative(parts[1], specification);
+        result._second = ParseNonNegative(parts[2], specification);
+        if (result._second < result._first)
+        {
+            throw std::invalid_argument("Maximum is less than minimum in '" + specification + "'");
+        }
+    }
+    else if (parts[0] == "exponential" && parts.size() == 2)
+    {
+        result._kind = Kind::Exponential;
+        result._first = ParseNonNegative(parts[1], specification);
+    }
+    else if (parts[0] == "lognormal" && parts.size() == 3)
+    {
+        result._kind = Kind::LogNormal;
+        result._first = ParseNonNegative(parts[1], specification);
+        result._second = ParseNonNegative(parts[2], specification);
+    }
+    else
+    {
+        throw std::invalid_argument("Unrecognized latency distribution '" + specification + "'");
+    }
+
+    return result;
+}
+
+std::chrono::microseconds LatencyDistribution::Sample(Random& random) const
+{
+    double milliseconds = 0;
+    switch (_kind)
+    {
+    case Kind::None:
+        break;
+
+    case Kind::Fixed:
+        milliseconds = _first;
+        break;
+
+    case Kind::Uniform:
+        milliseconds = _first + (_second - _first) * random.NextDouble();
+        break;
+
+    case Kind::Exponential:
+        milliseconds = -_first * std::log(1.0 - random.NextDouble());
+        break;
+
+    case Kind::LogNormal:
+        if (_first > 0)
+        {
+            std::lognormal_distribution<double> distribution(std::log(_first), _second);
+            milliseconds = distribution(random);
+        }
+        break;
+    }
+
+    return std::chrono::microseconds(static_cast<long long>(milliseconds * 1000));
+}
+
+bool LatencyDistribution::IsNone() const
+{
+    return _kind == Kind::None;
+}
+
+
+Fault::Fault()
+    : kind(FaultKind::None)
+    , status(0)
+{
+}
+
+Fault::Fault(FaultKind kind, int status)
+    : kind(kind)
+    , status(status)
+{
+}
+
+Fault Fault::Parse(const std::string& specification)
+{
+    if (specification == "ok")
+    {
+        return Fault();
+    }
+
+    if (specification == "reset")
+    {
+        return Fault(FaultKind::Reset);
+    }
+
+    if (specification == "slow")
+    {
+        return Fault(FaultKind::SlowBody);
+    }
+
+    char* end = nullptr;
+    long status = std::strtol(specification.c_str(), &end, 10);
+    if (specification.empty() || *end != '\0' || status < 400 || status > 599)
+    {
+        throw std::invalid_argument("Unrecognized fault '" + specification + "'");
+    }
+
+    return Fault(FaultKind::Status, static_cast<int>(status));
+}
+
+
+ServerOptions::ServerOptions()
+    : connectionMode(ConnectionMode::KeepAlive)
+    , threads(1)
+    , port(0)
+    , resetProbability(0)
+    , errorProbability(0)
+    , throttleProbability(0)
+    , slowBodyProbability(0)
+    , errorStatus(503)
+    , retryAfterSeconds(1)
+    , slowBodyBytesPerSecond(64)
+    , seed(0)
+{
+    approvedApplications.insert("*");
+}
+
+Fault ServerOptions::FaultFor(std::uint64_t sequence, Random& random) const
+{
+    if (sequence <= script.size())
+    {
+        return script[static_cast<size_t>(sequence - 1)];
+    }
+
+    double draw = random.NextDouble();
+    if ((draw -= resetProbability) < 0)
+    {
+        return Fault(FaultKind::Reset);
+    }
+    if ((draw -= errorProbability) < 0)
+    {
+        return Fault(FaultKind::Status, errorStatus);
+    }
+    if ((draw -= throttleProbability) < 0)
+    {
+        return Fault(FaultKind::Status, 429);
+    }
+    if ((draw -= slowBodyProbability) < 0)
+    {
+        return Fault(FaultKind::SlowBody);
+    }
+
+    return Fault();
+}
+
+void ServerOptions::Validate() const
+{
+    const double probabilities[] = { resetProbability, errorProbability, throttleProbability, slowBodyProbability };
+    double total = 0;
+    for (double probability : probabilities)
+    {
+        if (!(probability >= 0 && probability <= 1))
+        {
+            throw std::invalid_argument("Fault probabilities must be between 0 and 1");
+        }
+        total += probability;
+    }
+
+    if (total > 1)
+    {
+        throw std::invalid_argument("Fault probabilities must not add up to more than 1");
+    }
+
+    if (errorStatus < 500 || errorStatus > 599)
+    {
+        throw std::invalid_argument("Injected error status must be 5xx");
+    }
+
+    if (threads == 0)
+    {
+        throw std::invalid_argument("At least one thread is required");
+    }
+
+    if (!unixSocket.empty() && threads != 1)
+    {
+        throw std::invalid_argument("A Unix domain socket is served by one thread");
+    }
+
+    if (slowBodyBytesPerSecond == 0)
+    {
+        throw std::invalid_argument("Slow body rate must be at least one byte per second");
+    }
+}
+
+}
+}
+}
+}
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+
+//
+// A small, fast random number generator (SplitMix64) usable with the
+// standard distributions.  Seeding one per request from the server seed and
+// the request's sequence number makes every decision about that request
+// reproducible, whichever thread serves it.
+//
+class Random
+{
+    std::uint64_t _state;
+
+public:
+    typedef std::uint64_t result_type;
+
+    Random(std::uint64_t seed, std::uint64_t stream);
+
+    static result_type min() { return 0; }
+
+    static result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()();
+
+    //
+    // Returns a value uniformly distributed in [0, 1).
+    //
+    double NextDouble();
+};
+
+
+//
+// A distribution of delays, such as the time taken to produce a response.
+//
+class LatencyDistribution
+{
+public:
+    enum class Kind
+    {
+        None,
+        Fixed,
+        Uniform,
+        Exponential,
+        LogNormal
+    };
+
+    LatencyDistribution();
+
+    //
+    // Parses '<ms>', 'fixed:<ms>', 'uniform:<min ms>:<max ms>',
+    // 'exponential:<mean ms>' or 'lognormal:<median ms>:<sigma>'.  Throws
+    // std::invalid_argument if the specification is malformed.
+    //
+    static LatencyDistribution Parse(const std::string& specification);
+
+    std::chrono::microseconds Sample(Random& random) const;
+
+    bool IsNone() const;
+
+private:
+    Kind _kind;
+    double _first;
+    double _second;
+};
+
+
+enum class FaultKind
+{
+    // Respond normally.
+    None,
+    // Reset the connection (TCP RST) instead of responding.
+    Reset,
+    // Respond with an HTTP error status; 429 and 503 include Retry-After.
+    Status,
+    // Respond normally, but send the body a few bytes at a time.
+    SlowBody
+};
+
+struct Fault
+{
+    FaultKind kind;
+    int status;
+
+    Fault();
+
+    Fault(FaultKind kind, int status = 0);
+
+    //
+    // Parses 'ok', 'reset', 'slow' or an HTTP status code such as '503'.
+    // Throws std::invalid_argument if the specification is malformed.
+    //
+    static Fault Parse(const std::string& specification);
+};
+
+
+struct ServerOptions
+{
+    enum class ConnectionMode
+    {
+        // Honour HTTP/1.1 persistent connections.
+        KeepAlive,
+        // Close the connection after every response, so every request pays
+        // for a fresh TCP connection and TLS handshake.
+        Close
+    };
+
+    ServerOptions();
+
+    //
+    // Applications for which entitlements are granted; '*' grants any.
+    //
+    std::set<std::string> approvedApplications;
+
+    ConnectionMode connectionMode;
+
+    //
+    // Number of event loop threads.
+    //
+    unsigned threads;
+
+    //
+    // Port to listen on, on the loopback interface; 0 picks a free port.
+    //
+    unsigned short port;
+
+    //
+    // If not empty, the path of a Unix domain socket to serve plain HTTP on,
+    // without TLS, in place of the port; any file already at the path is
+    // replaced.  Served by one thread.
+    //
+    std::string unixSocket;
+
+    //
+    // Delay before each response (or reset).
+    //
+    LatencyDistribution latency;
+
+    //
+    // Delay before each TLS handshake is answered.
+    //
+    LatencyDistribution handshakeDelay;
+
+    //
+    // Probability of each fault for requests not covered by the script.
+    //
+    double resetProbability;
+    double errorProbability;
+    double throttleProbability;
+    double slowBodyProbability;
+
+    //
+    // Status used for injected errors; 5xx.
+    //
+    int errorStatus;
+
+    //
+    // Retry-After sent with 429 and 503 responses.
+    //
+    unsigned retryAfterSeconds;
+
+    //
+    // Rate at which slow bodies are sent.
+    //
+    unsigned slowBodyBytesPerSecond;
+
+    //
+    // Faults for the first requests, in order of arrival; the probabilities
+    // apply once the script is exhausted.
+    //
+    std::vector<Fault> script;
+
+    std::uint64_t seed;
+
+    //
+    // Returns the fault to inject into the sequence'th request (from 1).
+    //
+    Fault FaultFor(std::uint64_t sequence, Random& random) const;
+
+    //
+    // Throws std::invalid_argument if the options are inconsistent.
+    //
+    void Validate() const;
+};
+
+}
+}
+}
+}
+}
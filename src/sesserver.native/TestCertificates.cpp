@@ -0,0 +1,210 @@
+#include "TestCertificates.h"
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+namespace {
+
+void ThrowIfOpenSSLError(bool error, const char* operation)
+{
+    if (error)
+    {
+        char buffer[256];
+        ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+        throw std::runtime_error(std::string(operation) + " failed: " + buffer);
+    }
+}
+
+EVP_PKEY* GenerateKey()
+{
+    std::unique_ptr<EVP_PKEY_CTX, void(*)(EVP_PKEY_CTX*)> ctx(
+        EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr),
+        &EVP_PKEY_CTX_free);
+    ThrowIfOpenSSLError(ctx == nullptr, "EVP_PKEY_CTX_new_id");
+    ThrowIfOpenSSLError(EVP_PKEY_keygen_init(ctx.get()) != 1, "EVP_PKEY_keygen_init");
+    ThrowIfOpenSSLError(
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1) != 1,
+        "EVP_PKEY_CTX_set_ec_paramgen_curve_nid");
+
+    EVP_PKEY* key = nullptr;
+    ThrowIfOpenSSLError(EVP_PKEY_keygen(ctx.get(), &key) != 1, "EVP_PKEY_keygen");
+    return key;
+}
+
+void AddExtension(::X509* cert, ::X509* issuer, int nid, const char* value)
+{
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, issuer, cert, nullptr, nullptr, 0);
+
+    X509_EXTENSION* ext = X509V3_EXT_conf_nid(nullptr, &ctx, nid, const_cast<char*>(value));
+    ThrowIfOpenSSLError(ext == nullptr, "X509V3_EXT_conf_nid");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+}
+
+//
+// Issues a certificate for 'subjectKey' signed by 'issuerKey'.  Pass a null
+// 'issuer' to create a self-signed certificate.
+//
+::X509* IssueCertificate(
+    const char* commonName,
+    long serial,
+    EVP_PKEY* subjectKey,
+    ::X509* issuer,
+    EVP_PKEY* issuerKey,
+    bool isCA)
+{
+    ::X509* cert = X509_new();
+    ThrowIfOpenSSLError(cert == nullptr, "X509_new");
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+    X509_gmtime_adj(X509_get_notBefore(cert), -60L * 60);
+    X509_gmtime_adj(X509_get_notAfter(cert), 60L * 60 * 24 * 7);
+    X509_set_pubkey(cert, subjectKey);
+
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+        reinterpret_cast<const unsigned char*>("Azure Batch SES Stand-In"), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+        reinterpret_cast<const unsigned char*>(commonName), -1, -1, 0);
+
+    ::X509* signer = issuer != nullptr ? issuer : cert;
+    X509_set_issuer_name(cert, X509_get_subject_name(signer));
+
+    AddExtension(cert, signer, NID_subject_key_identifier, "hash");
+    if (issuer != nullptr)
+    {
+        AddExtension(cert, signer, NID_authority_key_identifier, "keyid:always");
+    }
+
+    if (isCA)
+    {
+        AddExtension(cert, signer, NID_basic_constraints, "critical,CA:TRUE");
+        AddExtension(cert, signer, NID_key_usage, "critical,keyCertSign,cRLSign");
+    }
+    else
+    {
+        AddExtension(cert, signer, NID_basic_constraints, "critical,CA:FALSE");
+        AddExtension(cert, signer, NID_key_usage, "critical,digitalSignature,keyEncipherment");
+        AddExtension(cert, signer, NID_ext_key_usage, "serverAuth");
+        AddExtension(cert, signer, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+    }
+
+    ThrowIfOpenSSLError(X509_sign(cert, issuerKey, EVP_sha256()) == 0, "X509_sign");
+    return cert;
+}
+
+std::string Sha1Thumbprint(::X509* cert)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = sizeof(digest);
+    ThrowIfOpenSSLError(X509_digest(cert, EVP_sha1(), digest, &length) != 1, "X509_digest");
+
+    static const char hex[] = "0123456789abcdef";
+    std::string thumbprint;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        thumbprint += hex[digest[i] >> 4];
+        thumbprint += hex[digest[i] & 0x0f];
+    }
+
+    return thumbprint;
+}
+
+std::string WriteTemporaryPem(::X509* cert)
+{
+    const char* tmp = std::getenv("TMPDIR");
+    std::string path = std::string(tmp != nullptr ? tmp : "/tmp") + "/ses-test-root-XXXXXX";
+
+    int fd = mkstemp(&path[0]);
+    ThrowIfOpenSSLError(fd == -1, "mkstemp");
+
+    FILE* file = fdopen(fd, "w");
+    ThrowIfOpenSSLError(file == nullptr, "fdopen");
+    int written = PEM_write_X509(file, cert);
+    std::fclose(file);
+    ThrowIfOpenSSLError(written != 1, "PEM_write_X509");
+
+    return path;
+}
+
+}   // anonymous namespace
+
+
+TestCertificates::TestCertificates()
+    : _intermediateCommonName("SES Test Intermediate CA")
+{
+    _rootKey.reset(GenerateKey());
+    _root.reset(IssueCertificate(
+        "SES Test Root CA", 1, _rootKey.get(), nullptr, _rootKey.get(), true));
+
+    _intermediateKey.reset(GenerateKey());
+    _intermediate.reset(IssueCertificate(
+        _intermediateCommonName.c_str(), 2, _intermediateKey.get(), _root.get(), _rootKey.get(), true));
+
+    _serverKey.reset(GenerateKey());
+    _server.reset(IssueCertificate(
+        "localhost", 3, _serverKey.get(), _intermediate.get(), _intermediateKey.get(), false));
+
+    _rootCertificatePath = WriteTemporaryPem(_root.get());
+    _intermediateThumbprint = Sha1Thumbprint(_intermediate.get());
+}
+
+TestCertificates::~TestCertificates()
+{
+    std::remove(_rootCertificatePath.c_str());
+}
+
+const std::string& TestCertificates::RootCertificatePath() const
+{
+    return _rootCertificatePath;
+}
+
+const std::string& TestCertificates::IntermediateThumbprint() const
+{
+    return _intermediateThumbprint;
+}
+
+const std::string& TestCertificates::IntermediateCommonName() const
+{
+    return _intermediateCommonName;
+}
+
+::X509* TestCertificates::ServerCertificate() const
+{
+    return _server.get();
+}
+
+::X509* TestCertificates::IntermediateCertificate() const
+{
+    return _intermediate.get();
+}
+
+::X509* TestCertificates::RootCertificate() const
+{
+    return _root.get();
+}
+
+EVP_PKEY* TestCertificates::ServerKey() const
+{
+    return _serverKey.get();
+}
+
+}
+}
+}
+}
+}
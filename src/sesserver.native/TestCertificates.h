@@ -0,0 +1,83 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace StandIn {
+
+//
+// A throw-away certificate hierarchy for exercising the client against a
+// local server: a self-signed root, an intermediate CA (the certificate the
+// client pins via AddSslCertificate), and a server certificate for
+// 'localhost' issued by the intermediate.
+//
+// Everything is generated in memory at start-up; no keys are checked in.
+//
+class TestCertificates
+{
+public:
+    TestCertificates();
+
+    ~TestCertificates();
+
+    //
+    // Path to a PEM file containing the root certificate, suitable for
+    // AZ_BATCH_SES_CURLOPT_CAINFO.
+    //
+    const std::string& RootCertificatePath() const;
+
+    //
+    // SHA-1 thumbprint (hex) and common name of the intermediate certificate,
+    // suitable for AddSslCertificate.
+    //
+    const std::string& IntermediateThumbprint() const;
+
+    const std::string& IntermediateCommonName() const;
+
+    ::X509* ServerCertificate() const;
+
+    ::X509* IntermediateCertificate() const;
+
+    ::X509* RootCertificate() const;
+
+    EVP_PKEY* ServerKey() const;
+
+private:
+    struct KeyDeleter
+    {
+        void operator()(EVP_PKEY* key) { EVP_PKEY_free(key); }
+    };
+
+    struct CertificateDeleter
+    {
+        void operator()(::X509* cert) { X509_free(cert); }
+    };
+
+    typedef std::unique_ptr<EVP_PKEY, KeyDeleter> Key;
+    typedef std::unique_ptr<::X509, CertificateDeleter> Certificate;
+
+    Key _rootKey;
+    Certificate _root;
+    Key _intermediateKey;
+    Certificate _intermediate;
+    Key _serverKey;
+    Certificate _server;
+
+    std::string _rootCertificatePath;
+    std::string _intermediateThumbprint;
+    std::string _intermediateCommonName;
+
+    TestCertificates(const TestCertificates&);
+    TestCertificates& operator=(const TestCertificates&);
+};
+
+}
+}
+}
+}
+}
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Server.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using SES::StandIn::Fault;
+using SES::StandIn::LatencyDistribution;
+using SES::StandIn::Server;
+using SES::StandIn::ServerOptions;
+using SES::StandIn::TestCertificates;
+
+namespace
+{
+    void ShowUsage(const char* exeName)
+    {
+        std::cerr
+            << exeName << ":" << std::endl
+            << "Runs a local stand-in for the Azure Batch software entitlement service, for load testing clients." << std::endl
+            << "Runs until interrupted (Ctrl+C)." << std::endl
+            << std::endl
+            << "Optional parameters:" << std::endl
+            << "    --port <port to listen on, on the loopback interface; default picks a free port>" << std::endl
+            << "    --threads <number of event loop threads, default 1>" << std::endl
+            << "    --unix-socket <path of a Unix domain socket to serve plain HTTP on, instead of --port>" << std::endl
+            << "    --connection <keep-alive (default) or close after every response>" << std::endl
+            << "    --applications <comma separated applications to approve; default * approves any>" << std::endl
+            << "    --certificate <PEM certificate chain to serve; default generates a test hierarchy>" << std::endl
+            << "    --key <PEM private key for --certificate>" << std::endl
+            << std::endl
+            << "Fault injection:" << std::endl
+            << "    --latency <delay before each response, in ms, or a distribution (see below)>" << std::endl
+            << "    --handshake-delay <delay before each TLS handshake, as for --latency>" << std::endl
+            << "    --reset <probability of resetting the connection instead of responding>" << std::endl
+            << "    --error <probability>[:<status>] <probability of an error response, 503 by default>" << std::endl
+            << "    --throttle <probability>[:<seconds>] <probability of 429 with Retry-After, 1 second by default>" << std::endl
+            << "    --slow-body <probability>[:<bytes per second>] <probability of a slowly sent body, 64 B/s by default>" << std::endl
+            << "    --script <comma separated faults for the first requests: ok, reset, slow or a status>" << std::endl
+            << "    --seed <seed making injected faults and delays reproducible, default 0>" << std::endl
+            << std::endl
+            << "Distributions: <ms>, fixed:<ms>, uniform:<min ms>:<max ms>, exponential:<mean ms>," << std::endl
+            << "lognormal:<median ms>:<sigma>." << std::endl;
+    }
+
+    static const std::vector<std::string> optionalParameterNames = {
+        "--port",
+        "--threads",
+        "--unix-socket",
+        "--connection",
+        "--applications",
+        "--certificate",
+        "--key",
+        "--latency",
+        "--handshake-delay",
+        "--reset",
+        "--error",
+        "--throttle",
+        "--slow-body",
+        "--script",
+        "--seed"
+    };
+
+    std::vector<std::string> split(const std::string& value, char separator)
+    {
+        std::vector<std::string> parts;
+        std::istringstream stream(value);
+        std::string part;
+        while (std::getline(stream, part, separator))
+        {
+            if (!part.empty())
+            {
+                parts.push_back(part);
+            }
+        }
+        return parts;
+    }
+
+    //
+    // Reads a non-negative number, throwing std::invalid_argument naming the
+    // parameter if it is malformed.
+    //
+    double readNumber(const std::string& name, const std::string& text, double maximum)
+    {
+        char* end = nullptr;
+        double value = std::strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || !(value >= 0 && value <= maximum))
+        {
+            throw std::invalid_argument(name + " must be a number between 0 and " + std::to_string(maximum));
+        }
+
+        return value;
+    }
+
+    //
+    // Reads '<probability>[:<value>]', leaving 'value' unchanged if omitted.
+    //
+    template <typename T>
+    double readProbability(const std::string& name, const std::string& text, T& value, double maximum)
+    {
+        size_t colon = text.find(':');
+        if (colon != std::string::npos)
+        {
+            value = static_cast<T>(readNumber(name, text.substr(colon + 1), maximum));
+        }
+
+        return readNumber(name, text.substr(0, colon), 1);
+    }
+
+    class ParameterParser
+    {
+    public:
+        //
+        // Returns false, having reported why, if the parameters are unusable.
+        //
+        bool parse(int argc, char** argv)
+        {
+            if ((argc % 2) == 0)
+            {
+                return false;
+            }
+
+            for (int i = 1; i < argc; i += 2)
+            {
+                if (std::find(optionalParameterNames.begin(), optionalParameterNames.end(), argv[i]) == optionalParameterNames.end())
+                {
+                    std::cerr << "Unexpected additional parameter: " << argv[i] << " " << argv[i + 1] << std::endl;
+                    return false;
+                }
+                _parameters[argv[i]] = argv[i + 1];
+            }
+
+            if (contains("--certificate") != contains("--key"))
+            {
+                std::cerr << "--certificate and --key must be used together" << std::endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        bool contains(const std::string& name) const
+        {
+            return _parameters.find(name) != _parameters.end();
+        }
+
+        std::string find(const std::string& name) const
+        {
+            return _parameters.find(name)->second;
+        }
+
+    private:
+        std::unordered_map<std::string, std::string> _parameters;
+    };
+
+    ServerOptions readServerOptions(const ParameterParser& parameters)
+    {
+        ServerOptions options;
+
+        if (parameters.contains("--port"))
+        {
+            options.port = static_cast<unsigned short>(readNumber("--port", parameters.find("--port"), 65535));
+        }
+
+        if (parameters.contains("--threads"))
+        {
+            options.threads = static_cast<unsigned>(readNumber("--threads", parameters.find("--threads"), 1024));
+        }
+
+        if (parameters.contains("--unix-socket"))
+        {
+            options.unixSocket = parameters.find("--unix-socket");
+        }
+
+        if (parameters.contains("--connection"))
+        {
+            auto mode = parameters.find("--connection");
+            if (mode == "close")
+            {
+                options.connectionMode = ServerOptions::ConnectionMode::Close;
+            }
+            else if (mode != "keep-alive")
+            {
+                throw std::invalid_argument("--connection must be keep-alive or close");
+            }
+        }
+
+        if (parameters.contains("--applications"))
+        {
+            auto applications = split(parameters.find("--applications"), ',');
+            options.approvedApplications.clear();
+            options.approvedApplications.insert(applications.begin(), applications.end());
+        }
+
+        if (parameters.contains("--latency"))
+        {
+            options.latency = LatencyDistribution::Parse(parameters.find("--latency"));
+        }
+
+        if (parameters.contains("--handshake-delay"))
+        {
+            options.handshakeDelay = LatencyDistribution::Parse(parameters.find("--handshake-delay"));
+        }
+
+        if (parameters.contains("--reset"))
+        {
+            options.resetProbability = readNumber("--reset", parameters.find("--reset"), 1);
+        }
+
+        if (parameters.contains("--error"))
+        {
+            options.errorProbability = readProbability("--error", parameters.find("--error"), options.errorStatus, 599);
+        }
+
+        if (parameters.contains("--throttle"))
+        {
+            options.throttleProbability = readProbability("--throttle", parameters.find("--throttle"), options.retryAfterSeconds, 86400);
+        }
+
+        if (parameters.contains("--slow-body"))
+        {
+            options.slowBodyProbability = readProbability("--slow-body", parameters.find("--slow-body"), options.slowBodyBytesPerSecond, 1e9);
+        }
+
+        if (parameters.contains("--script"))
+        {
+            for (const auto& fault : split(parameters.find("--script"), ','))
+            {
+                options.script.push_back(Fault::Parse(fault));
+            }
+        }
+
+        if (parameters.contains("--seed"))
+        {
+            options.seed = std::strtoull(parameters.find("--seed").c_str(), nullptr, 10);
+        }
+
+        options.Validate();
+        return options;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        ParameterParser parser;
+        if (!parser.parse(argc, argv))
+        {
+            ShowUsage(argv[0]);
+            return -EINVAL;
+        }
+
+        ServerOptions options;
+        try
+        {
+            options = readServerOptions(parser);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return -EINVAL;
+        }
+
+        //
+        // Block the signals that stop the server before any threads start, so
+        // that only sigwait below receives them.  Clients that give up on a
+        // connection must not take the server down with SIGPIPE.
+        //
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::unique_ptr<TestCertificates> certificates;
+        std::unique_ptr<Server> server;
+        if (parser.contains("--certificate"))
+        {
+            server.reset(new Server(parser.find("--certificate"), parser.find("--key"), options));
+        }
+        else
+        {
+            certificates.reset(new TestCertificates());
+            server.reset(new Server(*certificates, options));
+        }
+
+        if (!options.unixSocket.empty())
+        {
+            std::cout << "Listening on " << options.unixSocket << " (plain HTTP)" << std::endl;
+        }
+        else
+        {
+            std::cout << "Listening on " << server->Url() << std::endl;
+        }
+        if (certificates && options.unixSocket.empty())
+        {
+            std::cout
+                << "Trust the generated root certificate with:" << std::endl
+                << "    AZ_BATCH_SES_CURLOPT_CAINFO=" << certificates->RootCertificatePath() << std::endl
+                << "Pin the generated intermediate certificate with:" << std::endl
+                << "    --thumbprint " << certificates->IntermediateThumbprint()
+                << " --common-name \"" << certificates->IntermediateCommonName() << "\"" << std::endl;
+        }
+        std::cout << "Press Ctrl+C to stop." << std::endl;
+
+        int signal;
+        sigwait(&stopSignals, &signal);
+
+        auto requests = server->RequestCount();
+        auto connections = server->ConnectionCount();
+        server.reset();
+        std::cout << "Served " << requests << " requests on " << connections << " connections." << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "BenchmarkOptions.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Benchmarks {
+
+std::vector<char*> WithDefaultJsonOutput(
+    int argc,
+    char** argv,
+    const std::string& defaultFile,
+    std::vector<std::string>& storage)
+{
+    bool hasOut = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]).rfind("--benchmark_out=", 0) == 0)
+        {
+            hasOut = true;
+        }
+    }
+
+    std::vector<char*> args(argv, argv + argc);
+    if (!hasOut)
+    {
+        storage.push_back("--benchmark_out=" + defaultFile);
+        storage.push_back("--benchmark_out_format=json");
+        for (auto& arg : storage)
+        {
+            args.push_back(&arg[0]);
+        }
+    }
+
+    return args;
+}
+
+}
+}
+}
+}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Benchmarks {
+
+//
+// Returns the command line with '--benchmark_out=<defaultFile>' and
+// '--benchmark_out_format=json' appended unless an output file was already
+// given, so that every run leaves machine-readable results behind.
+//
+// The returned pointers refer into 'storage', which must outlive them.
+//
+std::vector<char*> WithDefaultJsonOutput(
+    int argc,
+    char** argv,
+    const std::string& defaultFile,
+    std::vector<std::string>& storage);
+
+}
+}
+}
+}
+}
@@ -0,0 +1,260 @@
+//
+// Benchmarks of CoroutineClient against local HTTPS stand-ins: many checks
+// awaited from coroutines on a single thread, and checks cancelled while the
+// server has yet to respond.
+//
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "BenchmarkOptions.h"
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientCoroutine.h"
+#include "Server.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using SES::StandIn::Server;
+using SES::StandIn::ServerOptions;
+using SES::StandIn::TestCertificates;
+
+namespace {
+
+const char* const ApprovedApplication = "contosoapp";
+const char* const DeniedApplication = "fabrikamapp";
+const char* const Token = "benchmark-token";
+
+std::unique_ptr<TestCertificates> s_certificates;
+std::unique_ptr<Server> s_warmServer;
+
+//
+// Responds long after any check against it has been cancelled.
+//
+std::unique_ptr<Server> s_stalledServer;
+const char* const StalledServerLatency = "fixed:2000";
+
+//
+// A coroutine that starts at once and is never awaited.
+//
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object()
+        {
+            return Detached();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+Detached CheckInto(
+    SES::CoroutineClient& client,
+    std::string application,
+    std::stop_token stop,
+    SES::CheckResult& result,
+    int& finished)
+{
+    result = co_await client.Check(Token, application, stop);
+    ++finished;
+}
+
+bool IsCancelled(const SES::CheckResult& result)
+{
+    try
+    {
+        if (result.error)
+        {
+            std::rethrow_exception(result.error);
+        }
+    }
+    catch (const SES::CheckCancelledException&)
+    {
+        return true;
+    }
+    catch (...)
+    {
+    }
+    return false;
+}
+
+//
+// state.range(0) coroutines on one thread each await a check, alternately of
+// an approved and a denied application.  With scheduled set, they are
+// resumed from a queue after Perform returns, as an application's own
+// scheduler would, rather than from within Perform.
+//
+void Coroutines(benchmark::State& state, bool scheduled)
+{
+    const int count = static_cast<int>(state.range(0));
+
+    std::deque<std::coroutine_handle<>> ready;
+    SES::CoroutineClient::Resumer resumer;
+    if (scheduled)
+    {
+        resumer = [&ready](std::coroutine_handle<> awaiting) { ready.push_back(awaiting); };
+    }
+    SES::CoroutineClient client(s_warmServer->Url(), resumer);
+
+    for (auto _ : state)
+    {
+        std::vector<SES::CheckResult> results(count);
+        int finished = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            CheckInto(client, i % 2 == 0 ? ApprovedApplication : DeniedApplication, std::stop_token(), results[i], finished);
+        }
+
+        while (finished < count)
+        {
+            client.Perform(1000);
+            while (!ready.empty())
+            {
+                std::coroutine_handle<> awaiting = ready.front();
+                ready.pop_front();
+                awaiting.resume();
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            if ((results[i].entitlement != nullptr) != (i % 2 == 0))
+            {
+                state.SkipWithError("Unexpected entitlement outcome from stand-in server");
+                return;
+            }
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+//
+// A check against a server that has yet to respond, cancelled from another
+// thread; cancel_us reports how long after the stop was requested the
+// awaiting coroutine was resumed.
+//
+void CoroutineCancel(benchmark::State& state)
+{
+    SES::CoroutineClient client(s_stalledServer->Url());
+
+    double cancelMicroseconds = 0;
+    for (auto _ : state)
+    {
+        std::stop_source stop;
+        SES::CheckResult result;
+        int finished = 0;
+        CheckInto(client, ApprovedApplication, stop.get_token(), result, finished);
+
+        std::chrono::steady_clock::time_point requested;
+        std::thread canceller([&stop, &requested]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            requested = std::chrono::steady_clock::now();
+            stop.request_stop();
+        });
+
+        while (finished == 0)
+        {
+            client.Perform(1000);
+        }
+        auto resumed = std::chrono::steady_clock::now();
+        canceller.join();
+
+        if (!IsCancelled(result))
+        {
+            state.SkipWithError("Expected a cancelled check");
+            break;
+        }
+        cancelMicroseconds += std::chrono::duration<double, std::micro>(resumed - requested).count();
+    }
+
+    state.counters["cancel_us"] = benchmark::Counter(cancelMicroseconds, benchmark::Counter::kAvgIterations);
+}
+
+}   // anonymous namespace
+
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> storage;
+    std::vector<char*> args = SES::Benchmarks::WithDefaultJsonOutput(argc, argv, "sesclient-coroutine-benchmarks.json", storage);
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+
+    //
+    // A client that gives up on a connection must not take the stand-in
+    // server down with it.
+    //
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int err = SES::Init();
+    if (err != 0)
+    {
+        return err;
+    }
+
+    s_certificates.reset(new TestCertificates());
+    ServerOptions options;
+    options.approvedApplications.clear();
+    options.approvedApplications.insert(ApprovedApplication);
+    s_warmServer.reset(new Server(*s_certificates, options));
+
+    ServerOptions stalledOptions;
+    stalledOptions.latency = SES::StandIn::LatencyDistribution::Parse(StalledServerLatency);
+    s_stalledServer.reset(new Server(*s_certificates, stalledOptions));
+
+    setenv("AZ_BATCH_SES_CURLOPT_CAINFO", s_certificates->RootCertificatePath().c_str(), 1);
+    SES::AddSslCertificate(s_certificates->IntermediateThumbprint(), s_certificates->IntermediateCommonName());
+
+    for (bool scheduled : { false, true })
+    {
+        benchmark::RegisterBenchmark(scheduled ? "Coroutines/scheduled" : "Coroutines/inline", Coroutines, scheduled)
+            ->RangeMultiplier(16)
+            ->Range(1, 256)
+            ->UseRealTime()
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    benchmark::RegisterBenchmark("CoroutineCancel", CoroutineCancel)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    s_stalledServer.reset();
+    s_warmServer.reset();
+    s_certificates.reset();
+    SES::Cleanup();
+
+    return 0;
+}
@@ -0,0 +1,981 @@
+//
+// End-to-end benchmarks of GetEntitlement against a local HTTPS stand-in.
+//
+// Each benchmark is run at 1 to 64 threads and reports throughput
+// (items_per_second) together with latency percentiles across all threads.
+//
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "BenchmarkOptions.h"
+#include "EpollLoop.h"
+#include "SilentListener.h"
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientC.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "Server.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using SES::StandIn::Server;
+using SES::StandIn::ServerOptions;
+using SES::StandIn::TestCertificates;
+using SES::Tests::EpollLoop;
+using SES::Tests::SilentListener;
+
+namespace {
+
+const char* const ApprovedApplication = "contosoapp";
+const char* const DeniedApplication = "fabrikamapp";
+const char* const Token = "benchmark-token";
+
+//
+// The api-version the stand-ins offer leases under.
+//
+const char* const LeaseApiVersion = "9999-09-09.99.99";
+
+enum class Outcome
+{
+    Approve,
+    Deny
+};
+
+enum class Api
+{
+    // GetEntitlement, catching the exception thrown for a denial.
+    Exception,
+    // TryGetEntitlement.
+    Result,
+    // ses_get_entitlement.
+    C
+};
+
+enum class Driver
+{
+    // AsyncClient::Perform, which waits for the sockets itself.
+    Perform,
+    // An epoll loop of the benchmark's own, through UseEventLoop.
+    EventLoop
+};
+
+enum class Waiting
+{
+    // For a response from a stand-in that has yet to send one.
+    Response,
+    // For the TLS handshake with a server that never accepts the connection.
+    Handshake,
+    // Between attempts, after the first timed out.
+    Retry,
+    // For another thread's check of the same application to finish.
+    Joined
+};
+
+enum class Connection
+{
+    // Every check needs a new TCP connection and TLS handshake.
+    Cold,
+    // The server keeps connections open, so any client-side reuse is visible.
+    Warm
+};
+
+std::unique_ptr<TestCertificates> s_certificates;
+std::unique_ptr<Server> s_coldServer;
+std::unique_ptr<Server> s_warmServer;
+
+//
+// Approves every application after a fixed delay, so that the cost of
+// checking applications one after another shows.
+//
+std::unique_ptr<Server> s_slowServer;
+const char* const SlowServerLatency = "fixed:20";
+
+//
+// Approves only ApprovedApplication, after a fixed delay long enough for
+// every thread of the coalescing benchmark to call GetEntitlement before the
+// first response.
+//
+std::unique_ptr<Server> s_coalescingServer;
+const char* const CoalescingServerLatency = "fixed:50";
+
+//
+// Serves plain HTTP on a Unix domain socket, reached through
+// UnixSocketTransport at UnixSocketUrl.
+//
+std::unique_ptr<Server> s_unixSocketServer;
+const char* const UnixSocketUrl = "https://unix-socket.invalid/";
+
+//
+// Responds long after any check against it has been cancelled.
+//
+std::unique_ptr<Server> s_stalledServer;
+const char* const StalledServerLatency = "fixed:2000";
+
+//
+// How long DeniedCheck/*/cached has denials remembered; every other
+// benchmark turns the cache off, so that denials reach the server.
+//
+const std::chrono::seconds DenialLifetime(30);
+
+//
+// Makes the token of every iteration of the application and coalescing
+// benchmarks unique, so that no check is answered from the library's cache
+// or joins a check from an earlier iteration.
+//
+unsigned s_tokens = 0;
+
+//
+// Gathers per-check latencies from every thread of a benchmark run so that
+// percentiles describe the run as a whole rather than a single thread.
+//
+class LatencyCollector
+{
+    std::mutex _lock;
+    std::condition_variable _arrived;
+    std::vector<double> _samples;
+    int _pending = 0;
+
+public:
+    void Start(int threads)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _samples.clear();
+        _pending = threads;
+    }
+
+    //
+    // Adds a thread's samples; returns once all threads of the run have done
+    // the same.
+    //
+    void Submit(const std::vector<double>& samples)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _samples.insert(_samples.end(), samples.begin(), samples.end());
+        --_pending;
+        _arrived.notify_all();
+        _arrived.wait(lock, [this]() { return _pending == 0; });
+    }
+
+    //
+    // Nearest-rank percentile, in microseconds.  Only valid after every
+    // thread has returned from Submit.
+    //
+    double Percentile(double p)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_samples.empty())
+        {
+            return 0;
+        }
+
+        std::sort(_samples.begin(), _samples.end());
+        size_t rank = static_cast<size_t>(p / 100.0 * (_samples.size() - 1) + 0.5);
+        return _samples[rank];
+    }
+};
+
+LatencyCollector s_latencies;
+
+void StartRun(const benchmark::State& state)
+{
+    s_latencies.Start(state.threads());
+}
+
+void GetEntitlement(benchmark::State& state, Outcome outcome, Connection connection)
+{
+    const std::string url = connection == Connection::Cold ? s_coldServer->Url() : s_warmServer->Url();
+    const std::string application = outcome == Outcome::Approve ? ApprovedApplication : DeniedApplication;
+
+    std::vector<double> samples;
+    samples.reserve(4096);
+
+    for (auto _ : state)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool approved;
+        try
+        {
+            auto entitlement = SES::GetEntitlement(url, Token, application);
+            benchmark::DoNotOptimize(entitlement);
+            approved = true;
+        }
+        catch (const SES::Exception&)
+        {
+            approved = false;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        samples.push_back(std::chrono::duration<double, std::micro>(elapsed).count());
+
+        if (approved != (outcome == Outcome::Approve))
+        {
+            state.SkipWithError("Unexpected entitlement outcome from stand-in server");
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+
+    s_latencies.Submit(samples);
+    if (state.thread_index() == 0)
+    {
+        state.counters["p50_us"] = s_latencies.Percentile(50);
+        state.counters["p90_us"] = s_latencies.Percentile(90);
+        state.counters["p99_us"] = s_latencies.Percentile(99);
+        state.counters["max_us"] = s_latencies.Percentile(100);
+    }
+}
+
+//
+// The checks of a task that needs state.range(0) applications: one after
+// another, or prefetched together and then checked one after another.
+//
+void Applications(benchmark::State& state, bool prefetch)
+{
+    const std::string url = s_slowServer->Url();
+    std::vector<std::string> applications;
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        applications.push_back("app" + std::to_string(i));
+    }
+
+    for (auto _ : state)
+    {
+        const std::string token = Token + std::to_string(++s_tokens);
+        try
+        {
+            if (prefetch)
+            {
+                SES::Prefetch(url, token, applications);
+            }
+
+            for (const auto& application : applications)
+            {
+                benchmark::DoNotOptimize(SES::GetEntitlement(url, token, application));
+            }
+        }
+        catch (const SES::Exception& e)
+        {
+            state.SkipWithError(e.what());
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+//
+// state.range(0) threads per key check an approved and a denied application
+// at the same moment, each with the same new token; requests_per_key shows
+// how many requests the checks of each key took.
+//
+void Coalescing(benchmark::State& state)
+{
+    const std::string url = s_coalescingServer->Url();
+    const int threadsPerKey = static_cast<int>(state.range(0));
+
+    std::uint64_t requests = 0;
+    for (auto _ : state)
+    {
+        const std::string token = Token + std::to_string(++s_tokens);
+        const std::uint64_t requestsBefore = s_coalescingServer->RequestCount();
+
+        std::mutex lock;
+        std::condition_variable started;
+        bool go = false;
+        std::vector<std::string> unexpected;
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 2 * threadsPerKey; ++i)
+        {
+            const std::string application = i % 2 == 0 ? ApprovedApplication : DeniedApplication;
+            threads.emplace_back([&, application]()
+            {
+                {
+                    std::unique_lock<std::mutex> wait(lock);
+                    started.wait(wait, [&go]() { return go; });
+                }
+
+                bool approved;
+                try
+                {
+                    approved = SES::GetEntitlement(url, token, application) != nullptr;
+                }
+                catch (const SES::Exception&)
+                {
+                    approved = false;
+                }
+
+                if (approved != (application == ApprovedApplication))
+                {
+                    std::lock_guard<std::mutex> done(lock);
+                    unexpected.push_back(application);
+                }
+            });
+        }
+
+        {
+            std::lock_guard<std::mutex> release(lock);
+            go = true;
+        }
+        started.notify_all();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        const std::uint64_t iterationRequests = s_coalescingServer->RequestCount() - requestsBefore;
+        requests += iterationRequests;
+
+        if (!unexpected.empty())
+        {
+            state.SkipWithError(("Unexpected outcome from stand-in server: " + unexpected.front()).c_str());
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * 2 * threadsPerKey);
+    state.counters["requests_per_key"] = benchmark::Counter(requests / 2.0, benchmark::Counter::kAvgIterations);
+}
+
+//
+// Checks against the stand-in that responds after 20ms, each with a new
+// token, reporting how much of each request the stand-in's Server-Timing
+// puts down to the server and how much that leaves to the loopback network.
+//
+void ServerTiming(benchmark::State& state)
+{
+    const std::string url = s_slowServer->Url();
+    std::int64_t serverTotal = 0;
+    std::int64_t networkTotal = 0;
+
+    for (auto _ : state)
+    {
+        const std::string token = Token + std::to_string(++s_tokens);
+        if (SES::TryGetEntitlement(url, token, ApprovedApplication, 0).category != SES::ErrorCategory::None)
+        {
+            state.SkipWithError("The check failed");
+            break;
+        }
+
+        const SES::RequestRecord record = SES::RecentRequests().back();
+        serverTotal += record.server_us;
+        networkTotal += record.network_us;
+    }
+
+    state.counters["server_us"] = benchmark::Counter(static_cast<double>(serverTotal), benchmark::Counter::kAvgIterations);
+    state.counters["network_us"] = benchmark::Counter(static_cast<double>(networkTotal), benchmark::Counter::kAvgIterations);
+}
+
+//
+// Approved checks on a kept connection, over HTTPS or as plain HTTP over a
+// Unix domain socket through UnixSocketTransport; the difference is what TLS
+// and TCP add to a check.
+//
+void Transport(benchmark::State& state, bool unixSocket)
+{
+    const std::string url = unixSocket ? UnixSocketUrl : s_warmServer->Url();
+
+    for (auto _ : state)
+    {
+        if (SES::TryGetEntitlement(url, Token, ApprovedApplication, 0).category != SES::ErrorCategory::None)
+        {
+            state.SkipWithError("The check failed");
+            break;
+        }
+    }
+}
+
+//
+// A denied check, answered from the library's cache of denials or by the
+// server, through each interface.
+//
+void DeniedCheck(benchmark::State& state, Api api, bool cached)
+{
+    const std::string url = s_warmServer->Url();
+    SES::SetDenialLifetime(cached ? DenialLifetime : std::chrono::seconds(0));
+
+    for (auto _ : state)
+    {
+        bool denied = false;
+        switch (api)
+        {
+        case Api::Exception:
+            try
+            {
+                SES::GetEntitlement(url, Token, DeniedApplication);
+            }
+            catch (const SES::EntitlementDeniedException&)
+            {
+                denied = true;
+            }
+            catch (const SES::Exception&)
+            {
+            }
+            break;
+
+        case Api::Result:
+            denied = SES::TryGetEntitlement(url, Token, DeniedApplication).category == SES::ErrorCategory::Denied;
+            break;
+
+        case Api::C:
+        {
+            ses_result* result = ses_get_entitlement(url.c_str(), Token, DeniedApplication, 5);
+            denied = result != nullptr && ses_result_category(result) == SES_DENIED;
+            ses_result_free(result);
+            break;
+        }
+        }
+
+        if (!denied)
+        {
+            state.SkipWithError("Expected a denial from the stand-in server");
+            break;
+        }
+    }
+
+    SES::SetDenialLifetime(std::chrono::seconds(0));
+    state.SetItemsProcessed(state.iterations());
+}
+
+//
+// state.range(0) checks at once from a single thread through AsyncClient,
+// alternately of an approved and a denied application, driven by Perform or
+// by an epoll loop.
+//
+void AsyncChecks(benchmark::State& state, Driver driver)
+{
+    const int count = static_cast<int>(state.range(0));
+    SES::AsyncClient client(s_warmServer->Url());
+    EpollLoop loop;
+    if (driver == Driver::EventLoop)
+    {
+        client.UseEventLoop(loop.Callbacks());
+    }
+
+    for (auto _ : state)
+    {
+        int finished = 0;
+        int unexpected = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            bool approve = i % 2 == 0;
+            client.Check(Token, approve ? ApprovedApplication : DeniedApplication, [&, approve](SES::CheckResult result)
+            {
+                ++finished;
+                if ((result.entitlement != nullptr) != approve)
+                {
+                    ++unexpected;
+                }
+            });
+        }
+
+        while (finished < count)
+        {
+            if (driver == Driver::EventLoop)
+            {
+                loop.RunOnce(client);
+            }
+            else
+            {
+                client.Perform(1000);
+            }
+        }
+
+        if (unexpected != 0)
+        {
+            state.SkipWithError("Unexpected entitlement outcome from stand-in server");
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+//
+// Checks application at url through api, cancelling the check from another
+// thread after delay.  Returns true if the check ended cancelled, setting
+// late to how long after the cancellation it returned.
+//
+bool CancelledCheck(
+    Api api,
+    const std::string& url,
+    const std::string& token,
+    const std::string& application,
+    std::chrono::milliseconds delay,
+    std::chrono::microseconds& late)
+{
+    SES::CancellationToken cancellation;
+    ses_cancellation* c = api == Api::C ? ses_cancellation_new() : nullptr;
+
+    std::chrono::steady_clock::time_point requested;
+    std::thread canceller([&]()
+    {
+        std::this_thread::sleep_for(delay);
+        requested = std::chrono::steady_clock::now();
+        if (c != nullptr)
+        {
+            ses_cancel(c);
+        }
+        else
+        {
+            cancellation.Cancel();
+        }
+    });
+
+    bool cancelled = false;
+    switch (api)
+    {
+    case Api::Exception:
+        try
+        {
+            SES::GetEntitlement(url, token, application, cancellation);
+        }
+        catch (const SES::CheckCancelledException&)
+        {
+            cancelled = true;
+        }
+        catch (const SES::Exception&)
+        {
+        }
+        break;
+
+    case Api::Result:
+        cancelled = SES::TryGetEntitlement(url, token, application, cancellation).category == SES::ErrorCategory::Cancelled;
+        break;
+
+    case Api::C:
+    {
+        ses_result* result = ses_get_entitlement_cancellable(url.c_str(), token.c_str(), application.c_str(), 5, c);
+        cancelled = result != nullptr && ses_result_category(result) == SES_CANCELLED;
+        ses_result_free(result);
+        break;
+    }
+    }
+
+    auto returned = std::chrono::steady_clock::now();
+    canceller.join();
+    ses_cancellation_free(c);
+
+    late = std::chrono::duration_cast<std::chrono::microseconds>(returned - requested);
+    return cancelled;
+}
+
+//
+// A check cancelled while waiting, through each interface in turn; cancel_us
+// reports how long after the cancellation the checks returned.
+//
+void Cancellation(benchmark::State& state, Waiting waiting)
+{
+    SilentListener silent;
+    std::string url = s_stalledServer->Url();
+    std::chrono::milliseconds delay(20);
+    if (waiting == Waiting::Handshake || waiting == Waiting::Retry)
+    {
+        url = silent.Url();
+    }
+    if (waiting == Waiting::Retry)
+    {
+        //
+        // The first attempt times out after a second, and the second waits
+        // a second to start.
+        //
+        setenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT", "1", 1);
+        delay = std::chrono::milliseconds(1500);
+    }
+
+    const Api apis[] = { Api::Exception, Api::Result, Api::C };
+    int iteration = 0;
+    double lateMicroseconds = 0;
+    for (auto _ : state)
+    {
+        const std::string token = Token + std::to_string(++s_tokens);
+
+        //
+        // A check that others wait for, until cancelled in turn.
+        //
+        SES::CancellationToken blocking;
+        std::thread blocker;
+        if (waiting == Waiting::Joined)
+        {
+            auto requests = s_stalledServer->RequestCount();
+            blocker = std::thread([&]() { SES::TryGetEntitlement(url, token, ApprovedApplication, blocking); });
+            while (s_stalledServer->RequestCount() == requests)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        std::chrono::microseconds late;
+        bool cancelled = CancelledCheck(
+            apis[iteration++ % 3],
+            url,
+            token,
+            ApprovedApplication,
+            delay,
+            late);
+
+        blocking.Cancel();
+        if (blocker.joinable())
+        {
+            blocker.join();
+        }
+        silent.Drain();
+
+        if (!cancelled)
+        {
+            state.SkipWithError("Expected a cancelled check");
+            break;
+        }
+        lateMicroseconds += late.count();
+    }
+
+    unsetenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT");
+    state.counters["cancel_us"] = benchmark::Counter(lateMicroseconds, benchmark::Counter::kAvgIterations);
+}
+
+//
+// A lease acquired, renewed and released against the warm stand-in.
+//
+void Leases(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        SES::Lease lease(s_warmServer->Url(), Token, ApprovedApplication, std::chrono::seconds(60), LeaseApiVersion);
+        lease.Renew(std::chrono::seconds(60));
+        lease.Release();
+    }
+}
+
+//
+// Makes count checks against the warm stand-in, paced at 100 a second after
+// a burst of 5: one after another through TryGetEntitlement if sync, or all
+// at once through an AsyncClient driven by driver.  Returns the time taken,
+// or zero if a check was not approved.
+//
+std::chrono::milliseconds PacedChecks(Driver driver, bool sync, int count)
+{
+    SES::AdmissionControl control;
+    control.rate = 100;
+    control.burst = 5;
+    SES::SetAdmissionControl(control);
+
+    auto start = std::chrono::steady_clock::now();
+    int approved = 0;
+    if (sync)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (SES::TryGetEntitlement(s_warmServer->Url(), Token + std::to_string(++s_tokens), ApprovedApplication).entitlement)
+            {
+                ++approved;
+            }
+        }
+    }
+    else
+    {
+        SES::AsyncClient client(s_warmServer->Url());
+        EpollLoop loop;
+        if (driver == Driver::EventLoop)
+        {
+            client.UseEventLoop(loop.Callbacks());
+        }
+
+        int finished = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            client.Check(Token + std::to_string(++s_tokens), ApprovedApplication, [&](SES::CheckResult result)
+            {
+                ++finished;
+                if (result.entitlement != nullptr)
+                {
+                    ++approved;
+                }
+            });
+        }
+
+        while (finished < count)
+        {
+            if (driver == Driver::EventLoop)
+            {
+                loop.RunOnce(client);
+            }
+            else
+            {
+                client.Perform(1000);
+            }
+        }
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    return approved == count ? elapsed : std::chrono::milliseconds(0);
+}
+
+//
+// Paces 15 checks at 100 a second after a burst of 5, through
+// TryGetEntitlement, Perform and an epoll loop without a wakeup function,
+// reporting how long each took; the pacing calls for 100ms.
+//
+void Admission(benchmark::State& state)
+{
+    const struct
+    {
+        const char* name;
+        Driver driver;
+        bool sync;
+    } paced[] = {
+        { "sync", Driver::Perform, true },
+        { "perform", Driver::Perform, false },
+        { "event_loop", Driver::EventLoop, false },
+    };
+
+    for (auto _ : state)
+    {
+        for (const auto& run : paced)
+        {
+            auto elapsed = PacedChecks(run.driver, run.sync, 15);
+            if (elapsed == std::chrono::milliseconds(0))
+            {
+                state.SkipWithError("Unexpected entitlement outcome from stand-in server");
+                break;
+            }
+            state.counters[std::string(run.name) + "_ms"] = static_cast<double>(elapsed.count());
+        }
+        state.counters["max_wait_us"] = static_cast<double>(SES::AdmissionStatistics().max_wait_us);
+    }
+
+    SES::SetAdmissionControl(SES::AdmissionControl());
+}
+
+//
+// A check waiting for its turn on one thread, behind a share of a 400ms
+// start-up window of at least 200ms, while another thread, marked
+// interactive, calls GetEntitlement; interactive_ms reports how long that
+// took.
+//
+void InteractiveBypass(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        SES::AdmissionControl control;
+        control.startup_window = std::chrono::milliseconds(400);
+        std::chrono::microseconds delay(0);
+        for (int node = 0; delay < std::chrono::milliseconds(200); ++node)
+        {
+            control.identity = "node-" + std::to_string(node);
+            SES::SetAdmissionControl(control);
+            delay = std::chrono::microseconds(SES::AdmissionStatistics().startup_delay_us);
+        }
+
+        const std::string pacedToken = Token + std::to_string(++s_tokens);
+        std::thread paced([&]()
+        {
+            SES::TryGetEntitlement(s_warmServer->Url(), pacedToken, ApprovedApplication);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        SES::SetInteractive(true);
+        auto interactiveStart = std::chrono::steady_clock::now();
+        SES::EntitlementResult interactive = SES::TryGetEntitlement(s_warmServer->Url(), Token + std::to_string(++s_tokens), ApprovedApplication);
+        auto interactiveWaited = std::chrono::steady_clock::now() - interactiveStart;
+        SES::SetInteractive(false);
+        paced.join();
+
+        if (!interactive.entitlement)
+        {
+            state.SkipWithError("Unexpected entitlement outcome from stand-in server");
+            break;
+        }
+        state.counters["interactive_ms"] = std::chrono::duration<double, std::milli>(interactiveWaited).count();
+    }
+
+    SES::SetAdmissionControl(SES::AdmissionControl());
+}
+
+void Register(const char* name, Outcome outcome, Connection connection)
+{
+    benchmark::RegisterBenchmark(name, GetEntitlement, outcome, connection)
+        ->Setup(StartRun)
+        ->ThreadRange(1, 64)
+        ->UseRealTime()
+        ->Unit(benchmark::kMicrosecond);
+}
+
+}   // anonymous namespace
+
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> storage;
+    std::vector<char*> args = SES::Benchmarks::WithDefaultJsonOutput(argc, argv, "sesclient-benchmarks.json", storage);
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+
+    //
+    // A client that gives up on a connection must not take the stand-in
+    // server down with it.
+    //
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int err = SES::Init();
+    if (err != 0)
+    {
+        return err;
+    }
+
+    s_certificates.reset(new TestCertificates());
+    ServerOptions options;
+    options.approvedApplications.clear();
+    options.approvedApplications.insert(ApprovedApplication);
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    options.connectionMode = ServerOptions::ConnectionMode::Close;
+    s_coldServer.reset(new Server(*s_certificates, options));
+    options.connectionMode = ServerOptions::ConnectionMode::KeepAlive;
+    s_warmServer.reset(new Server(*s_certificates, options));
+
+    ServerOptions slowOptions;
+    slowOptions.latency = SES::StandIn::LatencyDistribution::Parse(SlowServerLatency);
+    s_slowServer.reset(new Server(*s_certificates, slowOptions));
+
+    ServerOptions coalescingOptions;
+    coalescingOptions.approvedApplications.clear();
+    coalescingOptions.approvedApplications.insert(ApprovedApplication);
+    coalescingOptions.latency = SES::StandIn::LatencyDistribution::Parse(CoalescingServerLatency);
+    s_coalescingServer.reset(new Server(*s_certificates, coalescingOptions));
+
+    ServerOptions stalledOptions;
+    stalledOptions.latency = SES::StandIn::LatencyDistribution::Parse(StalledServerLatency);
+    s_stalledServer.reset(new Server(*s_certificates, stalledOptions));
+
+    ServerOptions unixSocketOptions;
+    unixSocketOptions.approvedApplications.clear();
+    unixSocketOptions.approvedApplications.insert(ApprovedApplication);
+    unixSocketOptions.unixSocket = "/tmp/sesclient-benchmarks-" + std::to_string(getpid()) + ".sock";
+    s_unixSocketServer.reset(new Server(*s_certificates, unixSocketOptions));
+    SES::Internal::SetTransport(UnixSocketUrl, SES::Internal::UnixSocketTransport(unixSocketOptions.unixSocket));
+
+    setenv("AZ_BATCH_SES_CURLOPT_CAINFO", s_certificates->RootCertificatePath().c_str(), 1);
+    SES::AddSslCertificate(s_certificates->IntermediateThumbprint(), s_certificates->IntermediateCommonName());
+
+    Register("GetEntitlement/approve/cold", Outcome::Approve, Connection::Cold);
+    Register("GetEntitlement/approve/warm", Outcome::Approve, Connection::Warm);
+    Register("GetEntitlement/deny/cold", Outcome::Deny, Connection::Cold);
+    Register("GetEntitlement/deny/warm", Outcome::Deny, Connection::Warm);
+
+    for (bool prefetch : { false, true })
+    {
+        benchmark::RegisterBenchmark(prefetch ? "Applications/prefetch" : "Applications/serial", Applications, prefetch)
+            ->RangeMultiplier(2)
+            ->Range(1, 16)
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+    }
+
+    benchmark::RegisterBenchmark("Coalescing", Coalescing)
+        ->RangeMultiplier(4)
+        ->Range(1, 64)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RegisterBenchmark("ServerTiming", ServerTiming)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    for (bool unixSocket : { false, true })
+    {
+        benchmark::RegisterBenchmark(unixSocket ? "Transport/unix_socket" : "Transport/https", Transport, unixSocket)
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    benchmark::RegisterBenchmark("Admission", Admission)
+        ->Iterations(1)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RegisterBenchmark("InteractiveBypass", InteractiveBypass)
+        ->Iterations(1)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RegisterBenchmark("Lease", Leases)
+        ->Unit(benchmark::kMicrosecond);
+
+    for (bool eventLoop : { false, true })
+    {
+        benchmark::RegisterBenchmark(
+            eventLoop ? "AsyncChecks/event_loop" : "AsyncChecks/perform",
+            AsyncChecks,
+            eventLoop ? Driver::EventLoop : Driver::Perform)
+            ->RangeMultiplier(8)
+            ->Range(1, 64)
+            ->UseRealTime()
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    const struct
+    {
+        const char* name;
+        Waiting waiting;
+    } cancellations[] = {
+        { "Cancellation/response", Waiting::Response },
+        { "Cancellation/handshake", Waiting::Handshake },
+        { "Cancellation/retry", Waiting::Retry },
+        { "Cancellation/joined", Waiting::Joined },
+    };
+    for (const auto& cancellation : cancellations)
+    {
+        auto registered = benchmark::RegisterBenchmark(cancellation.name, Cancellation, cancellation.waiting)
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+        if (cancellation.waiting == Waiting::Retry)
+        {
+            registered->Iterations(3);
+        }
+    }
+
+    const struct
+    {
+        const char* name;
+        Api api;
+        bool cached;
+    } deniedChecks[] = {
+        { "DeniedCheck/exception/server", Api::Exception, false },
+        { "DeniedCheck/result/server", Api::Result, false },
+        { "DeniedCheck/c/server", Api::C, false },
+        { "DeniedCheck/exception/cached", Api::Exception, true },
+        { "DeniedCheck/result/cached", Api::Result, true },
+        { "DeniedCheck/c/cached", Api::C, true },
+    };
+    for (const auto& check : deniedChecks)
+    {
+        benchmark::RegisterBenchmark(check.name, DeniedCheck, check.api, check.cached)
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    SES::Internal::SetTransport(UnixSocketUrl, SES::Internal::Transport());
+    s_unixSocketServer.reset();
+    s_stalledServer.reset();
+    s_coalescingServer.reset();
+    s_slowServer.reset();
+    s_warmServer.reset();
+    s_coldServer.reset();
+    s_certificates.reset();
+    SES::Cleanup();
+
+    return 0;
+}
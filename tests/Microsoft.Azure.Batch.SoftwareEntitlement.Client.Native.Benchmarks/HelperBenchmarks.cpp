@@ -0,0 +1,538 @@
+//
+// Microbenchmarks of the CPU-side helpers used by every entitlement check,
+// isolated from the network.  Alongside time per operation, each benchmark
+// reports heap allocations (and bytes allocated) per operation, counting both
+// C++ allocations and allocations made by OpenSSL.
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <curl/curl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "BenchmarkOptions.h"
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "TestCertificates.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using SES::StandIn::TestCertificates;
+
+namespace {
+
+std::atomic<std::uint64_t> s_allocations(0);
+std::atomic<std::uint64_t> s_allocatedBytes(0);
+
+void CountAllocation(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+extern "C" void* CountingMalloc(size_t size, const char* /*file*/, int /*line*/)
+{
+    CountAllocation(size);
+    return std::malloc(size);
+}
+
+extern "C" void* CountingRealloc(void* ptr, size_t size, const char* /*file*/, int /*line*/)
+{
+    CountAllocation(size);
+    return std::realloc(ptr, size);
+}
+
+extern "C" void CountingFree(void* ptr, const char* /*file*/, int /*line*/)
+{
+    std::free(ptr);
+}
+
+//
+// Reports allocations made between construction and destruction as
+// per-iteration counters on the benchmark.
+//
+class AllocationScope
+{
+    benchmark::State& _state;
+    std::uint64_t _allocations;
+    std::uint64_t _bytes;
+
+public:
+    explicit AllocationScope(benchmark::State& state)
+        : _state(state)
+        , _allocations(s_allocations.load())
+        , _bytes(s_allocatedBytes.load())
+    {
+    }
+
+    ~AllocationScope()
+    {
+        _state.counters["allocs_per_op"] = benchmark::Counter(
+            static_cast<double>(s_allocations.load() - _allocations),
+            benchmark::Counter::kAvgIterations);
+        _state.counters["bytes_per_op"] = benchmark::Counter(
+            static_cast<double>(s_allocatedBytes.load() - _bytes),
+            benchmark::Counter::kAvgIterations);
+    }
+};
+
+const TestCertificates& Certificates()
+{
+    static TestCertificates certificates;
+    return certificates;
+}
+
+SES::Internal::X509 IntermediateCertificate()
+{
+    return SES::Internal::X509(X509_dup(Certificates().IntermediateCertificate()));
+}
+
+//
+// A realistically sized token: the JWT issued by sestest for a single
+// application is a little over 700 characters.
+//
+std::string SampleToken()
+{
+    return std::string(760, 'x');
+}
+
+const char* const ThumbprintWithSeparators = "97:ef:f3:02:86:77:89:4b:dd:4f:9a:c5:3f:78:9b:ee:5d:f4:ad:86";
+
+const char* const ApprovedResponse =
+    R"({"id":"entitlement-24223578-1CE8-4168-91E0-126C2D5EAA0B","vmid":"f4e6cf3e-3b21-4d58-9b2a-3f3b2c9e1c8a"})";
+
+const char* const DeniedResponse =
+    R"({"code":"EntitlementDenied","message":{"lang":"en-us","value":"Entitlement for contosoapp was denied."}})";
+
+const char* const CodeOnlyResponse = R"({"code":"EntitlementDenied"})";
+
+const char* const MalformedResponse = "<html><body>Bad Gateway</body></html>";
+
+
+void StripNonHexThumbprintDigits(benchmark::State& state)
+{
+    const std::string input = ThumbprintWithSeparators;
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::StripNonHexThumbprintDigits(input));
+    }
+}
+BENCHMARK(StripNonHexThumbprintDigits);
+
+
+void ThumbprintToBinary(benchmark::State& state)
+{
+    const std::string input = ThumbprintWithSeparators;
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::ThumbprintToBinary(input));
+    }
+}
+BENCHMARK(ThumbprintToBinary);
+
+
+void X509_Thumbprint(benchmark::State& state)
+{
+    auto cert = IntermediateCertificate();
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(cert.Thumbprint());
+    }
+}
+BENCHMARK(X509_Thumbprint);
+
+
+void X509_MatchesThumbprint(benchmark::State& state)
+{
+    auto cert = IntermediateCertificate();
+    auto thumbprint = SES::Internal::ThumbprintToBinary(Certificates().IntermediateThumbprint());
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(cert.MatchesThumbprint(thumbprint));
+    }
+}
+BENCHMARK(X509_MatchesThumbprint);
+
+
+void X509_CommonName(benchmark::State& state)
+{
+    auto cert = IntermediateCertificate();
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(cert.CommonName());
+    }
+}
+BENCHMARK(X509_CommonName);
+
+
+void VerifyCertificateChain(benchmark::State& state)
+{
+    //
+    // The chain OpenSSL verifies during the handshake: server certificate,
+    // pinned intermediate and trusted root.
+    //
+    std::unique_ptr<STACK_OF(X509), void(*)(STACK_OF(X509)*)> chain(sk_X509_new_null(), [](STACK_OF(X509)* c) { sk_X509_free(c); });
+    sk_X509_push(chain.get(), Certificates().ServerCertificate());
+    sk_X509_push(chain.get(), Certificates().IntermediateCertificate());
+    sk_X509_push(chain.get(), Certificates().RootCertificate());
+
+    const std::string url = "https://localhost/";
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        SES::Internal::VerifyCertificateChain(chain.get(), url);
+    }
+}
+BENCHMARK(VerifyCertificateChain);
+
+
+//
+// Verifies the chain on every thread but one, which meanwhile pins a new
+// certificate each iteration, as a long-lived process rotating its pins
+// would; verifying never waits for a pin being added.
+//
+void PinRotation(benchmark::State& state)
+{
+    static std::atomic<unsigned> s_pins(0);
+
+    std::unique_ptr<STACK_OF(X509), void(*)(STACK_OF(X509)*)> chain(sk_X509_new_null(), [](STACK_OF(X509)* c) { sk_X509_free(c); });
+    sk_X509_push(chain.get(), Certificates().ServerCertificate());
+    sk_X509_push(chain.get(), Certificates().IntermediateCertificate());
+    sk_X509_push(chain.get(), Certificates().RootCertificate());
+
+    const std::string url = "https://localhost/";
+    for (auto _ : state)
+    {
+        if (state.thread_index() == 0)
+        {
+            char thumbprint[41];
+            std::snprintf(thumbprint, sizeof(thumbprint), "%040x", ++s_pins);
+            SES::AddSslCertificate(thumbprint, "Rotated test certificate");
+            continue;
+        }
+
+        try
+        {
+            SES::Internal::VerifyCertificateChain(chain.get(), url);
+        }
+        catch (const SES::Exception& e)
+        {
+            state.SkipWithError(e.what());
+            break;
+        }
+    }
+}
+BENCHMARK(PinRotation)->Threads(2)->Threads(4)->Threads(8)->Iterations(2000)->UseRealTime();
+
+
+void ExtractValue(benchmark::State& state)
+{
+    const std::string response = ApprovedResponse;
+    const std::string key = "id";
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::ExtractValue(response, key));
+    }
+}
+BENCHMARK(ExtractValue);
+
+
+void GetDetailedErrorMessage(benchmark::State& state, const char* body)
+{
+    const std::string response = body;
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::GetDetailedErrorMessage(response));
+    }
+}
+BENCHMARK_CAPTURE(GetDetailedErrorMessage, denied, DeniedResponse);
+BENCHMARK_CAPTURE(GetDetailedErrorMessage, code_only, CodeOnlyResponse);
+BENCHMARK_CAPTURE(GetDetailedErrorMessage, malformed, MalformedResponse);
+
+
+void BuildRequestBody(benchmark::State& state)
+{
+    const std::string token = SampleToken();
+    const std::string application = "contosoapp";
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::BuildRequestBody(token, application));
+    }
+}
+BENCHMARK(BuildRequestBody);
+
+
+void DigestToken(benchmark::State& state)
+{
+    const std::string token = SampleToken();
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(SES::Internal::DigestToken(token));
+    }
+}
+BENCHMARK(DigestToken);
+
+
+//
+// Adds a request to the flight recorder from each of several threads at
+// once.  Recording takes no locks, so the threads contend only for the next
+// entry's index and the cache lines of the entries themselves.
+//
+void RecordRequest(benchmark::State& state)
+{
+    const std::string endpoint = "https://localhost:44300/";
+    const std::string application = "contosoapp";
+    const SES::Internal::TokenDigest digest = SES::Internal::DigestToken(SampleToken());
+
+    SES::RequestRecord record;
+    record.attempt = 1;
+    record.http_status = 200;
+    record.pin_check = SES::PinCheck::Passed;
+    record.total_us = 1500;
+
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        SES::Internal::RecordRequest(endpoint, application, digest, record);
+    }
+}
+BENCHMARK(RecordRequest)->ThreadRange(1, 8)->UseRealTime();
+
+
+//
+// A whole check through TryGetEntitlement, answered by LoopbackTransport:
+// building the request, pinning the chain the server would present,
+// interpreting the response and recording the request, without the network.
+//
+void Loopback(benchmark::State& state, const char* application, SES::ErrorCategory expected)
+{
+    const std::string url = "https://loopback.invalid/";
+    std::vector<x509_st*> chain;
+    chain.push_back(Certificates().ServerCertificate());
+    chain.push_back(Certificates().IntermediateCertificate());
+    chain.push_back(Certificates().RootCertificate());
+    SES::Internal::SetTransport(url, SES::Internal::LoopbackTransport(std::vector<std::string>(1, "contosoapp"), chain));
+
+    const std::string token = SampleToken();
+    {
+        AllocationScope allocations(state);
+        for (auto _ : state)
+        {
+            SES::EntitlementResult result = SES::TryGetEntitlement(url, token, application, 0);
+            if (result.category != expected)
+            {
+                state.SkipWithError("Unexpected outcome from the loopback transport");
+                break;
+            }
+        }
+    }
+
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+}
+BENCHMARK_CAPTURE(Loopback, approve, "contosoapp", SES::ErrorCategory::None);
+BENCHMARK_CAPTURE(Loopback, deny, "fabrikamapp", SES::ErrorCategory::Denied);
+
+
+//
+// A token as the server issues them, valid until expires and for the
+// applications given as a JSON string or array: an RS256 JWS with an RSA
+// 2048 signature's worth of bytes.
+//
+std::string SampleJwsToken(long long expires, const char* applications)
+{
+    auto encode = [](const std::string& text) -> std::string
+    {
+        std::vector<unsigned char> encoded(4 * ((text.size() + 2) / 3) + 1);
+        int length = EVP_EncodeBlock(encoded.data(), reinterpret_cast<const unsigned char*>(text.data()), static_cast<int>(text.size()));
+        std::string base64url(encoded.begin(), encoded.begin() + length);
+        base64url.erase(base64url.find_last_not_of('=') + 1);
+        std::replace(base64url.begin(), base64url.end(), '+', '-');
+        std::replace(base64url.begin(), base64url.end(), '/', '_');
+        return base64url;
+    };
+
+    const std::string claims = std::string(R"({"vmid":"f4e6cf3e-3b21-4d58-9b2a-3f3b2c9e1c8a",)")
+        + R"("id":"entitlement-24223578-1CE8-4168-91E0-126C2D5EAA0B","ip":["10.0.0.4"],"app":)" + applications
+        + R"(,"nbf":1500000000,"exp":)" + std::to_string(expires)
+        + R"(,"iss":"https://batch.azure.test/software-entitlement","aud":"https://batch.azure.test/software-entitlement"})";
+    return encode(R"({"alg":"RS256","typ":"JWT"})") + '.' + encode(claims) + '.' + encode(std::string(256, 's'));
+}
+
+//
+// The token pre-check of a check of contosoapp: decoding the claims of a
+// token and deciding whether the server would refuse it.
+//
+void TokenPreCheck(benchmark::State& state, long long expires, const char* applications, bool usable)
+{
+    const std::string token = SampleJwsToken(expires, applications);
+    const std::string application = "contosoapp";
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        SES::Internal::TokenClaims claims = SES::Internal::ReadTokenClaims(token);
+        if (SES::Internal::UnusableTokenReason(claims, application, std::chrono::system_clock::now()).empty() != usable)
+        {
+            state.SkipWithError("Unexpected outcome of the token pre-check");
+            break;
+        }
+    }
+}
+BENCHMARK_CAPTURE(TokenPreCheck, usable, 4102444800LL, R"(["contosoapp","contosoapp-solver"])", true);
+BENCHMARK_CAPTURE(TokenPreCheck, expired, 1500086400LL, R"(["contosoapp","contosoapp-solver"])", false);
+BENCHMARK_CAPTURE(TokenPreCheck, other_application, 4102444800LL, R"("fabrikamapp")", false);
+
+
+//
+// The CA bundle libcurl loads by default, or OpenSSL's if libcurl is too old
+// to say.
+//
+std::string DefaultCaBundle()
+{
+#if LIBCURL_VERSION_NUM >= 0x075400
+    std::unique_ptr<CURL, void(*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
+    char* path = nullptr;
+    if (curl && curl_easy_getinfo(curl.get(), CURLINFO_CAINFO, &path) == CURLE_OK && path != nullptr)
+    {
+        return path;
+    }
+#endif
+    return X509_get_default_cert_file();
+}
+
+
+//
+// The cost of the CA certificates to each new connection: parsing the CA
+// bundle into a store of its own, as libcurl does by default, or taking a
+// reference to the store shared by all connections.  bytes_per_op is close to
+// the memory each connection holds for its trusted certificates.
+//
+void TrustStore(benchmark::State& state, bool shared)
+{
+    const std::string bundle = DefaultCaBundle();
+    std::unique_ptr<SSL_CTX, void(*)(SSL_CTX*)> probe(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+    if (SSL_CTX_load_verify_locations(probe.get(), bundle.c_str(), nullptr) != 1)
+    {
+        state.SkipWithError(("Unable to load " + bundle).c_str());
+        return;
+    }
+    probe.reset();
+    X509_STORE_free(SES::Internal::AcquireTrustStore(bundle, std::string()));
+
+    AllocationScope allocations(state);
+    for (auto _ : state)
+    {
+        SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+        if (shared)
+        {
+            SSL_CTX_set_cert_store(ctx, SES::Internal::AcquireTrustStore(bundle, std::string()));
+        }
+        else
+        {
+            SSL_CTX_load_verify_locations(ctx, bundle.c_str(), nullptr);
+        }
+        SSL_CTX_free(ctx);
+    }
+}
+BENCHMARK_CAPTURE(TrustStore, per_connection, false);
+BENCHMARK_CAPTURE(TrustStore, shared, true);
+
+}   // anonymous namespace
+
+
+//
+// Count every C++ allocation in the process.  GCC cannot see that these
+// operators pair malloc with free, so quieten its mismatch warning.
+//
+#if defined __GNUC__ && !defined __clang__ && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    CountAllocation(size);
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
+int main(int argc, char** argv)
+{
+    //
+    // Must precede any allocation by OpenSSL.
+    //
+    if (CRYPTO_set_mem_functions(CountingMalloc, CountingRealloc, CountingFree) != 1)
+    {
+        std::fprintf(stderr, "Unable to hook OpenSSL allocations; only C++ allocations will be counted.\n");
+    }
+
+    int err = SES::Init();
+    if (err != 0)
+    {
+        return err;
+    }
+
+    //
+    // Pinned after the built-in certificates, as a test server's would be.
+    //
+    SES::AddSslCertificate(Certificates().IntermediateThumbprint(), Certificates().IntermediateCommonName());
+
+    std::vector<std::string> storage;
+    std::vector<char*> args = SES::Benchmarks::WithDefaultJsonOutput(argc, argv, "sesclient-microbenchmarks.json", storage);
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    SES::Cleanup();
+    return 0;
+}
@@ -0,0 +1,202 @@
+//
+// Start-up cost of an application embedding the native client, measured by
+// running a minimal probe application (StartupProbe.cpp) as a child process.
+//
+// The probe is built twice: linked against libcurl, initialized eagerly by
+// Init, and loading libcurl with dlopen on first use.  Each is run without
+// an entitlement check, as in a run that never reaches one, and with a
+// single check against a local stand-in server, with and without a Warmup
+// ahead of the application's own initialization.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "BenchmarkOptions.h"
+#include "Server.h"
+
+extern char** environ;
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using SES::StandIn::Server;
+using SES::StandIn::ServerOptions;
+using SES::StandIn::TestCertificates;
+
+namespace {
+
+std::unique_ptr<TestCertificates> s_certificates;
+std::unique_ptr<Server> s_server;
+
+//
+// Time the probe spends on its own initialization after calling Warmup.
+//
+const char* const WarmupMilliseconds = "20";
+
+struct ProbeTimes
+{
+    long long main;
+    long long init;
+    long long checkStart;
+    long long checkEnd;
+};
+
+long long Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// Runs the probe to completion, returning false if it fails.
+//
+bool RunProbe(const std::vector<std::string>& arguments, ProbeTimes& times)
+{
+    int output[2];
+    if (pipe(output) != 0)
+    {
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, output[0]);
+
+    std::vector<char*> argv;
+    for (const auto& argument : arguments)
+    {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int spawned = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(output[1]);
+    if (spawned != 0)
+    {
+        close(output[0]);
+        return false;
+    }
+
+    std::string text;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(output[0], buffer, sizeof(buffer))) > 0)
+    {
+        text.append(buffer, static_cast<size_t>(n));
+    }
+    close(output[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status)
+        && WEXITSTATUS(status) == 0
+        && std::sscanf(text.c_str(), "%lld %lld %lld %lld", &times.main, &times.init, &times.checkStart, &times.checkEnd) == 4;
+}
+
+enum class Check
+{
+    None,
+    Cold,
+    Warmed
+};
+
+void Startup(benchmark::State& state, const char* probe, const char* mode, Check check)
+{
+    std::vector<std::string> arguments;
+    arguments.push_back(probe);
+    arguments.push_back(mode);
+    if (check != Check::None)
+    {
+        arguments.push_back(s_server->Url());
+        arguments.push_back(s_certificates->IntermediateThumbprint());
+        arguments.push_back(s_certificates->IntermediateCommonName());
+    }
+    if (check == Check::Warmed)
+    {
+        arguments.push_back(WarmupMilliseconds);
+    }
+
+    double toMain = 0;
+    double toInit = 0;
+    double toCheck = 0;
+    double checking = 0;
+    for (auto _ : state)
+    {
+        long long start = Now();
+        ProbeTimes times;
+        if (!RunProbe(arguments, times))
+        {
+            state.SkipWithError("Probe failed");
+            break;
+        }
+        state.SetIterationTime((Now() - start) / 1e9);
+
+        toMain += (times.main - start) / 1e3;
+        toInit += (times.init - start) / 1e3;
+        if (check != Check::None)
+        {
+            toCheck += (times.checkEnd - start) / 1e3;
+            checking += (times.checkEnd - times.checkStart) / 1e3;
+        }
+    }
+
+    state.counters["start_to_main_us"] = benchmark::Counter(toMain, benchmark::Counter::kAvgIterations);
+    state.counters["start_to_init_us"] = benchmark::Counter(toInit, benchmark::Counter::kAvgIterations);
+    if (check != Check::None)
+    {
+        state.counters["start_to_first_check_us"] = benchmark::Counter(toCheck, benchmark::Counter::kAvgIterations);
+        state.counters["first_check_us"] = benchmark::Counter(checking, benchmark::Counter::kAvgIterations);
+    }
+}
+
+void Register(const char* name, const char* probe, const char* mode, Check check)
+{
+    benchmark::RegisterBenchmark(name, Startup, probe, mode, check)
+        ->UseManualTime()
+        ->Unit(benchmark::kMicrosecond);
+}
+
+}   // anonymous namespace
+
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> storage;
+    std::vector<char*> args = SES::Benchmarks::WithDefaultJsonOutput(argc, argv, "sesclient-startup-benchmarks.json", storage);
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+
+    s_certificates.reset(new TestCertificates());
+    s_server.reset(new Server(*s_certificates, ServerOptions()));
+
+    //
+    // Inherited by the probes.
+    //
+    setenv("AZ_BATCH_SES_CURLOPT_CAINFO", s_certificates->RootCertificatePath().c_str(), 1);
+
+    Register("Startup/linked/no_check", SES_STARTUP_PROBE, "eager", Check::None);
+    Register("Startup/dlopen/no_check", SES_STARTUP_PROBE_DLOPEN, "on-first-use", Check::None);
+    Register("Startup/linked/first_check", SES_STARTUP_PROBE, "eager", Check::Cold);
+    Register("Startup/dlopen/first_check", SES_STARTUP_PROBE_DLOPEN, "on-first-use", Check::Cold);
+    Register("Startup/linked/warmed_check", SES_STARTUP_PROBE, "eager", Check::Warmed);
+    Register("Startup/dlopen/warmed_check", SES_STARTUP_PROBE_DLOPEN, "on-first-use", Check::Warmed);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    s_server.reset();
+    s_certificates.reset();
+    return 0;
+}
@@ -0,0 +1,78 @@
+//
+// A minimal application embedding the native client, run as a child
+// process by the start-up benchmarks.
+//
+// Usage: sesclient-startup-probe <eager|on-first-use> [<url> <thumbprint> <common name> [<warm-up ms>]]
+//
+// Given a warm-up time, the probe calls Warmup, then sleeps for that long in
+// place of the application's own initialization, before checking.
+//
+// Prints the steady clock, in nanoseconds, on entering main, after Init, and
+// before and after the first check (0 if no URL is given), for the parent to
+// subtract from the time it started the process.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "SoftwareEntitlementClient.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+
+namespace {
+
+long long Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}   // anonymous namespace
+
+
+int main(int argc, char** argv)
+{
+    long long atMain = Now();
+
+    if (argc != 2 && argc != 5 && argc != 6)
+    {
+        std::fprintf(stderr, "Usage: %s <eager|on-first-use> [<url> <thumbprint> <common name> [<warm-up ms>]]\n", argv[0]);
+        return 1;
+    }
+
+    SES::InitMode mode = std::strcmp(argv[1], "on-first-use") == 0 ? SES::InitMode::OnFirstUse : SES::InitMode::Eager;
+    if (SES::Init(mode) != 0)
+    {
+        return 1;
+    }
+    long long afterInit = Now();
+
+    long long beforeCheck = 0;
+    long long afterCheck = 0;
+    if (argc >= 5)
+    {
+        try
+        {
+            SES::AddSslCertificate(argv[3], argv[4]);
+            if (argc == 6)
+            {
+                SES::Warmup(argv[2]);
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::atoi(argv[5])));
+            }
+
+            beforeCheck = Now();
+            SES::GetEntitlement(argv[2], "startup-token", "contosoapp");
+        }
+        catch (const SES::Exception& e)
+        {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        afterCheck = Now();
+    }
+
+    std::printf("%lld %lld %lld %lld\n", atMain, afterInit, beforeCheck, afterCheck);
+    SES::Cleanup();
+    return 0;
+}
@@ -0,0 +1,296 @@
+//
+// Admission control: the start-up window, the pacing of requests, and the
+// interactive checks that bypass both.
+//
+// Only lower bounds are put on how long paced checks take, and waits that
+// must not happen are measured against windows long enough that no load on
+// the machine running the tests could account for them.
+//
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "EpollLoop.h"
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientC.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// How much sooner than called for a wait may end, for the rounding of the
+// clocks involved.
+//
+const std::chrono::milliseconds Rounding(5);
+
+class Admission : public testing::Test
+{
+protected:
+    void TearDown() override
+    {
+        SES::SetInteractive(false);
+        SES::SetAdmissionControl(SES::AdmissionControl());
+    }
+
+    //
+    // Sets a start-up window of window with the first identity whose share
+    // of it is between minimum and maximum, returning the share.
+    //
+    static std::chrono::microseconds SetStartupWindow(
+        std::chrono::milliseconds window,
+        std::chrono::milliseconds minimum,
+        std::chrono::milliseconds maximum,
+        SES::AdmissionControl& control)
+    {
+        control.startup_window = window;
+        std::chrono::microseconds delay(0);
+        for (int node = 0; delay < minimum || delay >= maximum; ++node)
+        {
+            control.identity = "node-" + std::to_string(node);
+            SES::SetAdmissionControl(control);
+            delay = std::chrono::microseconds(SES::AdmissionStatistics().startup_delay_us);
+        }
+        return delay;
+    }
+};
+
+TEST_F(Admission, StartupDelayDependsOnTheIdentityAlone)
+{
+    SES::AdmissionControl control;
+    std::chrono::microseconds delay = SetStartupWindow(
+        std::chrono::milliseconds(200), std::chrono::milliseconds(60), std::chrono::milliseconds(150), control);
+
+    SES::AdmissionControl other = control;
+    other.identity += "-other";
+    SES::SetAdmissionControl(other);
+    EXPECT_NE(delay.count(), SES::AdmissionStatistics().startup_delay_us);
+
+    SES::SetAdmissionControl(control);
+    EXPECT_EQ(delay.count(), SES::AdmissionStatistics().startup_delay_us);
+}
+
+TEST_F(Admission, FirstCheckWaitsForItsShareOfTheWindow)
+{
+    SES::AdmissionControl control;
+    std::chrono::microseconds delay = SetStartupWindow(
+        std::chrono::milliseconds(200), std::chrono::milliseconds(60), std::chrono::milliseconds(150), control);
+
+    auto before = SES::AdmissionStatistics();
+    auto start = std::chrono::steady_clock::now();
+    SES::EntitlementResult first = SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication);
+    auto waited = std::chrono::steady_clock::now() - start;
+
+    EXPECT_TRUE(first.entitlement);
+    EXPECT_GE(waited + Rounding, delay);
+    EXPECT_EQ(before.delayed + 1, SES::AdmissionStatistics().delayed);
+}
+
+TEST_F(Admission, InteractiveCheckDoesNotWait)
+{
+    SES::AdmissionControl control;
+    std::chrono::microseconds delay = SetStartupWindow(
+        std::chrono::seconds(20), std::chrono::seconds(10), std::chrono::seconds(20), control);
+
+    auto before = SES::AdmissionStatistics();
+    SES::SetInteractive(true);
+    auto start = std::chrono::steady_clock::now();
+    SES::EntitlementResult interactive = SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication);
+    auto waited = std::chrono::steady_clock::now() - start;
+
+    EXPECT_TRUE(interactive.entitlement);
+    EXPECT_LT(waited, delay / 2);
+    EXPECT_EQ(before.bypassed + 1, SES::AdmissionStatistics().bypassed);
+}
+
+TEST_F(Admission, CheckWaitingForItsTurnCanBeCancelled)
+{
+    SES::AdmissionControl control;
+    std::chrono::microseconds delay = SetStartupWindow(
+        std::chrono::seconds(20), std::chrono::seconds(10), std::chrono::seconds(20), control);
+
+    ses_cancellation* cancellation = ses_cancellation_new();
+    std::thread canceller([cancellation]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ses_cancel(cancellation);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    ses_result* result = ses_get_entitlement_cancellable(
+        WarmServer().Url().c_str(), UniqueToken().c_str(), ApprovedApplication, 5, cancellation);
+    auto waited = std::chrono::steady_clock::now() - start;
+    canceller.join();
+
+    ASSERT_NE(nullptr, result);
+    EXPECT_EQ(SES_CANCELLED, ses_result_category(result));
+    EXPECT_LT(waited, delay / 2);
+    ses_result_free(result);
+    ses_cancellation_free(cancellation);
+}
+
+//
+// While one thread's check waits for its share of the window, another's,
+// marked interactive, must be sent and answered; the first must still wait
+// its turn.
+//
+TEST_F(Admission, InteractiveCheckDoesNotWaitBehindAnotherThread)
+{
+    SES::AdmissionControl control;
+    std::chrono::microseconds delay = SetStartupWindow(
+        std::chrono::seconds(2), std::chrono::seconds(1), std::chrono::seconds(2), control);
+
+    std::atomic<bool> pacedFinished(false);
+    bool pacedApproved = false;
+    std::chrono::steady_clock::duration pacedWaited;
+    auto start = std::chrono::steady_clock::now();
+    std::thread paced([&]()
+    {
+        pacedApproved = SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication).entitlement != nullptr;
+        pacedWaited = std::chrono::steady_clock::now() - start;
+        pacedFinished = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    SES::SetInteractive(true);
+    EXPECT_NO_THROW(SES::GetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication));
+    EXPECT_FALSE(pacedFinished);
+    paced.join();
+
+    EXPECT_TRUE(pacedApproved);
+    EXPECT_GE(pacedWaited + Rounding, delay);
+}
+
+//
+// A thread checking one entitlement after another keeps the bucket in debt;
+// a check made meanwhile through an AsyncClient must still have its turn,
+// in the order it asked, rather than wait for the thread to stop.
+//
+TEST_F(Admission, AsyncCheckIsNotStarvedByBlockingCallers)
+{
+    SES::AdmissionControl control;
+    control.rate = 20;
+    control.burst = 1;
+    SES::SetAdmissionControl(control);
+
+    std::atomic<bool> stop(false);
+    std::thread blocking([&stop]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        while (!stop && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+        {
+            SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    SES::AsyncClient client(WarmServer().Url());
+    bool approved = false;
+    client.Check(UniqueToken(), ApprovedApplication, [&approved](SES::CheckResult result)
+    {
+        approved = result.entitlement != nullptr;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    while (client.Pending() > 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+    {
+        client.Perform(100);
+    }
+    auto waited = std::chrono::steady_clock::now() - start;
+    stop = true;
+    blocking.join();
+
+    EXPECT_TRUE(approved);
+    EXPECT_LT(waited, std::chrono::seconds(2));
+}
+
+enum class Driver
+{
+    // TryGetEntitlement, one check after another.
+    Sync,
+    // An AsyncClient's Perform.
+    Perform,
+    // An epoll loop without a wakeup function, through UseEventLoop.
+    EventLoop
+};
+
+class Pacing : public Admission, public testing::WithParamInterface<Driver>
+{
+};
+
+//
+// 15 checks paced at 100 a second after a burst of 5 must take at least the
+// 100ms the pacing calls for, however they are made.
+//
+TEST_P(Pacing, ChecksTakeTheirTurns)
+{
+    SES::AdmissionControl control;
+    control.rate = 100;
+    control.burst = 5;
+    SES::SetAdmissionControl(control);
+
+    const int count = 15;
+    int approved = 0;
+    auto start = std::chrono::steady_clock::now();
+    if (GetParam() == Driver::Sync)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication).entitlement)
+            {
+                ++approved;
+            }
+        }
+    }
+    else
+    {
+        SES::AsyncClient client(WarmServer().Url());
+        EpollLoop loop;
+        if (GetParam() == Driver::EventLoop)
+        {
+            client.UseEventLoop(loop.Callbacks());
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            client.Check(UniqueToken(), ApprovedApplication, [&approved](SES::CheckResult result)
+            {
+                approved += result.entitlement != nullptr ? 1 : 0;
+            });
+        }
+
+        while (client.Pending() > 0)
+        {
+            if (GetParam() == Driver::EventLoop)
+            {
+                loop.RunOnce(client);
+            }
+            else
+            {
+                client.Perform(1000);
+            }
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(count, approved);
+    EXPECT_GE(elapsed + Rounding, std::chrono::milliseconds(100));
+
+    std::vector<char> description(ses_describe_admission(nullptr, 0) + 1);
+    ses_describe_admission(description.data(), description.size());
+    EXPECT_NE(std::string::npos, std::string(description.data()).find("startup_delay_us=0"));
+}
+
+std::string NameOf(const testing::TestParamInfo<Driver>& info)
+{
+    const char* const names[] = { "Sync", "Perform", "EventLoop" };
+    return names[static_cast<int>(info.param)];
+}
+
+INSTANTIATE_TEST_SUITE_P(Drivers, Pacing, testing::Values(Driver::Sync, Driver::Perform, Driver::EventLoop), NameOf);
+
+}   // anonymous namespace
@@ -0,0 +1,216 @@
+//
+// Checks cancelled from another thread while waiting, through each of the
+// synchronous interfaces.
+//
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <gtest/gtest.h>
+#include "SilentListener.h"
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientC.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// How soon after its cancellation a check must return: far less than
+// anything it could have been waiting for.
+//
+const std::chrono::milliseconds CancelTolerance(250);
+
+enum class Api
+{
+    // GetEntitlement, which throws a CheckCancelledException.
+    Exception,
+    // TryGetEntitlement.
+    Result,
+    // ses_get_entitlement_cancellable.
+    C
+};
+
+enum class Waiting
+{
+    // For a response from a stand-in that has yet to send one.
+    Response,
+    // For the TLS handshake with a server that never accepts the connection.
+    Handshake,
+    // Between attempts, after the first timed out.
+    Retry,
+    // For another thread's check of the same application to finish.
+    Joined
+};
+
+//
+// Checks application at url through api, cancelling the check from another
+// thread after delay.  Returns true if the check ended cancelled, setting
+// late to how long after the cancellation it returned.
+//
+bool CancelledCheck(
+    Api api,
+    const std::string& url,
+    const std::string& token,
+    std::chrono::milliseconds delay,
+    std::chrono::microseconds& late)
+{
+    SES::CancellationToken cancellation;
+    ses_cancellation* c = api == Api::C ? ses_cancellation_new() : nullptr;
+
+    std::chrono::steady_clock::time_point requested;
+    std::thread canceller([&]()
+    {
+        std::this_thread::sleep_for(delay);
+        requested = std::chrono::steady_clock::now();
+        if (c != nullptr)
+        {
+            ses_cancel(c);
+        }
+        else
+        {
+            cancellation.Cancel();
+        }
+    });
+
+    bool cancelled = false;
+    switch (api)
+    {
+    case Api::Exception:
+        try
+        {
+            SES::GetEntitlement(url, token, ApprovedApplication, cancellation);
+        }
+        catch (const SES::CheckCancelledException&)
+        {
+            cancelled = true;
+        }
+        catch (const SES::Exception&)
+        {
+        }
+        break;
+
+    case Api::Result:
+        cancelled = SES::TryGetEntitlement(url, token, ApprovedApplication, cancellation).category == SES::ErrorCategory::Cancelled;
+        break;
+
+    case Api::C:
+    {
+        ses_result* result = ses_get_entitlement_cancellable(url.c_str(), token.c_str(), ApprovedApplication, 5, c);
+        cancelled = result != nullptr && ses_result_category(result) == SES_CANCELLED;
+        ses_result_free(result);
+        break;
+    }
+    }
+
+    auto returned = std::chrono::steady_clock::now();
+    canceller.join();
+    ses_cancellation_free(c);
+
+    late = std::chrono::duration_cast<std::chrono::microseconds>(returned - requested);
+    return cancelled;
+}
+
+class Cancellation : public testing::TestWithParam<std::tuple<Waiting, Api>>
+{
+protected:
+    void TearDown() override
+    {
+        unsetenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT");
+    }
+};
+
+//
+// The check must end cancelled, within CancelTolerance of the cancellation,
+// whatever it was waiting for.
+//
+TEST_P(Cancellation, ReturnsPromptly)
+{
+    const Waiting waiting = std::get<0>(GetParam());
+    const Api api = std::get<1>(GetParam());
+
+    SilentListener silent;
+    std::string url = StalledServer().Url();
+    std::chrono::milliseconds delay(20);
+    if (waiting == Waiting::Handshake || waiting == Waiting::Retry)
+    {
+        url = silent.Url();
+    }
+    if (waiting == Waiting::Retry)
+    {
+        //
+        // The first attempt times out after a second, and the second waits
+        // a second to start.
+        //
+        setenv("AZ_BATCH_SES_CURLOPT_CONNECTTIMEOUT", "1", 1);
+        delay = std::chrono::milliseconds(1500);
+    }
+
+    const std::string token = UniqueToken();
+
+    //
+    // A check that this one joins, until cancelled in turn.
+    //
+    SES::CancellationToken blocking;
+    std::thread blocker;
+    if (waiting == Waiting::Joined)
+    {
+        const std::uint64_t requests = StalledServer().RequestCount();
+        blocker = std::thread([&]() { SES::TryGetEntitlement(url, token, ApprovedApplication, blocking); });
+        while (StalledServer().RequestCount() == requests)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    std::chrono::microseconds late;
+    bool cancelled = CancelledCheck(api, url, token, delay, late);
+
+    blocking.Cancel();
+    if (blocker.joinable())
+    {
+        blocker.join();
+    }
+    silent.Drain();
+
+    EXPECT_TRUE(cancelled);
+    EXPECT_LE(late, CancelTolerance);
+}
+
+std::string NameOf(const testing::TestParamInfo<Cancellation::ParamType>& info)
+{
+    const char* const waiting[] = { "Response", "Handshake", "Retry", "Joined" };
+    const char* const api[] = { "Exception", "Result", "C" };
+    return std::string(waiting[static_cast<int>(std::get<0>(info.param))])
+        + api[static_cast<int>(std::get<1>(info.param))];
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Waiting,
+    Cancellation,
+    testing::Combine(
+        testing::Values(Waiting::Response, Waiting::Handshake, Waiting::Retry, Waiting::Joined),
+        testing::Values(Api::Exception, Api::Result, Api::C)),
+    NameOf);
+
+//
+// A check whose token was cancelled before it started must not reach the
+// server at all.
+//
+TEST(CancelledBeforehand, NeverReachesTheServer)
+{
+    const std::uint64_t requests = WarmServer().RequestCount();
+    SES::CancellationToken cancellation;
+    cancellation.Cancel();
+
+    SES::EntitlementResult result = SES::TryGetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication, cancellation);
+
+    EXPECT_EQ(SES::ErrorCategory::Cancelled, result.category);
+    EXPECT_EQ(requests, WarmServer().RequestCount());
+}
+
+}   // anonymous namespace
@@ -0,0 +1,101 @@
+//
+// GetEntitlement called from many threads at once for the same check.
+//
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+class Coalescing : public testing::TestWithParam<int>
+{
+};
+
+//
+// GetParam() threads per key check an approved and a denied application at
+// the same moment.  The stand-in must receive one request per key, and every
+// thread get its outcome: the same entitlement, or the same error.
+//
+TEST_P(Coalescing, OneRequestPerKey)
+{
+    const int threadsPerKey = GetParam();
+    const std::string url = CoalescingServer().Url();
+    const std::string token = UniqueToken();
+    const std::uint64_t requestsBefore = CoalescingServer().RequestCount();
+
+    std::mutex lock;
+    std::condition_variable started;
+    bool go = false;
+    std::vector<std::string> approvals;
+    std::vector<std::string> denials;
+    std::vector<std::string> unexpected;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2 * threadsPerKey; ++i)
+    {
+        const std::string application = i % 2 == 0 ? ApprovedApplication : DeniedApplication;
+        threads.emplace_back([&, application]()
+        {
+            {
+                std::unique_lock<std::mutex> wait(lock);
+                started.wait(wait, [&go]() { return go; });
+            }
+
+            std::string approval;
+            std::string denial;
+            try
+            {
+                approval = SES::GetEntitlement(url, token, application)->Id();
+            }
+            catch (const SES::Exception& e)
+            {
+                denial = e.what();
+            }
+
+            std::lock_guard<std::mutex> done(lock);
+            if (application == ApprovedApplication && !approval.empty())
+            {
+                approvals.push_back(approval);
+            }
+            else if (application == DeniedApplication && !denial.empty())
+            {
+                denials.push_back(denial);
+            }
+            else
+            {
+                unexpected.push_back(application + ": " + (approval.empty() ? denial : approval));
+            }
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> release(lock);
+        go = true;
+    }
+    started.notify_all();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_TRUE(unexpected.empty()) << unexpected.front();
+    EXPECT_EQ(2u, CoalescingServer().RequestCount() - requestsBefore);
+    ASSERT_EQ(static_cast<size_t>(threadsPerKey), approvals.size());
+    ASSERT_EQ(static_cast<size_t>(threadsPerKey), denials.size());
+    EXPECT_EQ(threadsPerKey, std::count(approvals.begin(), approvals.end(), approvals.front()));
+    EXPECT_EQ(threadsPerKey, std::count(denials.begin(), denials.end(), denials.front()));
+}
+
+INSTANTIATE_TEST_SUITE_P(ThreadsPerKey, Coalescing, testing::Values(1, 4, 16, 64));
+
+}   // anonymous namespace
@@ -0,0 +1,406 @@
+//
+// The adaptive limit on the checks each server may have in flight at once.
+//
+// Synchronous checks go to servers stood in for by transports of the tests'
+// own, which hold requests until told to answer and report the latency and
+// status they are given, so that the limits follow from the test alone and
+// not from how fast the machine running it is.
+//
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientC.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// How long a test waits for checks to reach a state it expects, before
+// failing; far longer than they should ever take.
+//
+const std::chrono::seconds Patience(10);
+
+//
+// A server, new to the limiter, stood in for by a transport that holds
+// requests while closed and answers with the status and server latency it
+// is given.
+//
+class ScriptedServer
+{
+    struct State
+    {
+        std::mutex lock;
+        std::condition_variable changed;
+        bool open = true;
+        unsigned int arrived = 0;
+        long status = 200;
+        int curlCode = CURLE_OK;
+        std::int64_t latency_us = 1000;
+    };
+
+    std::string _url;
+    std::shared_ptr<State> _state;
+
+public:
+    ScriptedServer()
+        : _url("https://limit-" + UniqueToken() + ".invalid/")
+        , _state(std::make_shared<State>())
+    {
+        std::shared_ptr<State> state = _state;
+        SES::Internal::SetTransport(_url, [state](
+            const SES::Internal::TransportRequest&,
+            SES::Internal::TransportResponse& response,
+            SES::Internal::Cancellation*)
+        {
+            std::unique_lock<std::mutex> lock(state->lock);
+            ++state->arrived;
+            state->changed.notify_all();
+            state->changed.wait(lock, [&state]() { return state->open; });
+
+            if (state->curlCode != CURLE_OK)
+            {
+                response.category = SES::ErrorCategory::Transport;
+                response.curl_code = state->curlCode;
+                response.error = curl_easy_strerror(static_cast<CURLcode>(state->curlCode));
+                return;
+            }
+            response.category = SES::ErrorCategory::None;
+            response.http_status = state->status;
+            response.body = state->status == 200 ? "{\"id\":\"entitlement\",\"vmid\":\"scripted\"}" : "";
+            response.server_latency_us = state->latency_us;
+        });
+    }
+
+    ~ScriptedServer()
+    {
+        Open();
+        SES::Internal::SetTransport(_url, SES::Internal::Transport());
+    }
+
+    ScriptedServer(const ScriptedServer&) = delete;
+    ScriptedServer& operator=(const ScriptedServer&) = delete;
+
+    const std::string& Url() const
+    {
+        return _url;
+    }
+
+    //
+    // Holds requests, from now on, until Open.
+    //
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(_state->lock);
+        _state->open = false;
+    }
+
+    void Open()
+    {
+        std::lock_guard<std::mutex> lock(_state->lock);
+        _state->open = true;
+        _state->changed.notify_all();
+    }
+
+    void Answer(long status, std::int64_t latency_us)
+    {
+        std::lock_guard<std::mutex> lock(_state->lock);
+        _state->status = status;
+        _state->curlCode = CURLE_OK;
+        _state->latency_us = latency_us;
+    }
+
+    void FailWith(CURLcode code)
+    {
+        std::lock_guard<std::mutex> lock(_state->lock);
+        _state->curlCode = code;
+    }
+
+    //
+    // Waits until count requests have arrived in all; returns false if they
+    // do not within Patience.
+    //
+    bool WaitForArrivals(unsigned int count)
+    {
+        std::unique_lock<std::mutex> lock(_state->lock);
+        return _state->changed.wait_for(lock, Patience, [this, count]() { return _state->arrived >= count; });
+    }
+
+    unsigned int Arrived()
+    {
+        std::lock_guard<std::mutex> lock(_state->lock);
+        return _state->arrived;
+    }
+};
+
+//
+// The limit of the server at url, as reported by ConcurrencyLimits.
+//
+SES::ConcurrencyLimit LimitOf(const std::string& url)
+{
+    for (const auto& limit : SES::ConcurrencyLimits())
+    {
+        if (limit.endpoint.compare(0, url.size(), url) == 0)
+        {
+            return limit;
+        }
+    }
+    return SES::ConcurrencyLimit();
+}
+
+//
+// Waits until waiting checks to url wait for a place; returns false if they
+// do not within Patience.
+//
+bool WaitForWaiting(const std::string& url, unsigned int waiting)
+{
+    auto deadline = std::chrono::steady_clock::now() + Patience;
+    while (LimitOf(url).waiting < waiting)
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+//
+// Checks server from count threads at once, each with a token of its own,
+// counting those approved.
+//
+class ConcurrentChecks
+{
+    ScriptedServer& _server;
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    int _approved = 0;
+
+public:
+    ConcurrentChecks(ScriptedServer& server, int count)
+        : _server(server)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            const std::string url = server.Url();
+            const std::string token = UniqueToken();
+            _threads.emplace_back([this, url, token]()
+            {
+                bool approved = SES::TryGetEntitlement(url, token, ApprovedApplication, 0).entitlement != nullptr;
+                std::lock_guard<std::mutex> lock(_lock);
+                _approved += approved ? 1 : 0;
+            });
+        }
+    }
+
+    //
+    // Lets the checks finish, should the test have ended before it did.
+    //
+    ~ConcurrentChecks()
+    {
+        _server.Open();
+        Join();
+    }
+
+    int Join()
+    {
+        for (auto& thread : _threads)
+        {
+            if (thread.joinable())
+            {
+                thread.join();
+            }
+        }
+        return _approved;
+    }
+};
+
+class ConcurrencyLimit : public testing::Test
+{
+protected:
+    ScriptedServer _server;
+
+    void TearDown() override
+    {
+        SES::SetMaxConcurrency(1000);
+    }
+};
+
+//
+// A new server may have 16 checks in flight, from as many threads; the rest
+// wait for one of those to finish.
+//
+TEST_F(ConcurrencyLimit, SixteenInFlightAtFirst)
+{
+    _server.Close();
+    ConcurrentChecks checks(_server, 24);
+    ASSERT_TRUE(_server.WaitForArrivals(16));
+    ASSERT_TRUE(WaitForWaiting(_server.Url(), 8));
+
+    SES::ConcurrencyLimit started = LimitOf(_server.Url());
+    EXPECT_EQ(16u, started.limit);
+    EXPECT_EQ(16u, started.in_flight);
+    EXPECT_EQ(8u, started.waiting);
+    EXPECT_EQ(16u, _server.Arrived());
+
+    _server.Open();
+    EXPECT_EQ(24, checks.Join());
+}
+
+//
+// Checks answered while the limit is in use raise it, without a backoff.
+//
+TEST_F(ConcurrencyLimit, GrowsWhileAnswered)
+{
+    _server.Close();
+    ConcurrentChecks checks(_server, 16);
+    ASSERT_TRUE(_server.WaitForArrivals(16));
+    _server.Open();
+    EXPECT_EQ(16, checks.Join());
+
+    SES::ConcurrencyLimit grown = LimitOf(_server.Url());
+    EXPECT_GT(grown.limit, 16u);
+    EXPECT_EQ(0u, grown.backoffs);
+    EXPECT_EQ(0u, grown.in_flight);
+    EXPECT_EQ(0u, grown.waiting);
+}
+
+//
+// Checks in flight together that are all answered with a 503 halve the
+// limit once: each saw the same overload.
+//
+TEST_F(ConcurrencyLimit, HalvedOnceForOverload)
+{
+    _server.Answer(503, 1000);
+    _server.Close();
+    ConcurrentChecks checks(_server, 4);
+    ASSERT_TRUE(_server.WaitForArrivals(4));
+    _server.Open();
+    EXPECT_EQ(0, checks.Join());
+
+    SES::ConcurrencyLimit shrunk = LimitOf(_server.Url());
+    EXPECT_EQ(8u, shrunk.limit);
+    EXPECT_EQ(1u, shrunk.backoffs);
+
+    std::vector<char> description(ses_describe_concurrency_limits(nullptr, 0) + 1);
+    ses_describe_concurrency_limits(description.data(), description.size());
+    EXPECT_NE(std::string::npos, std::string(description.data()).find("endpoint=" + _server.Url()));
+}
+
+//
+// A server whose latency rises well above its baseline has its limit cut,
+// by less than for overload.
+//
+TEST_F(ConcurrencyLimit, CutWhenLatencyRises)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_TRUE(SES::TryGetEntitlement(_server.Url(), UniqueToken(), ApprovedApplication, 0).entitlement);
+    }
+    EXPECT_EQ(0u, LimitOf(_server.Url()).backoffs);
+
+    _server.Answer(200, 10000);
+    ASSERT_TRUE(SES::TryGetEntitlement(_server.Url(), UniqueToken(), ApprovedApplication, 0).entitlement);
+
+    SES::ConcurrencyLimit cut = LimitOf(_server.Url());
+    EXPECT_EQ(1u, cut.backoffs);
+    EXPECT_EQ(14u, cut.limit);
+    EXPECT_GT(cut.latency_us, 2 * cut.baseline_latency_us);
+}
+
+//
+// A server that cannot be reached is overloaded as far as the limit is
+// concerned, but one whose name does not resolve says nothing of it.
+//
+TEST_F(ConcurrencyLimit, TransportFailuresBackOffUnlessUnresolved)
+{
+    _server.FailWith(CURLE_COULDNT_RESOLVE_HOST);
+    EXPECT_EQ(SES::ErrorCategory::Transport, SES::TryGetEntitlement(_server.Url(), UniqueToken(), ApprovedApplication, 0).category);
+    EXPECT_EQ(0u, LimitOf(_server.Url()).backoffs);
+
+    _server.FailWith(CURLE_COULDNT_CONNECT);
+    EXPECT_EQ(SES::ErrorCategory::Transport, SES::TryGetEntitlement(_server.Url(), UniqueToken(), ApprovedApplication, 0).category);
+    EXPECT_EQ(1u, LimitOf(_server.Url()).backoffs);
+}
+
+//
+// With SetMaxConcurrency(1), a check waits for the only one allowed in
+// flight to its server, until cancelled.
+//
+TEST_F(ConcurrencyLimit, CappedBySetMaxConcurrency)
+{
+    SES::SetMaxConcurrency(1);
+    _server.Close();
+    ConcurrentChecks first(_server, 1);
+    ASSERT_TRUE(_server.WaitForArrivals(1));
+
+    SES::CancellationToken cancellation;
+    SES::EntitlementResult second;
+    std::thread waiter([&]()
+    {
+        second = SES::TryGetEntitlement(_server.Url(), UniqueToken(), ApprovedApplication, cancellation, 0);
+    });
+    EXPECT_TRUE(WaitForWaiting(_server.Url(), 1));
+
+    SES::ConcurrencyLimit capped = LimitOf(_server.Url());
+    EXPECT_EQ(1u, capped.limit);
+    EXPECT_EQ(1u, capped.in_flight);
+
+    cancellation.Cancel();
+    waiter.join();
+    EXPECT_EQ(SES::ErrorCategory::Cancelled, second.category);
+    EXPECT_EQ(1u, _server.Arrived());
+
+    _server.Open();
+    EXPECT_EQ(1, first.Join());
+}
+
+//
+// An AsyncClient's checks to a new server take the 16 places at once, the
+// rest being queued in the client, before any reaches the network.
+//
+TEST(AsyncConcurrencyLimit, SixteenInFlightAtFirst)
+{
+    SES::StandIn::ServerOptions options;
+    options.approvedApplications.clear();
+    options.approvedApplications.insert(ApprovedApplication);
+    SES::StandIn::Server server(Certificates(), options);
+
+    SES::AsyncClient client(server.Url());
+    const int count = 64;
+    int approved = 0;
+    int finished = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        client.Check(UniqueToken(), ApprovedApplication, [&](SES::CheckResult result)
+        {
+            ++finished;
+            approved += result.entitlement != nullptr ? 1 : 0;
+        });
+    }
+
+    SES::ConcurrencyLimit started = LimitOf(server.Url());
+    EXPECT_EQ(16u, started.limit);
+    EXPECT_EQ(16u, started.in_flight);
+    EXPECT_EQ(48u, started.waiting);
+
+    while (finished < count)
+    {
+        client.Perform(1000);
+    }
+    EXPECT_EQ(count, approved);
+}
+
+}   // anonymous namespace
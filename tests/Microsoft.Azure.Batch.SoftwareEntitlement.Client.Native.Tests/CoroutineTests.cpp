@@ -0,0 +1,201 @@
+//
+// CoroutineClient: checks awaited from coroutines on one thread, and checks
+// cancelled or timed out while the server has yet to respond.
+//
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientCoroutine.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// How soon after a cancellation or time limit the awaiting coroutine must be
+// resumed: well before the stalled stand-in responds.
+//
+const std::chrono::milliseconds ResumeTolerance(1000);
+
+//
+// A coroutine that starts at once and is never awaited.
+//
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object()
+        {
+            return Detached();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+Detached CheckInto(
+    SES::CoroutineClient& client,
+    std::string token,
+    std::string application,
+    std::stop_token stop,
+    SES::CheckResult& result,
+    int& finished)
+{
+    result = co_await client.Check(token, application, stop);
+    ++finished;
+}
+
+bool IsCancelled(const SES::CheckResult& result)
+{
+    try
+    {
+        if (result.error)
+        {
+            std::rethrow_exception(result.error);
+        }
+    }
+    catch (const SES::CheckCancelledException&)
+    {
+        return true;
+    }
+    catch (...)
+    {
+    }
+    return false;
+}
+
+//
+// Sixteen coroutines on one thread each await a check, alternately of an
+// approved and a denied application, resumed from within Perform or, if
+// scheduled, from a queue after Perform returns, as by an application's own
+// scheduler.  Every check must get its outcome.
+//
+void ExpectOutcomes(bool scheduled)
+{
+    const int count = 16;
+
+    std::deque<std::coroutine_handle<>> ready;
+    SES::CoroutineClient::Resumer resumer;
+    if (scheduled)
+    {
+        resumer = [&ready](std::coroutine_handle<> awaiting) { ready.push_back(awaiting); };
+    }
+    SES::CoroutineClient client(WarmServer().Url(), resumer);
+
+    std::vector<SES::CheckResult> results(count);
+    int finished = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        CheckInto(client, UniqueToken(), i % 2 == 0 ? ApprovedApplication : DeniedApplication, std::stop_token(), results[i], finished);
+    }
+
+    while (finished < count)
+    {
+        client.Perform(1000);
+        while (!ready.empty())
+        {
+            std::coroutine_handle<> awaiting = ready.front();
+            ready.pop_front();
+            awaiting.resume();
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        EXPECT_EQ(i % 2 == 0, results[i].entitlement != nullptr) << "check " << i;
+    }
+}
+
+TEST(Coroutines, ResumedInline)
+{
+    ExpectOutcomes(false);
+}
+
+TEST(Coroutines, ResumedByScheduler)
+{
+    ExpectOutcomes(true);
+}
+
+//
+// A check cancelled from another thread must resume its coroutine with a
+// CheckCancelledException.
+//
+TEST(Coroutines, Cancelled)
+{
+    SES::CoroutineClient client(StalledServer().Url());
+
+    std::stop_source stop;
+    SES::CheckResult result;
+    int finished = 0;
+    CheckInto(client, UniqueToken(), ApprovedApplication, stop.get_token(), result, finished);
+
+    std::chrono::steady_clock::time_point requested;
+    std::thread canceller([&stop, &requested]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        requested = std::chrono::steady_clock::now();
+        stop.request_stop();
+    });
+
+    while (finished == 0)
+    {
+        client.Perform(1000);
+    }
+    auto resumed = std::chrono::steady_clock::now();
+    canceller.join();
+
+    EXPECT_TRUE(IsCancelled(result));
+    EXPECT_LT(resumed - requested, ResumeTolerance);
+}
+
+//
+// A check with a time limit must resume its coroutine with a timeout.
+//
+TEST(Coroutines, TimedOut)
+{
+    const std::chrono::milliseconds timeout(50);
+    SES::CoroutineClient client(StalledServer().Url());
+    client.SetTimeout(timeout);
+
+    SES::CheckResult result;
+    int finished = 0;
+    auto start = std::chrono::steady_clock::now();
+    CheckInto(client, UniqueToken(), ApprovedApplication, std::stop_token(), result, finished);
+    while (finished == 0)
+    {
+        client.Perform(1000);
+    }
+
+    EXPECT_EQ(CURLE_OPERATION_TIMEDOUT, result.curl_code);
+    EXPECT_TRUE(result.error);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, timeout + ResumeTolerance);
+}
+
+}   // anonymous namespace
@@ -0,0 +1,135 @@
+//
+// Denials remembered by the library for SetDenialLifetime, and failures that
+// must not be.
+//
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+class DenialCache : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        SES::SetDenialLifetime(std::chrono::seconds(30));
+    }
+
+    void TearDown() override
+    {
+        SES::SetDenialLifetime(std::chrono::seconds(0));
+    }
+};
+
+//
+// Whether a check of application at url was denied from the cache; fails the
+// test unless it was denied at all.
+//
+bool DeniedFromCache(const std::string& url, const std::string& token, const std::string& application)
+{
+    try
+    {
+        SES::GetEntitlement(url, token, application);
+    }
+    catch (const SES::EntitlementDeniedException& e)
+    {
+        return e.Cached();
+    }
+    ADD_FAILURE() << "Expected " << application << " to be denied";
+    return false;
+}
+
+TEST_F(DenialCache, SecondDenialIsRemembered)
+{
+    const std::string token = UniqueToken();
+    const std::uint64_t before = WarmServer().RequestCount();
+
+    EXPECT_FALSE(DeniedFromCache(WarmServer().Url(), token, DeniedApplication));
+    EXPECT_TRUE(DeniedFromCache(WarmServer().Url(), token, DeniedApplication));
+    EXPECT_EQ(1u, WarmServer().RequestCount() - before);
+}
+
+//
+// A denial is forgotten once its lifetime is over, and the server asked
+// again.
+//
+TEST_F(DenialCache, ForgottenOnceExpired)
+{
+    SES::SetDenialLifetime(std::chrono::seconds(1));
+    const std::string token = UniqueToken();
+    const std::uint64_t before = WarmServer().RequestCount();
+
+    EXPECT_FALSE(DeniedFromCache(WarmServer().Url(), token, DeniedApplication));
+    EXPECT_TRUE(DeniedFromCache(WarmServer().Url(), token, DeniedApplication));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    EXPECT_FALSE(DeniedFromCache(WarmServer().Url(), token, DeniedApplication));
+    EXPECT_EQ(2u, WarmServer().RequestCount() - before);
+}
+
+//
+// Once 4096 outcomes are remembered, the one due to be forgotten soonest
+// makes way for the next.  Denials come from a transport answering from
+// memory, so that thousands of checks take no time.
+//
+TEST_F(DenialCache, HoldsAtMost4096)
+{
+    const std::string url = "https://denial-cache.invalid/";
+    SES::Internal::SetTransport(url, SES::Internal::LoopbackTransport(std::vector<std::string>(), std::vector<x509_st*>()));
+
+    std::vector<std::string> tokens;
+    for (int i = 0; i < 4097; ++i)
+    {
+        tokens.push_back(UniqueToken());
+        EXPECT_FALSE(DeniedFromCache(url, tokens.back(), DeniedApplication));
+    }
+
+    EXPECT_TRUE(DeniedFromCache(url, tokens[1], DeniedApplication));
+    EXPECT_TRUE(DeniedFromCache(url, tokens.back(), DeniedApplication));
+    EXPECT_FALSE(DeniedFromCache(url, tokens[0], DeniedApplication));
+
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+}
+
+TEST_F(DenialCache, ServerErrorsAreNotRemembered)
+{
+    const std::string token = UniqueToken();
+    const std::uint64_t before = FailingServer().RequestCount();
+
+    for (int check = 0; check < 2; ++check)
+    {
+        SES::EntitlementResult result = SES::TryGetEntitlement(FailingServer().Url(), token, ApprovedApplication, 0);
+        EXPECT_EQ(SES::ErrorCategory::UnexpectedResponse, result.category);
+        EXPECT_FALSE(result.cached);
+    }
+    EXPECT_EQ(2u, FailingServer().RequestCount() - before);
+}
+
+//
+// Denials reach the server every time unless SetDenialLifetime says
+// otherwise.
+//
+TEST(DenialLifetime, NoneByDefault)
+{
+    const std::string token = UniqueToken();
+    const std::uint64_t before = WarmServer().RequestCount();
+
+    for (int check = 0; check < 2; ++check)
+    {
+        SES::EntitlementResult result = SES::TryGetEntitlement(WarmServer().Url(), token, DeniedApplication, 0);
+        EXPECT_EQ(SES::ErrorCategory::Denied, result.category);
+        EXPECT_FALSE(result.cached);
+    }
+    EXPECT_EQ(2u, WarmServer().RequestCount() - before);
+}
+
+}   // anonymous namespace
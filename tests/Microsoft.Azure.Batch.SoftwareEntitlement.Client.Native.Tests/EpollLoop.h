@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "SoftwareEntitlementClient.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+//
+// A minimal epoll loop, standing in for an application's own, that drives an
+// AsyncClient through UseEventLoop.
+//
+class EpollLoop
+{
+    typedef std::chrono::steady_clock Clock;
+
+    int _epoll;
+    bool _timerSet;
+    Clock::time_point _timerDue;
+
+public:
+    EpollLoop()
+        : _epoll(epoll_create1(EPOLL_CLOEXEC))
+        , _timerSet(false)
+    {
+    }
+
+    ~EpollLoop()
+    {
+        close(_epoll);
+    }
+
+    AsyncClient::EventLoop Callbacks()
+    {
+        AsyncClient::EventLoop loop;
+        loop.watchSocket = [this](AsyncClient::Socket socket, int events) { Watch(socket, events); };
+        loop.setTimer = [this](long timeout_ms)
+        {
+            _timerSet = timeout_ms >= 0;
+            _timerDue = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        };
+        return loop;
+    }
+
+    //
+    // Waits for the sockets being watched, or the timer, and tells client
+    // about those that are ready.
+    //
+    void RunOnce(AsyncClient& client)
+    {
+        //
+        // Rounded up, so as not to spin while a timer less than a
+        // millisecond away comes due.
+        //
+        int timeout = 1000;
+        if (_timerSet)
+        {
+            auto due = std::chrono::duration_cast<std::chrono::microseconds>(_timerDue - Clock::now()).count();
+            timeout = static_cast<int>(std::max<long long>(0, std::min<long long>((due + 999) / 1000, timeout)));
+        }
+
+        epoll_event ready[64];
+        int count = epoll_wait(_epoll, ready, 64, timeout);
+        for (int i = 0; i < count; ++i)
+        {
+            int events = 0;
+            if (ready[i].events & EPOLLIN)
+            {
+                events |= AsyncClient::Readable;
+            }
+            if (ready[i].events & EPOLLOUT)
+            {
+                events |= AsyncClient::Writable;
+            }
+            if (ready[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                events |= AsyncClient::SocketError;
+            }
+            client.SocketReady(ready[i].data.fd, events);
+        }
+
+        if (_timerSet && Clock::now() >= _timerDue)
+        {
+            _timerSet = false;
+            client.TimerExpired();
+        }
+    }
+
+private:
+    void Watch(int socket, int events)
+    {
+        if (events == 0)
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, socket, nullptr);
+            return;
+        }
+
+        //
+        // A socket closed without being unwatched leaves epoll on its own,
+        // and its descriptor may be reused for another, so whether to add or
+        // modify is decided by epoll rather than remembered here.
+        //
+        epoll_event watch = {};
+        watch.events = ((events & AsyncClient::Readable) ? EPOLLIN : 0)
+            | ((events & AsyncClient::Writable) ? EPOLLOUT : 0);
+        watch.data.fd = socket;
+        if (epoll_ctl(_epoll, EPOLL_CTL_MOD, socket, &watch) != 0 && errno == ENOENT)
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, socket, &watch);
+        }
+    }
+};
+
+}
+}
+}
+}
+}
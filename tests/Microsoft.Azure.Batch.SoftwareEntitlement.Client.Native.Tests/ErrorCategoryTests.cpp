@@ -0,0 +1,45 @@
+//
+// The ErrorCategory a check ends in, through GetEntitlement,
+// TryGetEntitlement and the C interface.
+//
+#include <gtest/gtest.h>
+#include "Interfaces.h"
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+TEST(ErrorCategory, None)
+{
+    EXPECT_EQ(SES::ErrorCategory::None, CategoryThroughEveryInterface(WarmServer().Url(), UniqueToken(), ApprovedApplication));
+}
+
+TEST(ErrorCategory, Denied)
+{
+    EXPECT_EQ(SES::ErrorCategory::Denied, CategoryThroughEveryInterface(WarmServer().Url(), UniqueToken(), DeniedApplication));
+}
+
+TEST(ErrorCategory, BadRequest)
+{
+    EXPECT_EQ(SES::ErrorCategory::BadRequest, CategoryThroughEveryInterface(WarmServer().Url(), "", ApprovedApplication));
+}
+
+TEST(ErrorCategory, UnexpectedResponse)
+{
+    EXPECT_EQ(SES::ErrorCategory::UnexpectedResponse, CategoryThroughEveryInterface(FailingServer().Url(), UniqueToken(), ApprovedApplication));
+}
+
+TEST(ErrorCategory, Transport)
+{
+    EXPECT_EQ(SES::ErrorCategory::Transport, CategoryThroughEveryInterface("https://localhost:1/", UniqueToken(), ApprovedApplication));
+}
+
+TEST(ErrorCategory, Internal)
+{
+    EXPECT_EQ(SES::ErrorCategory::Internal, CategoryThroughEveryInterface("http://localhost/", UniqueToken(), ApprovedApplication));
+}
+
+}   // anonymous namespace
@@ -0,0 +1,85 @@
+//
+// AsyncClient checks driven by an application's epoll loop through
+// UseEventLoop, rather than by Perform.
+//
+#include <thread>
+#include <gtest/gtest.h>
+#include "EpollLoop.h"
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// GetParam() checks at once from a single thread, alternately of an approved
+// and a denied application.
+//
+class EventLoop : public testing::TestWithParam<int>
+{
+};
+
+TEST_P(EventLoop, EveryCheckGetsItsOutcome)
+{
+    const int count = GetParam();
+    SES::AsyncClient client(WarmServer().Url());
+    EpollLoop loop;
+    client.UseEventLoop(loop.Callbacks());
+
+    int finished = 0;
+    int unexpected = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        bool approve = i % 2 == 0;
+        client.Check(UniqueToken(), approve ? ApprovedApplication : DeniedApplication, [&, approve](SES::CheckResult result)
+        {
+            ++finished;
+            if ((result.entitlement != nullptr) != approve)
+            {
+                ++unexpected;
+            }
+        });
+    }
+
+    while (client.Pending() > 0)
+    {
+        loop.RunOnce(client);
+    }
+
+    EXPECT_EQ(count, finished);
+    EXPECT_EQ(0, unexpected);
+}
+
+TEST_P(EventLoop, CallbacksRunOnTheLoopsThread)
+{
+    const int count = GetParam();
+    SES::AsyncClient client(WarmServer().Url());
+    EpollLoop loop;
+    client.UseEventLoop(loop.Callbacks());
+
+    int elsewhere = 0;
+    const auto loopThread = std::this_thread::get_id();
+    for (int i = 0; i < count; ++i)
+    {
+        client.Check(UniqueToken(), ApprovedApplication, [&](SES::CheckResult)
+        {
+            if (std::this_thread::get_id() != loopThread)
+            {
+                ++elsewhere;
+            }
+        });
+    }
+
+    while (client.Pending() > 0)
+    {
+        loop.RunOnce(client);
+    }
+
+    EXPECT_EQ(0, elsewhere);
+}
+
+INSTANTIATE_TEST_SUITE_P(Checks, EventLoop, testing::Values(1, 16, 256));
+
+}   // anonymous namespace
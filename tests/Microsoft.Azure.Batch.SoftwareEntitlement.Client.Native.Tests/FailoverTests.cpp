@@ -0,0 +1,55 @@
+//
+// Checks against an EndpointSet whose first endpoint is failing or slow.
+//
+#include <cstdint>
+#include <string>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+const int Checks = 20;
+
+//
+// Every check must succeed, and the failing endpoint be sent only the one
+// request that shows it is failing.
+//
+TEST(Failover, FailingEndpointIsAvoided)
+{
+    SES::EndpointSet endpoints;
+    endpoints.Add(FailingServer().Url());
+    endpoints.Add(WarmServer().Url());
+
+    const std::uint64_t before = FailingServer().RequestCount();
+    for (int check = 0; check < Checks; ++check)
+    {
+        SES::EntitlementResult result = SES::TryGetEntitlement(endpoints, UniqueToken(), ApprovedApplication, 1);
+        ASSERT_EQ(SES::ErrorCategory::None, result.category) << result.Message();
+    }
+    EXPECT_EQ(1u, FailingServer().RequestCount() - before);
+}
+
+//
+// Every check must succeed, and the endpoint 20ms slower than the other be
+// sent only the one request that shows it is slower.
+//
+TEST(Failover, SlowerEndpointIsAvoided)
+{
+    SES::EndpointSet endpoints;
+    endpoints.Add(SlowServer().Url());
+    endpoints.Add(WarmServer().Url());
+
+    const std::uint64_t before = SlowServer().RequestCount();
+    for (int check = 0; check < Checks; ++check)
+    {
+        SES::EntitlementResult result = SES::TryGetEntitlement(endpoints, UniqueToken(), ApprovedApplication);
+        ASSERT_EQ(SES::ErrorCategory::None, result.category) << result.Message();
+    }
+    EXPECT_LE(SlowServer().RequestCount() - before, 1u);
+}
+
+}   // anonymous namespace
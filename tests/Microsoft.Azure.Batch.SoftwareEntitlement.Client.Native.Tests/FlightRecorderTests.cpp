@@ -0,0 +1,200 @@
+//
+// The flight recorder: the requests it records, the file it dumps failed
+// checks to, and the tokens it must never keep.
+//
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientC.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// The digest of a token the flight recorder keeps in its place.
+//
+std::string TokenDigest(const std::string& token)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    EVP_Digest(token.data(), token.size(), hash, &size, EVP_sha256(), nullptr);
+
+    std::string digest;
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        char digits[3];
+        std::snprintf(digits, sizeof(digits), "%02x", hash[i]);
+        digest += digits;
+    }
+    return digest;
+}
+
+//
+// Checks an approved application against the cold stand-in, then against
+// the one answering 503, with the flight recorder dumping to a file of the
+// test's own.
+//
+class FlightRecorder : public testing::Test
+{
+protected:
+    std::string _dumpPath;
+    std::string _token;
+
+    void SetUp() override
+    {
+        _dumpPath = testing::TempDir() + "sesclient-flight-recorder-" + std::to_string(getpid()) + ".log";
+        std::remove(_dumpPath.c_str());
+        setenv("AZ_BATCH_SES_FLIGHT_RECORDER", _dumpPath.c_str(), 1);
+
+        _token = UniqueToken();
+        SES::TryGetEntitlement(ColdServer().Url(), _token, ApprovedApplication, 0);
+        SES::TryGetEntitlement(FailingServer().Url(), _token, ApprovedApplication, 0);
+    }
+
+    void TearDown() override
+    {
+        unsetenv("AZ_BATCH_SES_FLIGHT_RECORDER");
+        std::remove(_dumpPath.c_str());
+    }
+
+    std::string Dump() const
+    {
+        std::ifstream file(_dumpPath);
+        return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+};
+
+TEST_F(FlightRecorder, RecordsBothRequests)
+{
+    std::vector<SES::RequestRecord> records = SES::RecentRequests();
+    ASSERT_GE(records.size(), 2u);
+
+    const SES::RequestRecord& granted = records[records.size() - 2];
+    EXPECT_EQ(ColdServer().Url(), granted.endpoint);
+    EXPECT_EQ(SES::ErrorCategory::None, granted.category);
+    EXPECT_EQ(200, granted.http_status);
+    EXPECT_NE(SES::PinCheck::Failed, granted.pin_check);
+    EXPECT_GT(granted.tls_handshake_us, 0);
+
+    const SES::RequestRecord& failed = records.back();
+    EXPECT_EQ(FailingServer().Url(), failed.endpoint);
+    EXPECT_EQ(SES::ErrorCategory::UnexpectedResponse, failed.category);
+    EXPECT_EQ(503, failed.http_status);
+    EXPECT_EQ(1, failed.attempt);
+
+    for (const SES::RequestRecord* record : { &granted, &failed })
+    {
+        EXPECT_EQ(ApprovedApplication, record->application);
+        EXPECT_EQ(TokenDigest(_token), record->token_digest);
+        EXPECT_GT(record->started_us, 0);
+        EXPECT_GT(record->total_us, 0);
+    }
+}
+
+TEST_F(FlightRecorder, DumpsTheFailedCheck)
+{
+    std::string dump = Dump();
+    EXPECT_NE(std::string::npos, dump.find("endpoint=" + FailingServer().Url()));
+    EXPECT_NE(std::string::npos, dump.find("category=UnexpectedResponse"));
+}
+
+TEST_F(FlightRecorder, NeverKeepsTheToken)
+{
+    EXPECT_EQ(std::string::npos, SES::DescribeRecentRequests().find(_token));
+    EXPECT_EQ(std::string::npos, Dump().find(_token));
+}
+
+TEST_F(FlightRecorder, DescribedAlikeThroughTheCInterface)
+{
+    std::string description = SES::DescribeRecentRequests();
+    std::vector<char> buffer(description.size() + 1);
+    EXPECT_EQ(description.size(), ses_describe_recent_requests(buffer.data(), buffer.size()));
+    EXPECT_EQ(description, buffer.data());
+}
+
+//
+// The first connection to a stand-in of its own cannot resume a TLS session,
+// so it must be recorded passing the pin checks.
+//
+TEST_F(FlightRecorder, NewConnectionsPassThePinChecks)
+{
+    SES::StandIn::Server server(Certificates(), SES::StandIn::ServerOptions());
+    SES::TryGetEntitlement(server.Url(), UniqueToken(), ApprovedApplication, 0);
+
+    std::vector<SES::RequestRecord> records = SES::RecentRequests();
+    ASSERT_FALSE(records.empty());
+    EXPECT_EQ(server.Url(), records.back().endpoint);
+    EXPECT_EQ(SES::PinCheck::Passed, records.back().pin_check);
+}
+
+//
+// A dump to a FIFO that nothing reads yet cannot be written, and holds up
+// the call whose check failed.  A call that joined the check must return
+// regardless, with the same failure.
+//
+TEST(FlightRecorderDump, JoinedChecksDoNotWaitForIt)
+{
+    const std::string fifo = testing::TempDir() + "sesclient-flight-recorder-" + std::to_string(getpid()) + ".fifo";
+    std::remove(fifo.c_str());
+    ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600));
+    setenv("AZ_BATCH_SES_FLIGHT_RECORDER", fifo.c_str(), 1);
+
+    const std::string url = "https://flight-recorder-dump.invalid/";
+    std::shared_ptr<std::atomic<int>> requests = std::make_shared<std::atomic<int>>(0);
+    SES::Internal::SetTransport(url, [requests](
+        const SES::Internal::TransportRequest&,
+        SES::Internal::TransportResponse& response,
+        SES::Internal::Cancellation*)
+    {
+        ++*requests;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        response.category = SES::ErrorCategory::None;
+        response.http_status = 503;
+    });
+
+    const std::string token = UniqueToken();
+    SES::ErrorCategory failed = SES::ErrorCategory::None;
+    std::thread checking([&]()
+    {
+        failed = SES::TryGetEntitlement(url, token, ApprovedApplication, 0).category;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::future<SES::ErrorCategory> joined = std::async(std::launch::async, [&]()
+    {
+        return SES::TryGetEntitlement(url, token, ApprovedApplication, 0).category;
+    });
+    EXPECT_EQ(std::future_status::ready, joined.wait_for(std::chrono::seconds(5)));
+
+    std::ifstream reader(fifo);
+    std::string dump((std::istreambuf_iterator<char>(reader)), std::istreambuf_iterator<char>());
+    checking.join();
+
+    EXPECT_EQ(SES::ErrorCategory::UnexpectedResponse, joined.get());
+    EXPECT_EQ(SES::ErrorCategory::UnexpectedResponse, failed);
+    EXPECT_EQ(1, requests->load());
+    EXPECT_NE(std::string::npos, dump.find("endpoint=" + url));
+
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+    unsetenv("AZ_BATCH_SES_FLIGHT_RECORDER");
+    std::remove(fifo.c_str());
+}
+
+}   // anonymous namespace
@@ -0,0 +1,40 @@
+//
+// GetEntitlement against stand-ins that close every connection and that keep
+// them open, with the full validation of the server's chain on every check.
+//
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+TEST(GetEntitlement, ApprovesOnNewConnections)
+{
+    for (int check = 0; check < 3; ++check)
+    {
+        auto entitlement = SES::GetEntitlement(ColdServer().Url(), UniqueToken(), ApprovedApplication);
+        ASSERT_NE(nullptr, entitlement);
+        EXPECT_FALSE(entitlement->Id().empty());
+    }
+}
+
+TEST(GetEntitlement, ApprovesOnKeptConnections)
+{
+    for (int check = 0; check < 3; ++check)
+    {
+        auto entitlement = SES::GetEntitlement(WarmServer().Url(), UniqueToken(), ApprovedApplication);
+        ASSERT_NE(nullptr, entitlement);
+        EXPECT_FALSE(entitlement->Id().empty());
+    }
+}
+
+TEST(GetEntitlement, ThrowsForDenial)
+{
+    EXPECT_THROW(SES::GetEntitlement(ColdServer().Url(), UniqueToken(), DeniedApplication), SES::EntitlementDeniedException);
+    EXPECT_THROW(SES::GetEntitlement(WarmServer().Url(), UniqueToken(), DeniedApplication), SES::EntitlementDeniedException);
+}
+
+}   // anonymous namespace
@@ -0,0 +1,59 @@
+#include "Interfaces.h"
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClientC.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+ErrorCategory CategoryThroughEveryInterface(
+    const std::string& url,
+    const std::string& token,
+    const std::string& application)
+{
+    EntitlementResult result = TryGetEntitlement(url, token, application, 0);
+    if (result.category != ErrorCategory::None)
+    {
+        EXPECT_FALSE(result.Message().empty()) << "checking " << application << " at " << url;
+    }
+
+    ses_result* c = ses_get_entitlement(url.c_str(), token.c_str(), application.c_str(), 0);
+    EXPECT_NE(nullptr, c);
+    if (c != nullptr)
+    {
+        EXPECT_EQ(static_cast<ses_error_category>(result.category), ses_result_category(c)) << "checking " << application << " at " << url;
+        EXPECT_EQ(result.http_status, ses_result_http_status(c));
+        EXPECT_EQ(result.entitlement != nullptr, ses_result_entitlement_id(c) != nullptr);
+        ses_result_free(c);
+    }
+
+    //
+    // libcurl's messages include how long the attempt took, so may differ.
+    //
+    bool sameMessage = result.category != ErrorCategory::Transport && result.category != ErrorCategory::Timeout;
+
+    bool thrown = false;
+    try
+    {
+        GetEntitlement(url, token, application, 0);
+    }
+    catch (const Exception& e)
+    {
+        thrown = true;
+        if (sameMessage)
+        {
+            EXPECT_EQ(result.Message(), e.what());
+        }
+    }
+    EXPECT_EQ(result.category != ErrorCategory::None, thrown) << "checking " << application << " at " << url;
+
+    return result.category;
+}
+
+}
+}
+}
+}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include "SoftwareEntitlementClient.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+//
+// Checks application at url, without retrying, through TryGetEntitlement,
+// the C interface and GetEntitlement, and returns the category the check
+// ended in.  Fails the test if the interfaces disagree on the outcome, or a
+// failure comes without a message.
+//
+ErrorCategory CategoryThroughEveryInterface(
+    const std::string& url,
+    const std::string& token,
+    const std::string& application);
+
+}
+}
+}
+}
+}
@@ -0,0 +1,233 @@
+//
+// Leases of an entitlement, held directly through Lease and for the life of
+// a command through 'sesclient.native --exec'.
+//
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+extern char** environ;
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+TEST(Lease, AcquiredRenewedAndReleasedOnce)
+{
+    SES::StandIn::Server& server = WarmServer();
+    const std::uint64_t acquired = server.AcquireCount();
+    const std::uint64_t renewed = server.RenewCount();
+    const std::uint64_t released = server.ReleaseCount();
+
+    SES::Lease lease(server.Url(), UniqueToken(), ApprovedApplication, std::chrono::seconds(60), LeaseApiVersion);
+    EXPECT_FALSE(lease.Id().empty());
+    EXPECT_FALSE(lease.Expiry().empty());
+    lease.Renew(std::chrono::seconds(60));
+    lease.Release();
+
+    EXPECT_EQ(1u, server.AcquireCount() - acquired);
+    EXPECT_EQ(1u, server.RenewCount() - renewed);
+    EXPECT_EQ(1u, server.ReleaseCount() - released);
+}
+
+TEST(Lease, LostOnceReleased)
+{
+    SES::Lease lease(WarmServer().Url(), UniqueToken(), ApprovedApplication, std::chrono::seconds(60), LeaseApiVersion);
+    lease.Release();
+    EXPECT_THROW(lease.Renew(std::chrono::seconds(60)), SES::LeaseLostException);
+}
+
+TEST(Lease, DeniedForADeniedApplication)
+{
+    EXPECT_THROW(
+        SES::Lease(WarmServer().Url(), UniqueToken(), DeniedApplication, std::chrono::seconds(60), LeaseApiVersion),
+        SES::EntitlementDeniedException);
+}
+
+//
+// No released version of the service offers leases, so there is no
+// api-version to assume; without one, no request is made.
+//
+TEST(Lease, NeedsAnApiVersion)
+{
+    SES::StandIn::Server& server = WarmServer();
+    const std::uint64_t requests = server.RequestCount();
+
+    EXPECT_THROW(
+        SES::Lease(server.Url(), UniqueToken(), ApprovedApplication, std::chrono::seconds(60), ""),
+        SES::Exception);
+    EXPECT_EQ(requests, server.RequestCount());
+}
+
+//
+// A server, stood in for by a transport, that gives the lease an identifier
+// with characters that mean something in a URL.  The renewal and release
+// must both address the lease by it, percent-encoded, and every request be
+// made under the api-version given.
+//
+TEST(Lease, AddressedByItsEscapedId)
+{
+    const std::string url = "https://lease-id.invalid/";
+    std::shared_ptr<std::vector<std::string>> paths = std::make_shared<std::vector<std::string>>();
+    std::shared_ptr<std::vector<std::string>> queries = std::make_shared<std::vector<std::string>>();
+    SES::Internal::SetTransport(url, [paths, queries](
+        const SES::Internal::TransportRequest& request,
+        SES::Internal::TransportResponse& response,
+        SES::Internal::Cancellation*)
+    {
+        std::string::size_type query = request.path.find('?');
+        paths->push_back(request.path.substr(0, query));
+        queries->push_back(query == std::string::npos ? std::string() : request.path.substr(query + 1));
+        response.category = SES::ErrorCategory::None;
+        if (request.method != nullptr)
+        {
+            response.http_status = 204;
+        }
+        else if (paths->size() == 1)
+        {
+            response.http_status = 200;
+            response.body = "{\"entitlementId\":\"a/b?c#d %\",\"initialExpiryTime\":\"9999-12-31T23:59:59Z\"}";
+        }
+        else
+        {
+            response.http_status = 200;
+            response.body = "{\"expiryTime\":\"9999-12-31T23:59:59Z\"}";
+        }
+    });
+
+    {
+        SES::Lease lease(url, UniqueToken(), ApprovedApplication, std::chrono::seconds(60), "2099-01-01.1.0");
+        lease.Renew(std::chrono::seconds(60));
+        lease.Release();
+        EXPECT_EQ("a/b?c#d %", lease.Id());
+    }
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+
+    const std::string expected = "softwareEntitlements/a%2Fb%3Fc%23d%20%25";
+    ASSERT_EQ(3u, paths->size());
+    EXPECT_EQ(expected, (*paths)[1]);
+    EXPECT_EQ(expected, (*paths)[2]);
+    for (const auto& query : *queries)
+    {
+        EXPECT_EQ("api-version=2099-01-01.1.0", query);
+    }
+}
+
+//
+// Starts command under 'sesclient.native --exec' against the warm stand-in,
+// with one-second leases under apiVersion (none if empty), returning the
+// wrapper's process id.
+//
+pid_t Exec(const std::string& command, const std::string& apiVersion = LeaseApiVersion)
+{
+    std::vector<std::string> arguments = {
+        SES_CLIENT_NATIVE,
+        "--url", WarmServer().Url(),
+        "--token", UniqueToken(),
+        "--application", ApprovedApplication,
+        "--thumbprint", Certificates().IntermediateThumbprint(),
+        "--common-name", Certificates().IntermediateCommonName(),
+        "--lease", "1"
+    };
+    if (!apiVersion.empty())
+    {
+        arguments.push_back("--lease-api-version");
+        arguments.push_back(apiVersion);
+    }
+    const std::string tail[] = { "--exec", "--", "/bin/sh", "-c", command };
+    arguments.insert(arguments.end(), std::begin(tail), std::end(tail));
+    std::vector<char*> argv;
+    for (const auto& argument : arguments)
+    {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = 0;
+    EXPECT_EQ(0, posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ));
+    return pid;
+}
+
+int ExitCodeOf(pid_t pid)
+{
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//
+// A command that outlives its first lease must have it renewed, and the
+// wrapper return its exit code once the lease is released.
+//
+TEST(Exec, ReturnsTheCommandsExitCode)
+{
+    SES::StandIn::Server& server = WarmServer();
+    const std::uint64_t acquired = server.AcquireCount();
+    const std::uint64_t renewed = server.RenewCount();
+    const std::uint64_t released = server.ReleaseCount();
+
+    pid_t pid = Exec("sleep 1.5; exit 7");
+    ASSERT_NE(0, pid);
+
+    EXPECT_EQ(7, ExitCodeOf(pid));
+    EXPECT_EQ(1u, server.AcquireCount() - acquired);
+    EXPECT_LT(0u, server.RenewCount() - renewed);
+    EXPECT_EQ(1u, server.ReleaseCount() - released);
+}
+
+//
+// SIGTERM sent to the wrapper must be passed on to the command, and the
+// lease released.
+//
+TEST(Exec, PassesOnSigterm)
+{
+    SES::StandIn::Server& server = WarmServer();
+    const std::uint64_t acquired = server.AcquireCount();
+    const std::uint64_t released = server.ReleaseCount();
+
+    pid_t pid = Exec("sleep 10");
+    ASSERT_NE(0, pid);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.AcquireCount() == acquired && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    kill(pid, SIGTERM);
+
+    EXPECT_EQ(128 + SIGTERM, ExitCodeOf(pid));
+    EXPECT_EQ(1u, server.AcquireCount() - acquired);
+    EXPECT_EQ(1u, server.ReleaseCount() - released);
+}
+
+//
+// Without --lease-api-version, the wrapper refuses to start, and the command
+// never runs.
+//
+TEST(Exec, NeedsALeaseApiVersion)
+{
+    SES::StandIn::Server& server = WarmServer();
+    const std::uint64_t acquired = server.AcquireCount();
+
+    pid_t pid = Exec("exit 7", "");
+    ASSERT_NE(0, pid);
+
+    int exitCode = ExitCodeOf(pid);
+    EXPECT_NE(0, exitCode);
+    EXPECT_NE(7, exitCode);
+    EXPECT_EQ(acquired, server.AcquireCount());
+}
+
+}   // anonymous namespace
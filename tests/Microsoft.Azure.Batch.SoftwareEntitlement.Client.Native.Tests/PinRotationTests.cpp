@@ -0,0 +1,88 @@
+//
+// Verifying the server's chain against the pinned certificates, including
+// while certificates are being pinned on another thread.
+//
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// Several threads verify the stand-ins' chain while another pins a new
+// certificate after every verification, as a long-lived process rotating its
+// pins would.  No verification may fail.
+//
+TEST(PinRotation, VerificationNeverFailsWhilePinning)
+{
+    const int verifiers = 4;
+    const int verifications = 2000;
+
+    std::unique_ptr<STACK_OF(X509), void(*)(STACK_OF(X509)*)> chain(sk_X509_new_null(), [](STACK_OF(X509)* c) { sk_X509_free(c); });
+    sk_X509_push(chain.get(), Certificates().ServerCertificate());
+    sk_X509_push(chain.get(), Certificates().IntermediateCertificate());
+    sk_X509_push(chain.get(), Certificates().RootCertificate());
+
+    std::atomic<int> running(verifiers);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < verifiers; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            for (int verification = 0; verification < verifications; ++verification)
+            {
+                try
+                {
+                    SES::Internal::VerifyCertificateChain(chain.get(), "https://localhost/");
+                }
+                catch (const SES::Exception&)
+                {
+                    ++failures;
+                }
+            }
+            --running;
+        });
+    }
+
+    unsigned pins = 0;
+    while (running > 0)
+    {
+        char thumbprint[41];
+        std::snprintf(thumbprint, sizeof(thumbprint), "%040x", ++pins);
+        SES::AddSslCertificate(thumbprint, "Rotated test certificate");
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    EXPECT_EQ(0, failures.load());
+    EXPECT_GT(pins, 0u);
+}
+
+//
+// With X509_V_FLAG_PARTIAL_CHAIN, a chain verified against an intermediate
+// trusted in the store ends at that intermediate; when it is the one
+// pinned, the chain must be accepted.
+//
+TEST(PinnedCertificate, AcceptedAsTheAnchorOfTheChain)
+{
+    std::unique_ptr<STACK_OF(X509), void(*)(STACK_OF(X509)*)> chain(sk_X509_new_null(), [](STACK_OF(X509)* c) { sk_X509_free(c); });
+    sk_X509_push(chain.get(), Certificates().ServerCertificate());
+    sk_X509_push(chain.get(), Certificates().IntermediateCertificate());
+
+    EXPECT_NO_THROW(SES::Internal::VerifyCertificateChain(chain.get(), "https://localhost/"));
+}
+
+}   // anonymous namespace
@@ -0,0 +1,104 @@
+//
+// The ids each request and its response are recorded with, and the split of
+// a request's time between the server and the network that the server's
+// Server-Timing header allows.
+//
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// The flight recorder's record of the last request, which must have gone to
+// url.
+//
+SES::RequestRecord LastRequest(const std::string& url)
+{
+    std::vector<SES::RequestRecord> records = SES::RecentRequests();
+    EXPECT_FALSE(records.empty());
+    if (records.empty())
+    {
+        return SES::RequestRecord();
+    }
+    EXPECT_EQ(url, records.back().endpoint);
+    return records.back();
+}
+
+//
+// Every request is sent with a client request id of its own, a version 4
+// UUID, and recorded with it and the stand-in's request id.
+//
+TEST(ServerTiming, EveryRequestIsIdentified)
+{
+    const std::string url = SlowServer().Url();
+    std::string lastClientRequestId;
+    for (int i = 0; i < 3; ++i)
+    {
+        ASSERT_EQ(SES::ErrorCategory::None, SES::TryGetEntitlement(url, UniqueToken(), ApprovedApplication, 0).category);
+
+        SES::RequestRecord record = LastRequest(url);
+        ASSERT_EQ(36u, record.client_request_id.size());
+        EXPECT_EQ('4', record.client_request_id[14]);
+        EXPECT_NE(lastClientRequestId, record.client_request_id);
+        EXPECT_EQ(36u, record.request_id.size());
+        EXPECT_NE(std::string::npos, SES::DescribeRecentRequests().find("client_request_id=" + record.client_request_id));
+        lastClientRequestId = record.client_request_id;
+    }
+}
+
+//
+// The stand-in that responds after 20ms says so in its Server-Timing, which
+// must be put down to the server, within the time to the first byte.
+//
+TEST(ServerTiming, ServersTimeIsRecorded)
+{
+    const std::string url = SlowServer().Url();
+    ASSERT_EQ(SES::ErrorCategory::None, SES::TryGetEntitlement(url, UniqueToken(), ApprovedApplication, 0).category);
+
+    SES::RequestRecord record = LastRequest(url);
+    EXPECT_GE(record.server_us, 20000);
+    EXPECT_GE(record.network_us, 0);
+    EXPECT_LE(record.server_us + record.network_us, record.first_byte_us);
+}
+
+//
+// A server, stood in for by a transport, whose Server-Timing gives a total
+// and other metrics: the total is the server's time, and the rest of the
+// latency the network's.
+//
+TEST(ServerTiming, RestOfTheLatencyIsTheNetworks)
+{
+    const std::string url = "https://server-timing.invalid/";
+    SES::Internal::SetTransport(url, [](
+        const SES::Internal::TransportRequest&,
+        SES::Internal::TransportResponse& response,
+        SES::Internal::Cancellation*)
+    {
+        response.category = SES::ErrorCategory::None;
+        response.http_status = 200;
+        response.body = "{\"id\":\"entitlement\",\"vmid\":\"timed\"}";
+        response.request_id = "timed-request";
+        response.server_timing = "db;dur=30, total;dur=12.5, app;desc=\"render\";dur=8";
+        response.server_latency_us = 20000;
+    });
+
+    SES::EntitlementResult result = SES::TryGetEntitlement(url, UniqueToken(), ApprovedApplication, 0);
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+    ASSERT_EQ(SES::ErrorCategory::None, result.category);
+
+    SES::RequestRecord record = LastRequest(url);
+    EXPECT_EQ("timed-request", record.request_id);
+    EXPECT_EQ(12500, record.server_us);
+    EXPECT_EQ(7500, record.network_us);
+}
+
+}   // anonymous namespace
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+//
+// Listens on the loopback interface without ever accepting, so that the
+// kernel completes the TCP handshake of the clients connecting but they
+// never get past the TLS handshake.
+//
+class SilentListener
+{
+    int _socket;
+    int _port;
+
+public:
+    SilentListener()
+        : _socket(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+        , _port(0)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (_socket < 0
+            || bind(_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(_socket, 64) != 0
+            || getsockname(_socket, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+        {
+            throw std::runtime_error("Failed to open a listening socket");
+        }
+        _port = ntohs(address.sin_port);
+    }
+
+    ~SilentListener()
+    {
+        close(_socket);
+    }
+
+    SilentListener(const SilentListener&) = delete;
+    SilentListener& operator=(const SilentListener&) = delete;
+
+    std::string Url() const
+    {
+        return "https://127.0.0.1:" + std::to_string(_port) + "/";
+    }
+
+    //
+    // Closes the connections abandoned by the clients, so that the backlog
+    // never fills.
+    //
+    void Drain()
+    {
+        int connection;
+        while ((connection = accept(_socket, nullptr, nullptr)) >= 0)
+        {
+            close(connection);
+        }
+    }
+};
+
+}
+}
+}
+}
+}
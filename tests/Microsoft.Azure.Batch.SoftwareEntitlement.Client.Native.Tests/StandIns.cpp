@@ -0,0 +1,136 @@
+#include "StandIns.h"
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+namespace {
+
+std::mutex s_lock;
+unsigned s_tokens = 0;
+
+std::unique_ptr<StandIn::TestCertificates> s_certificates;
+std::unique_ptr<StandIn::Server> s_coldServer;
+std::unique_ptr<StandIn::Server> s_warmServer;
+std::unique_ptr<StandIn::Server> s_slowServer;
+std::unique_ptr<StandIn::Server> s_coalescingServer;
+std::unique_ptr<StandIn::Server> s_failingServer;
+std::unique_ptr<StandIn::Server> s_stalledServer;
+
+//
+// Options approving ApprovedApplication only, served by a thread per core.
+//
+StandIn::ServerOptions ApprovingOptions()
+{
+    StandIn::ServerOptions options;
+    options.approvedApplications.clear();
+    options.approvedApplications.insert(ApprovedApplication);
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+    return options;
+}
+
+StandIn::Server& Started(std::unique_ptr<StandIn::Server>& server, const StandIn::ServerOptions& options)
+{
+    std::lock_guard<std::mutex> lock(s_lock);
+    if (!server)
+    {
+        server.reset(new StandIn::Server(*s_certificates, options));
+    }
+    return *server;
+}
+
+//
+// Trusts and pins the certificates before the first test, and stops the
+// stand-ins after the last.
+//
+class StandInEnvironment : public testing::Environment
+{
+public:
+    void SetUp() override
+    {
+        s_certificates.reset(new StandIn::TestCertificates());
+        setenv("AZ_BATCH_SES_CURLOPT_CAINFO", s_certificates->RootCertificatePath().c_str(), 1);
+        AddSslCertificate(s_certificates->IntermediateThumbprint(), s_certificates->IntermediateCommonName());
+    }
+
+    void TearDown() override
+    {
+        s_stalledServer.reset();
+        s_failingServer.reset();
+        s_coalescingServer.reset();
+        s_slowServer.reset();
+        s_warmServer.reset();
+        s_coldServer.reset();
+        s_certificates.reset();
+    }
+};
+
+const testing::Environment* const s_environment = testing::AddGlobalTestEnvironment(new StandInEnvironment());
+
+}   // anonymous namespace
+
+std::string UniqueToken()
+{
+    std::lock_guard<std::mutex> lock(s_lock);
+    return "test-token" + std::to_string(++s_tokens);
+}
+
+const StandIn::TestCertificates& Certificates()
+{
+    return *s_certificates;
+}
+
+StandIn::Server& ColdServer()
+{
+    StandIn::ServerOptions options = ApprovingOptions();
+    options.connectionMode = StandIn::ServerOptions::ConnectionMode::Close;
+    return Started(s_coldServer, options);
+}
+
+StandIn::Server& WarmServer()
+{
+    return Started(s_warmServer, ApprovingOptions());
+}
+
+StandIn::Server& SlowServer()
+{
+    StandIn::ServerOptions options;
+    options.latency = StandIn::LatencyDistribution::Parse("fixed:20");
+    return Started(s_slowServer, options);
+}
+
+StandIn::Server& CoalescingServer()
+{
+    StandIn::ServerOptions options = ApprovingOptions();
+    options.latency = StandIn::LatencyDistribution::Parse("fixed:200");
+    return Started(s_coalescingServer, options);
+}
+
+StandIn::Server& FailingServer()
+{
+    StandIn::ServerOptions options;
+    options.errorProbability = 1;
+    return Started(s_failingServer, options);
+}
+
+StandIn::Server& StalledServer()
+{
+    StandIn::ServerOptions options;
+    options.latency = StandIn::LatencyDistribution::Parse("fixed:5000");
+    return Started(s_stalledServer, options);
+}
+
+}
+}
+}
+}
+}
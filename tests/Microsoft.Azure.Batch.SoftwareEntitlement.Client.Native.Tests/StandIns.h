@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include "Server.h"
+
+namespace Microsoft {
+namespace Azure {
+namespace Batch {
+namespace SoftwareEntitlement {
+namespace Tests {
+
+//
+// The only application the stand-ins approve, unless stated otherwise, and
+// one they deny.
+//
+const char* const ApprovedApplication = "contosoapp";
+const char* const DeniedApplication = "fabrikamapp";
+
+//
+// The api-version the stand-ins offer leases under.
+//
+const char* const LeaseApiVersion = "9999-09-09.99.99";
+
+//
+// A token no check has used yet in this process, so that no check with it
+// is answered from the library's caches or joins another test's check.
+//
+std::string UniqueToken();
+
+//
+// The throw-away certificate hierarchy every stand-in serves with.  Its
+// root is trusted through AZ_BATCH_SES_CURLOPT_CAINFO, and its intermediate
+// pinned, before the first test runs.
+//
+const StandIn::TestCertificates& Certificates();
+
+//
+// Stand-ins for the service on the loopback interface, each started by the
+// first test to use it and stopped once every test has run.
+//
+
+//
+// Closes the connection after every response.
+//
+StandIn::Server& ColdServer();
+
+//
+// Keeps connections open for the client to reuse.
+//
+StandIn::Server& WarmServer();
+
+//
+// Approves every application after 20ms.
+//
+StandIn::Server& SlowServer();
+
+//
+// Approves ApprovedApplication after 200ms, long enough for every thread of
+// a test to have made its check before the first response.
+//
+StandIn::Server& CoalescingServer();
+
+//
+// Answers every request with a 503.
+//
+StandIn::Server& FailingServer();
+
+//
+// Responds after five seconds, long after any check against it should have
+// been cancelled or timed out.
+//
+StandIn::Server& StalledServer();
+
+}
+}
+}
+}
+}
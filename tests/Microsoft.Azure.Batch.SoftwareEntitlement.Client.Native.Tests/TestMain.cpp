@@ -0,0 +1,31 @@
+//
+// Behaviour tests of the native client library, against local HTTPS
+// stand-ins for the service and, where timing must not decide the outcome,
+// transports of the tests' own.
+//
+#include <csignal>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+
+    //
+    // A client that gives up on a connection must not take a stand-in down
+    // with it.
+    //
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int err = SES::Init();
+    if (err != 0)
+    {
+        return err;
+    }
+
+    int result = RUN_ALL_TESTS();
+    SES::Cleanup();
+    return result;
+}
@@ -0,0 +1,74 @@
+//
+// AsyncClient callbacks that throw, through Perform and through an
+// application's event loop.
+//
+#include <stdexcept>
+#include <gtest/gtest.h>
+#include "EpollLoop.h"
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// Makes eight checks whose first callback to run throws, driving the client
+// with Perform or, if loop is not nullptr, through it.  Every callback must
+// still be invoked, and the exception rethrown once.
+//
+void ExpectEveryCallbackAndOneException(SES::AsyncClient& client, EpollLoop* loop)
+{
+    const int count = 8;
+    int finished = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        client.Check(UniqueToken(), ApprovedApplication, [&finished](SES::CheckResult)
+        {
+            if (finished++ == 0)
+            {
+                throw std::runtime_error("Callback failed");
+            }
+        });
+    }
+
+    int thrown = 0;
+    while (client.Pending() > 0)
+    {
+        try
+        {
+            if (loop != nullptr)
+            {
+                loop->RunOnce(client);
+            }
+            else
+            {
+                client.Perform(1000);
+            }
+        }
+        catch (const std::runtime_error&)
+        {
+            ++thrown;
+        }
+    }
+
+    EXPECT_EQ(count, finished);
+    EXPECT_EQ(1, thrown);
+}
+
+TEST(ThrowingCallback, RethrownOnceByPerform)
+{
+    SES::AsyncClient client(WarmServer().Url());
+    ExpectEveryCallbackAndOneException(client, nullptr);
+}
+
+TEST(ThrowingCallback, RethrownOnceThroughEventLoop)
+{
+    SES::AsyncClient client(WarmServer().Url());
+    EpollLoop loop;
+    client.UseEventLoop(loop.Callbacks());
+    ExpectEveryCallbackAndOneException(client, &loop);
+}
+
+}   // anonymous namespace
@@ -0,0 +1,119 @@
+//
+// The local pre-check of unencrypted tokens, and the cap a token's expiry
+// puts on how long its entitlements are remembered.
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/evp.h>
+#include <gtest/gtest.h>
+#include "Interfaces.h"
+#include "SoftwareEntitlementClient.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// A signed but unencrypted token for application, unique to the test,
+// valid from notBefore until expires (seconds since the epoch).  The
+// stand-ins never check its signature.
+//
+std::string JwsToken(std::time_t notBefore, std::time_t expires, const char* application)
+{
+    auto encode = [](const std::string& text) -> std::string
+    {
+        std::vector<unsigned char> encoded(4 * ((text.size() + 2) / 3) + 1);
+        int length = EVP_EncodeBlock(encoded.data(), reinterpret_cast<const unsigned char*>(text.data()), static_cast<int>(text.size()));
+        std::string base64url(encoded.begin(), encoded.begin() + length);
+        base64url.erase(base64url.find_last_not_of('=') + 1);
+        std::replace(base64url.begin(), base64url.end(), '+', '-');
+        std::replace(base64url.begin(), base64url.end(), '/', '_');
+        return base64url;
+    };
+
+    const std::string claims = "{\"id\":\"" + UniqueToken() + "\",\"app\":[\"" + application + "\"]"
+        + ",\"nbf\":" + std::to_string(notBefore)
+        + ",\"exp\":" + std::to_string(expires) + "}";
+    return encode(R"({"alg":"RS256","typ":"JWT"})") + '.' + encode(claims) + '.' + encode(std::string(256, 's'));
+}
+
+class TokenPreCheck : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        SES::SetTokenPreCheck(true);
+    }
+
+    void TearDown() override
+    {
+        SES::SetTokenPreCheck(false);
+    }
+};
+
+//
+// Tokens that have expired, are not yet valid, or are for another
+// application fail as UnusableToken through every interface, Prefetch
+// included, without reaching the server.
+//
+TEST_F(TokenPreCheck, UnusableTokensNeverReachTheServer)
+{
+    const std::time_t now = std::time(nullptr);
+    const std::string unusable[] = {
+        JwsToken(now - 3600, now - 600, ApprovedApplication),
+        JwsToken(now + 600, now + 3600, ApprovedApplication),
+        JwsToken(now, now + 3600, DeniedApplication),
+    };
+
+    const std::uint64_t before = WarmServer().RequestCount();
+    for (const auto& token : unusable)
+    {
+        EXPECT_EQ(SES::ErrorCategory::UnusableToken, CategoryThroughEveryInterface(WarmServer().Url(), token, ApprovedApplication));
+    }
+
+    std::vector<SES::CheckResult> prefetched = SES::Prefetch(WarmServer().Url(), unusable[0], std::vector<std::string>(1, ApprovedApplication));
+    ASSERT_EQ(1u, prefetched.size());
+    EXPECT_FALSE(prefetched[0].entitlement);
+    EXPECT_TRUE(prefetched[0].error);
+
+    EXPECT_EQ(before, WarmServer().RequestCount());
+}
+
+TEST_F(TokenPreCheck, UsableTokenIsCheckedWithTheServer)
+{
+    const std::time_t now = std::time(nullptr);
+    const std::uint64_t before = WarmServer().RequestCount();
+
+    EXPECT_EQ(SES::ErrorCategory::None, SES::TryGetEntitlement(WarmServer().Url(), JwsToken(now, now + 3600, ApprovedApplication), ApprovedApplication, 0).category);
+    EXPECT_EQ(before + 1, WarmServer().RequestCount());
+}
+
+//
+// Prefetch keeps entitlements for minutes, but one whose token lasts
+// seconds is remembered until the token expires, and no longer, whether or
+// not the pre-check is on.
+//
+TEST(TokenExpiry, CapsHowLongAnEntitlementIsRemembered)
+{
+    const std::time_t now = std::time(nullptr);
+    const std::time_t expires = now + 2;
+    const std::string token = JwsToken(now, expires, ApprovedApplication);
+
+    SES::Prefetch(WarmServer().Url(), token, std::vector<std::string>(1, ApprovedApplication));
+    EXPECT_TRUE(SES::TryGetEntitlement(WarmServer().Url(), token, ApprovedApplication, 0).cached);
+
+    while (std::time(nullptr) <= expires)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_FALSE(SES::TryGetEntitlement(WarmServer().Url(), token, ApprovedApplication, 0).cached);
+}
+
+}   // anonymous namespace
@@ -0,0 +1,88 @@
+//
+// The library's internal transports, in place of libcurl over HTTPS: plain
+// HTTP over a Unix domain socket, and answers from memory.
+//
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "SoftwareEntitlementClient.h"
+#include "SoftwareEntitlementClientInternal.h"
+#include "StandIns.h"
+
+namespace SES = Microsoft::Azure::Batch::SoftwareEntitlement;
+using namespace SES::Tests;
+
+namespace {
+
+//
+// The most recent request recorded for url.
+//
+SES::RequestRecord LastRequest(const std::string& url)
+{
+    std::vector<SES::RequestRecord> records = SES::RecentRequests();
+    for (auto record = records.rbegin(); record != records.rend(); ++record)
+    {
+        if (record->endpoint == url)
+        {
+            return *record;
+        }
+    }
+    return SES::RequestRecord();
+}
+
+//
+// Checks through UnixSocketTransport reach the stand-in listening on the
+// socket, and are recorded with its request id; there is no handshake for
+// the pins to be checked in.
+//
+TEST(Transport, UnixSocketReachesTheServer)
+{
+    const std::string url = "https://unix-socket.invalid/";
+    SES::StandIn::ServerOptions options;
+    options.approvedApplications.clear();
+    options.approvedApplications.insert(ApprovedApplication);
+    options.unixSocket = testing::TempDir() + "sesclient-tests-" + std::to_string(getpid()) + ".sock";
+    SES::StandIn::Server server(Certificates(), options);
+    SES::Internal::SetTransport(url, SES::Internal::UnixSocketTransport(options.unixSocket));
+
+    for (int i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(SES::ErrorCategory::None, SES::TryGetEntitlement(url, UniqueToken(), ApprovedApplication, 0).category);
+    }
+    EXPECT_EQ(SES::ErrorCategory::Denied, SES::TryGetEntitlement(url, UniqueToken(), DeniedApplication, 0).category);
+    EXPECT_EQ(3u, server.RequestCount());
+
+    SES::RequestRecord record = LastRequest(url);
+    EXPECT_EQ(36u, record.request_id.size());
+    EXPECT_EQ(SES::PinCheck::NotMade, record.pin_check);
+
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+}
+
+//
+// LoopbackTransport grants the applications it is given and denies others,
+// checking the chain it presents against the pinned certificates.
+//
+TEST(Loopback, AnswersAsTheServiceWould)
+{
+    const std::string url = "https://loopback.invalid/";
+    std::vector<x509_st*> chain;
+    chain.push_back(Certificates().ServerCertificate());
+    chain.push_back(Certificates().IntermediateCertificate());
+    chain.push_back(Certificates().RootCertificate());
+    SES::Internal::SetTransport(url, SES::Internal::LoopbackTransport(std::vector<std::string>(1, ApprovedApplication), chain));
+
+    SES::EntitlementResult approved = SES::TryGetEntitlement(url, UniqueToken(), ApprovedApplication, 0);
+    EXPECT_EQ(SES::ErrorCategory::None, approved.category);
+    EXPECT_TRUE(approved.entitlement);
+    EXPECT_EQ(SES::PinCheck::Passed, LastRequest(url).pin_check);
+
+    SES::EntitlementResult denied = SES::TryGetEntitlement(url, UniqueToken(), DeniedApplication, 0);
+    EXPECT_EQ(SES::ErrorCategory::Denied, denied.category);
+    EXPECT_FALSE(denied.entitlement);
+
+    SES::Internal::SetTransport(url, SES::Internal::Transport());
+}
+
+}   // anonymous namespace